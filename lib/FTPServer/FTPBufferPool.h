@@ -0,0 +1,117 @@
+#include "FTPPlatform.h"
+
+#ifdef ARDUINO
+#include <esp_heap_caps.h>
+#endif
+
+// Size of one transfer buffer. Larger buffers mean fewer, longer SD accesses
+// and socket writes per transfer.
+#ifndef FTP_BUF_SIZE
+#define FTP_BUF_SIZE 4096
+#endif
+
+// Buffers shared by all sessions. A pipelined transfer takes
+// FTP_PIPELINE_BUFFERS of them, any other transfer one.
+#ifndef FTP_BUFFER_COUNT
+#define FTP_BUFFER_COUNT 10
+#endif
+
+// Put the buffers in external PSRAM when the board has it
+#ifndef FTP_BUFFER_PSRAM
+#define FTP_BUFFER_PSRAM 0
+#endif
+
+#if FTP_BUF_SIZE < 2048
+#error "FTP_BUF_SIZE must hold a listing batch and a directory entry (2048 bytes or more)"
+#endif
+
+// Fixed size transfer buffers allocated once when the server starts.
+// Transfers check buffers out when the data connection is accepted and give
+// them back when they end, so idle sessions hold no transfer memory. Only the
+// FTP task checks buffers out and in, no locking is needed.
+class FTPBufferPool
+{
+private:
+  uint8_t *memory = NULL;
+  uint8_t *freeBuffers[FTP_BUFFER_COUNT];
+  uint8_t freeCount = 0;
+  uint8_t fewestFree = 0;
+  unsigned long failures = 0;
+  boolean external = false;
+
+public:
+  boolean begin()
+  {
+    if (this->memory != NULL)
+    {
+      return true;
+    }
+    size_t size = (size_t)FTP_BUFFER_COUNT * FTP_BUF_SIZE;
+#if defined(ARDUINO) && FTP_BUFFER_PSRAM
+    this->memory = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    this->external = this->memory != NULL;
+#endif
+    if (this->memory == NULL)
+    {
+      this->memory = (uint8_t *)malloc(size);
+    }
+    if (this->memory == NULL)
+    {
+      LOG_ERROR("Cannot allocate %u transfer buffers", (unsigned)FTP_BUFFER_COUNT);
+      return false;
+    }
+    for (uint8_t i = 0; i < FTP_BUFFER_COUNT; i++)
+    {
+      this->freeBuffers[i] = this->memory + (size_t)i * FTP_BUF_SIZE;
+    }
+    this->freeCount = FTP_BUFFER_COUNT;
+    this->fewestFree = FTP_BUFFER_COUNT;
+    LOG_INFO("%u transfer buffers of %u bytes in %s", (unsigned)FTP_BUFFER_COUNT, (unsigned)FTP_BUF_SIZE, this->external ? "PSRAM" : "internal RAM");
+    return true;
+  }
+
+  // Take count buffers, all of them or none
+  boolean checkout(uint8_t **buffers, uint8_t count)
+  {
+    if (count > this->freeCount)
+    {
+      this->failures++;
+      return false;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+      buffers[i] = this->freeBuffers[--this->freeCount];
+    }
+    this->fewestFree = min(this->fewestFree, this->freeCount);
+    return true;
+  }
+
+  void giveBack(uint8_t **buffers, uint8_t count)
+  {
+    for (uint8_t i = 0; i < count; i++)
+    {
+      this->freeBuffers[this->freeCount++] = buffers[i];
+      buffers[i] = NULL;
+    }
+  }
+
+  uint8_t available()
+  {
+    return this->freeCount;
+  }
+
+  uint8_t getFewestFree()
+  {
+    return this->fewestFree;
+  }
+
+  unsigned long getFailures()
+  {
+    return this->failures;
+  }
+
+  boolean inPsram()
+  {
+    return this->external;
+  }
+};
@@ -0,0 +1,45 @@
+#include "FTPPlatform.h"
+
+// Command verbs are packed into an integer, so that dispatch compares one
+// word per table entry instead of strings. FTP verbs have 3 or 4 letters.
+constexpr uint32_t ftpVerb(const char *verb, int i = 0)
+{
+  return (i == 4 || verb[i] == '\0') ? 0 : ((uint32_t)(uint8_t)verb[i] << (8 * i)) | ftpVerb(verb, i + 1);
+}
+
+// Packed verb of a received command, 0 if it cannot be a valid verb
+inline uint32_t ftpPackVerb(const char *command)
+{
+  uint32_t verb = 0;
+  for (int i = 0; command[i] != '\0'; i++)
+  {
+    if (i == 4)
+    {
+      return 0;
+    }
+    verb |= (uint32_t)(uint8_t)command[i] << (8 * i);
+  }
+  return verb;
+}
+
+// Session states in which a command is accepted
+#define FTP_STATE(status) (1 << (status))
+#define FTP_ANY_STATE (FTP_STATE(WAIT_USERNAME) | FTP_STATE(WAIT_PASSWORD) | FTP_STATE(WAIT_COMMAND))
+#define FTP_LOGGED_IN FTP_STATE(WAIT_COMMAND)
+
+class FTPSession;
+
+// Handlers return false when the session should be closed
+typedef boolean (FTPSession::*FTPCommandHandler)(const char *params);
+
+// Command flags
+// Reads or changes the storage, refused while the server is quiesced
+#define FTP_USES_STORAGE 1
+
+struct FTPCommandEntry
+{
+  uint32_t verb;
+  uint8_t states;
+  FTPCommandHandler handler;
+  uint8_t flags;
+};
@@ -0,0 +1,438 @@
+#pragma once
+
+// Encryption at rest (FTP_ENCRYPTION). Every file on the card starts with a
+// header holding a random nonce, the rest is the content XORed with the
+// ChaCha20 (RFC 8439) keystream of one device key and that nonce. The
+// keystream can be computed for any file position, so REST and the pipeline
+// work unchanged. Destroying the key makes every file unreadable at once,
+// however full the card is, the files themselves can be deleted afterwards.
+//
+// A resumed upload (REST, STOR) rewrites the file from the offset with the
+// keystream it was first written with. Anyone holding a copy of the card
+// from before and one from after gets the XOR of the old and the new bytes
+// there, without the key. Upload afresh what must not be exposed that way.
+//
+// Included by FTPPlatform.h, which then uses FTPCryptoFile and
+// FTPCryptoStorage as FTPFile and FTPStorage.
+
+#ifdef ARDUINO
+#include <Preferences.h>
+#include <esp_random.h>
+#else
+#include <stdio.h>
+#endif
+#include <atomic>
+
+#define FTP_CRYPTO_KEY_SIZE 32
+#define FTP_CRYPTO_NONCE_SIZE 12
+#define FTP_CRYPTO_MAGIC "FTPX"
+#define FTP_CRYPTO_HEADER_SIZE (4 + FTP_CRYPTO_NONCE_SIZE)
+
+class FTPChaCha20
+{
+private:
+  static uint32_t rotate(uint32_t value, uint8_t bits)
+  {
+    return (value << bits) | (value >> (32 - bits));
+  }
+
+  static void quarterRound(uint32_t *x, uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+  {
+    x[a] += x[b];
+    x[d] = rotate(x[d] ^ x[a], 16);
+    x[c] += x[d];
+    x[b] = rotate(x[b] ^ x[c], 12);
+    x[a] += x[b];
+    x[d] = rotate(x[d] ^ x[a], 8);
+    x[c] += x[d];
+    x[b] = rotate(x[b] ^ x[c], 7);
+  }
+
+  static uint32_t load(const uint8_t *bytes)
+  {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+  }
+
+public:
+  // Keystream block counter of state[12], in little endian byte order
+  static void block(const uint32_t *state, uint8_t *out)
+  {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    for (uint8_t i = 0; i < 10; i++)
+    {
+      quarterRound(x, 0, 4, 8, 12);
+      quarterRound(x, 1, 5, 9, 13);
+      quarterRound(x, 2, 6, 10, 14);
+      quarterRound(x, 3, 7, 11, 15);
+      quarterRound(x, 0, 5, 10, 15);
+      quarterRound(x, 1, 6, 11, 12);
+      quarterRound(x, 2, 7, 8, 13);
+      quarterRound(x, 3, 4, 9, 14);
+    }
+    for (uint8_t i = 0; i < 16; i++)
+    {
+      uint32_t word = x[i] + state[i];
+      out[4 * i] = word;
+      out[4 * i + 1] = word >> 8;
+      out[4 * i + 2] = word >> 16;
+      out[4 * i + 3] = word >> 24;
+    }
+  }
+
+  // Encrypt or decrypt length bytes in place, data[0] being the byte at
+  // position of the stream
+  static void apply(const uint8_t *key, const uint8_t *nonce, uint64_t position, uint8_t *data, size_t length)
+  {
+    uint32_t state[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (uint8_t i = 0; i < 8; i++)
+    {
+      state[4 + i] = load(key + 4 * i);
+    }
+    state[12] = position / 64;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      state[13 + i] = load(nonce + 4 * i);
+    }
+
+    uint8_t stream[64];
+    size_t skip = position % 64;
+    while (length > 0)
+    {
+      block(state, stream);
+      state[12]++;
+      size_t count = min(length, (size_t)(64 - skip));
+      for (size_t i = 0; i < count; i++)
+      {
+        data[i] ^= stream[skip + i];
+      }
+      data += count;
+      length -= count;
+      skip = 0;
+    }
+    memset(stream, 0, sizeof(stream));
+    memset(state, 0, sizeof(state));
+  }
+};
+
+// Overwrite key material so the compiler cannot drop the stores
+inline void ftpWipeKey(uint8_t *data, size_t length)
+{
+  volatile uint8_t *bytes = data;
+  for (size_t i = 0; i < length; i++)
+  {
+    bytes[i] = 0;
+  }
+}
+
+// The device key. Kept in RAM while the server runs and in NVS across
+// reboots (the native build keeps it in RAM only).
+//
+// The tamper task destroys the key while the FTP task and the pipeline
+// tasks may be encrypting with it. They never use the key in place: every
+// chunk works on a copy taken with copyKey(), which fails if the key
+// changed since the file was opened or is being changed right now. The
+// generation counter is odd while the key is rewritten, like a seqlock.
+class FTPKeyStore
+{
+private:
+  uint8_t key[FTP_CRYPTO_KEY_SIZE];
+  volatile boolean ready = false;
+  std::atomic<uint32_t> generation;
+
+  void beginChange()
+  {
+    this->generation.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void endChange()
+  {
+    this->generation.fetch_add(1, std::memory_order_release);
+  }
+
+  static void random(uint8_t *data, size_t length)
+  {
+#ifdef ARDUINO
+    esp_fill_random(data, length);
+#else
+    FILE *source = fopen("/dev/urandom", "rb");
+    if (source == NULL || fread(data, 1, length, source) != length)
+    {
+      LOG_ERROR("No random source, cannot create a key");
+      abort();
+    }
+    fclose(source);
+#endif
+  }
+
+public:
+  FTPKeyStore() : generation(0) {}
+
+  // Load the key, or create one on first use
+  boolean begin()
+  {
+    if (this->ready)
+    {
+      return true;
+    }
+#ifdef ARDUINO
+    Preferences preferences;
+    preferences.begin("ftpcrypto", false);
+    this->beginChange();
+    boolean loaded = preferences.getBytes("key", this->key, FTP_CRYPTO_KEY_SIZE) == FTP_CRYPTO_KEY_SIZE;
+    this->ready = loaded;
+    this->endChange();
+    preferences.end();
+    if (loaded)
+    {
+      return true;
+    }
+#endif
+    return this->renew();
+  }
+
+  // Replace the key with a new one. Files written with the old key can no
+  // longer be read.
+  boolean renew()
+  {
+    this->beginChange();
+    random(this->key, FTP_CRYPTO_KEY_SIZE);
+#ifdef ARDUINO
+    Preferences preferences;
+    preferences.begin("ftpcrypto", false);
+    boolean stored = preferences.putBytes("key", this->key, FTP_CRYPTO_KEY_SIZE) == FTP_CRYPTO_KEY_SIZE;
+    preferences.end();
+    if (!stored)
+    {
+      LOG_ERROR("Cannot store the file key");
+      this->ready = false;
+      ftpWipeKey(this->key, FTP_CRYPTO_KEY_SIZE);
+      this->endChange();
+      return false;
+    }
+#endif
+    this->ready = true;
+    this->endChange();
+    return true;
+  }
+
+  // Forget the key, in RAM and in NVS. Opening a file fails from now on,
+  // and so does every chunk of a file already open.
+  // NVS marks the entry erased, the flash page is reused later, so use NVS
+  // encryption when the flash itself must not give the key away.
+  void destroy()
+  {
+    this->beginChange();
+    this->ready = false;
+    ftpWipeKey(this->key, FTP_CRYPTO_KEY_SIZE);
+    this->endChange();
+#ifdef ARDUINO
+    Preferences preferences;
+    preferences.begin("ftpcrypto", false);
+    preferences.remove("key");
+    preferences.end();
+#endif
+  }
+
+  boolean isReady()
+  {
+    return this->ready;
+  }
+
+  // Key a file opened now is encrypted with, odd while the key changes
+  uint32_t getGeneration()
+  {
+    return this->generation.load(std::memory_order_acquire);
+  }
+
+  // Copy of the key of generation into copy, for one chunk. False if that
+  // key is gone or is being replaced, the chunk must then fail.
+  boolean copyKey(uint8_t *copy, uint32_t generation)
+  {
+    if ((generation & 1) != 0 || this->generation.load(std::memory_order_acquire) != generation || !this->ready)
+    {
+      return false;
+    }
+    const volatile uint8_t *key = this->key;
+    for (uint8_t i = 0; i < FTP_CRYPTO_KEY_SIZE; i++)
+    {
+      copy[i] = key[i];
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (this->generation.load(std::memory_order_relaxed) != generation)
+    {
+      ftpWipeKey(copy, FTP_CRYPTO_KEY_SIZE);
+      return false;
+    }
+    return true;
+  }
+
+  void newNonce(uint8_t *nonce)
+  {
+    random(nonce, FTP_CRYPTO_NONCE_SIZE);
+  }
+};
+
+// One key store for the whole program, the tamper response reaches it here
+inline FTPKeyStore &ftpKeyStore()
+{
+  static FTPKeyStore instance;
+  return instance;
+}
+
+// A file of the card seen through the cipher: positions and sizes leave the
+// header out, read data is decrypted and written data encrypted. Entries
+// returned by openNextFile are for listing only, they cannot be read.
+// Reads and writes fail once the key the file was opened with is destroyed.
+class FTPCryptoFile
+{
+private:
+  FTPPlatformFile file;
+  uint8_t nonce[FTP_CRYPTO_NONCE_SIZE] = {0};
+  boolean hasNonce = false;
+  uint32_t generation = 0;
+
+  boolean readable()
+  {
+    return this->file && this->hasNonce;
+  }
+
+public:
+  FTPCryptoFile() {}
+  FTPCryptoFile(const FTPPlatformFile &file) : file(file) {}
+
+  // Open an encrypted file, mode "w" starts a new one with a fresh nonce
+  static FTPCryptoFile open(FTPPlatformStorage &storage, const String &path, const char *mode)
+  {
+    FTPCryptoFile opened(storage.open(path, mode));
+    if (!opened.file || opened.file.isDirectory())
+    {
+      return opened;
+    }
+    uint8_t header[FTP_CRYPTO_HEADER_SIZE];
+    opened.generation = ftpKeyStore().getGeneration();
+    boolean valid = ftpKeyStore().isReady() && (opened.generation & 1) == 0;
+    if (valid && mode[0] == 'w')
+    {
+      memcpy(header, FTP_CRYPTO_MAGIC, 4);
+      ftpKeyStore().newNonce(header + 4);
+      valid = opened.file.write(header, FTP_CRYPTO_HEADER_SIZE) == FTP_CRYPTO_HEADER_SIZE;
+    }
+    else if (valid)
+    {
+      valid = opened.file.read(header, FTP_CRYPTO_HEADER_SIZE) == FTP_CRYPTO_HEADER_SIZE &&
+              memcmp(header, FTP_CRYPTO_MAGIC, 4) == 0;
+    }
+    if (!valid)
+    {
+      opened.file.close();
+      return FTPCryptoFile();
+    }
+    memcpy(opened.nonce, header + 4, FTP_CRYPTO_NONCE_SIZE);
+    opened.hasNonce = true;
+    return opened;
+  }
+
+  operator bool()
+  {
+    return (bool)this->file;
+  }
+
+  const char *name() { return this->file.name(); }
+  boolean isDirectory() { return this->file.isDirectory(); }
+  time_t getLastWrite() { return this->file.getLastWrite(); }
+  void flush() { this->file.flush(); }
+
+  size_t size()
+  {
+    size_t size = this->file.size();
+    return size > FTP_CRYPTO_HEADER_SIZE ? size - FTP_CRYPTO_HEADER_SIZE : 0;
+  }
+
+  size_t position()
+  {
+    size_t position = this->file.position();
+    return position > FTP_CRYPTO_HEADER_SIZE ? position - FTP_CRYPTO_HEADER_SIZE : 0;
+  }
+
+  boolean seek(uint32_t position)
+  {
+    return this->hasNonce && this->file.seek(position + FTP_CRYPTO_HEADER_SIZE);
+  }
+
+  int read(uint8_t *data, size_t length)
+  {
+    if (!this->readable())
+    {
+      return -1;
+    }
+    size_t position = this->position();
+    int count = this->file.read(data, length);
+    if (count > 0)
+    {
+      uint8_t key[FTP_CRYPTO_KEY_SIZE];
+      if (!ftpKeyStore().copyKey(key, this->generation))
+      {
+        return -1;
+      }
+      FTPChaCha20::apply(key, this->nonce, position, data, count);
+      ftpWipeKey(key, sizeof(key));
+    }
+    return count;
+  }
+
+  size_t readBytes(char *data, size_t length)
+  {
+    int count = this->read((uint8_t *)data, length);
+    return count > 0 ? count : 0;
+  }
+
+  // Encrypts data in place. Bytes that were not written are decrypted again,
+  // so the caller can retry with the same buffer.
+  size_t write(uint8_t *data, size_t length)
+  {
+    uint8_t key[FTP_CRYPTO_KEY_SIZE];
+    if (!this->readable() || !ftpKeyStore().copyKey(key, this->generation))
+    {
+      return 0;
+    }
+    size_t position = this->position();
+    FTPChaCha20::apply(key, this->nonce, position, data, length);
+    size_t written = this->file.write(data, length);
+    if (written < length)
+    {
+      FTPChaCha20::apply(key, this->nonce, position + written, data + written, length - written);
+    }
+    ftpWipeKey(key, sizeof(key));
+    return written;
+  }
+
+  void close()
+  {
+    this->file.close();
+    this->hasNonce = false;
+  }
+
+  FTPCryptoFile openNextFile()
+  {
+    return FTPCryptoFile(this->file.openNextFile());
+  }
+};
+
+class FTPCryptoStorage
+{
+private:
+  FTPPlatformStorage storage;
+
+public:
+  FTPCryptoStorage(const FTPPlatformStorage &storage = FTPPlatformStorage()) : storage(storage) {}
+
+  FTPCryptoFile open(const String &path, const char *mode = "r") { return FTPCryptoFile::open(this->storage, path, mode); }
+  boolean exists(const String &path) { return this->storage.exists(path); }
+  boolean mkdir(const String &path) { return this->storage.mkdir(path); }
+  boolean rmdir(const String &path) { return this->storage.rmdir(path); }
+  boolean remove(const String &path) { return this->storage.remove(path); }
+  boolean rename(const String &from, const String &to) { return this->storage.rename(from, to); }
+  boolean truncate(const String &path, uint32_t size) { return this->storage.truncate(path, size + FTP_CRYPTO_HEADER_SIZE); }
+};
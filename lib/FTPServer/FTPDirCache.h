@@ -0,0 +1,393 @@
+#include "FTPPlatform.h"
+
+// RAM used by all cached listings together
+#ifndef FTP_DIR_CACHE_BYTES
+#define FTP_DIR_CACHE_BYTES 32768
+#endif
+
+// Number of directories kept in the cache
+#ifndef FTP_DIR_CACHE_SLOTS
+#define FTP_DIR_CACHE_SLOTS 4
+#endif
+
+// Paths and names are matched like the storage does: FAT on the SD card
+// ignores case, the POSIX file systems of the native build do not
+#ifndef FTP_STORAGE_IGNORES_CASE
+#ifdef ARDUINO
+#define FTP_STORAGE_IGNORES_CASE 1
+#else
+#define FTP_STORAGE_IGNORES_CASE 0
+#endif
+#endif
+
+inline boolean ftpSameName(const char *a, const char *b, size_t length)
+{
+#if FTP_STORAGE_IGNORES_CASE
+  return strncasecmp(a, b, length) == 0;
+#else
+  return strncmp(a, b, length) == 0;
+#endif
+}
+
+inline boolean ftpSamePath(const String &a, const String &b)
+{
+  return a.length() == b.length() && ftpSameName(a.c_str(), b.c_str(), a.length());
+}
+
+struct FTPDirEntry
+{
+  const char *name;
+  uint32_t size;
+  uint32_t modified;
+  boolean isDirectory;
+};
+
+// Entries are stored back to back in one block per directory:
+// size (4 bytes), modified (4), isDirectory (1), name length (1), name.
+#define FTP_DIR_RECORD_HEADER 10
+
+// Collects the entries of a directory while it is listed from the SD card
+class FTPDirBuilder
+{
+public:
+  uint8_t *data = NULL;
+  size_t length;
+  size_t capacity;
+  uint32_t version;
+  boolean failed = true;
+
+  void begin(uint32_t version)
+  {
+    this->discard();
+    this->length = 0;
+    this->capacity = 0;
+    this->version = version;
+    this->failed = false;
+  }
+
+  void add(const FTPDirEntry &entry)
+  {
+    if (this->failed)
+    {
+      return;
+    }
+    size_t nameLength = strlen(entry.name);
+    size_t recordLength = FTP_DIR_RECORD_HEADER + nameLength;
+    if (nameLength > 255 || this->length + recordLength > FTP_DIR_CACHE_BYTES)
+    {
+      // Directory does not fit in the cache, list it from the card every time
+      this->discard();
+      return;
+    }
+    if (this->length + recordLength > this->capacity)
+    {
+      size_t capacity = max(this->capacity * 2, (size_t)1024);
+      capacity = min(max(capacity, this->length + recordLength), (size_t)FTP_DIR_CACHE_BYTES);
+      uint8_t *data = (uint8_t *)realloc(this->data, capacity);
+      if (data == NULL)
+      {
+        this->discard();
+        return;
+      }
+      this->data = data;
+      this->capacity = capacity;
+    }
+    uint8_t *record = this->data + this->length;
+    memcpy(record, &entry.size, 4);
+    memcpy(record + 4, &entry.modified, 4);
+    record[8] = entry.isDirectory;
+    record[9] = nameLength;
+    memcpy(record + FTP_DIR_RECORD_HEADER, entry.name, nameLength);
+    this->length += recordLength;
+  }
+
+  void discard()
+  {
+    free(this->data);
+    this->data = NULL;
+    this->failed = true;
+  }
+};
+
+// Listings of recently used directories, so repeated LIST/MLSD/NLST and
+// existence checks do not walk the SD card. All mutations done through the
+// FTP server invalidate the affected directories. Least recently used
+// directories are evicted to stay within FTP_DIR_CACHE_BYTES.
+class FTPDirCache
+{
+private:
+  struct Slot
+  {
+    String path;
+    uint8_t *data;
+    size_t length;
+    uint32_t lastUse;
+    // Listings in progress reading this slot, its memory is kept until they end
+    uint8_t readers;
+    boolean stale;
+  };
+
+  Slot slots[FTP_DIR_CACHE_SLOTS];
+  size_t usedBytes = 0;
+  uint32_t useCounter = 0;
+  // Changed on every invalidation, so listings started before it are not stored
+  uint32_t currentVersion = 0;
+
+  unsigned long hits = 0;
+  unsigned long misses = 0;
+  unsigned long evictions = 0;
+  unsigned long invalidations = 0;
+
+  int8_t find(const String &path)
+  {
+    for (int8_t i = 0; i < FTP_DIR_CACHE_SLOTS; i++)
+    {
+      if (this->slots[i].data != NULL && !this->slots[i].stale && ftpSamePath(this->slots[i].path, path))
+      {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void release(int8_t slot)
+  {
+    Slot &s = this->slots[slot];
+    if (s.readers > 0)
+    {
+      s.stale = true;
+      return;
+    }
+    free(s.data);
+    this->usedBytes -= s.length;
+    s.data = NULL;
+    s.path = "";
+  }
+
+  // True if path is dir itself or lies below it
+  static boolean isWithin(const String &path, const String &dir)
+  {
+    if (dir == "/")
+    {
+      return true;
+    }
+    return ftpSameName(path.c_str(), dir.c_str(), dir.length()) && (path.length() == dir.length() || path.charAt(dir.length()) == '/');
+  }
+
+  static String parentOf(const String &path)
+  {
+    int sep = path.lastIndexOf('/');
+    if (sep <= 0)
+    {
+      return "/";
+    }
+    return path.substring(0, sep);
+  }
+
+public:
+  FTPDirCache()
+  {
+    for (uint8_t i = 0; i < FTP_DIR_CACHE_SLOTS; i++)
+    {
+      this->slots[i].data = NULL;
+      this->slots[i].readers = 0;
+      this->slots[i].stale = false;
+    }
+  }
+
+  uint32_t version()
+  {
+    return this->currentVersion;
+  }
+
+  // Start reading the cached listing of path, -1 if it is not cached
+  int8_t open(const String &path)
+  {
+    int8_t slot = this->find(path);
+    if (slot < 0)
+    {
+      this->misses++;
+      return -1;
+    }
+    this->hits++;
+    this->slots[slot].readers++;
+    this->slots[slot].lastUse = ++this->useCounter;
+    return slot;
+  }
+
+  // Next entry of an opened listing. entry.name points to a scratch buffer
+  // and stays valid until the next call.
+  boolean next(int8_t slot, size_t &offset, FTPDirEntry &entry)
+  {
+    Slot &s = this->slots[slot];
+    if (offset >= s.length)
+    {
+      return false;
+    }
+    const uint8_t *record = s.data + offset;
+    memcpy(&entry.size, record, 4);
+    memcpy(&entry.modified, record + 4, 4);
+    entry.isDirectory = record[8];
+    // Names are not terminated in the cache, copy to a scratch buffer
+    uint8_t nameLength = record[9];
+    memcpy(this->name, record + FTP_DIR_RECORD_HEADER, nameLength);
+    this->name[nameLength] = '\0';
+    entry.name = this->name;
+    offset += FTP_DIR_RECORD_HEADER + nameLength;
+    return true;
+  }
+
+  void close(int8_t slot)
+  {
+    Slot &s = this->slots[slot];
+    s.readers--;
+    if (s.readers == 0 && s.stale)
+    {
+      s.stale = false;
+      this->release(slot);
+    }
+  }
+
+  // Keep the listing collected from the card, evicting older ones if needed
+  void store(const String &path, FTPDirBuilder &builder)
+  {
+    if (builder.failed || builder.version != this->currentVersion || this->find(path) >= 0)
+    {
+      builder.discard();
+      return;
+    }
+
+    while (true)
+    {
+      int8_t victim = -1;
+      int8_t empty = -1;
+      for (int8_t i = 0; i < FTP_DIR_CACHE_SLOTS; i++)
+      {
+        if (this->slots[i].data == NULL)
+        {
+          empty = i;
+        }
+        else if (this->slots[i].readers == 0 && (victim < 0 || this->slots[i].lastUse < this->slots[victim].lastUse))
+        {
+          victim = i;
+        }
+      }
+      if (empty >= 0 && this->usedBytes + builder.length <= FTP_DIR_CACHE_BYTES)
+      {
+        // Give back the unused end of the block
+        uint8_t *data = (uint8_t *)realloc(builder.data, builder.length);
+        Slot &s = this->slots[empty];
+        s.path = path;
+        s.data = data != NULL ? data : builder.data;
+        s.length = builder.length;
+        s.lastUse = ++this->useCounter;
+        s.stale = false;
+        this->usedBytes += builder.length;
+        builder.data = NULL;
+        builder.failed = true;
+        return;
+      }
+      if (victim < 0)
+      {
+        builder.discard();
+        return;
+      }
+      this->evictions++;
+      this->release(victim);
+    }
+  }
+
+  // Path was created, changed or removed: drop its parent directory and, if it
+  // is a directory, everything cached below it
+  void invalidate(const String &path)
+  {
+    String parent = parentOf(path);
+    this->currentVersion++;
+    for (int8_t i = 0; i < FTP_DIR_CACHE_SLOTS; i++)
+    {
+      Slot &s = this->slots[i];
+      if (s.data != NULL && !s.stale && (ftpSamePath(s.path, parent) || isWithin(s.path, path)))
+      {
+        this->invalidations++;
+        this->release(i);
+      }
+    }
+  }
+
+  // Card was changed outside the FTP server
+  void clear()
+  {
+    this->currentVersion++;
+    for (int8_t i = 0; i < FTP_DIR_CACHE_SLOTS; i++)
+    {
+      if (this->slots[i].data != NULL && !this->slots[i].stale)
+      {
+        this->release(i);
+      }
+    }
+  }
+
+  // 1 if path exists, 0 if not, -1 if its directory is not cached
+  int8_t exists(const String &path)
+  {
+    int sep = path.lastIndexOf('/');
+    if (sep < 0 || sep == (int)path.length() - 1)
+    {
+      return -1;
+    }
+    int8_t slot = this->find(parentOf(path));
+    if (slot < 0)
+    {
+      this->misses++;
+      return -1;
+    }
+    const char *name = path.c_str() + sep + 1;
+    size_t nameLength = path.length() - sep - 1;
+    Slot &s = this->slots[slot];
+    size_t offset = 0;
+    while (offset < s.length)
+    {
+      const uint8_t *record = s.data + offset;
+      if (record[9] == nameLength && ftpSameName((const char *)record + FTP_DIR_RECORD_HEADER, name, nameLength))
+      {
+        this->hits++;
+        return 1;
+      }
+      offset += FTP_DIR_RECORD_HEADER + record[9];
+    }
+    this->hits++;
+    return 0;
+  }
+
+  unsigned long getHits()
+  {
+    return this->hits;
+  }
+
+  unsigned long getMisses()
+  {
+    return this->misses;
+  }
+
+  unsigned long getEvictions()
+  {
+    return this->evictions;
+  }
+
+  unsigned long getInvalidations()
+  {
+    return this->invalidations;
+  }
+
+  // Counters only, the cached listings stay
+  void resetCounters()
+  {
+    this->hits = 0;
+    this->misses = 0;
+    this->evictions = 0;
+    this->invalidations = 0;
+  }
+
+private:
+  char name[256];
+};
@@ -0,0 +1,152 @@
+#include "FTPPlatform.h"
+
+// Longest accepted control line, including CRLF
+#ifndef FTP_COMMAND_SIZE
+#define FTP_COMMAND_SIZE 512
+#endif
+
+// Frames the control connection into CRLF terminated commands in a fixed
+// buffer. Bytes after the first complete line stay in the buffer for the next
+// call, so pipelined commands ("TYPE I\r\nPASV\r\n") are handed out one by one.
+// command() and params() point into the buffer and are valid until the next
+// call to next().
+class FTPLineAssembler
+{
+private:
+  char line[FTP_COMMAND_SIZE];
+  uint16_t length;
+  // Bytes of the last returned line, dropped on the next call
+  uint16_t consumed;
+  // Discarding the rest of a line longer than the buffer
+  boolean overflow;
+
+  const char *commandView;
+  const char *paramsView;
+
+  int findLineEnd()
+  {
+    for (uint16_t i = 0; i < this->length; i++)
+    {
+      if (this->line[i] == '\n')
+      {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void split(uint16_t end)
+  {
+    char *begin = this->line;
+    while (begin < this->line + end && *begin == ' ')
+    {
+      begin++;
+    }
+    // Strip CR and trailing spaces
+    while (end > 0 && (this->line[end - 1] == '\r' || this->line[end - 1] == ' '))
+    {
+      end--;
+    }
+    this->line[end] = '\0';
+
+    char *params = begin;
+    while (*params != '\0' && *params != ' ')
+    {
+      // Commands are case insensitive
+      if (*params >= 'a' && *params <= 'z')
+      {
+        *params -= 'a' - 'A';
+      }
+      params++;
+    }
+    if (*params == ' ')
+    {
+      *params++ = '\0';
+      while (*params == ' ')
+      {
+        params++;
+      }
+    }
+    this->commandView = begin;
+    this->paramsView = params;
+  }
+
+public:
+  FTPLineAssembler()
+  {
+    this->reset();
+  }
+
+  void reset()
+  {
+    this->length = 0;
+    this->consumed = 0;
+    this->overflow = false;
+    this->commandView = "";
+    this->paramsView = "";
+  }
+
+  // Returns true when the next complete command is available. The socket is
+  // read only when no complete line is buffered.
+  boolean next(FTPConnection &client)
+  {
+    if (this->consumed > 0)
+    {
+      this->length -= this->consumed;
+      memmove(this->line, this->line + this->consumed, this->length);
+      this->consumed = 0;
+    }
+
+    int end = this->findLineEnd();
+    if (end < 0)
+    {
+      int numberBytesRead = client.read((uint8_t *)this->line + this->length, FTP_COMMAND_SIZE - 1 - this->length);
+      if (numberBytesRead <= 0)
+      {
+        return false;
+      }
+      this->length += numberBytesRead;
+      end = this->findLineEnd();
+    }
+
+    if (end < 0)
+    {
+      if (this->length == FTP_COMMAND_SIZE - 1)
+      {
+        this->overflow = true;
+        this->length = 0;
+      }
+      return false;
+    }
+
+    this->consumed = end + 1;
+    if (this->overflow)
+    {
+      // Hand out an empty command, it is answered with a syntax error
+      this->overflow = false;
+      this->line[0] = '\0';
+      this->commandView = this->line;
+      this->paramsView = this->line;
+      return true;
+    }
+    this->split(end);
+    return true;
+  }
+
+  // A complete command is buffered, next() returns it without reading the
+  // socket
+  boolean hasLine()
+  {
+    return memchr(this->line + this->consumed, '\n', this->length - this->consumed) != NULL;
+  }
+
+  const char *command()
+  {
+    return this->commandView;
+  }
+
+  const char *params()
+  {
+    return this->paramsView;
+  }
+};
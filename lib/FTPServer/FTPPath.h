@@ -0,0 +1,40 @@
+#pragma once
+
+// Paths as the FTP server hands them to the storage: absolute, without
+// ".", ".." or empty segments.
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "posix/FTPPosixRuntime.h"
+#endif
+
+// Resolve "." and ".." in path, relative paths are taken from the root.
+// ".." stops at the root, so a client cannot name anything outside the
+// served directory, e.g. "/a/../../etc/passwd" is "/etc/passwd".
+inline String ftpNormalizePath(const String &path)
+{
+  String normalized = "";
+  unsigned int begin = 0;
+  while (begin <= path.length())
+  {
+    int end = path.indexOf('/', begin);
+    if (end < 0)
+    {
+      end = path.length();
+    }
+    String segment = path.substring(begin, end);
+    if (segment == "..")
+    {
+      int sep = normalized.lastIndexOf('/');
+      normalized = sep > 0 ? normalized.substring(0, sep) : String("");
+    }
+    else if (segment.length() > 0 && segment != ".")
+    {
+      normalized += "/";
+      normalized += segment;
+    }
+    begin = end + 1;
+  }
+  return normalized.length() > 0 ? normalized : String("/");
+}
@@ -0,0 +1,381 @@
+#include "FTPPlatform.h"
+#include "FTPStats.h"
+#include "FTPBufferPool.h"
+#include "FTPWait.h"
+#include <atomic>
+
+// Number of FTP_BUF_SIZE buffers in a transfer pipeline
+#ifndef FTP_PIPELINE_BUFFERS
+#define FTP_PIPELINE_BUFFERS 4
+#endif
+
+// Storage tasks run on the core not used by the FTP task
+#ifndef FTP_PIPELINE_CORE
+#define FTP_PIPELINE_CORE 0
+#endif
+
+// Priority of the task running mainFTPLoop() (FTPThread in main.cpp)
+#ifndef FTP_TASK_PRIORITY
+#define FTP_TASK_PRIORITY 1
+#endif
+
+// The FTP task waits for the storage tasks, so they run at its priority.
+// At idle priority they only got the card when nothing else on their core
+// wanted to run. The sensor task (priority 1) shares their core and still
+// gets its turn every tick, a storage task mostly waits for the card.
+#ifndef FTP_PIPELINE_PRIORITY
+#define FTP_PIPELINE_PRIORITY FTP_TASK_PRIORITY
+#endif
+
+// Longest time finish() waits for the rest of an upload to be written, in
+// ms. The upload is then aborted instead of blocking the FTP task.
+#ifndef FTP_PIPELINE_FINISH_TIMEOUT
+#define FTP_PIPELINE_FINISH_TIMEOUT 5000
+#endif
+
+#define FTP_PIPELINE_STACK 4096
+
+// Attempts to write a chunk to the SD card before the upload is failed
+#define FTP_WRITE_RETRIES 3
+
+struct FTPChunk
+{
+  uint8_t index;
+  size_t length;
+};
+
+// Moves file data between the SD card and the FTP task through a ring of
+// buffers, with the SD side running on its own task. Buffers go round
+// between two queues:
+//  - RETR: the reader task fills free buffers from the file, the FTP task
+//    sends them (next) and gives them back (release),
+//  - STOR: the FTP task fills free buffers from the socket (acquire, submit),
+//    the writer task writes them to the file in the background.
+class FTPPipeline
+{
+private:
+  // Checked out from the FTPBufferPool by the session for one transfer
+  uint8_t *buffers[FTP_PIPELINE_BUFFERS];
+
+  QueueHandle_t freeBuffers = NULL;
+  QueueHandle_t fullBuffers = NULL;
+  SemaphoreHandle_t workerDone = NULL;
+
+  FTPFile *file;
+  boolean storing;
+  // Wakes the FTP task when it sleeps waiting for the worker
+  FTPWaker *waker = NULL;
+  std::atomic<bool> ftpWaiting;
+  volatile boolean stopRequested;
+  volatile boolean writeFailed;
+  volatile boolean readFailed;
+  boolean finishTimedOut;
+  boolean running = false;
+
+  // Longest wait for a free buffer on upload and longest chunk write, in us
+  unsigned long stallBeginTime;
+  unsigned long maxStall;
+  volatile unsigned long maxWriteTime;
+
+  // Chunk read and write times in us, only touched by the worker task
+  FTPHistogram readTimes;
+  FTPHistogram writeTimes;
+
+  static void readerTask(void *params)
+  {
+    ((FTPPipeline *)params)->readLoop();
+    vTaskDelete(NULL);
+  }
+
+  static void writerTask(void *params)
+  {
+    ((FTPPipeline *)params)->writeLoop();
+    vTaskDelete(NULL);
+  }
+
+  void readLoop()
+  {
+    FTPChunk chunk;
+    while (!this->stopRequested)
+    {
+      if (xQueueReceive(this->freeBuffers, &chunk.index, 10) != pdTRUE)
+      {
+        continue;
+      }
+      unsigned long begin = micros();
+      int count = this->file->read(this->buffers[chunk.index], FTP_BUF_SIZE);
+      this->readTimes.add(micros() - begin);
+      // A read error ends the file early, failed() tells it from the end
+      if (count < 0)
+      {
+        this->readFailed = true;
+        count = 0;
+      }
+      chunk.length = count;
+      // Never blocks, there are only FTP_PIPELINE_BUFFERS chunks in circulation
+      xQueueSend(this->fullBuffers, &chunk, portMAX_DELAY);
+      this->notify();
+      if (chunk.length == 0)
+      {
+        break;
+      }
+    }
+    xSemaphoreGive(this->workerDone);
+  }
+
+  void writeLoop()
+  {
+    FTPChunk chunk;
+    while (true)
+    {
+      if (xQueueReceive(this->fullBuffers, &chunk, 10) != pdTRUE)
+      {
+        if (this->stopRequested)
+          break;
+        continue;
+      }
+      // Zero length chunk closes the upload
+      if (chunk.length == 0)
+      {
+        break;
+      }
+      // After a failure or a stop the rest of the upload is dropped, so the
+      // FTP task never waits for more than the chunk being written
+      if (!this->writeFailed && !this->stopRequested)
+      {
+        unsigned long begin = micros();
+        if (writeFully(*this->file, this->buffers[chunk.index], chunk.length) != chunk.length)
+        {
+          this->writeFailed = true;
+        }
+        unsigned long writeTime = micros() - begin;
+        this->writeTimes.add(writeTime);
+        if (writeTime > this->maxWriteTime)
+        {
+          this->maxWriteTime = writeTime;
+        }
+      }
+      xQueueSend(this->freeBuffers, &chunk.index, portMAX_DELAY);
+      this->notify();
+    }
+    xSemaphoreGive(this->workerDone);
+  }
+
+  // Worker: a chunk (RETR) or a free buffer (STOR) was handed over
+  void notify()
+  {
+    if (this->waker != NULL && this->ftpWaiting.exchange(false))
+    {
+      this->waker->wake();
+    }
+  }
+
+  boolean begin(FTPFile *file, uint8_t **buffers, TaskFunction_t worker, const char *name)
+  {
+    if (this->freeBuffers == NULL)
+    {
+      this->freeBuffers = xQueueCreate(FTP_PIPELINE_BUFFERS, sizeof(uint8_t));
+      // One more slot for the end of upload marker
+      this->fullBuffers = xQueueCreate(FTP_PIPELINE_BUFFERS + 1, sizeof(FTPChunk));
+      this->workerDone = xSemaphoreCreateBinary();
+    }
+    if (this->freeBuffers == NULL || this->fullBuffers == NULL || this->workerDone == NULL)
+    {
+      return false;
+    }
+
+    xQueueReset(this->freeBuffers);
+    xQueueReset(this->fullBuffers);
+    for (uint8_t i = 0; i < FTP_PIPELINE_BUFFERS; i++)
+    {
+      xQueueSend(this->freeBuffers, &i, 0);
+    }
+
+    memcpy(this->buffers, buffers, sizeof(this->buffers));
+    this->file = file;
+    this->storing = worker == writerTask;
+    this->ftpWaiting = false;
+    this->stopRequested = false;
+    this->writeFailed = false;
+    this->readFailed = false;
+    this->finishTimedOut = false;
+    this->stallBeginTime = 0;
+    this->maxStall = 0;
+    this->maxWriteTime = 0;
+    if (xTaskCreatePinnedToCore(worker, name, FTP_PIPELINE_STACK, this, FTP_PIPELINE_PRIORITY, NULL, FTP_PIPELINE_CORE) != pdPASS)
+    {
+      return false;
+    }
+    this->running = true;
+    return true;
+  }
+
+public:
+  FTPPipeline() : ftpWaiting(false) {}
+
+  // Lets the worker wake the FTP task, see readyOrNotify()
+  void setWaker(FTPWaker *waker)
+  {
+    this->waker = waker;
+  }
+
+  // Whether readyOrNotify() can be relied on, else the FTP task has to poll
+  boolean canNotify()
+  {
+    return this->waker != NULL && this->waker->fd() >= 0;
+  }
+
+  // FTP task, before it sleeps: true if the worker already has a chunk
+  // (RETR) or a free buffer (STOR) for it. Otherwise the worker wakes it
+  // through the waker as soon as it has one.
+  boolean readyOrNotify()
+  {
+    this->ftpWaiting = true;
+    // Checked after the flag is set, a hand-over in between is not missed
+    if (uxQueueMessagesWaiting(this->storing ? this->freeBuffers : this->fullBuffers) > 0)
+    {
+      this->ftpWaiting = false;
+      return true;
+    }
+    return false;
+  }
+
+  // Write the whole chunk, retrying a few times before giving up.
+  // Returns the number of bytes written. With FTP_ENCRYPTION the written
+  // bytes are encrypted in place.
+  static size_t writeFully(FTPFile &file, uint8_t *data, size_t length)
+  {
+    size_t written = 0;
+    for (int attempt = 0; attempt < FTP_WRITE_RETRIES && written < length; attempt++)
+    {
+      size_t n = file.write(data + written, length - written);
+      written += n;
+      if (n == 0)
+      {
+        vTaskDelay(10);
+      }
+    }
+    return written;
+  }
+
+  // Start reading or writing file on the storage core, using the
+  // FTP_PIPELINE_BUFFERS given buffers. Returns false if the pipeline cannot
+  // be started, the caller should then access the file directly.
+  boolean beginRetrieve(FTPFile *file, uint8_t **buffers)
+  {
+    return this->begin(file, buffers, readerTask, "FTPReader");
+  }
+
+  boolean beginStore(FTPFile *file, uint8_t **buffers)
+  {
+    return this->begin(file, buffers, writerTask, "FTPWriter");
+  }
+
+  // RETR: next chunk read from the file, false if the reader has not filled
+  // one yet. A chunk with length 0 marks the end of the file.
+  boolean next(FTPChunk &chunk)
+  {
+    return xQueueReceive(this->fullBuffers, &chunk, 0) == pdTRUE;
+  }
+
+  void release(FTPChunk &chunk)
+  {
+    xQueueSend(this->freeBuffers, &chunk.index, 0);
+  }
+
+  // STOR: free buffer to fill from the socket, false while the writer is
+  // still busy with all of them
+  boolean acquire(FTPChunk &chunk)
+  {
+    if (xQueueReceive(this->freeBuffers, &chunk.index, 0) != pdTRUE)
+    {
+      if (this->stallBeginTime == 0)
+      {
+        this->stallBeginTime = micros() | 1;
+      }
+      return false;
+    }
+    if (this->stallBeginTime != 0)
+    {
+      if (micros() - this->stallBeginTime > this->maxStall)
+      {
+        this->maxStall = micros() - this->stallBeginTime;
+      }
+      this->stallBeginTime = 0;
+    }
+    chunk.length = 0;
+    return true;
+  }
+
+  void submit(FTPChunk &chunk)
+  {
+    xQueueSend(this->fullBuffers, &chunk, portMAX_DELAY);
+  }
+
+  // STOR: wait until every submitted chunk is written. Returns false if
+  // any of them failed, or if they were not written within
+  // FTP_PIPELINE_FINISH_TIMEOUT (timedOut()). The writer then still runs,
+  // stop() drops what it has not written yet.
+  boolean finish()
+  {
+    FTPChunk end = {0, 0};
+    // Never blocks, the queue has a slot for the end marker
+    xQueueSend(this->fullBuffers, &end, portMAX_DELAY);
+    if (xSemaphoreTake(this->workerDone, pdMS_TO_TICKS(FTP_PIPELINE_FINISH_TIMEOUT)) != pdTRUE)
+    {
+      this->finishTimedOut = true;
+      return false;
+    }
+    this->running = false;
+    return !this->writeFailed;
+  }
+
+  // A chunk could not be written (STOR) or read (RETR)
+  boolean failed()
+  {
+    return this->writeFailed || this->readFailed;
+  }
+
+  // finish() gave up waiting for the writer
+  boolean timedOut()
+  {
+    return this->finishTimedOut;
+  }
+
+  uint8_t *data(FTPChunk &chunk)
+  {
+    return this->buffers[chunk.index];
+  }
+
+  unsigned long getMaxStall()
+  {
+    return this->maxStall;
+  }
+
+  unsigned long getMaxWriteTime()
+  {
+    return this->maxWriteTime;
+  }
+
+  // Move the chunk timings of the last transfer into the totals. Only call
+  // once the worker has ended (finish or stop).
+  void collectTimes(FTPHistogram &reads, FTPHistogram &writes)
+  {
+    reads.merge(this->readTimes);
+    writes.merge(this->writeTimes);
+    this->readTimes.clear();
+    this->writeTimes.clear();
+  }
+
+  // Stop the worker and wait until it no longer uses the file, at most
+  // until the chunk it reads or writes is done
+  void stop()
+  {
+    if (this->running)
+    {
+      this->stopRequested = true;
+      xSemaphoreTake(this->workerDone, portMAX_DELAY);
+      this->running = false;
+    }
+  }
+};
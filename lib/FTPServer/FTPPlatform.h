@@ -0,0 +1,100 @@
+#pragma once
+
+// Everything the FTP server uses from the board: Arduino core, FreeRTOS,
+// network and file system. Built for the ESP32 with the Arduino framework,
+// and for Linux (the PlatformIO native env) on POSIX sockets and files.
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <unistd.h>
+#include "SD.h"
+
+typedef WiFiServer FTPListener;
+typedef WiFiClient FTPConnection;
+typedef fs::File FTPPlatformFile;
+
+// Files are served from any Arduino file system, the SD card by default.
+// fs::FS cannot truncate, that goes through the VFS path of its mount point.
+class FTPPlatformStorage
+{
+private:
+  fs::FS *fileSystem;
+  const char *mountPoint;
+
+public:
+  FTPPlatformStorage(fs::FS &fs = SD, const char *mountPoint = "/sd") : fileSystem(&fs), mountPoint(mountPoint) {}
+
+  FTPPlatformFile open(const String &path, const char *mode = "r") { return this->fileSystem->open(path, mode); }
+  boolean exists(const String &path) { return this->fileSystem->exists(path); }
+  boolean mkdir(const String &path) { return this->fileSystem->mkdir(path); }
+  boolean rmdir(const String &path) { return this->fileSystem->rmdir(path); }
+  boolean remove(const String &path) { return this->fileSystem->remove(path); }
+  boolean rename(const String &from, const String &to) { return this->fileSystem->rename(from, to); }
+  boolean truncate(const String &path, uint32_t size) { return ::truncate((String(this->mountPoint) + path).c_str(), size) == 0; }
+};
+
+// Address the client reached us on, sent back in the PASV reply
+inline boolean ftpLocalAddress(FTPConnection &connection, uint8_t address[4])
+{
+  IPAddress ip = WiFi.localIP();
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    address[i] = ip[i];
+  }
+  return true;
+}
+
+// WiFiServer does not expose its socket, new connections are found by polling
+inline int ftpListenerFd(FTPListener &listener)
+{
+  return -1;
+}
+
+#else
+
+#include "posix/FTPPosixRuntime.h"
+
+// Tests can bring their own network or file system: they define
+// FTP_HOST_NETWORK or FTP_HOST_STORAGE and the typedefs below before
+// including the server, see test/support
+#ifndef FTP_HOST_NETWORK
+#include "posix/FTPPosixNetwork.h"
+typedef FTPPosixListener FTPListener;
+typedef FTPPosixConnection FTPConnection;
+#endif
+
+#ifndef FTP_HOST_STORAGE
+#include "posix/FTPPosixStorage.h"
+typedef FTPPosixFile FTPPlatformFile;
+typedef FTPPosixStorage FTPPlatformStorage;
+#endif
+
+inline boolean ftpLocalAddress(FTPConnection &connection, uint8_t address[4])
+{
+  return connection.localAddress(address);
+}
+
+inline int ftpListenerFd(FTPListener &listener)
+{
+  return listener.fd();
+}
+
+#endif
+
+#include <Logger.h>
+
+// Encrypt file contents on the card, see FTPCrypto.h
+#ifndef FTP_ENCRYPTION
+#define FTP_ENCRYPTION 0
+#endif
+
+#if FTP_ENCRYPTION
+#include "FTPCrypto.h"
+typedef FTPCryptoFile FTPFile;
+typedef FTPCryptoStorage FTPStorage;
+#else
+typedef FTPPlatformFile FTPFile;
+typedef FTPPlatformStorage FTPStorage;
+#endif
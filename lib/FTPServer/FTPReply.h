@@ -0,0 +1,58 @@
+#include "FTPPlatform.h"
+#include <stdarg.h>
+
+// Room for the longest multi-line reply sent in one write
+#ifndef FTP_REPLY_SIZE
+#define FTP_REPLY_SIZE 512
+#endif
+
+// Collects reply lines in a fixed buffer, so a complete (possibly multi-line)
+// reply goes out in a single write instead of one TCP segment per line.
+class FTPReply
+{
+private:
+  char text[FTP_REPLY_SIZE];
+  uint16_t length = 0;
+
+public:
+  // Append one CRLF terminated line. If the buffer is full the lines
+  // collected so far are sent first.
+  void line(FTPConnection &client, const char *format, va_list args)
+  {
+    va_list retry;
+    va_copy(retry, args);
+    int lineLength = vsnprintf(this->text + this->length, FTP_REPLY_SIZE - this->length, format, args);
+    if (lineLength >= 0 && this->length + lineLength + 2 > FTP_REPLY_SIZE && this->length > 0)
+    {
+      this->send(client);
+      lineLength = vsnprintf(this->text, FTP_REPLY_SIZE, format, retry);
+    }
+    va_end(retry);
+    if (lineLength < 0)
+    {
+      return;
+    }
+    // Too long even for an empty buffer - truncate
+    if (this->length + lineLength + 2 > FTP_REPLY_SIZE)
+    {
+      lineLength = FTP_REPLY_SIZE - 2 - this->length;
+    }
+    this->length += lineLength;
+    this->text[this->length++] = '\r';
+    this->text[this->length++] = '\n';
+  }
+
+  void send(FTPConnection &client)
+  {
+    if (this->length > 0)
+    {
+      client.write((const uint8_t *)this->text, this->length);
+      this->length = 0;
+    }
+  }
+
+  void clear()
+  {
+    this->length = 0;
+  }
+};
@@ -1,855 +1,252 @@
-#include "SD.h"
-#include <WiFi.h>
-
-enum CommandStatus
-{
-  RESET = 0,
-  WAIT_CONNECTION = 1,
-  IDLE = 2,
-  WAIT_USERNAME = 3,
-  WAIT_PASSWORD = 4,
-  WAIT_COMMAND = 5,
-};
-
-enum TransferStatus
-{
-  NO_TRANSFER = 0,
-  RETRIEVE = 1,
-  STORE = 2,
-};
-
-#define FTP_BUF_SIZE 4096
-
-unsigned int FTP_TIMEOUT = 5 * 60 * 1000;
+#include "FTPSession.h"
+
+// Number of clients served at the same time. Session i listens for data
+// connections on dataPort + i.
+#ifndef FTP_MAX_SESSIONS
+#define FTP_MAX_SESSIONS 3
+#endif
+
+// How often new control connections are looked for when the listening socket
+// cannot be waited on (WiFiServer), in ms
+#ifndef FTP_ACCEPT_INTERVAL
+#define FTP_ACCEPT_INTERVAL 20
+#endif
+
+// Control connection port. The native build uses an unprivileged port.
+#ifndef FTP_COMMAND_PORT
+#define FTP_COMMAND_PORT 21
+#endif
+
+// Longest time quiesce() waits for the FTP task to let go of the storage,
+// in ms. The FTP task finishes at most one transfer chunk first.
+#ifndef FTP_QUIESCE_TIMEOUT
+#define FTP_QUIESCE_TIMEOUT 250
+#endif
+
+// Longest sleep of the FTP task when it cannot be woken by another task (no
+// FTPWaker socket), in ms
+#ifndef FTP_QUIESCE_POLL
+#define FTP_QUIESCE_POLL 20
+#endif
+
+// Fixed sleep between mainFTPLoop() passes in ms instead of waiting for
+// the sockets, 0 to wait for them. 1 is the polling loop the FTP task used
+// to run, kept as a baseline for measurements.
+#ifndef FTP_POLL_INTERVAL
+#define FTP_POLL_INTERVAL 0
+#endif
+
+#define FTP_REQUEST_NONE 0
+#define FTP_REQUEST_QUIESCE 1
+#define FTP_REQUEST_RESUME 2
 
 class FTPServer
 {
 
 private:
-  String ftpUsername;
-  String ftpPassword;
-
-  int ftpDataPort;
-
-  WiFiServer ftpDataServer;
-  WiFiServer ftpCommandServer;
-
-  WiFiClient ftpDataClient;
-  WiFiClient ftpCommandClient;
-
-  CommandStatus status;
-  TransferStatus transfer;
-
-  unsigned long connectTimeoutTime;
-  unsigned long transactionBeginTime;
-
-  String currentDir;
-  String fileToRename;
-  File currentFile;
-
-  String filePath;
-
-  String lastUserCommand;
-  String lastUserParams;
-
-  char buf[FTP_BUF_SIZE];
-  unsigned long bytesTransfered;
-
-  uint16_t iCL;
-
-public:
-  void begin(String username, String password, int dataPort)
-  {
-    this->ftpUsername = username;
-    this->ftpPassword = password;
-    this->ftpDataPort = dataPort;
+  FTPListener ftpCommandServer;
+  FTPStorage storage;
 
-    this->ftpDataServer = WiFiServer(dataPort);
-    this->ftpCommandServer = WiFiServer(21);
-
-    this->ftpDataServer.begin();
-    this->ftpCommandServer.begin();
+  FTPSession sessions[FTP_MAX_SESSIONS];
+  uint8_t nextSession;
 
-    this->currentDir = "/";
-    this->filePath = "";
+  // Shared by all sessions, they run on the same task
+  FTPDirCache dirCache;
+  FTPStats stats;
+  FTPBufferPool bufferPool;
 
-    this->status = RESET;
-    this->transfer = NO_TRANSFER;
-  }
+  // Requests of other tasks, carried out by the FTP task at the start of
+  // the next mainFTPLoop() pass
+  FTPWaker waker;
+  std::atomic<uint8_t> request;
+  volatile unsigned long requestMicros = 0;
+  volatile unsigned long requestTimeout = 0;
+  SemaphoreHandle_t quiesceDone = NULL;
+  volatile boolean started = false;
+  volatile unsigned long quiesceMicros = 0;
+  boolean quiesced = false;
 
-  void configVariables()
+  void handleRequest()
   {
-  }
-
-  void mainFTPLoop()
-  {
-    // Serial.println("mainFTPLoop: Current state is " + String(this->status));
-
-    // Continue transfer if exists
-    if (this->transfer != NO_TRANSFER)
-    {
-      this->processTransfer();
-      return;
-    }
-
-    // New client appeared
-    if (this->ftpCommandServer.hasClient())
-    {
-      Serial.println("New client");
-      this->ftpCommandClient.stop();
-      this->ftpCommandClient = this->ftpCommandServer.available();
-    }
-
-    // Client timeout - disconnect
-    else if (this->status > IDLE && millis() > this->connectTimeoutTime)
-    {
-      this->ftpCommandClient.println("530 Timeout");
-      vTaskDelay(200);
-      this->status = RESET;
-      return;
-    }
-
-    switch (this->status)
-    {
-    case RESET:
-    {
-      Serial.println("RESET");
-      if (this->ftpCommandClient.connected())
-      {
-        this->disconnectClient();
-      }
-      this->status = WAIT_CONNECTION;
-      break;
-    }
-
-    case WAIT_CONNECTION:
-    {
-      this->abortTransfer();
-      Serial.println("Ftp server waiting for connection on port 21");
-      this->currentDir = "/";
-      this->status = IDLE;
-      break;
-    }
-    case IDLE:
-    {
-      if (this->ftpCommandClient.connected())
-      {
-        this->handleClientConnect();
-        this->connectTimeoutTime = millis() + 10 * 1000;
-        this->status = WAIT_USERNAME;
-      }
-      break;
-    }
-    case WAIT_USERNAME:
-    {
-      if (this->isNewClientCommand())
-      {
-        Serial.println("WAIT_USERNAME");
-
-        if (this->encryptionRejected())
-        {
-          Serial.println("encryptionRejected");
-          return;
-        }
-
-        if (this->handleClientUsername())
-        {
-          this->status = WAIT_PASSWORD;
-        }
-        else
-        {
-          this->status = RESET;
-          vTaskDelay(100);
-        }
-        return;
-      }
-      else if (!this->ftpCommandClient.connected() || !this->ftpCommandClient)
-      {
-        this->status = WAIT_CONNECTION;
-        Serial.println("WAIT_DISCONNECTED");
-      }
-      break;
-    }
-    case WAIT_PASSWORD:
+    uint8_t request = this->request.exchange(FTP_REQUEST_NONE);
+    if (request == FTP_REQUEST_QUIESCE)
     {
-      if (this->isNewClientCommand())
+      for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i++)
       {
-        Serial.println("WAIT_PASSWORD");
-        if (this->handleClientPassword())
-        {
-          this->status = WAIT_COMMAND;
-          this->connectTimeoutTime = millis() + 10 * 1000;
-        }
-        else
-        {
-          this->status = RESET;
-        }
-        return;
+        this->sessions[i].quiesce();
       }
-      else if (!this->ftpCommandClient.connected() || !this->ftpCommandClient)
+      this->dirCache.clear();
+      this->quiesced = true;
+      unsigned long elapsed = micros() - this->requestMicros;
+      this->quiesceMicros = elapsed;
+      this->stats.quiesces++;
+      this->stats.quiesceTimes.add(elapsed);
+      if (elapsed > this->requestTimeout * 1000)
       {
-        this->status = WAIT_CONNECTION;
-        Serial.println("WAIT_DISCONNECTED");
+        this->stats.lateQuiesces++;
       }
-      break;
+      xSemaphoreGive(this->quiesceDone);
+      LOG_INFO("FTP quiesced in %lu us", elapsed);
     }
-    case WAIT_COMMAND:
+    else if (request == FTP_REQUEST_RESUME && this->quiesced)
     {
-      if (this->isNewClientCommand())
+      for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i++)
       {
-        Serial.println("WAIT_COMMAND");
-        if (!this->processCommand(this->lastUserCommand, this->lastUserParams))
-        {
-          this->status = RESET;
-          return;
-        }
-        else
-        {
-          this->connectTimeoutTime = millis() + FTP_TIMEOUT;
-        }
+        this->sessions[i].resume();
       }
-      else if (!this->ftpCommandClient.connected() || !this->ftpCommandClient)
-      {
-        this->status = WAIT_CONNECTION;
-        Serial.println("WAIT_DISCONNECTED");
-      }
-    }
-    }
-  }
-
-  void processTransfer()
-  {
-    if (this->transfer == RETRIEVE)
-    {
-      if (!this->dataSend())
-        this->transfer = NO_TRANSFER;
-      return;
-    }
-    else if (this->transfer == STORE)
-    {
-      if (!this->dataReceive())
-        this->transfer = NO_TRANSFER;
-      return;
+      // The storage may have changed in the meantime
+      this->dirCache.clear();
+      this->quiesced = false;
+      LOG_INFO("FTP resumed");
     }
   }
 
-  void handleClientConnect()
-  {
-    Serial.println("Client connected!");
-    this->ftpCommandClient.println("220--- FTP SERVER FOR ESP32 ---");
-    this->ftpCommandClient.println("220--- BY Jacek Nitychoruk & Karol Musur ---");
-    this->ftpCommandClient.println("220 -- VERSION 0.1 --");
-    this->iCL = 0;
-  }
+public:
+  FTPServer() : request(FTP_REQUEST_NONE) {}
 
-  void disconnectClient()
-  {
-    Serial.println("Disconnecting client");
-    this->abortTransfer();
-    this->ftpCommandClient.println("221 Goodbye");
-    this->ftpCommandClient.stop();
-  }
+  // Serve files from another file system than the SD card (or, in the
+  // native build, from a host directory)
+  FTPServer(const FTPStorage &storage) : storage(storage), request(FTP_REQUEST_NONE) {}
 
-  // Return 530 on AUTH command, to indicate that we do not support encrypted connection
-  // Returns true if user is trying to use encryption, and should try again with different protocol
-  // Returns false if program can continue execution
-  boolean encryptionRejected()
+  void begin(String username, String password, int dataPort)
   {
-    if (String(this->lastUserCommand) == "AUTH")
-    {
-      this->ftpCommandClient.println("530 Please login with USER and PASS.");
-      return true;
-    }
-    else
-    {
-      return false;
-    }
-  }
+    this->ftpCommandServer = FTPListener(FTP_COMMAND_PORT);
+    this->ftpCommandServer.begin();
+    this->bufferPool.begin();
+#if FTP_ENCRYPTION
+    ftpKeyStore().begin();
+#endif
 
-  boolean handleClientUsername()
-  {
-    Serial.println("HANDLING_USERNAME");
-    if (String(this->lastUserCommand) != "USER")
-    {
-      Serial.println(this->lastUserCommand);
-      this->ftpCommandClient.println("500 Syntax error");
-      return false;
-    }
-    if (this->ftpUsername != String(this->lastUserParams))
+    for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i++)
     {
-      Serial.println(this->lastUserCommand);
-      this->ftpCommandClient.println("530 user not found");
-      return false;
-    }
-    else
-    {
-      this->ftpCommandClient.println("331 OK. Password required");
-      return true;
+      this->sessions[i].begin(username, password, dataPort + i, &this->storage, &this->dirCache, &this->stats, &this->bufferPool, &this->waker);
     }
-  }
+    this->nextSession = 0;
 
-  boolean handleClientPassword()
-  {
-    if (String(this->lastUserCommand) != "PASS")
+    this->quiesceDone = xSemaphoreCreateBinary();
+    if (!this->waker.begin())
     {
-      Serial.println(this->lastUserCommand);
-      this->ftpCommandClient.println("500 Syntax error");
-      return false;
-    }
-    if (this->ftpPassword != String(this->lastUserParams))
-    {
-      this->ftpCommandClient.println("530 ");
-      return false;
-    }
-    else
-    {
-      this->ftpCommandClient.println("230 OK.");
-      this->currentDir = "/";
-      return true;
+      LOG_WARN("FTP wake socket failed, polling every %d ms", FTP_QUIESCE_POLL);
     }
+    this->started = true;
   }
 
-  boolean processCommand(String command, String params)
+  // Called from another task that needs the storage to itself (the card
+  // wipe): every transfer is aborted (426), the files of the sessions are
+  // closed and storage commands are refused with 450 until resume().
+  // Returns true once the FTP task no longer uses the storage, false if it
+  // did not get there within timeout ms.
+  boolean quiesce(unsigned long timeout = FTP_QUIESCE_TIMEOUT)
   {
-    if (command == "PWD")
+    if (!this->started)
     {
-      Serial.println("Current dir: " + this->currentDir);
-      this->ftpCommandClient.println("257 \"" + currentDir + "\" is your current directory");
       return true;
     }
-    else if (command == "NOOP")
-    {
-      this->ftpCommandClient.println("200 NOOP");
-      return true;
-    }
-    else if (command == "QUIT")
+    // Left over from a request that timed out
+    xSemaphoreTake(this->quiesceDone, 0);
+    this->requestTimeout = timeout;
+    this->requestMicros = micros();
+    this->request.store(FTP_REQUEST_QUIESCE);
+    this->waker.wake();
+    if (xSemaphoreTake(this->quiesceDone, pdMS_TO_TICKS(timeout)) != pdTRUE)
     {
+      LOG_WARN("FTP not quiesced after %lu ms", timeout);
       return false;
     }
-    else if (command == "ABOR")
-    {
-      Serial.println("ABORting");
-      this->abortTransfer();
-      this->ftpCommandClient.println("226 Data connection closed");
-
-      return true;
-    }
-    else if (command == "MODE")
-    {
-      if (params == "S")
-      {
-        this->ftpCommandClient.println("200 OK");
-      }
-      else
-      {
-        this->ftpCommandClient.println("504 Only Stream is supported");
-      }
-      return true;
-    }
-    else if (command == "STRU")
-    {
-      if (params == "F")
-      {
-        this->ftpCommandClient.println("200 OK");
-      }
-      else
-      {
-        this->ftpCommandClient.println("504 Only File is supported");
-      }
-      return true;
-    }
-    else if (command == "CDUP")
-    {
-      return cd("..");
-    }
-    else if (command == "CWD")
-    {
-      return cd(params);
-    }
-    else if (command == "FEAT")
-    {
-      this->ftpCommandClient.println("211-Extensions suported:");
-      this->ftpCommandClient.println(" MLSD");
-      this->ftpCommandClient.println("211 End.");
-      return true;
-    }
-    else if (command == "MKD")
-    {
-      if (params == "")
-      {
-        this->ftpCommandClient.println("501 No file name given");
-        return false;
-      }
-
-      String dirname = getFullPath(params);
-
-      if (SD.exists(dirname))
-      {
-        this->ftpCommandClient.println("553 Directory " + dirname + " already exists");
-        return true;
-      }
-
-      if (SD.mkdir(dirname))
-      {
-        this->ftpCommandClient.println("275 Directory successfully created");
-        return true;
-      }
-      else
-      {
-        this->ftpCommandClient.println("550 MKD failed");
-        return true;
-      }
-    }
-    else if (command == "TYPE")
-    {
-      if (params == "A")
-        this->ftpCommandClient.println("200 TYPE is now ASCII");
-      else if (params == "I")
-        this->ftpCommandClient.println("200 TYPE is now 8-bit binary");
-      else
-        this->ftpCommandClient.println("504 Unknown TYPE");
-      return true;
-    }
-
-    else if (command == "PASV")
-    {
-      if (this->ftpDataClient.connected())
-      {
-        this->ftpDataClient.stop();
-      }
-      IPAddress dataIp = WiFi.localIP();
-      Serial.println("Connection management set to passive");
-      Serial.println("Data port set to " + String(this->ftpDataPort));
-      this->ftpCommandClient.println("227 Entering Passive Mode (" + String(dataIp[0]) + "," + String(dataIp[1]) + "," + String(dataIp[2]) + "," + String(dataIp[3]) + "," + String(this->ftpDataPort >> 8) + "," + String(this->ftpDataPort & 255) + ").");
-      return true;
-    }
-
-    else if (command == "MLSD" || command == "LIST")
-    {
-      if (!this->dataConnect())
-      {
-        this->ftpCommandClient.println("425 No data connection MLSD");
-        return false;
-      }
-      else
-      {
-        this->ftpCommandClient.println("150 Accepted data connection");
-        uint16_t nm = 0;
-        File dir = SD.open(this->currentDir);
-        if ((!dir) || (!dir.isDirectory()))
-          this->ftpCommandClient.println("550 Cannot open directory " + this->currentDir);
-        else
-        {
-
-          File file = dir.openNextFile();
-          while (file)
-          {
-            String fileName, fileSize;
-            fileName = file.name();
-            int sep = fileName.lastIndexOf('/');
-            fileName = fileName.substring(sep + 1);
-            fileSize = String(file.size());
-            if (file.isDirectory())
-            {
-              if (command == "MLSD")
-              {
-                this->ftpDataClient.println("Type=dir;Size=" + fileSize + ";" + "modify=20210101000000;" + " " + fileName);
-              }
-              else
-              {
-                this->ftpDataClient.println("01-01-2000  00:00AM <DIR> " + fileName);
-              }
-            }
-            else
-            {
-              if (command == "MLSD")
-              {
-                this->ftpDataClient.println("Type=file;Size=" + fileSize + ";" + "modify=20210101000000;" + " " + fileName);
-              }
-              else
-              {
-                this->ftpDataClient.println("01-01-2000  00:00AM " + fileSize + " " + fileName);
-              }
-            }
-            nm++;
-
-            file = dir.openNextFile();
-          }
-
-          if (command == "MLSD")
-          {
-            this->ftpCommandClient.println("226-options: -a -l");
-          }
-          this->ftpCommandClient.println("226 " + String(nm) + " matches total");
-        }
-        this->ftpDataClient.stop();
-      }
-      return true;
-    }
-    else if (command == "DELE" || command == "RMD")
-    {
-      if (params == "")
-      {
-        this->ftpCommandClient.println("501 No file name");
-        return false;
-      }
-
-      String filePath = getFullPath(params);
-
-      if (!SD.exists(filePath))
-      {
-        this->ftpCommandClient.println("550 File " + filePath + " not found");
-        return false;
-      }
-
-      if (command == "DELE" ? SD.remove(filePath) : SD.rmdir(filePath))
-      {
-        this->ftpCommandClient.println("250 Deleted " + filePath);
-        return true;
-      }
-      else
-      {
-        this->ftpCommandClient.println("450 Can't delete " + filePath);
-        return false;
-      }
-    }
-
-    else if (command == "RNFR")
-    {
-      if (params == "")
-      {
-        this->ftpCommandClient.println("501 No file name");
-        return false;
-      }
-
-      fileToRename = getFullPath(params);
-
-      if (!SD.exists(fileToRename))
-      {
-        this->ftpCommandClient.println("550 File " + fileToRename + " not found");
-        return false;
-      }
-
-      Serial.println("Renaming " + fileToRename);
-      this->ftpCommandClient.println("350 RNFR accepted");
-    }
-
-    else if (command == "RNTO")
-    {
-      if (params == "")
-      {
-        this->ftpCommandClient.println("501 No file name given");
-        return false;
-      }
-
-      if (fileToRename == "")
-      {
-        this->ftpCommandClient.println("501 No file name set by RNFR");
-        return false;
-      }
-
-      String newFileName = getFullPath(params);
-
-      if (SD.exists(newFileName))
-      {
-        this->ftpCommandClient.println("553 File " + fileToRename + " already exists");
-        return false;
-      }
-
-      if (SD.rename(fileToRename, newFileName))
-      {
-        this->ftpCommandClient.println("250 File successfully renamed or moved");
-        Serial.println("Renaming " + fileToRename);
-        fileToRename = "";
-        return true;
-      }
-      else
-      {
-        this->ftpCommandClient.println("451 Rename failed");
-        fileToRename = "";
-        return false;
-      }
-    }
-
-    else if (command == "RETR")
-    {
-      if (params.length() == 0)
-      {
-        this->ftpCommandClient.println("501 No file name");
-        return false;
-      }
-
-      String filePath = getFullPath(params);
-      this->currentFile = SD.open(filePath, "r");
-      if (!this->currentFile)
-        this->ftpCommandClient.println("550 File " + params + " not found");
-      else if (!this->currentFile)
-        this->ftpCommandClient.println("450 Cannot open " + params);
-      else if (!this->dataConnect())
-        this->ftpCommandClient.println("425 No data connection");
-      else
-      {
-        Serial.println("Sending " + params);
-        this->ftpCommandClient.println("150-Connected to port " + String(this->ftpDataPort));
-        this->ftpCommandClient.println("150 " + String(this->currentFile.size()) + " bytes to download");
-        this->transactionBeginTime = millis();
-        this->bytesTransfered = 0;
-        this->transfer = RETRIEVE;
-      }
-      return true;
-    }
-    else if (command == "STOR")
-    {
-      if (params == "")
-      {
-        this->ftpCommandClient.println("501 No file name given");
-        return false;
-      }
-
-      String filePath = getFullPath(params);
-
-      this->filePath = filePath;
-      this->currentFile = SD.open(filePath, "w");
-
-      if (!this->currentFile)
-      {
-        this->ftpCommandClient.println("451 Can't create or open " + filePath);
-        return true;
-      }
-
-      if (!this->dataConnect())
-      {
-        this->ftpCommandClient.println("425 No data connection");
-        this->currentFile.close();
-        return true;
-      }
-
-      Serial.println("Receiving " + params);
-      this->ftpCommandClient.println("150 Connected to port " + String(this->ftpDataPort));
-      this->transactionBeginTime = millis();
-      this->bytesTransfered = 0;
-      this->transfer = STORE;
-
-      return true;
-    }
-    else if (command == "SYST")
-    {
-      this->ftpCommandClient.println("215 ESP32");
-    }
-    else
-    {
-      this->ftpCommandClient.println("500 Syntax error, command unrecognized.");
-      return true;
-    }
     return true;
   }
 
-  boolean dataConnect()
+  // From request to storage released, of the last quiesce()
+  unsigned long getQuiesceMicros()
   {
-    unsigned long startTime = millis();
-    if (!this->ftpDataClient.connected())
-    {
-      while (!this->ftpDataServer.hasClient() && millis() - startTime < 10000)
-      {
-        yield();
-      }
-      if (this->ftpDataServer.hasClient())
-      {
-        this->ftpDataClient.stop();
-        this->ftpDataClient = this->ftpDataServer.available();
-        Serial.println("FTP data client connected");
-      }
-    }
-
-    return this->ftpDataClient.connected();
+    return this->quiesceMicros;
   }
 
-  boolean dataSend()
+  // Called from another task: serve the storage again
+  void resume()
   {
-    size_t numberBytesRead = this->currentFile.readBytes(buf, FTP_BUF_SIZE);
-    // Serial.println("Buffer: " + String(buf));
-    // Serial.println("----: ");
-    // Serial.println("numberBytesRead: " + String(numberBytesRead));
-    if (numberBytesRead > 0 && ftpDataClient.connected())
-    {
-
-      ftpDataClient.write((char *)buf, numberBytesRead);
-      bytesTransfered += numberBytesRead;
-      return true;
-    }
-    else
-    {
-      Serial.println("Transfer closed");
-      this->closeTransfer();
-      return false;
-    }
+    this->request.store(FTP_REQUEST_RESUME);
+    this->waker.wake();
   }
 
-  boolean dataReceive()
+  void configVariables()
   {
-    size_t numberBytesRead = ftpDataClient.readBytes((uint8_t *)buf, FTP_BUF_SIZE);
-    if (numberBytesRead > 0)
-    {
-      size_t position = this->currentFile.position();
-      size_t written = this->currentFile.write((uint8_t *)buf, numberBytesRead);
-      while (written == 0)
-      {
-        this->currentFile.close();
-        this->currentFile = SD.open(this->filePath, "w");
-        this->currentFile.seek(position);
-        written = this->currentFile.write((uint8_t *)buf, numberBytesRead);
-      }
-      bytesTransfered += numberBytesRead;
-      return true;
-    }
-    else
-    {
-      if (!this->ftpDataClient.connected())
-      {
-        this->closeTransfer();
-        return false;
-      }
-      else
-      {
-        return true;
-      }
-    }
   }
 
-  void abortTransfer()
+  void mainFTPLoop()
   {
-    if (this->transfer != NO_TRANSFER)
+    if (this->request.load(std::memory_order_relaxed) != FTP_REQUEST_NONE)
     {
-      this->currentFile.close();
-      this->ftpDataClient.stop();
-      this->ftpCommandClient.println("426 Transfer aborted");
-      Serial.println("Transfer aborted!");
+      this->handleRequest();
     }
-    this->transfer = NO_TRANSFER;
-  }
 
-  void closeTransfer()
-  {
-    uint32_t deltaT = (millis() - this->transactionBeginTime);
-    Serial.println("Transfer close");
-    Serial.println("bytesTransfered: " + String(this->bytesTransfered));
-    if (deltaT > 0 && this->bytesTransfered > 0)
+    // New client appeared
+    if (this->ftpCommandServer.hasClient())
     {
-      this->ftpCommandClient.println("226-File successfully transferred");
-
-      this->ftpCommandClient.println("226 " + String(deltaT) + " ms, " + String(bytesTransfered / deltaT) + " kbytes/s");
+      this->acceptClient();
     }
-    else
+
+    // Every session makes one step (command or transfer chunk) per pass,
+    // starting from a different session each time
+    for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i++)
     {
-      this->ftpCommandClient.println("226 File successfully transferred");
+      this->sessions[(this->nextSession + i) % FTP_MAX_SESSIONS].loop();
     }
-
-    this->currentFile.flush();
-    this->currentFile.close();
-    this->ftpDataClient.stop();
+    this->nextSession = (this->nextSession + 1) % FTP_MAX_SESSIONS;
   }
 
-  boolean isNewClientCommand()
+  // Sleep until a session socket is ready or a session timer is due. Call
+  // between mainFTPLoop() passes instead of a fixed delay.
+  void wait()
   {
-    int c;
-    String commandBuffer = "";
-    String command = "";
-    String params = "";
-    while ((c = this->ftpCommandClient.read()) != -1)
+    if (FTP_POLL_INTERVAL > 0)
     {
-      commandBuffer.concat(String((char)c));
+      unsigned long begin = micros();
+      vTaskDelay(pdMS_TO_TICKS(FTP_POLL_INTERVAL));
+      this->waker.drain();
+      this->stats.loopWakeups++;
+      this->stats.wakeMicros = micros();
+      this->stats.idleMicros += this->stats.wakeMicros - begin;
+      return;
     }
-    if (commandBuffer == "")
+    FTPWaitSet wait;
+    int listenerFd = ftpListenerFd(this->ftpCommandServer);
+    wait.addRead(listenerFd);
+    if (listenerFd < 0)
     {
-      return false;
+      wait.wakeIn(FTP_ACCEPT_INTERVAL);
     }
-    else
+    wait.addRead(this->waker.fd());
+    if (this->waker.fd() < 0)
     {
-      int spaceIndex = -1;
-      if ((spaceIndex = commandBuffer.indexOf(' ')) != -1)
-      {
-        command = commandBuffer.substring(0, spaceIndex);
-        params = commandBuffer.substring(spaceIndex + 1);
-        params.trim();
-      }
-      else
-      {
-        command = commandBuffer;
-        command.trim();
-        params = "";
-      }
-
-      this->lastUserCommand = command;
-      this->lastUserParams = params;
-      Serial.print("commandBuffer: ");
-      Serial.println(String(commandBuffer));
-      Serial.print("command: ");
-      Serial.println(String(command));
-      Serial.print("params: ");
-      Serial.println(params);
-      return true;
+      wait.wakeIn(FTP_QUIESCE_POLL);
     }
-  }
-
-  boolean cd(String path)
-  {
-    Serial.println("Old dir: " + this->currentDir);
-    if (path == ".")
-      return processCommand("PWD", "");
-    else if (path == "..")
+    for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i++)
     {
-      String newPath;
-      if (this->currentDir == "/")
-      {
-        newPath == "/";
-      }
-      int sep = this->currentDir.lastIndexOf('/');
-      newPath = this->currentDir.substring(0, sep);
-      if (newPath == "")
-      {
-        newPath = "/";
-      }
-      this->currentDir = newPath;
-    }
-    else if (path == "/")
-    {
-      this->currentDir = "/";
-    }
-    else
-    {
-      if (path.charAt(0) == '/')
-      {
-        this->currentDir = path;
-      }
-      else
-      {
-        if (this->currentDir == "/")
-        {
-          this->currentDir.concat(path);
-        }
-        else
-        {
-          this->currentDir.concat("/" + path);
-        }
-      }
+      this->sessions[i].prepareWait(wait);
     }
-
-    Serial.println("New dir: " + this->currentDir);
-    this->ftpCommandClient.println("250 Ok. Directory changed to " + this->currentDir);
-    return true;
+    unsigned long begin = micros();
+    wait.wait();
+    this->waker.drain();
+    this->stats.loopWakeups++;
+    this->stats.wakeMicros = micros();
+    this->stats.idleMicros += this->stats.wakeMicros - begin;
   }
 
-  String getFullPath(String relativePath)
+  void acceptClient()
   {
-    String filePath;
-    if (currentDir == "/")
+    FTPConnection client = this->ftpCommandServer.available();
+    for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i++)
     {
-      filePath = "/" + relativePath;
-    }
-    else
-    {
-      filePath = this->currentDir + "/" + relativePath;
+      if (this->sessions[i].isFree())
+      {
+        LOG_INFO("New client in session %u", i);
+        this->sessions[i].attachClient(client);
+        return;
+      }
     }
-    return filePath;
+    LOG_WARN("New client rejected, all sessions busy");
+    client.println("421 Too many users, try again later");
+    client.stop();
   }
 };
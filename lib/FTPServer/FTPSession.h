@@ -0,0 +1,1638 @@
+#include "FTPPlatform.h"
+
+enum CommandStatus
+{
+  RESET = 0,
+  WAIT_CONNECTION = 1,
+  IDLE = 2,
+  WAIT_USERNAME = 3,
+  WAIT_PASSWORD = 4,
+  WAIT_COMMAND = 5,
+};
+
+enum TransferStatus
+{
+  NO_TRANSFER = 0,
+  RETRIEVE = 1,
+  STORE = 2,
+  LIST = 3,
+};
+
+enum ListFormat
+{
+  LIST_FORMAT = 0,
+  MLSD_FORMAT = 1,
+  NLST_FORMAT = 2,
+};
+
+// Directory listings are sent in batches of one TCP segment, one batch per
+// loop() pass
+#define FTP_LIST_BATCH_SIZE 1460
+
+// Time given to the client to open the passive data connection, in ms
+#ifndef FTP_DATA_CONNECT_TIMEOUT
+#define FTP_DATA_CONNECT_TIMEOUT 10000
+#endif
+
+// Read RETR files on a separate task while sending (see FTPPipeline.h)
+#ifndef FTP_PIPELINED_RETRIEVE
+#define FTP_PIPELINED_RETRIEVE 1
+#endif
+
+// Write STOR uploads on a separate task while receiving (see FTPPipeline.h)
+#ifndef FTP_PIPELINED_STORE
+#define FTP_PIPELINED_STORE 1
+#endif
+
+// Print a machine-readable record for every login, command, transfer and
+// listing (see FTPSession::measurement)
+#ifndef FTP_MEASUREMENTS
+#define FTP_MEASUREMENTS 0
+#endif
+
+#include "FTPPipeline.h"
+#include "FTPLineAssembler.h"
+#include "FTPCommands.h"
+#include "FTPReply.h"
+#include "FTPDirCache.h"
+#include "FTPStats.h"
+#include "FTPWait.h"
+#include "FTPPath.h"
+#include <TamperIncidents.h>
+
+unsigned int FTP_TIMEOUT = 5 * 60 * 1000;
+
+// Per-connection state of the FTP server. Every control connection accepted by
+// FTPServer is served by one session with its own data port, working directory
+// and transfer buffer.
+class FTPSession
+{
+
+private:
+  String ftpUsername;
+  String ftpPassword;
+
+  int ftpDataPort;
+
+  FTPListener ftpDataServer;
+
+  FTPConnection ftpDataClient;
+  FTPConnection ftpCommandClient;
+
+  CommandStatus status;
+  TransferStatus transfer;
+  ListFormat listFormat;
+  FTPFile listDir;
+  FTPFile listFile;
+  uint32_t listCount;
+  size_t listLength;
+
+  // File system the session serves, shared with the other sessions
+  FTPStorage *storage;
+
+  // Totals of all sessions, reported by STAT and SITE STATS
+  FTPStats *stats;
+
+  // Listing read from the cache, or collected for it while read from the card
+  FTPDirCache *dirCache;
+  int8_t listSlot;
+  size_t listOffset;
+  FTPDirBuilder listBuilder;
+
+  // Transfer is accepted, but the client has not opened the data connection yet
+  boolean dataPeerPending;
+  unsigned long dataConnectBeginTime;
+  unsigned long lastLoopTime;
+  unsigned long maxControlLoopGap;
+
+  unsigned long connectTimeoutTime;
+  unsigned long transactionBeginTime;
+  // Same moments in microseconds, for measurement records
+  unsigned long connectBeginMicros;
+  unsigned long transactionBeginMicros;
+
+  String currentDir;
+  String fileToRename;
+  FTPFile currentFile;
+
+  String filePath;
+
+  FTPLineAssembler commandLine;
+  FTPReply replyBuffer;
+  const char *lastUserCommand;
+  const char *lastUserParams;
+
+  // Transfer buffers checked out from the pool while a transfer runs: one,
+  // or FTP_PIPELINE_BUFFERS for a pipelined transfer. buf is the first one.
+  FTPBufferPool *bufferPool;
+  uint8_t *buffers[FTP_PIPELINE_BUFFERS];
+  uint8_t bufferCount;
+  char *buf;
+  unsigned long bytesTransfered;
+
+  // Offset set by REST for the next RETR or STOR
+  uint32_t restartOffset;
+
+  FTPPipeline pipeline;
+  boolean pipelined;
+  // Storage commands are refused, see FTPServer::quiesce
+  boolean quiesced = false;
+  // The data socket of a RETR or LIST took no more data
+  boolean dataStalled = false;
+  // STOR buffer being filled from the socket
+  FTPChunk storeChunk;
+  boolean storeChunkHeld;
+
+  uint16_t iCL;
+
+public:
+  void begin(String username, String password, int dataPort, FTPStorage *storage, FTPDirCache *dirCache, FTPStats *stats, FTPBufferPool *bufferPool, FTPWaker *waker)
+  {
+    this->stats = stats;
+    this->pipeline.setWaker(waker);
+    this->bufferPool = bufferPool;
+    this->bufferCount = 0;
+    this->buf = NULL;
+    this->storage = storage;
+    this->dirCache = dirCache;
+    this->listSlot = -1;
+    this->ftpUsername = username;
+    this->ftpPassword = password;
+    this->ftpDataPort = dataPort;
+
+    this->ftpDataServer = FTPListener(dataPort);
+    this->ftpDataServer.begin();
+
+    this->currentDir = "/";
+    this->filePath = "";
+    this->lastUserCommand = "";
+    this->lastUserParams = "";
+    this->restartOffset = 0;
+
+    this->status = RESET;
+    this->transfer = NO_TRANSFER;
+    this->dataPeerPending = false;
+  }
+
+  // Session can take a new control connection
+  boolean isFree()
+  {
+    return this->status <= IDLE && !this->ftpCommandClient.connected();
+  }
+
+  // Abort the transfer and close its files, then refuse storage commands
+  // until resume(). Runs on the FTP task.
+  void quiesce()
+  {
+    this->quiesced = true;
+    this->abortTransfer();
+    this->flushReply();
+  }
+
+  void resume()
+  {
+    this->quiesced = false;
+  }
+
+  void attachClient(FTPConnection client)
+  {
+    this->ftpCommandClient.stop();
+    this->ftpCommandClient = client;
+    this->commandLine.reset();
+    this->replyBuffer.clear();
+    this->restartOffset = 0;
+    this->status = WAIT_CONNECTION;
+  }
+
+  // Queue a reply line. Lines queued during one loop() pass are sent
+  // together in a single write.
+  void reply(const char *format, ...) __attribute__((format(printf, 2, 3)))
+  {
+    va_list args;
+    va_start(args, format);
+    this->replyBuffer.line(this->ftpCommandClient, format, args);
+    va_end(args);
+  }
+
+  void flushReply()
+  {
+    this->replyBuffer.send(this->ftpCommandClient);
+  }
+
+  // Log one measurement as a JSON object after "FTPM ",
+  // e.g. FTPM {"event":"retr","bytes":1048576,"us":95021,"pipelined":1}.
+  // The format gives the members without the braces. Runs of a benchmark
+  // client can then be compared between builds by grepping the log.
+  void measurement(const char *format, ...) __attribute__((format(printf, 2, 3)))
+  {
+#if FTP_MEASUREMENTS
+    char line[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line + 6, sizeof(line) - 7, format, args);
+    va_end(args);
+    if (length < 0 || length > (int)sizeof(line) - 8)
+    {
+      return;
+    }
+    memcpy(line, "FTPM {", 6);
+    line[6 + length] = '}';
+    line[7 + length] = '\0';
+    logger().write(LOG_LEVEL_INFO, "%s", line);
+#endif
+  }
+
+  void loop()
+  {
+    this->step();
+    this->flushReply();
+  }
+
+  // What the next loop() pass waits for: data on the control connection, the
+  // data connection or its listener, or one of the session timers
+  void prepareWait(FTPWaitSet &wait)
+  {
+    if (this->status < IDLE)
+    {
+      // RESET and WAIT_CONNECTION move on by themselves
+      wait.wakeIn(0);
+      return;
+    }
+    if (this->status == IDLE)
+    {
+      // A client attached by the server is greeted on the next pass
+      if (this->ftpCommandClient.connected())
+      {
+        wait.wakeIn(0);
+      }
+      return;
+    }
+
+    if (this->transfer != NO_TRANSFER && !this->dataPeerPending)
+    {
+      if (this->transfer == STORE)
+      {
+        // Sleep until data or the end of the upload arrives, or with all
+        // pipeline buffers busy until the writer frees one. The timeout
+        // catches a failed write in the pipeline.
+        if (!this->pipelined || this->storeChunkHeld || this->pipeline.readyOrNotify())
+        {
+          wait.addRead(this->ftpDataClient.fd());
+        }
+        wait.wakeIn(this->pipelined && !this->pipeline.canNotify() ? 1 : 10);
+      }
+      else if (this->dataStalled)
+      {
+        // The client does not read, sleep until it does
+        wait.addWrite(this->ftpDataClient.fd());
+      }
+      else if (this->pipelined && !this->pipeline.readyOrNotify())
+      {
+        // Sleep until the reader has filled a chunk
+        wait.wakeIn(this->pipeline.canNotify() ? 10 : 1);
+      }
+      else
+      {
+        // RETR and LIST send as long as the socket takes data
+        wait.wakeIn(0);
+      }
+      return;
+    }
+
+    if (this->dataPeerPending)
+    {
+      int listenerFd = ftpListenerFd(this->ftpDataServer);
+      wait.addRead(listenerFd);
+      wait.wakeIn(listenerFd < 0 ? 1 : remaining(this->dataConnectBeginTime + FTP_DATA_CONNECT_TIMEOUT));
+    }
+
+    if (this->commandLine.hasLine() || this->ftpCommandClient.available() > 0)
+    {
+      wait.wakeIn(0);
+      return;
+    }
+    wait.addRead(this->ftpCommandClient.fd());
+    wait.wakeIn(remaining(this->connectTimeoutTime));
+  }
+
+  static unsigned long remaining(unsigned long deadline)
+  {
+    long left = (long)(deadline - millis());
+    return left > 0 ? left + 1 : 0;
+  }
+
+  void step()
+  {
+    // LOG_DEBUG("step: Current state is %d", this->status);
+
+    // Continue transfer if exists. While waiting for the data connection the
+    // control channel is still served, so NOOP and ABOR get answered.
+    if (this->transfer != NO_TRANSFER)
+    {
+      if (!this->dataPeerPending)
+      {
+        this->processTransfer();
+        return;
+      }
+      this->waitDataPeer();
+    }
+
+    // Client timeout - disconnect
+    if (this->status > IDLE && millis() > this->connectTimeoutTime)
+    {
+      this->reply("530 Timeout");
+      this->stats->controlTimeouts++;
+      this->status = RESET;
+      return;
+    }
+
+    switch (this->status)
+    {
+    case RESET:
+    {
+      LOG_DEBUG("RESET");
+      if (this->ftpCommandClient.connected())
+      {
+        this->disconnectClient();
+      }
+      this->status = WAIT_CONNECTION;
+      break;
+    }
+
+    case WAIT_CONNECTION:
+    {
+      this->abortTransfer();
+      LOG_DEBUG("FTP session waiting for connection, data port %d", this->ftpDataPort);
+      this->currentDir = "/";
+      this->status = IDLE;
+      break;
+    }
+    case IDLE:
+    {
+      if (this->ftpCommandClient.connected())
+      {
+        this->handleClientConnect();
+        this->connectTimeoutTime = millis() + 10 * 1000;
+        this->status = WAIT_USERNAME;
+      }
+      break;
+    }
+    case WAIT_USERNAME:
+    case WAIT_PASSWORD:
+    case WAIT_COMMAND:
+    {
+      if (this->isNewClientCommand())
+      {
+        if (!this->processCommand(this->lastUserCommand, this->lastUserParams))
+        {
+          this->status = RESET;
+          return;
+        }
+        else if (this->status == WAIT_COMMAND)
+        {
+          this->connectTimeoutTime = millis() + FTP_TIMEOUT;
+        }
+      }
+      else if (!this->ftpCommandClient.connected() || !this->ftpCommandClient)
+      {
+        this->status = WAIT_CONNECTION;
+        LOG_DEBUG("WAIT_DISCONNECTED");
+      }
+    }
+    }
+  }
+
+  void processTransfer()
+  {
+    boolean running = true;
+    // RETR and LIST only send what the socket takes at once, a client that
+    // stops reading then cannot hold the FTP task in a write
+    this->dataStalled = this->transfer != STORE && !FTPWaitSet::isWritable(this->ftpDataClient.fd());
+    if (this->dataStalled)
+      return;
+    if (this->transfer == RETRIEVE)
+      running = this->dataSend();
+    else if (this->transfer == STORE)
+      running = this->dataReceive();
+    else if (this->transfer == LIST)
+      running = this->dataList();
+    if (!running)
+    {
+      this->transfer = NO_TRANSFER;
+      this->releaseBuffers();
+    }
+  }
+
+  void handleClientConnect()
+  {
+    LOG_INFO("Client connected!");
+    this->connectBeginMicros = micros();
+    this->reply("220--- FTP SERVER FOR ESP32 ---");
+    this->reply("220--- BY Jacek Nitychoruk & Karol Musur ---");
+    this->reply("220 -- VERSION 0.1 --");
+    this->iCL = 0;
+  }
+
+  void disconnectClient()
+  {
+    LOG_INFO("Disconnecting client");
+    this->abortTransfer();
+    this->reply("221 Goodbye");
+    this->flushReply();
+    this->ftpCommandClient.stop();
+  }
+
+  // Return 530 on AUTH command, to indicate that we do not support encrypted connection,
+  // client should try again with different protocol
+  boolean handleAUTH(const char *params)
+  {
+    LOG_DEBUG("encryptionRejected");
+    this->reply("530 Please login with USER and PASS.");
+    return true;
+  }
+
+  boolean handleUSER(const char *params)
+  {
+    LOG_DEBUG("HANDLING_USERNAME");
+    if (this->ftpUsername != params)
+    {
+      this->reply("530 user not found");
+      this->stats->failedLogins++;
+      return false;
+    }
+    this->reply("331 OK. Password required");
+    this->status = WAIT_PASSWORD;
+    return true;
+  }
+
+  boolean handlePASS(const char *params)
+  {
+    if (this->ftpPassword != params)
+    {
+      this->reply("530 ");
+      this->stats->failedLogins++;
+      return false;
+    }
+    this->reply("230 OK.");
+    this->stats->logins++;
+    this->measurement("\"event\":\"login\",\"us\":%lu", micros() - this->connectBeginMicros);
+    this->currentDir = "/";
+    this->status = WAIT_COMMAND;
+    return true;
+  }
+
+public:
+  // Entry of a packed verb, NULL if unknown. Public for the dispatch
+  // benchmark.
+  static const FTPCommandEntry *findCommand(uint32_t verb)
+  {
+    // Transfer commands first, they are the most frequent ones
+    static const FTPCommandEntry commands[] = {
+        {ftpVerb("RETR"), FTP_LOGGED_IN, &FTPSession::handleRETR, FTP_USES_STORAGE},
+        {ftpVerb("STOR"), FTP_LOGGED_IN, &FTPSession::handleSTOR, FTP_USES_STORAGE},
+        {ftpVerb("PASV"), FTP_LOGGED_IN, &FTPSession::handlePASV, 0},
+        {ftpVerb("TYPE"), FTP_LOGGED_IN, &FTPSession::handleTYPE, 0},
+        {ftpVerb("MLSD"), FTP_LOGGED_IN, &FTPSession::handleLIST, FTP_USES_STORAGE},
+        {ftpVerb("LIST"), FTP_LOGGED_IN, &FTPSession::handleLIST, FTP_USES_STORAGE},
+        {ftpVerb("NLST"), FTP_LOGGED_IN, &FTPSession::handleLIST, FTP_USES_STORAGE},
+        {ftpVerb("CWD"), FTP_LOGGED_IN, &FTPSession::handleCWD, FTP_USES_STORAGE},
+        {ftpVerb("PWD"), FTP_LOGGED_IN, &FTPSession::handlePWD, 0},
+        {ftpVerb("SIZE"), FTP_LOGGED_IN, &FTPSession::handleSIZE, FTP_USES_STORAGE},
+        {ftpVerb("REST"), FTP_LOGGED_IN, &FTPSession::handleREST, 0},
+        {ftpVerb("MDTM"), FTP_LOGGED_IN, &FTPSession::handleMDTM, FTP_USES_STORAGE},
+        {ftpVerb("NOOP"), FTP_ANY_STATE, &FTPSession::handleNOOP, 0},
+        {ftpVerb("CDUP"), FTP_LOGGED_IN, &FTPSession::handleCDUP, FTP_USES_STORAGE},
+        {ftpVerb("DELE"), FTP_LOGGED_IN, &FTPSession::handleDELE, FTP_USES_STORAGE},
+        {ftpVerb("RMD"), FTP_LOGGED_IN, &FTPSession::handleDELE, FTP_USES_STORAGE},
+        {ftpVerb("MKD"), FTP_LOGGED_IN, &FTPSession::handleMKD, FTP_USES_STORAGE},
+        {ftpVerb("RNFR"), FTP_LOGGED_IN, &FTPSession::handleRNFR, FTP_USES_STORAGE},
+        {ftpVerb("RNTO"), FTP_LOGGED_IN, &FTPSession::handleRNTO, FTP_USES_STORAGE},
+        {ftpVerb("ABOR"), FTP_LOGGED_IN, &FTPSession::handleABOR, 0},
+        {ftpVerb("MODE"), FTP_LOGGED_IN, &FTPSession::handleMODE, 0},
+        {ftpVerb("STRU"), FTP_LOGGED_IN, &FTPSession::handleSTRU, 0},
+        {ftpVerb("FEAT"), FTP_ANY_STATE, &FTPSession::handleFEAT, 0},
+        {ftpVerb("SYST"), FTP_ANY_STATE, &FTPSession::handleSYST, 0},
+        {ftpVerb("STAT"), FTP_LOGGED_IN, &FTPSession::handleSTAT, 0},
+        {ftpVerb("SITE"), FTP_LOGGED_IN, &FTPSession::handleSITE, 0},
+        {ftpVerb("QUIT"), FTP_ANY_STATE, &FTPSession::handleQUIT, 0},
+        {ftpVerb("USER"), FTP_STATE(WAIT_USERNAME), &FTPSession::handleUSER, 0},
+        {ftpVerb("PASS"), FTP_STATE(WAIT_PASSWORD), &FTPSession::handlePASS, 0},
+        {ftpVerb("AUTH"), FTP_STATE(WAIT_USERNAME), &FTPSession::handleAUTH, 0},
+    };
+
+    for (uint8_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+      if (commands[i].verb == verb)
+      {
+        return &commands[i];
+      }
+    }
+    return NULL;
+  }
+
+private:
+  boolean processCommand(const char *command, const char *params)
+  {
+    const FTPCommandEntry *entry = findCommand(ftpPackVerb(command));
+    if (entry == NULL)
+    {
+      this->reply("500 Syntax error, command unrecognized.");
+      return true;
+    }
+    if ((entry->states & FTP_STATE(this->status)) == 0)
+    {
+      if (this->status == WAIT_COMMAND)
+        this->reply("503 Bad sequence of commands");
+      else
+        this->reply("530 Please login with USER and PASS.");
+      return true;
+    }
+    if ((entry->flags & FTP_USES_STORAGE) != 0 && this->quiesced)
+    {
+      this->reply("450 Storage unavailable, try again later");
+      return true;
+    }
+    // Only known verbs are measured, the command text goes into the record
+    unsigned long beginMicros = micros();
+    boolean keepSession = (this->*(entry->handler))(params);
+    this->measurement("\"event\":\"command\",\"verb\":\"%s\",\"us\":%lu", command, micros() - beginMicros);
+    return keepSession;
+  }
+
+  boolean handlePWD(const char *params)
+  {
+    LOG_DEBUG("Current dir: %s", this->currentDir.c_str());
+    this->reply("257 \"%s\" is your current directory", this->currentDir.c_str());
+    return true;
+  }
+
+  boolean handleNOOP(const char *params)
+  {
+    this->reply("200 NOOP");
+    return true;
+  }
+
+  boolean handleQUIT(const char *params)
+  {
+    return false;
+  }
+
+  boolean handleABOR(const char *params)
+  {
+    LOG_DEBUG("ABORting");
+    this->abortTransfer();
+    this->reply("226 Data connection closed");
+    return true;
+  }
+
+  boolean handleMODE(const char *params)
+  {
+    if (strcmp(params, "S") == 0)
+    {
+      this->reply("200 OK");
+    }
+    else
+    {
+      this->reply("504 Only Stream is supported");
+    }
+    return true;
+  }
+
+  boolean handleSTRU(const char *params)
+  {
+    if (strcmp(params, "F") == 0)
+    {
+      this->reply("200 OK");
+    }
+    else
+    {
+      this->reply("504 Only File is supported");
+    }
+    return true;
+  }
+
+  boolean handleCDUP(const char *params)
+  {
+    return cd("..");
+  }
+
+  boolean handleCWD(const char *params)
+  {
+    return cd(params);
+  }
+
+  boolean handleFEAT(const char *params)
+  {
+    this->reply("211-Extensions suported:");
+    this->reply(" MLSD");
+    this->reply(" SIZE");
+    this->reply(" MDTM");
+    this->reply(" REST STREAM");
+    this->reply("211 End.");
+    return true;
+  }
+
+  boolean handleMKD(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name given");
+      return false;
+    }
+
+    String dirname = getFullPath(params);
+
+    if (this->fileExists(dirname))
+    {
+      this->reply("553 Directory %s already exists", dirname.c_str());
+      return true;
+    }
+
+    if (this->storage->mkdir(dirname))
+    {
+      this->dirCache->invalidate(dirname);
+      this->reply("275 Directory successfully created");
+      return true;
+    }
+    else
+    {
+      this->reply("550 MKD failed");
+      return true;
+    }
+  }
+
+  boolean handleTYPE(const char *params)
+  {
+    if (strcmp(params, "A") == 0)
+      this->reply("200 TYPE is now ASCII");
+    else if (strcmp(params, "I") == 0)
+      this->reply("200 TYPE is now 8-bit binary");
+    else
+      this->reply("504 Unknown TYPE");
+    return true;
+  }
+
+  boolean handlePASV(const char *params)
+  {
+    if (this->ftpDataClient.connected())
+    {
+      this->ftpDataClient.stop();
+    }
+    uint8_t dataIp[4] = {0, 0, 0, 0};
+    ftpLocalAddress(this->ftpCommandClient, dataIp);
+    LOG_DEBUG("Connection management set to passive, data port %d", this->ftpDataPort);
+    this->reply("227 Entering Passive Mode (%u,%u,%u,%u,%d,%d).", dataIp[0], dataIp[1], dataIp[2], dataIp[3], this->ftpDataPort >> 8, this->ftpDataPort & 255);
+    return true;
+  }
+
+  boolean handleLIST(const char *params)
+  {
+    if (this->transfer != NO_TRANSFER)
+    {
+      this->reply("425 Data connection already pending");
+      return true;
+    }
+    if (strcmp(this->lastUserCommand, "MLSD") == 0)
+      this->listFormat = MLSD_FORMAT;
+    else if (strcmp(this->lastUserCommand, "NLST") == 0)
+      this->listFormat = NLST_FORMAT;
+    else
+      this->listFormat = LIST_FORMAT;
+    this->beginDataTransfer(LIST);
+    return true;
+  }
+
+  // DELE and RMD
+  boolean handleDELE(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name");
+      return false;
+    }
+
+    String filePath = getFullPath(params);
+
+    if (!this->fileExists(filePath))
+    {
+      this->reply("550 File %s not found", filePath.c_str());
+      return false;
+    }
+
+    if (strcmp(this->lastUserCommand, "DELE") == 0 ? this->storage->remove(filePath) : this->storage->rmdir(filePath))
+    {
+      this->dirCache->invalidate(filePath);
+      this->reply("250 Deleted %s", filePath.c_str());
+      return true;
+    }
+    else
+    {
+      this->reply("450 Can't delete %s", filePath.c_str());
+      return false;
+    }
+  }
+
+  boolean handleRNFR(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name");
+      return false;
+    }
+
+    fileToRename = getFullPath(params);
+
+    if (!this->fileExists(fileToRename))
+    {
+      this->reply("550 File %s not found", fileToRename.c_str());
+      return false;
+    }
+
+    LOG_INFO("Renaming %s", fileToRename.c_str());
+    this->reply("350 RNFR accepted");
+    return true;
+  }
+
+  boolean handleRNTO(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name given");
+      return false;
+    }
+
+    if (fileToRename == "")
+    {
+      this->reply("501 No file name set by RNFR");
+      return false;
+    }
+
+    String newFileName = getFullPath(params);
+
+    if (this->fileExists(newFileName))
+    {
+      this->reply("553 File %s already exists", fileToRename.c_str());
+      return false;
+    }
+
+    if (this->storage->rename(fileToRename, newFileName))
+    {
+      this->dirCache->invalidate(fileToRename);
+      this->dirCache->invalidate(newFileName);
+      this->reply("250 File successfully renamed or moved");
+      LOG_INFO("Renaming %s", fileToRename.c_str());
+      fileToRename = "";
+      return true;
+    }
+    else
+    {
+      this->reply("451 Rename failed");
+      fileToRename = "";
+      return false;
+    }
+  }
+
+  boolean handleRETR(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name");
+      return false;
+    }
+
+    if (this->transfer != NO_TRANSFER)
+    {
+      this->reply("425 Data connection already pending");
+      return true;
+    }
+
+    uint32_t offset = this->restartOffset;
+    this->restartOffset = 0;
+
+    String filePath = getFullPath(params);
+    this->currentFile = this->storage->open(filePath, "r");
+    if (!this->currentFile)
+      this->reply("550 File %s not found", params);
+    else if (offset > this->currentFile.size() || !this->currentFile.seek(offset))
+    {
+      this->reply("554 Invalid restart offset %lu", (unsigned long)offset);
+      this->currentFile.close();
+    }
+    else
+    {
+      LOG_INFO("Sending %s from %lu", params, (unsigned long)offset);
+      this->beginDataTransfer(RETRIEVE);
+    }
+    return true;
+  }
+
+  boolean handleSTOR(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name given");
+      return false;
+    }
+
+    if (this->transfer != NO_TRANSFER)
+    {
+      this->reply("425 Data connection already pending");
+      return true;
+    }
+
+    uint32_t offset = this->restartOffset;
+    this->restartOffset = 0;
+
+    String filePath = getFullPath(params);
+
+    this->filePath = filePath;
+    // Resumed upload keeps the data before the offset and nothing after it,
+    // a shorter upload must not leave the old end of the file behind
+    if (offset > 0)
+    {
+      FTPFile existing = this->storage->open(filePath, "r");
+      boolean found = existing;
+      uint32_t size = found ? existing.size() : 0;
+      existing.close();
+      if (!found || offset > size)
+      {
+        this->reply("554 Invalid restart offset %lu", (unsigned long)offset);
+        return true;
+      }
+      if (offset < size && !this->storage->truncate(filePath, offset))
+      {
+        this->reply("451 Can't truncate %s", filePath.c_str());
+        return true;
+      }
+    }
+    this->currentFile = this->storage->open(filePath, offset > 0 ? "r+" : "w");
+    this->dirCache->invalidate(filePath);
+
+    if (!this->currentFile)
+    {
+      this->reply("451 Can't create or open %s", filePath.c_str());
+      return true;
+    }
+
+    if (!this->currentFile.seek(offset))
+    {
+      this->reply("554 Invalid restart offset %lu", (unsigned long)offset);
+      this->currentFile.close();
+      return true;
+    }
+
+    LOG_INFO("Receiving %s from %lu", params, (unsigned long)offset);
+    this->beginDataTransfer(STORE);
+
+    return true;
+  }
+
+  boolean handleREST(const char *params)
+  {
+    char *end;
+    unsigned long offset = strtoul(params, &end, 10);
+    if (params[0] < '0' || params[0] > '9' || *end != '\0')
+    {
+      this->reply("501 Invalid restart offset");
+      return true;
+    }
+    this->restartOffset = offset;
+    this->reply("350 Restarting at %lu. Send STOR or RETR", offset);
+    return true;
+  }
+
+  boolean handleSIZE(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name given");
+      return true;
+    }
+    FTPFile file = this->storage->open(getFullPath(params), "r");
+    if (!file || file.isDirectory())
+    {
+      this->reply("550 No such file");
+      return true;
+    }
+    this->reply("213 %u", (unsigned)file.size());
+    file.close();
+    return true;
+  }
+
+  boolean handleMDTM(const char *params)
+  {
+    if (params[0] == '\0')
+    {
+      this->reply("501 No file name given");
+      return true;
+    }
+    FTPFile file = this->storage->open(getFullPath(params), "r");
+    if (!file)
+    {
+      this->reply("550 No such file");
+      return true;
+    }
+    time_t lastWrite = file.getLastWrite();
+    file.close();
+    char modified[20];
+    strftime(modified, sizeof(modified), "213 %Y%m%d%H%M%S", gmtime(&lastWrite));
+    this->reply("%s", modified);
+    return true;
+  }
+
+  boolean handleSYST(const char *params)
+  {
+    this->reply("215 ESP32");
+    return true;
+  }
+
+  // Server status. Listing a path over the control connection (STAT with an
+  // argument) is not supported.
+  boolean handleSTAT(const char *params)
+  {
+    if (strlen(params) > 0)
+    {
+      this->reply("504 STAT with an argument is not supported");
+      return true;
+    }
+    static const char *transferNames[] = {"none", "RETR", "STOR", "LIST"};
+    this->reply("211-FTP server status");
+    this->reply(" Session data port %d, directory %s, transfer %s%s", this->ftpDataPort, this->currentDir.c_str(),
+                transferNames[this->transfer], this->dataPeerPending ? " (waiting for data connection)" : "");
+    this->replyStats();
+    this->reply("211 End of status");
+    return true;
+  }
+
+  boolean handleSITE(const char *params)
+  {
+    if (strcasecmp(params, "STATS") == 0)
+    {
+      this->reply("211-Server statistics");
+      this->replyStats();
+      this->reply("211 End of statistics");
+    }
+    else if (strcasecmp(params, "STATS RESET") == 0)
+    {
+      this->stats->reset();
+      this->dirCache->resetCounters();
+      this->reply("200 Statistics reset");
+    }
+    else if (strcasecmp(params, "INCIDENTS") == 0)
+    {
+      this->replyIncidents();
+    }
+    else
+    {
+      this->reply("504 Unknown SITE command");
+    }
+    return true;
+  }
+
+  // Tamper responses of this and earlier boots, oldest first
+  void replyIncidents()
+  {
+    TamperIncident incidents[TAMPER_INCIDENTS];
+    uint32_t count = tamperIncidents().snapshot(incidents);
+    char line[FTP_REPLY_SIZE - 2];
+    this->reply("211-Tamper incidents, %lu kept, times after the sample", (unsigned long)count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      line[0] = ' ';
+      TamperIncidentLog::format(incidents[i], line + 1, sizeof(line) - 1);
+      this->reply("%s", line);
+    }
+    this->reply("211 End of incidents");
+  }
+
+  // Counters and histograms of FTPStats, one reply line each
+  void replyStats()
+  {
+    FTPStats *stats = this->stats;
+    char line[FTP_REPLY_SIZE - 2];
+    this->reply(" Uptime %lu s, statistics since %lu s ago", millis() / 1000, (millis() - stats->since) / 1000);
+    this->reply(" Logins %lu, failed %lu, control timeouts %lu", stats->logins, stats->failedLogins, stats->controlTimeouts);
+    this->reply(" Transfers RETR %lu, STOR %lu, LIST %lu, aborted %lu, data timeouts %lu, write errors %lu",
+                stats->retrieves, stats->stores, stats->lists, stats->aborts, stats->dataTimeouts, stats->writeErrors);
+    this->reply(" Bytes sent %llu, received %llu", (unsigned long long)stats->bytesSent, (unsigned long long)stats->bytesReceived);
+    this->reply(" Transfer buffers %u of %u free, fewest free %u, %lu checkouts refused, %u bytes each in %s",
+                this->bufferPool->available(), (unsigned)FTP_BUFFER_COUNT, this->bufferPool->getFewestFree(),
+                this->bufferPool->getFailures(), (unsigned)FTP_BUF_SIZE, this->bufferPool->inPsram() ? "PSRAM" : "RAM");
+    unsigned long elapsed = max(millis() - stats->since, 1UL);
+    unsigned long idle = min((unsigned long)(stats->idleMicros / elapsed), 1000UL);
+    this->reply(" Loop wakeups %lu, FTP task idle %lu.%lu%%, longest control loop gap waiting for data %lu us",
+                stats->loopWakeups, idle / 10, idle % 10, stats->maxControlLoopGap);
+    this->reply(" Listing cache hits %lu, misses %lu, evictions %lu, invalidations %lu", this->dirCache->getHits(),
+                this->dirCache->getMisses(), this->dirCache->getEvictions(), this->dirCache->getInvalidations());
+    this->reply(" Quiesced %lu times, %lu too late", stats->quiesces, stats->lateQuiesces);
+    stats->quiesceTimes.format(line, sizeof(line), " quiesce_us");
+    this->reply("%s", line);
+    stats->transferSizes.format(line, sizeof(line), " transfer_bytes");
+    this->reply("%s", line);
+    stats->transferTimes.format(line, sizeof(line), " transfer_ms");
+    this->reply("%s", line);
+    stats->storageReads.format(line, sizeof(line), " storage_read_us");
+    this->reply("%s", line);
+    stats->storageWrites.format(line, sizeof(line), " storage_write_us");
+    this->reply("%s", line);
+    stats->socketSends.format(line, sizeof(line), " socket_send_us");
+    this->reply("%s", line);
+  }
+
+  // Accept the transfer and wait for the data connection in loop()
+  void beginDataTransfer(TransferStatus transfer)
+  {
+    this->transfer = transfer;
+    this->dataPeerPending = true;
+    this->dataConnectBeginTime = millis();
+    this->lastLoopTime = micros();
+    this->maxControlLoopGap = 0;
+  }
+
+  void waitDataPeer()
+  {
+    // Time asleep in FTPServer::wait is no gap, the FTP task wakes up for
+    // a command on the control connection
+    unsigned long now = micros();
+    unsigned long gap = min(now - this->lastLoopTime, now - this->stats->wakeMicros);
+    if (gap > this->maxControlLoopGap)
+    {
+      this->maxControlLoopGap = gap;
+    }
+    if (gap > this->stats->maxControlLoopGap)
+    {
+      this->stats->maxControlLoopGap = gap;
+    }
+    this->lastLoopTime = now;
+
+    if (!this->ftpDataClient.connected() && this->ftpDataServer.hasClient())
+    {
+      this->ftpDataClient.stop();
+      this->ftpDataClient = this->ftpDataServer.available();
+      LOG_DEBUG("FTP data client connected");
+    }
+
+    if (this->ftpDataClient.connected())
+    {
+      LOG_DEBUG("Data peer after %lu ms, max control loop gap %lu us", millis() - this->dataConnectBeginTime, this->maxControlLoopGap);
+      this->measurement("\"event\":\"data_peer\",\"ms\":%lu,\"gap_us\":%lu,\"connected\":1", millis() - this->dataConnectBeginTime, this->maxControlLoopGap);
+      this->dataPeerPending = false;
+      this->startTransfer();
+    }
+    else if (millis() - this->dataConnectBeginTime > FTP_DATA_CONNECT_TIMEOUT)
+    {
+      LOG_WARN("Data peer timeout, max control loop gap %lu us", this->maxControlLoopGap);
+      this->measurement("\"event\":\"data_peer\",\"ms\":%lu,\"gap_us\":%lu,\"connected\":0", millis() - this->dataConnectBeginTime, this->maxControlLoopGap);
+      this->reply("425 No data connection");
+      this->stats->dataTimeouts++;
+      this->currentFile.close();
+      this->dataPeerPending = false;
+      this->transfer = NO_TRANSFER;
+    }
+  }
+
+  // Take the buffers for the transfer from the pool. A pipelined transfer
+  // needs a whole ring, if the pool cannot spare it the transfer runs
+  // unpipelined on a single buffer.
+  boolean checkoutBuffers()
+  {
+    if ((this->transfer == RETRIEVE && FTP_PIPELINED_RETRIEVE) || (this->transfer == STORE && FTP_PIPELINED_STORE))
+    {
+      if (this->bufferPool->checkout(this->buffers, FTP_PIPELINE_BUFFERS))
+      {
+        this->bufferCount = FTP_PIPELINE_BUFFERS;
+        this->buf = (char *)this->buffers[0];
+        return true;
+      }
+    }
+    if (this->bufferPool->checkout(this->buffers, 1))
+    {
+      this->bufferCount = 1;
+      this->buf = (char *)this->buffers[0];
+      return true;
+    }
+    return false;
+  }
+
+  // Return the buffers of the ended transfer, once the pipeline no longer
+  // uses them
+  void releaseBuffers()
+  {
+    this->pipeline.stop();
+    this->bufferPool->giveBack(this->buffers, this->bufferCount);
+    this->bufferCount = 0;
+    this->buf = NULL;
+  }
+
+  void startTransfer()
+  {
+    if (!this->checkoutBuffers())
+    {
+      this->reply("425 No transfer buffer free, try again later");
+      this->currentFile.close();
+      this->ftpDataClient.stop();
+      this->transfer = NO_TRANSFER;
+      return;
+    }
+
+    if (this->transfer == RETRIEVE)
+    {
+      this->reply("150-Connected to port %d", this->ftpDataPort);
+      this->reply("150 %u bytes to download", (unsigned)(this->currentFile.size() - this->currentFile.position()));
+    }
+    else if (this->transfer == STORE)
+    {
+      this->reply("150 Connected to port %d", this->ftpDataPort);
+    }
+    else if (this->transfer == LIST)
+    {
+      this->listSlot = this->dirCache->open(this->currentDir);
+      this->listOffset = 0;
+      if (this->listSlot < 0)
+      {
+        this->listDir = this->storage->open(this->currentDir);
+        if (!this->listDir || !this->listDir.isDirectory())
+        {
+          this->reply("550 Cannot open directory %s", this->currentDir.c_str());
+          this->listDir.close();
+          this->ftpDataClient.stop();
+          this->transfer = NO_TRANSFER;
+          this->releaseBuffers();
+          return;
+        }
+        this->listBuilder.begin(this->dirCache->version());
+      }
+      this->listCount = 0;
+      this->listLength = 0;
+      this->reply("150 Accepted data connection");
+    }
+    this->transactionBeginTime = millis();
+    this->transactionBeginMicros = micros();
+    this->bytesTransfered = 0;
+    this->pipelined = false;
+    if (this->bufferCount == FTP_PIPELINE_BUFFERS && this->transfer == RETRIEVE)
+    {
+      this->pipelined = this->pipeline.beginRetrieve(&this->currentFile, this->buffers);
+    }
+    else if (this->bufferCount == FTP_PIPELINE_BUFFERS && this->transfer == STORE)
+    {
+      this->pipelined = this->pipeline.beginStore(&this->currentFile, this->buffers);
+      this->storeChunkHeld = false;
+    }
+  }
+
+  boolean nextListEntry(FTPDirEntry &entry)
+  {
+    if (this->listSlot >= 0)
+    {
+      return this->dirCache->next(this->listSlot, this->listOffset, entry);
+    }
+
+    this->listFile = this->listDir.openNextFile();
+    if (!this->listFile)
+    {
+      return false;
+    }
+    entry.name = this->listFile.name();
+    const char *sep = strrchr(entry.name, '/');
+    if (sep != NULL)
+    {
+      entry.name = sep + 1;
+    }
+    entry.size = this->listFile.size();
+    entry.modified = this->listFile.getLastWrite();
+    entry.isDirectory = this->listFile.isDirectory();
+    this->listBuilder.add(entry);
+    return true;
+  }
+
+  // Release the listing source, a complete listing from the card is cached
+  void closeList(boolean complete)
+  {
+    if (this->listSlot >= 0)
+    {
+      this->dirCache->close(this->listSlot);
+      this->listSlot = -1;
+    }
+    else if (complete)
+    {
+      this->dirCache->store(this->currentDir, this->listBuilder);
+    }
+    else
+    {
+      this->listBuilder.discard();
+    }
+    this->listFile.close();
+    this->listDir.close();
+  }
+
+  size_t formatListEntry(const FTPDirEntry &entry, char *line, size_t size)
+  {
+    time_t modifiedTime = entry.modified;
+    struct tm *modified = gmtime(&modifiedTime);
+    char date[20];
+    int length;
+    if (this->listFormat == NLST_FORMAT)
+    {
+      length = snprintf(line, size, "%s\r\n", entry.name);
+    }
+    else if (this->listFormat == MLSD_FORMAT)
+    {
+      strftime(date, sizeof(date), "%Y%m%d%H%M%S", modified);
+      length = snprintf(line, size, "Type=%s;Size=%lu;modify=%s; %s\r\n", entry.isDirectory ? "dir" : "file", (unsigned long)entry.size, date, entry.name);
+    }
+    else if (entry.isDirectory)
+    {
+      strftime(date, sizeof(date), "%m-%d-%Y  %I:%M%p", modified);
+      length = snprintf(line, size, "%s <DIR> %s\r\n", date, entry.name);
+    }
+    else
+    {
+      strftime(date, sizeof(date), "%m-%d-%Y  %I:%M%p", modified);
+      length = snprintf(line, size, "%s %lu %s\r\n", date, (unsigned long)entry.size, entry.name);
+    }
+    if (length < 0 || (size_t)length >= size)
+    {
+      return 0;
+    }
+    return length;
+  }
+
+  // Pack directory entries into buf and send one full segment per call, so
+  // large directories do not hold up the other sessions
+  boolean dataList()
+  {
+    if (!this->ftpDataClient.connected())
+    {
+      this->closeList(false);
+      this->reply("426 Connection closed; transfer aborted");
+      return false;
+    }
+
+    FTPDirEntry entry;
+    while (this->listLength < FTP_LIST_BATCH_SIZE)
+    {
+      if (!this->nextListEntry(entry))
+      {
+        // End of directory
+        if (this->listLength > 0 && !this->sendData((uint8_t *)this->buf, this->listLength))
+        {
+          return false;
+        }
+        LOG_DEBUG("Listed %lu entries in %lu ms%s", (unsigned long)this->listCount, millis() - this->transactionBeginTime, this->listSlot >= 0 ? " (cached)" : "");
+        LOG_DEBUG("Dir cache hits: %lu, misses: %lu", this->dirCache->getHits(), this->dirCache->getMisses());
+        this->measurement("\"event\":\"list\",\"format\":\"%s\",\"entries\":%lu,\"us\":%lu,\"cached\":%d", this->listFormat == MLSD_FORMAT ? "mlsd" : this->listFormat == NLST_FORMAT ? "nlst" : "list", (unsigned long)this->listCount, micros() - this->transactionBeginMicros, this->listSlot >= 0);
+        if (this->listFormat == MLSD_FORMAT)
+        {
+          this->reply("226-options: -a -l");
+        }
+        this->reply("226 %lu matches total", (unsigned long)this->listCount);
+        this->stats->lists++;
+        this->closeList(true);
+        this->ftpDataClient.stop();
+        return false;
+      }
+      this->listLength += this->formatListEntry(entry, this->buf + this->listLength, FTP_BUF_SIZE - this->listLength);
+      this->listCount++;
+    }
+
+    if (!this->sendData((uint8_t *)this->buf, FTP_LIST_BATCH_SIZE))
+    {
+      return false;
+    }
+    this->listLength -= FTP_LIST_BATCH_SIZE;
+    memmove(this->buf, this->buf + FTP_LIST_BATCH_SIZE, this->listLength);
+    return true;
+  }
+
+  boolean dataSend()
+  {
+    if (this->pipelined)
+    {
+      return this->dataSendPipelined();
+    }
+
+    unsigned long readBegin = micros();
+    int numberBytesRead = this->currentFile.read((uint8_t *)buf, FTP_BUF_SIZE);
+    this->stats->storageReads.add(micros() - readBegin);
+    if (numberBytesRead < 0)
+    {
+      this->failRetrieve();
+      return false;
+    }
+    if (numberBytesRead > 0 && ftpDataClient.connected())
+    {
+      return this->sendData((uint8_t *)buf, numberBytesRead);
+    }
+    else if (numberBytesRead > 0)
+    {
+      // Data connection lost before the end of file, client can resume with REST
+      this->abortTransfer();
+      return false;
+    }
+    else
+    {
+      LOG_DEBUG("Transfer closed");
+      this->closeTransfer();
+      return false;
+    }
+  }
+
+  // Send all of data on the data connection. The socket only gives up on a
+  // client that stopped reading or went away, then the transfer is aborted
+  // with 426 instead of skipping the rest: a RETR can be resumed with REST
+  // from the bytes the client got.
+  boolean sendData(const uint8_t *data, size_t length)
+  {
+    unsigned long sendBegin = micros();
+    size_t sent = this->ftpDataClient.write(data, length);
+    if (this->transfer == RETRIEVE)
+    {
+      this->stats->socketSends.add(micros() - sendBegin);
+      this->bytesTransfered += sent;
+    }
+    if (sent != length)
+    {
+      LOG_WARN("Short write on the data connection: %u of %u bytes", (unsigned)sent, (unsigned)length);
+      this->abortTransfer();
+      return false;
+    }
+    return true;
+  }
+
+  // Send the chunks filled by the reader task, do not wait if none is ready
+  boolean dataSendPipelined()
+  {
+    FTPChunk chunk;
+    if (!this->pipeline.next(chunk))
+    {
+      return true;
+    }
+    if (chunk.length > 0 && ftpDataClient.connected())
+    {
+      boolean sent = this->sendData(this->pipeline.data(chunk), chunk.length);
+      if (sent)
+      {
+        this->pipeline.release(chunk);
+      }
+      return sent;
+    }
+    else if (chunk.length > 0)
+    {
+      // Data connection lost before the end of file, client can resume with REST
+      this->pipeline.release(chunk);
+      this->abortTransfer();
+      return false;
+    }
+    else if (this->pipeline.failed())
+    {
+      this->pipeline.release(chunk);
+      this->failRetrieve();
+      return false;
+    }
+    else
+    {
+      LOG_DEBUG("Transfer closed");
+      this->pipeline.release(chunk);
+      this->closeTransfer();
+      return false;
+    }
+  }
+
+  boolean dataReceive()
+  {
+    if (this->pipelined)
+    {
+      return this->dataReceivePipelined();
+    }
+
+    size_t numberBytesRead = ftpDataClient.readBytes((uint8_t *)buf, FTP_BUF_SIZE);
+    if (numberBytesRead > 0)
+    {
+      unsigned long writeBegin = micros();
+      size_t written = FTPPipeline::writeFully(this->currentFile, (uint8_t *)buf, numberBytesRead);
+      this->stats->storageWrites.add(micros() - writeBegin);
+      if (written != numberBytesRead)
+      {
+        this->failStore();
+        return false;
+      }
+      bytesTransfered += numberBytesRead;
+      return true;
+    }
+    else
+    {
+      if (!this->ftpDataClient.connected())
+      {
+        this->closeTransfer();
+        return false;
+      }
+      else
+      {
+        return true;
+      }
+    }
+  }
+
+  // Fill buffers from the socket and queue them for the writer task. The
+  // socket is read as long as the writer has free buffers, SD writes go on
+  // in the background.
+  boolean dataReceivePipelined()
+  {
+    if (this->pipeline.failed())
+    {
+      this->failStore();
+      return false;
+    }
+    if (!this->storeChunkHeld)
+    {
+      if (!this->pipeline.acquire(this->storeChunk))
+      {
+        return true;
+      }
+      this->storeChunkHeld = true;
+    }
+
+    uint8_t *data = this->pipeline.data(this->storeChunk);
+    int numberBytesRead = ftpDataClient.read(data + this->storeChunk.length, FTP_BUF_SIZE - this->storeChunk.length);
+    if (numberBytesRead > 0)
+    {
+      this->storeChunk.length += numberBytesRead;
+      bytesTransfered += numberBytesRead;
+      if (this->storeChunk.length == FTP_BUF_SIZE)
+      {
+        this->pipeline.submit(this->storeChunk);
+        this->storeChunkHeld = false;
+      }
+      return true;
+    }
+    if (this->ftpDataClient.connected())
+    {
+      return true;
+    }
+
+    // Upload complete, write what is left
+    if (this->storeChunk.length > 0)
+    {
+      this->pipeline.submit(this->storeChunk);
+    }
+    this->storeChunkHeld = false;
+    if (!this->pipeline.finish())
+    {
+      if (this->pipeline.timedOut())
+      {
+        // The card is too slow: abort with 426 rather than keep the FTP
+        // task from every other session
+        LOG_ERROR("Upload not written after %d ms", FTP_PIPELINE_FINISH_TIMEOUT);
+        this->abortTransfer();
+        return false;
+      }
+      this->failStore();
+      return false;
+    }
+    this->closeTransfer();
+    return false;
+  }
+
+  // SD card does not accept data - drop the upload instead of retrying forever
+  void failStore()
+  {
+    LOG_ERROR("Write failed, upload aborted");
+    this->pipeline.stop();
+    this->pipeline.collectTimes(this->stats->storageReads, this->stats->storageWrites);
+    this->stats->writeErrors++;
+    this->currentFile.close();
+    this->dirCache->invalidate(this->filePath);
+    this->ftpDataClient.stop();
+    this->reply("451 Write error, upload aborted");
+  }
+
+  // The file cannot be read any more (its key was destroyed): end the
+  // download with an error rather than a short file and 226
+  void failRetrieve()
+  {
+    LOG_ERROR("Read failed, download aborted");
+    this->pipeline.stop();
+    this->pipeline.collectTimes(this->stats->storageReads, this->stats->storageWrites);
+    this->stats->aborts++;
+    this->currentFile.close();
+    this->ftpDataClient.stop();
+    this->reply("451 Read error, download aborted");
+  }
+
+  void abortTransfer()
+  {
+    if (this->transfer != NO_TRANSFER)
+    {
+      this->dataPeerPending = false;
+      this->pipeline.stop();
+      this->pipeline.collectTimes(this->stats->storageReads, this->stats->storageWrites);
+      this->stats->aborts++;
+      this->currentFile.close();
+      if (this->transfer == LIST)
+      {
+        this->closeList(false);
+      }
+      else if (this->transfer == STORE)
+      {
+        this->dirCache->invalidate(this->filePath);
+      }
+      this->ftpDataClient.stop();
+      this->reply("426 Transfer aborted");
+      LOG_WARN("Transfer aborted!");
+    }
+    this->transfer = NO_TRANSFER;
+    this->releaseBuffers();
+  }
+
+  void closeTransfer()
+  {
+    uint32_t deltaT = (millis() - this->transactionBeginTime);
+    unsigned long deltaMicros = micros() - this->transactionBeginMicros;
+    this->measurement("\"event\":\"%s\",\"bytes\":%lu,\"us\":%lu,\"pipelined\":%d", this->transfer == STORE ? "stor" : "retr", this->bytesTransfered, deltaMicros, this->pipelined);
+    LOG_INFO("Transfer close, bytesTransfered: %lu%s", this->bytesTransfered, this->pipelined ? " (pipelined)" : "");
+    if (this->pipelined && this->transfer == STORE)
+    {
+      LOG_DEBUG("Max socket stall: %lu us, max SD write: %lu us", this->pipeline.getMaxStall(), this->pipeline.getMaxWriteTime());
+    }
+    if (deltaMicros > 0 && this->bytesTransfered > 0)
+    {
+      // Rate in hundredths of kbytes/s, so short transfers do not read 0
+      unsigned long rate = (uint64_t)this->bytesTransfered * 100000 / deltaMicros;
+      this->reply("226-File successfully transferred");
+      this->reply("226 %u ms, %lu.%02lu kbytes/s", (unsigned)deltaT, rate / 100, rate % 100);
+    }
+    else
+    {
+      this->reply("226 File successfully transferred");
+    }
+
+    this->pipeline.stop();
+    this->pipeline.collectTimes(this->stats->storageReads, this->stats->storageWrites);
+    this->stats->transferSizes.add(this->bytesTransfered);
+    this->stats->transferTimes.add(deltaT);
+    if (this->transfer == STORE)
+    {
+      this->stats->stores++;
+      this->stats->bytesReceived += this->bytesTransfered;
+    }
+    else
+    {
+      this->stats->retrieves++;
+      this->stats->bytesSent += this->bytesTransfered;
+    }
+    this->currentFile.flush();
+    this->currentFile.close();
+    if (this->transfer == STORE)
+    {
+      // Size and modification time changed
+      this->dirCache->invalidate(this->filePath);
+    }
+    this->ftpDataClient.stop();
+  }
+
+  boolean isNewClientCommand()
+  {
+    if (!this->commandLine.next(this->ftpCommandClient))
+    {
+      return false;
+    }
+    this->lastUserCommand = this->commandLine.command();
+    this->lastUserParams = this->commandLine.params();
+    LOG_DEBUG("command: %s, params: %s", this->lastUserCommand, this->lastUserParams);
+    return true;
+  }
+
+  boolean cd(String path)
+  {
+    LOG_DEBUG("Old dir: %s", this->currentDir.c_str());
+    if (path == ".")
+      return handlePWD("");
+    this->currentDir = getFullPath(path);
+    LOG_DEBUG("New dir: %s", this->currentDir.c_str());
+    this->reply("250 Ok. Directory changed to %s", this->currentDir.c_str());
+    return true;
+  }
+
+  // Existence check answered from the directory cache when possible
+  boolean fileExists(const String &path)
+  {
+    int8_t cached = this->dirCache->exists(path);
+    if (cached >= 0)
+    {
+      return cached;
+    }
+    return this->storage->exists(path);
+  }
+
+  // Absolute, normalized path of a command argument. ".." stops at "/",
+  // nothing outside the served file system can be named.
+  String getFullPath(String relativePath)
+  {
+    if (relativePath.charAt(0) == '/')
+    {
+      return ftpNormalizePath(relativePath);
+    }
+    return ftpNormalizePath(this->currentDir + "/" + relativePath);
+  }
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "FTPPlatform.h"
+
+// Bucket i of a histogram counts values below 2^i (and at least 2^(i-1)),
+// the last bucket also takes everything larger
+#define FTP_HISTOGRAM_BUCKETS 32
+
+// Distribution of a measured value in power of two buckets. Adding a value
+// costs a few instructions and no allocation, so it can be done per chunk.
+class FTPHistogram
+{
+public:
+  uint32_t buckets[FTP_HISTOGRAM_BUCKETS];
+  uint32_t count;
+  uint64_t sum;
+  uint32_t max;
+
+  FTPHistogram()
+  {
+    this->clear();
+  }
+
+  void add(uint32_t value)
+  {
+    uint8_t bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+    if (bucket >= FTP_HISTOGRAM_BUCKETS)
+    {
+      bucket = FTP_HISTOGRAM_BUCKETS - 1;
+    }
+    this->buckets[bucket]++;
+    this->count++;
+    this->sum += value;
+    if (value > this->max)
+    {
+      this->max = value;
+    }
+  }
+
+  void merge(const FTPHistogram &other)
+  {
+    for (uint8_t i = 0; i < FTP_HISTOGRAM_BUCKETS; i++)
+    {
+      this->buckets[i] += other.buckets[i];
+    }
+    this->count += other.count;
+    this->sum += other.sum;
+    if (other.max > this->max)
+    {
+      this->max = other.max;
+    }
+  }
+
+  void clear()
+  {
+    memset(this->buckets, 0, sizeof(this->buckets));
+    this->count = 0;
+    this->sum = 0;
+    this->max = 0;
+  }
+
+  // One line: "name n=.. avg=.. max=.. <2:.. <4:.. ...", empty buckets left out
+  size_t format(char *text, size_t size, const char *name) const
+  {
+    int length = snprintf(text, size, "%s n=%lu avg=%lu max=%lu", name, (unsigned long)this->count,
+                          this->count > 0 ? (unsigned long)(this->sum / this->count) : 0UL, (unsigned long)this->max);
+    for (uint8_t i = 0; i < FTP_HISTOGRAM_BUCKETS && length >= 0 && (size_t)length < size; i++)
+    {
+      if (this->buckets[i] == 0)
+        continue;
+      if (i == FTP_HISTOGRAM_BUCKETS - 1)
+        length += snprintf(text + length, size - length, " >=%lu:%lu", 1UL << (i - 1), (unsigned long)this->buckets[i]);
+      else
+        length += snprintf(text + length, size - length, " <%lu:%lu", 1UL << i, (unsigned long)this->buckets[i]);
+    }
+    return length < 0 ? 0 : min((size_t)length, size - 1);
+  }
+};
+
+// Counters and distributions of everything the server did since boot (or
+// since the last SITE STATS RESET), shared by all sessions. Reported with
+// STAT and SITE STATS, so a device can be profiled without a serial cable.
+class FTPStats
+{
+public:
+  unsigned long since;
+
+  unsigned long logins;
+  unsigned long failedLogins;
+  unsigned long controlTimeouts;
+  unsigned long dataTimeouts;
+  unsigned long aborts;
+  unsigned long writeErrors;
+  unsigned long retrieves;
+  unsigned long stores;
+  unsigned long lists;
+  uint64_t bytesSent;
+  uint64_t bytesReceived;
+
+  // FTPServer::quiesce requests, those that took longer than the caller
+  // waited, and the time from request to storage released in us
+  unsigned long quiesces;
+  unsigned long lateQuiesces;
+  FTPHistogram quiesceTimes;
+
+  // FTP task sleeps between loop passes (FTPServer::wait), and micros()
+  // when the last one ended
+  unsigned long loopWakeups;
+  uint64_t idleMicros;
+  unsigned long wakeMicros;
+  // Longest time in us a session waiting for its data connection went
+  // without a loop pass while the FTP task was awake. NOOP and ABOR are
+  // answered within it.
+  unsigned long maxControlLoopGap;
+
+  // Whole transfers: size in bytes and duration in ms
+  FTPHistogram transferSizes;
+  FTPHistogram transferTimes;
+  // Per chunk, in us
+  FTPHistogram storageReads;
+  FTPHistogram storageWrites;
+  FTPHistogram socketSends;
+
+  FTPStats()
+  {
+    this->reset();
+  }
+
+  void reset()
+  {
+    this->since = millis();
+    this->logins = 0;
+    this->failedLogins = 0;
+    this->controlTimeouts = 0;
+    this->dataTimeouts = 0;
+    this->aborts = 0;
+    this->writeErrors = 0;
+    this->retrieves = 0;
+    this->stores = 0;
+    this->lists = 0;
+    this->bytesSent = 0;
+    this->bytesReceived = 0;
+    this->quiesces = 0;
+    this->lateQuiesces = 0;
+    this->quiesceTimes.clear();
+    this->loopWakeups = 0;
+    this->idleMicros = 0;
+    this->wakeMicros = micros();
+    this->maxControlLoopGap = 0;
+    this->transferSizes.clear();
+    this->transferTimes.clear();
+    this->storageReads.clear();
+    this->storageWrites.clear();
+    this->socketSends.clear();
+  }
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "FTPPlatform.h"
+
+#ifdef ARDUINO
+#include <lwip/sockets.h>
+#else
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Longest sleep of the FTP task, also when nothing is due
+#ifndef FTP_MAX_WAIT
+#define FTP_MAX_WAIT 1000
+#endif
+
+// Sockets and timers the FTP task sleeps on between mainFTPLoop() passes.
+// Sessions add what they wait for, then wait() blocks in select() until one
+// of the sockets is ready or the earliest timer is due.
+class FTPWaitSet
+{
+private:
+  fd_set readable;
+  fd_set writable;
+  int maxFd;
+  unsigned long timeout;
+
+public:
+  FTPWaitSet()
+  {
+    FD_ZERO(&this->readable);
+    FD_ZERO(&this->writable);
+    this->maxFd = -1;
+    this->timeout = FTP_MAX_WAIT;
+  }
+
+  void addRead(int fd)
+  {
+    if (fd >= 0)
+    {
+      FD_SET(fd, &this->readable);
+      this->maxFd = max(this->maxFd, fd);
+    }
+  }
+
+  void addWrite(int fd)
+  {
+    if (fd >= 0)
+    {
+      FD_SET(fd, &this->writable);
+      this->maxFd = max(this->maxFd, fd);
+    }
+  }
+
+  // Wake up after ms at the latest, 0 to not sleep at all
+  void wakeIn(unsigned long ms)
+  {
+    this->timeout = min(this->timeout, ms);
+  }
+
+  unsigned long getTimeout()
+  {
+    return this->timeout;
+  }
+
+  // A write to fd would not block (or fd is not a socket we can check)
+  static boolean isWritable(int fd)
+  {
+    if (fd < 0)
+    {
+      return true;
+    }
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(fd, &writable);
+    struct timeval none = {0, 0};
+    return select(fd + 1, NULL, &writable, NULL, &none) != 0;
+  }
+
+  void wait()
+  {
+    if (this->timeout == 0)
+    {
+      // Work is pending, only let other tasks of the same priority run
+      yield();
+      return;
+    }
+    struct timeval limit;
+    limit.tv_sec = this->timeout / 1000;
+    limit.tv_usec = (this->timeout % 1000) * 1000;
+    if (select(this->maxFd + 1, &this->readable, &this->writable, NULL, &limit) < 0)
+    {
+      vTaskDelay(1);
+    }
+  }
+};
+
+// Lets another task wake the FTP task from its select(): a UDP socket bound
+// to the loopback address, which the FTP task waits on and other tasks send
+// a datagram to.
+class FTPWaker
+{
+private:
+  int socketFd = -1;
+  struct sockaddr_in address;
+
+public:
+  // False if the socket cannot be set up, the FTP task must then poll
+  boolean begin()
+  {
+    if (this->socketFd >= 0)
+    {
+      return true;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+      return false;
+    }
+    memset(&this->address, 0, sizeof(this->address));
+    this->address.sin_family = AF_INET;
+    this->address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    this->address.sin_port = 0;
+    socklen_t length = sizeof(this->address);
+    if (bind(fd, (struct sockaddr *)&this->address, sizeof(this->address)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&this->address, &length) != 0)
+    {
+      close(fd);
+      return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    this->socketFd = fd;
+    return true;
+  }
+
+  int fd()
+  {
+    return this->socketFd;
+  }
+
+  // Any task
+  void wake()
+  {
+    if (this->socketFd >= 0)
+    {
+      uint8_t signal = 1;
+      sendto(this->socketFd, &signal, 1, 0, (struct sockaddr *)&this->address, sizeof(this->address));
+    }
+  }
+
+  // FTP task, after its wait
+  void drain()
+  {
+    uint8_t signals[8];
+    while (this->socketFd >= 0 && recv(this->socketFd, signals, sizeof(signals), 0) > 0)
+    {
+    }
+  }
+};
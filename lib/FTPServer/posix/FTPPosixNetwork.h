@@ -0,0 +1,232 @@
+#pragma once
+
+// BSD socket versions of the WiFiServer/WiFiClient calls used by the FTP
+// server. All sockets are non-blocking, like lwIP sockets behind WiFiClient.
+
+#include <memory>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <Logger.h>
+
+// How long a write waits for room in the socket send buffer
+#ifndef FTP_POSIX_WRITE_TIMEOUT
+#define FTP_POSIX_WRITE_TIMEOUT 5000
+#endif
+
+class FTPPosixConnection
+{
+private:
+  // Copies share the socket, it is closed with the last copy (as WiFiClient does)
+  struct Socket
+  {
+    int fd;
+    Socket(int fd) : fd(fd) {}
+    ~Socket() { ::close(fd); }
+  };
+
+  std::shared_ptr<Socket> socket;
+
+public:
+  FTPPosixConnection() {}
+
+  explicit FTPPosixConnection(int fd) : socket(std::make_shared<Socket>(fd))
+  {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+  }
+
+  int fd() const
+  {
+    return this->socket ? this->socket->fd : -1;
+  }
+
+  uint8_t connected()
+  {
+    if (!this->socket)
+    {
+      return 0;
+    }
+    char c;
+    int result = ::recv(this->socket->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      return 0;
+    }
+    return 1;
+  }
+
+  operator bool()
+  {
+    return this->connected();
+  }
+
+  int available()
+  {
+    int count = 0;
+    if (!this->socket || ioctl(this->socket->fd, FIONREAD, &count) < 0)
+    {
+      return 0;
+    }
+    return count;
+  }
+
+  int read()
+  {
+    uint8_t c;
+    return this->read(&c, 1) == 1 ? c : -1;
+  }
+
+  int read(uint8_t *data, size_t length)
+  {
+    if (!this->socket)
+    {
+      return -1;
+    }
+    return ::recv(this->socket->fd, data, length, MSG_DONTWAIT);
+  }
+
+  // Waits up to a second for length bytes, like Stream::readBytes
+  size_t readBytes(char *data, size_t length)
+  {
+    size_t received = 0;
+    unsigned long start = millis();
+    while (received < length && this->socket && millis() - start < 1000)
+    {
+      int result = ::recv(this->socket->fd, data + received, length - received, MSG_DONTWAIT);
+      if (result > 0)
+      {
+        received += result;
+      }
+      else if (result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      {
+        break;
+      }
+      else
+      {
+        struct pollfd readable = {this->socket->fd, POLLIN, 0};
+        poll(&readable, 1, 10);
+      }
+    }
+    return received;
+  }
+
+  size_t readBytes(uint8_t *data, size_t length)
+  {
+    return this->readBytes((char *)data, length);
+  }
+
+  size_t write(const uint8_t *data, size_t length)
+  {
+    size_t sent = 0;
+    unsigned long start = millis();
+    while (sent < length && this->socket && millis() - start < FTP_POSIX_WRITE_TIMEOUT)
+    {
+      int result = ::send(this->socket->fd, data + sent, length - sent, MSG_NOSIGNAL);
+      if (result > 0)
+      {
+        sent += result;
+      }
+      else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+        struct pollfd writable = {this->socket->fd, POLLOUT, 0};
+        poll(&writable, 1, 10);
+      }
+      else
+      {
+        break;
+      }
+    }
+    return sent;
+  }
+
+  size_t println(const char *text)
+  {
+    size_t length = this->write((const uint8_t *)text, strlen(text));
+    return length + this->write((const uint8_t *)"\r\n", 2);
+  }
+
+  void stop()
+  {
+    if (this->socket)
+    {
+      ::shutdown(this->socket->fd, SHUT_RDWR);
+    }
+    this->socket.reset();
+  }
+
+  // Address of this end of the connection
+  boolean localAddress(uint8_t address[4])
+  {
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    if (!this->socket || getsockname(this->socket->fd, (struct sockaddr *)&local, &length) != 0 || local.sin_family != AF_INET)
+    {
+      return false;
+    }
+    memcpy(address, &local.sin_addr.s_addr, 4);
+    return true;
+  }
+};
+
+class FTPPosixListener
+{
+private:
+  uint16_t port;
+  int listenFd = -1;
+  int pending = -1;
+
+public:
+  FTPPosixListener(uint16_t port = 0) : port(port) {}
+
+  void begin()
+  {
+    this->listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(this->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(this->port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(this->listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(this->listenFd, 4) != 0)
+    {
+      LOG_ERROR("Cannot listen on port %u: %s", this->port, strerror(errno));
+      ::close(this->listenFd);
+      this->listenFd = -1;
+      return;
+    }
+    fcntl(this->listenFd, F_SETFL, O_NONBLOCK);
+  }
+
+  int fd()
+  {
+    return this->listenFd;
+  }
+
+  boolean hasClient()
+  {
+    if (this->pending < 0 && this->listenFd >= 0)
+    {
+      this->pending = ::accept(this->listenFd, NULL, NULL);
+    }
+    return this->pending >= 0;
+  }
+
+  FTPPosixConnection available()
+  {
+    if (!this->hasClient())
+    {
+      return FTPPosixConnection();
+    }
+    int client = this->pending;
+    this->pending = -1;
+    return FTPPosixConnection(client);
+  }
+};
@@ -0,0 +1,322 @@
+#pragma once
+
+// The parts of the Arduino core and FreeRTOS used by the FTP server,
+// implemented on the C++ standard library for the native (Linux) build.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+using std::max;
+using std::min;
+
+inline unsigned long millis()
+{
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline unsigned long micros()
+{
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void yield()
+{
+  std::this_thread::yield();
+}
+
+// Arduino String subset
+class String
+{
+private:
+  std::string text;
+
+public:
+  String() {}
+  String(const char *text) : text(text != NULL ? text : "") {}
+  String(const std::string &text) : text(text) {}
+  String(char c) : text(1, c) {}
+  String(int value) : text(std::to_string(value)) {}
+  String(unsigned int value) : text(std::to_string(value)) {}
+  String(long value) : text(std::to_string(value)) {}
+  String(unsigned long value) : text(std::to_string(value)) {}
+  String(double value, unsigned int decimals = 2)
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    this->text = buffer;
+  }
+
+  unsigned int length() const { return this->text.size(); }
+  const char *c_str() const { return this->text.c_str(); }
+  char charAt(unsigned int index) const { return index < this->text.size() ? this->text[index] : 0; }
+
+  bool concat(const String &other)
+  {
+    this->text += other.text;
+    return true;
+  }
+
+  String &operator+=(const String &other)
+  {
+    this->text += other.text;
+    return *this;
+  }
+
+  int indexOf(char c, unsigned int from = 0) const
+  {
+    size_t index = this->text.find(c, from);
+    return index == std::string::npos ? -1 : (int)index;
+  }
+
+  int lastIndexOf(char c) const
+  {
+    size_t index = this->text.rfind(c);
+    return index == std::string::npos ? -1 : (int)index;
+  }
+
+  String substring(unsigned int from) const
+  {
+    return from >= this->text.size() ? String() : String(this->text.substr(from));
+  }
+
+  String substring(unsigned int from, unsigned int to) const
+  {
+    return from >= this->text.size() || to <= from ? String() : String(this->text.substr(from, to - from));
+  }
+
+  void trim()
+  {
+    size_t begin = this->text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+    {
+      this->text.clear();
+      return;
+    }
+    this->text = this->text.substr(begin, this->text.find_last_not_of(" \t\r\n") - begin + 1);
+  }
+
+  bool equalsIgnoreCase(const String &other) const { return strcasecmp(this->c_str(), other.c_str()) == 0; }
+  bool operator==(const String &other) const { return this->text == other.text; }
+  bool operator==(const char *other) const { return this->text == other; }
+  bool operator!=(const String &other) const { return this->text != other.text; }
+  bool operator!=(const char *other) const { return this->text != other; }
+
+  friend String operator+(const String &a, const String &b) { return String(a.text + b.text); }
+  friend String operator+(const String &a, const char *b) { return String(a.text + b); }
+  friend String operator+(const char *a, const String &b) { return String(std::string(a) + b.text); }
+};
+
+// Serial console on stdout
+class FTPPosixSerial
+{
+public:
+  void begin(unsigned long baud) {}
+  size_t print(const char *text) { return fputs(text, stdout) >= 0 ? strlen(text) : 0; }
+  size_t print(const String &text) { return this->print(text.c_str()); }
+  size_t print(long value) { return printf("%ld", value); }
+  size_t print(unsigned long value) { return printf("%lu", value); }
+  size_t print(int value) { return printf("%d", value); }
+  size_t print(unsigned int value) { return printf("%u", value); }
+  size_t print(double value) { return printf("%.2f", value); }
+  size_t println() { return this->print("\n"); }
+
+  template <typename T>
+  size_t println(T value)
+  {
+    size_t n = this->print(value);
+    return n + this->println();
+  }
+
+  operator bool() { return true; }
+};
+
+static FTPPosixSerial Serial __attribute__((unused));
+
+// FreeRTOS subset on std::thread. Ticks are milliseconds.
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffUL
+#define pdMS_TO_TICKS(ms) (ms)
+#define portTICK_PERIOD_MS 1
+
+inline void vTaskDelay(TickType_t ticks)
+{
+  delay(ticks);
+}
+
+inline TickType_t xTaskGetTickCount()
+{
+  return millis();
+}
+
+inline void vTaskDelayUntil(TickType_t *previousWakeTime, TickType_t period)
+{
+  *previousWakeTime += period;
+  int32_t wait = (int32_t)(*previousWakeTime - xTaskGetTickCount());
+  if (wait > 0)
+  {
+    delay(wait);
+  }
+}
+
+// Tasks end by returning from the task function, deleting the calling task is a no-op
+inline void vTaskDelete(TaskHandle_t task) {}
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackSize, void *params, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+  std::thread(function, params).detach();
+  if (handle != NULL)
+  {
+    *handle = NULL;
+  }
+  return pdPASS;
+}
+
+inline std::chrono::milliseconds ticksToWait(TickType_t ticks)
+{
+  return std::chrono::milliseconds(ticks == portMAX_DELAY ? 24UL * 3600 * 1000 : ticks);
+}
+
+struct FTPPosixQueue
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::vector<uint8_t>> items;
+  size_t capacity;
+  size_t itemSize;
+};
+
+typedef FTPPosixQueue *QueueHandle_t;
+
+inline QueueHandle_t xQueueCreate(size_t length, size_t itemSize)
+{
+  FTPPosixQueue *queue = new FTPPosixQueue();
+  queue->capacity = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+inline void vQueueDelete(QueueHandle_t queue)
+{
+  delete queue;
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!queue->changed.wait_for(lock, ticksToWait(ticks), [queue] { return queue->items.size() < queue->capacity; }))
+  {
+    return pdFALSE;
+  }
+  queue->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + queue->itemSize);
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!queue->changed.wait_for(lock, ticksToWait(ticks), [queue] { return !queue->items.empty(); }))
+  {
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+inline BaseType_t xQueueReset(QueueHandle_t queue)
+{
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  queue->items.clear();
+  queue->changed.notify_all();
+  return pdPASS;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->items.size();
+}
+
+struct FTPPosixSemaphore
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  UBaseType_t count;
+  UBaseType_t maxCount;
+};
+
+typedef FTPPosixSemaphore *SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount)
+{
+  FTPPosixSemaphore *semaphore = new FTPPosixSemaphore();
+  semaphore->count = initialCount;
+  semaphore->maxCount = maxCount;
+  return semaphore;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return xSemaphoreCreateCounting(1, 0);
+}
+
+inline void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+  delete semaphore;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  std::lock_guard<std::mutex> lock(semaphore->mutex);
+  if (semaphore->count >= semaphore->maxCount)
+  {
+    return pdFALSE;
+  }
+  semaphore->count++;
+  semaphore->changed.notify_all();
+  return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(semaphore->mutex);
+  if (!semaphore->changed.wait_for(lock, ticksToWait(ticks), [semaphore] { return semaphore->count > 0; }))
+  {
+    return pdFALSE;
+  }
+  semaphore->count--;
+  return pdTRUE;
+}
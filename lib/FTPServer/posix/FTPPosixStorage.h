@@ -0,0 +1,217 @@
+#pragma once
+
+// Files below a host directory, with the subset of the fs::File and fs::FS
+// API used by the FTP server. Paths are absolute within the root, as on SD,
+// and normalized before they are joined to it: ".." never leaves the root.
+
+#include <memory>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../FTPPath.h"
+
+class FTPPosixFile
+{
+private:
+  struct Handle
+  {
+    FILE *file = NULL;
+    DIR *dir = NULL;
+    std::string root;
+    std::string path;
+
+    ~Handle()
+    {
+      if (this->file != NULL)
+        fclose(this->file);
+      if (this->dir != NULL)
+        closedir(this->dir);
+    }
+  };
+
+  std::shared_ptr<Handle> handle;
+
+  boolean status(struct stat &info)
+  {
+    return this->handle && stat((this->handle->root + this->handle->path).c_str(), &info) == 0;
+  }
+
+public:
+  static FTPPosixFile open(const std::string &root, const std::string &path, const char *mode)
+  {
+    FTPPosixFile opened;
+    std::shared_ptr<Handle> handle = std::make_shared<Handle>();
+    handle->root = root;
+    handle->path = path;
+    std::string fullPath = root + path;
+    struct stat info;
+    if (stat(fullPath.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    {
+      handle->dir = opendir(fullPath.c_str());
+    }
+    else
+    {
+      // Binary modes, without stdio buffering so write errors show up at once
+      std::string binaryMode = std::string(mode) + "b";
+      handle->file = fopen(fullPath.c_str(), binaryMode.c_str());
+      if (handle->file != NULL)
+        setvbuf(handle->file, NULL, _IONBF, 0);
+    }
+    if (handle->file != NULL || handle->dir != NULL)
+    {
+      opened.handle = handle;
+    }
+    return opened;
+  }
+
+  operator bool() const
+  {
+    return (bool)this->handle;
+  }
+
+  const char *name() const
+  {
+    if (!this->handle)
+      return "";
+    size_t sep = this->handle->path.rfind('/');
+    return this->handle->path.c_str() + (sep == std::string::npos ? 0 : sep + 1);
+  }
+
+  const char *path() const
+  {
+    return this->handle ? this->handle->path.c_str() : "";
+  }
+
+  boolean isDirectory() const
+  {
+    return this->handle && this->handle->dir != NULL;
+  }
+
+  size_t size()
+  {
+    struct stat info;
+    return this->status(info) && !S_ISDIR(info.st_mode) ? info.st_size : 0;
+  }
+
+  time_t getLastWrite()
+  {
+    struct stat info;
+    return this->status(info) ? info.st_mtime : 0;
+  }
+
+  int read(uint8_t *data, size_t length)
+  {
+    return this->handle && this->handle->file != NULL ? (int)fread(data, 1, length, this->handle->file) : -1;
+  }
+
+  size_t readBytes(char *data, size_t length)
+  {
+    return this->handle && this->handle->file != NULL ? fread(data, 1, length, this->handle->file) : 0;
+  }
+
+  size_t write(const uint8_t *data, size_t length)
+  {
+    return this->handle && this->handle->file != NULL ? fwrite(data, 1, length, this->handle->file) : 0;
+  }
+
+  boolean seek(uint32_t position)
+  {
+    return this->handle && this->handle->file != NULL && fseek(this->handle->file, position, SEEK_SET) == 0;
+  }
+
+  size_t position()
+  {
+    return this->handle && this->handle->file != NULL ? ftell(this->handle->file) : 0;
+  }
+
+  void flush()
+  {
+    if (this->handle && this->handle->file != NULL)
+      fflush(this->handle->file);
+  }
+
+  void close()
+  {
+    this->handle.reset();
+  }
+
+  FTPPosixFile openNextFile()
+  {
+    if (!this->handle || this->handle->dir == NULL)
+    {
+      return FTPPosixFile();
+    }
+    struct dirent *entry;
+    while ((entry = readdir(this->handle->dir)) != NULL)
+    {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      {
+        continue;
+      }
+      std::string path = this->handle->path == "/" ? "/" : this->handle->path + "/";
+      FTPPosixFile next = open(this->handle->root, path + entry->d_name, "r");
+      if (next)
+      {
+        return next;
+      }
+    }
+    return FTPPosixFile();
+  }
+};
+
+class FTPPosixStorage
+{
+private:
+  std::string root;
+
+  std::string hostPath(const String &path)
+  {
+    return this->root + ftpNormalizePath(path).c_str();
+  }
+
+public:
+  FTPPosixStorage(const char *root = ".") : root(root)
+  {
+    // "/" maps to the root itself
+    while (this->root.size() > 1 && this->root[this->root.size() - 1] == '/')
+    {
+      this->root.erase(this->root.size() - 1);
+    }
+  }
+
+  FTPPosixFile open(const String &path, const char *mode = "r")
+  {
+    return FTPPosixFile::open(this->root, ftpNormalizePath(path).c_str(), mode);
+  }
+
+  boolean exists(const String &path)
+  {
+    struct stat info;
+    return stat(this->hostPath(path).c_str(), &info) == 0;
+  }
+
+  boolean mkdir(const String &path)
+  {
+    return ::mkdir(this->hostPath(path).c_str(), 0755) == 0;
+  }
+
+  boolean rmdir(const String &path)
+  {
+    return ::rmdir(this->hostPath(path).c_str()) == 0;
+  }
+
+  boolean remove(const String &path)
+  {
+    return ::unlink(this->hostPath(path).c_str()) == 0;
+  }
+
+  boolean rename(const String &from, const String &to)
+  {
+    return ::rename(this->hostPath(from).c_str(), this->hostPath(to).c_str()) == 0;
+  }
+
+  boolean truncate(const String &path, uint32_t size)
+  {
+    return ::truncate(this->hostPath(path).c_str(), size) == 0;
+  }
+};
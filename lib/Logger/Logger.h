@@ -0,0 +1,312 @@
+#pragma once
+
+// Deferred logging. LOG_ERROR/LOG_WARN/LOG_INFO/LOG_DEBUG format the line
+// into a ring buffer of the calling core and return, a low priority task
+// prints the rings to Serial. A task in the FTP or sensor loop never waits
+// for the UART, and lines above LOG_LEVEL are not compiled at all.
+//
+// Each ring is a bounded multi-producer queue (every slot carries a sequence
+// number, producers claim slots with a compare-and-swap), so tasks that
+// preempt each other on one core need no lock. When a ring is full the line
+// is dropped and counted.
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+typedef bool boolean;
+#endif
+#include <atomic>
+#include <stdarg.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Lines with a higher level are removed at compile time
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Lines buffered per core, must be a power of two
+#ifndef LOG_RING_SLOTS
+#define LOG_RING_SLOTS 32
+#endif
+
+// Longest line, longer ones are truncated
+#ifndef LOG_LINE_SIZE
+#define LOG_LINE_SIZE 120
+#endif
+
+// How often the drain task looks for new lines, in ms
+#ifndef LOG_DRAIN_INTERVAL
+#define LOG_DRAIN_INTERVAL 20
+#endif
+
+#ifdef ARDUINO
+#define LOG_CORES portNUM_PROCESSORS
+#else
+#define LOG_CORES 1
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logger().write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) \
+  do                   \
+  {                    \
+  } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logger().write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) \
+  do                  \
+  {                   \
+  } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logger().write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) \
+  do                  \
+  {                   \
+  } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logger().write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) \
+  do                   \
+  {                    \
+  } while (0)
+#endif
+
+struct LogRecord
+{
+  // Equals the claim position when the slot is free, position + 1 once the
+  // line is written
+  std::atomic<uint32_t> sequence;
+  uint32_t time;
+  uint8_t level;
+  char text[LOG_LINE_SIZE];
+};
+
+class LogRing
+{
+private:
+  LogRecord records[LOG_RING_SLOTS];
+  std::atomic<uint32_t> head;
+  // Only used by the drain task
+  uint32_t tail;
+
+public:
+  std::atomic<uint32_t> dropped;
+
+  LogRing() : head(0), tail(0), dropped(0)
+  {
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++)
+    {
+      this->records[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Free slot for a new line, NULL if the ring is full
+  LogRecord *claim(uint32_t &position)
+  {
+    position = this->head.load(std::memory_order_relaxed);
+    while (true)
+    {
+      LogRecord *record = &this->records[position & (LOG_RING_SLOTS - 1)];
+      int32_t difference = (int32_t)(record->sequence.load(std::memory_order_acquire) - position);
+      if (difference == 0)
+      {
+        if (this->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        {
+          return record;
+        }
+      }
+      else if (difference < 0)
+      {
+        this->dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+      }
+      else
+      {
+        position = this->head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void publish(LogRecord *record, uint32_t position)
+  {
+    record->sequence.store(position + 1, std::memory_order_release);
+  }
+
+  // Oldest written line, NULL if there is none
+  LogRecord *peek()
+  {
+    LogRecord *record = &this->records[this->tail & (LOG_RING_SLOTS - 1)];
+    if (record->sequence.load(std::memory_order_acquire) != this->tail + 1)
+    {
+      return NULL;
+    }
+    return record;
+  }
+
+  void pop(LogRecord *record)
+  {
+    record->sequence.store(this->tail + LOG_RING_SLOTS, std::memory_order_release);
+    this->tail++;
+  }
+};
+
+class Logger
+{
+private:
+  LogRing rings[LOG_CORES];
+  volatile boolean started = false;
+
+  static char levelLetter(uint8_t level)
+  {
+    static const char letters[] = "-EWID";
+    return level <= LOG_LEVEL_DEBUG ? letters[level] : '?';
+  }
+
+  static uint32_t now()
+  {
+#ifdef ARDUINO
+    return millis();
+#else
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+#endif
+  }
+
+  static uint8_t core()
+  {
+#ifdef ARDUINO
+    return xPortGetCoreID();
+#else
+    return 0;
+#endif
+  }
+
+  static void print(const char *text, size_t length)
+  {
+#ifdef ARDUINO
+    Serial.write((const uint8_t *)text, length);
+#else
+    fwrite(text, 1, length, stdout);
+    fflush(stdout);
+#endif
+  }
+
+  static void printRecord(uint32_t time, uint8_t level, const char *text)
+  {
+    char line[LOG_LINE_SIZE + 16];
+    int length = snprintf(line, sizeof(line), "%lu %c %s\n", (unsigned long)time, levelLetter(level), text);
+    if (length > 0)
+    {
+      print(line, (size_t)length < sizeof(line) ? length : sizeof(line) - 1);
+    }
+  }
+
+  static void drainTask(void *params)
+  {
+    Logger *logger = (Logger *)params;
+    while (true)
+    {
+      if (logger->drain() == 0)
+      {
+#ifdef ARDUINO
+        vTaskDelay(LOG_DRAIN_INTERVAL);
+#else
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOG_DRAIN_INTERVAL));
+#endif
+      }
+    }
+  }
+
+public:
+  // Start the drain task. Until then lines are printed at once, so messages
+  // from early setup are not lost.
+  void begin()
+  {
+    if (this->started)
+    {
+      return;
+    }
+#ifdef ARDUINO
+    xTaskCreatePinnedToCore(drainTask, "Log", 3072, this, tskIDLE_PRIORITY, NULL, 0);
+#else
+    std::thread(drainTask, this).detach();
+#endif
+    this->started = true;
+  }
+
+  void write(uint8_t level, const char *format, ...) __attribute__((format(printf, 3, 4)))
+  {
+    va_list args;
+    va_start(args, format);
+    if (!this->started)
+    {
+      char text[LOG_LINE_SIZE];
+      vsnprintf(text, sizeof(text), format, args);
+      va_end(args);
+      printRecord(now(), level, text);
+      return;
+    }
+    LogRing &ring = this->rings[core() % LOG_CORES];
+    uint32_t position;
+    LogRecord *record = ring.claim(position);
+    if (record != NULL)
+    {
+      record->time = now();
+      record->level = level;
+      vsnprintf(record->text, LOG_LINE_SIZE, format, args);
+      ring.publish(record, position);
+    }
+    va_end(args);
+  }
+
+  // Print the buffered lines of all cores, returns how many were printed
+  size_t drain()
+  {
+    size_t printed = 0;
+    for (uint8_t i = 0; i < LOG_CORES; i++)
+    {
+      LogRing &ring = this->rings[i];
+      LogRecord *record;
+      while ((record = ring.peek()) != NULL)
+      {
+        printRecord(record->time, record->level, record->text);
+        ring.pop(record);
+        printed++;
+      }
+      uint32_t dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+      if (dropped > 0)
+      {
+        char text[40];
+        snprintf(text, sizeof(text), "%lu log lines dropped", (unsigned long)dropped);
+        printRecord(now(), LOG_LEVEL_WARN, text);
+      }
+    }
+    return printed;
+  }
+};
+
+// One logger for the whole program, also when included from several files
+inline Logger &logger()
+{
+  static Logger instance;
+  return instance;
+}
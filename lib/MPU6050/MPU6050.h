@@ -1,157 +1,131 @@
 #include <Adafruit_MPU6050.h>
 #include <Adafruit_Sensor.h>
 #include <Wire.h>
+#include <Logger.h>
+#include <MotionDetector.h>
+#include "MPU6050Fifo.h"
 
-#define MPU_HISTORY_COUNT 10
+// MPU_FIFO, MPU_FIFO_RATE and the detector settings are in MotionDetector.h
+
+// Samples read per FIFO pass, the FIFO holds 85
+#define MPU_FIFO_BATCH 42
+
+// Raw samples as read, for the sensor trace. Time is micros().
+typedef void (*MPU6050SampleHook)(uint32_t time, const int16_t *accel, const int16_t *gyro);
 
 class MPU6050
 {
 public:
-  float AccAverage[6];
-  float AccHistory[MPU_HISTORY_COUNT][6];
-  int historyIdx = 0;
-  int anomalyHistory = 0;
-
   MPU6050()
   {
   }
 
-  void init()
+  // Returns false when there is no MPU6050 on the bus
+  boolean init()
   {
     if (!this->mpu.begin())
     {
-      Serial.println("Failed to find MPU6050 chip");
-      while (1)
-      {
-        delay(10);
-      }
+      LOG_ERROR("Failed to find MPU6050 chip");
+      return false;
     }
-    Serial.println("MPU6050 Found!");
+    LOG_INFO("MPU6050 Found!");
     this->mpu.setAccelerometerRange(MPU6050_RANGE_8_G);
     this->mpu.setGyroRange(MPU6050_RANGE_500_DEG);
-    this->mpu.setFilterBandwidth(MPU6050_BAND_5_HZ);
-    this->calibrate();
-  }
-  void clearHistory()
-  {
-    for (int i = 0; i < 6; i++)
+#if MPU_FIFO
+    this->fifoMode = this->fifo.begin(this->bus, MPU_FIFO_RATE);
+    if (!this->fifoMode)
     {
-      for (int j = 0; j < MPU_HISTORY_COUNT; j++)
-      {
-        this->AccHistory[j][i] = -1;
-      }
-      this->AccAverage[i] = -1;
+      LOG_WARN("MPU - FIFO setup failed, sampling with getEvent");
+    }
+#endif
+    if (!this->fifoMode)
+    {
+      this->mpu.setFilterBandwidth(MPU6050_BAND_5_HZ);
     }
-    this->historyIdx = 0;
-    this->anomalyHistory = 0;
+    this->calibrate();
+    return true;
   }
 
+  // Start a new calibration. It goes on with the next checkForAnomalies
+  // calls, which use MPU_HISTORY_COUNT steady samples as the reference.
   void calibrate()
   {
-    Serial.println("MPU - Calibration started");
-    for (int i = 0; i < MPU_HISTORY_COUNT; i++)
-    {
-      do
-      {
-        Serial.println("MPU - Calibrating");
-        mpu.getEvent(&this->acc, &this->gyro, &this->temp);
-        this->printSensorData();
-        vTaskDelay(50);
-      } while ((abs(this->acc.acceleration.x) < 7 && abs(this->acc.acceleration.y < 7) && abs(this->acc.acceleration.z < 7)) ||
-               (abs(this->acc.acceleration.x) > 11) ||
-               (abs(this->acc.acceleration.y) > 11) ||
-               (abs(this->acc.acceleration.z) > 11) ||
-               (abs(this->gyro.gyro.x) > 1) ||
-               (abs(this->gyro.gyro.y) > 1) ||
-               (abs(this->gyro.gyro.z) > 1));
-      this->saveToHistory();
-      vTaskDelay(150);
-    }
-    Serial.println("MPU - Calibration finished");
-    this->calculateAverage();
-    Serial.println(String(this->AccAverage[5]));
+    LOG_INFO("MPU - Calibration started");
+    this->detector.calibrate();
   }
 
-  void saveToHistory()
+  boolean isCalibrated()
   {
-    AccHistory[historyIdx][0] = this->gyro.gyro.x;
-    AccHistory[historyIdx][1] = this->gyro.gyro.y;
-    AccHistory[historyIdx][2] = this->gyro.gyro.z;
-    AccHistory[historyIdx][3] = this->acc.acceleration.x;
-    AccHistory[historyIdx][4] = this->acc.acceleration.y;
-    AccHistory[historyIdx][5] = this->acc.acceleration.z;
-    historyIdx = (historyIdx + 1) % MPU_HISTORY_COUNT;
+    return this->detector.isCalibrated();
   }
 
-  void calculateAverage()
+  // micros() when the last sample checked was taken, for a FIFO sample
+  // estimated from its place in the FIFO
+  uint32_t getSampleTime()
   {
-    for (int i = 0; i < 6; i++)
-    {
-      float sum = 0;
-      for (int j = 0; j < MPU_HISTORY_COUNT; j++)
-      {
-        sum += AccHistory[j][i];
-      }
-      this->AccAverage[i] = sum / MPU_HISTORY_COUNT;
-    }
+    return this->sampleTime;
   }
 
+  // Called with every sample read, NULL for none
+  void setSampleHook(MPU6050SampleHook hook)
+  {
+    this->sampleHook = hook;
+  }
+
+  // Check everything sampled since the last call, true on intrusion
   boolean checkForAnomalies()
   {
-    // Serial.println("---");
-    // for (int i=0; i<MPU_HISTORY_COUNT; i++){
-    //   for(int j=0; j<6; j++){
-    //     Serial.print(String(AccHistory[i][j]));
-    //     Serial.print(",");
-    //   }
-    //   Serial.println("");
-    // }
-
-    // Serial.println("---");
-    if (this->AccHistory[MPU_HISTORY_COUNT - 1][0] + 1 < 1e-3)
+    if (!this->fifoMode)
     {
-      Serial.println("MPU - not enought data for anomaly detection");
-      return false;
+      mpu.getEvent(&this->acc, &this->gyro, &this->temp);
+      this->sampleTime = micros();
+      this->printSensorData();
+      MotionSample sample = {{this->acc.acceleration.x, this->acc.acceleration.y, this->acc.acceleration.z},
+                             {this->gyro.gyro.x, this->gyro.gyro.y, this->gyro.gyro.z}};
+      if (this->sampleHook != NULL)
+      {
+        int16_t accel[3], gyro[3];
+        for (uint8_t i = 0; i < 3; i++)
+        {
+          accel[i] = sample.accel[i] * MPU_ACCEL_LSB_PER_G / MOTION_GRAVITY;
+          gyro[i] = sample.gyro[i] * MPU_GYRO_LSB_PER_DPS / MOTION_DEG_TO_RAD;
+        }
+        this->sampleHook(this->sampleTime, accel, gyro);
+      }
+      return this->detector.add(sample);
     }
-    mpu.getEvent(&this->acc, &this->gyro, &this->temp);
-
-    this->printSensorData();
 
-    this->calculateAverage();
-    Serial.print("MPU - AVG: ");
-    for (int i = 0; i < 6; i++)
+    MPU6050FifoSample samples[MPU_FIFO_BATCH];
+    size_t count;
+    do
     {
-      Serial.print(String(AccAverage[i]));
-      Serial.print(",");
-    }
-    Serial.println("");
-    this->anomalyHistory <<= 1;
-    if ((abs(this->acc.acceleration.x) < 0.5 && abs(this->acc.acceleration.y < 0.5) && abs(this->acc.acceleration.z < 0.5)) ||
-        (abs(this->acc.acceleration.x) > 15) ||
-        (abs(this->acc.acceleration.y) > 15) ||
-        (abs(this->acc.acceleration.z) > 15))
-    {
-      // Error
-      return false;
-    }
-    if ((abs(this->acc.acceleration.x - AccAverage[3]) > 0.5) ||
-        (abs(this->acc.acceleration.y - AccAverage[4]) > 0.5) ||
-        (abs(this->acc.acceleration.z - AccAverage[5]) > 0.5))
-    {
-      // Anomaly detected
-      Serial.println("MPU - sensor data change detected");
-      this->anomalyHistory |= 1;
-      if (((this->anomalyHistory) & 0b11111) == 0b11111)
+      // read() starts with the FIFO count, the newest frame it counts was
+      // taken about then. Older ones are one period apart, including those
+      // left for the next batch.
+      uint32_t countTime = micros();
+      count = this->fifo.read(samples, MPU_FIFO_BATCH);
+      for (size_t i = 0; i < count; i++)
       {
-        this->clearHistory();
-        Serial.println("MPU - Intrusion!!!");
-        return true;
+        this->sampleTime = countTime - (this->fifo.remaining + count - 1 - i) * (1000000UL / MPU_FIFO_RATE);
+        if (this->sampleHook != NULL)
+        {
+          this->sampleHook(this->sampleTime, samples[i].accel, samples[i].gyro);
+        }
+        MotionSample sample = MotionSample::fromRaw(samples[i].accel, samples[i].gyro);
+        this->setSample(sample);
+        if (this->detector.add(sample))
+        {
+          this->fifo.reset();
+          return true;
+        }
       }
-    }
-    else
+    } while (count == MPU_FIFO_BATCH);
+    if (this->fifo.overflows != this->reportedOverflows)
     {
-      this->saveToHistory();
+      LOG_WARN("MPU - FIFO overflow, samples lost");
+      this->reportedOverflows = this->fifo.overflows;
     }
+    this->printSensorData();
     return false;
   }
 
@@ -174,30 +148,31 @@ public:
   }
   void printSensorData()
   {
-    Serial.print("Acceleration X: ");
-    Serial.print(this->acc.acceleration.x);
-    Serial.print(", Y: ");
-    Serial.print(this->acc.acceleration.y);
-    Serial.print(", Z: ");
-    Serial.print(this->acc.acceleration.z);
-    Serial.print(" m/s^2 ");
-
-    Serial.print(" Rotation X: ");
-    Serial.print(this->gyro.gyro.x);
-    Serial.print(", Y: ");
-    Serial.print(this->gyro.gyro.y);
-    Serial.print(", Z: ");
-    Serial.print(this->gyro.gyro.z);
-    Serial.print(" rad/s ");
-
-    Serial.print(" Temperature: ");
-    Serial.print(this->temp.temperature);
-    Serial.print(" degC ");
-    Serial.println("");
+    LOG_DEBUG("Acceleration X: %.2f, Y: %.2f, Z: %.2f m/s^2  Rotation X: %.2f, Y: %.2f, Z: %.2f rad/s  Temperature: %.2f degC",
+              this->acc.acceleration.x, this->acc.acceleration.y, this->acc.acceleration.z,
+              this->gyro.gyro.x, this->gyro.gyro.y, this->gyro.gyro.z, this->temp.temperature);
   }
 
 private:
   Adafruit_MPU6050 mpu;
+  MPU6050Bus bus;
+  MPU6050Fifo fifo;
+  MotionDetector detector;
+  MPU6050SampleHook sampleHook = NULL;
+  uint32_t sampleTime = 0;
+  boolean fifoMode = false;
+  unsigned long reportedOverflows = 0;
   sensors_event_t acc, gyro, temp;
   sensors_vec_t defaultAcc;
+
+  // Last FIFO sample, for printSensorData
+  void setSample(const MotionSample &sample)
+  {
+    this->acc.acceleration.x = sample.accel[0];
+    this->acc.acceleration.y = sample.accel[1];
+    this->acc.acceleration.z = sample.accel[2];
+    this->gyro.gyro.x = sample.gyro[0];
+    this->gyro.gyro.y = sample.gyro[1];
+    this->gyro.gyro.z = sample.gyro[2];
+  }
 };
@@ -0,0 +1,192 @@
+#pragma once
+
+// Reads the MPU6050 through its FIFO: the chip samples acceleration and
+// rotation at a fixed rate into its 1024 byte FIFO, read() then fetches
+// everything collected since the last call in a few I2C bursts. Many
+// samples per second cost one transaction per MPU6050_FIFO_BURST samples
+// instead of a full register read each.
+//
+// Registers are accessed through MPU6050Bus: the Wire bus on the board,
+// MPU6050ReplayBus (recorded FIFO data) on the host.
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include <Wire.h>
+#endif
+
+#define MPU6050_ADDRESS 0x68
+
+#define MPU6050_REG_SMPLRT_DIV 0x19
+#define MPU6050_REG_CONFIG 0x1A
+#define MPU6050_REG_FIFO_EN 0x23
+#define MPU6050_REG_INT_STATUS 0x3A
+#define MPU6050_REG_USER_CTRL 0x6A
+#define MPU6050_REG_FIFO_COUNTH 0x72
+#define MPU6050_REG_FIFO_R_W 0x74
+
+// FIFO_EN: gyroscope x, y, z and accelerometer
+#define MPU6050_FIFO_GYRO_ACCEL 0x78
+// USER_CTRL
+#define MPU6050_USER_FIFO_EN 0x40
+#define MPU6050_USER_FIFO_RESET 0x04
+// INT_STATUS
+#define MPU6050_INT_FIFO_OFLOW 0x10
+
+#define MPU6050_FIFO_SIZE 1024
+// Acceleration x, y, z then rotation x, y, z, 16 bit big endian each
+#define MPU6050_FIFO_FRAME 12
+
+// Samples per I2C read, the ESP32 Wire buffer holds 128 bytes
+#ifndef MPU6050_FIFO_BURST
+#define MPU6050_FIFO_BURST 10
+#endif
+
+// Digital low pass filter while sampling into the FIFO: 3 is 44 Hz
+// bandwidth with a 1 kHz internal rate
+#ifndef MPU6050_FIFO_DLPF
+#define MPU6050_FIFO_DLPF 3
+#endif
+
+#ifdef ARDUINO
+
+class MPU6050Bus
+{
+private:
+  TwoWire *wire;
+  uint8_t address;
+
+public:
+  MPU6050Bus(TwoWire &wire = Wire, uint8_t address = MPU6050_ADDRESS) : wire(&wire), address(address) {}
+
+  bool writeRegister(uint8_t reg, uint8_t value)
+  {
+    this->wire->beginTransmission(this->address);
+    this->wire->write(reg);
+    this->wire->write(value);
+    return this->wire->endTransmission() == 0;
+  }
+
+  bool readRegisters(uint8_t reg, uint8_t *data, size_t length)
+  {
+    this->wire->beginTransmission(this->address);
+    this->wire->write(reg);
+    if (this->wire->endTransmission(false) != 0)
+    {
+      return false;
+    }
+    if (this->wire->requestFrom(this->address, (uint8_t)length) != length)
+    {
+      return false;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+      data[i] = this->wire->read();
+    }
+    return true;
+  }
+};
+
+#else
+
+#include "host/MPU6050ReplayBus.h"
+typedef MPU6050ReplayBus MPU6050Bus;
+
+#endif
+
+// Raw readings of one FIFO frame
+struct MPU6050FifoSample
+{
+  int16_t accel[3];
+  int16_t gyro[3];
+};
+
+class MPU6050Fifo
+{
+private:
+  MPU6050Bus *bus = NULL;
+
+public:
+  unsigned long samples = 0;
+  unsigned long transactions = 0;
+  unsigned long overflows = 0;
+  // Frames the FIFO held beyond those returned by the last read(), they
+  // are newer than the returned ones
+  size_t remaining = 0;
+
+  // Sample at rate Hz (4 to 1000) into the FIFO
+  bool begin(MPU6050Bus &bus, uint16_t rate)
+  {
+    this->bus = &bus;
+    uint8_t divider = 1000 / rate - 1;
+    return bus.writeRegister(MPU6050_REG_CONFIG, MPU6050_FIFO_DLPF) &&
+           bus.writeRegister(MPU6050_REG_SMPLRT_DIV, divider) &&
+           bus.writeRegister(MPU6050_REG_FIFO_EN, MPU6050_FIFO_GYRO_ACCEL) &&
+           this->reset();
+  }
+
+  // Drop what the FIFO holds and start over
+  bool reset()
+  {
+    return this->bus->writeRegister(MPU6050_REG_USER_CTRL, MPU6050_USER_FIFO_RESET) &&
+           this->bus->writeRegister(MPU6050_REG_USER_CTRL, MPU6050_USER_FIFO_EN);
+  }
+
+  // Oldest samples collected by the chip, at most max of them. After an
+  // overflow the FIFO is no longer frame aligned, it is reset and 0 returned.
+  size_t read(MPU6050FifoSample *samples, size_t max)
+  {
+    uint8_t data[MPU6050_FIFO_BURST * MPU6050_FIFO_FRAME];
+    uint8_t status;
+    this->remaining = 0;
+    if (!this->bus->readRegisters(MPU6050_REG_INT_STATUS, &status, 1) ||
+        !this->bus->readRegisters(MPU6050_REG_FIFO_COUNTH, data, 2))
+    {
+      return 0;
+    }
+    this->transactions += 2;
+    uint16_t count = ((uint16_t)data[0] << 8) | data[1];
+    if ((status & MPU6050_INT_FIFO_OFLOW) != 0 || count >= MPU6050_FIFO_SIZE)
+    {
+      this->overflows++;
+      this->reset();
+      return 0;
+    }
+
+    size_t frames = count / MPU6050_FIFO_FRAME;
+    size_t available = frames;
+    if (available > max)
+    {
+      available = max;
+    }
+    size_t done = 0;
+    while (done < available)
+    {
+      size_t burst = available - done;
+      if (burst > MPU6050_FIFO_BURST)
+      {
+        burst = MPU6050_FIFO_BURST;
+      }
+      if (!this->bus->readRegisters(MPU6050_REG_FIFO_R_W, data, burst * MPU6050_FIFO_FRAME))
+      {
+        break;
+      }
+      this->transactions++;
+      for (size_t i = 0; i < burst; i++)
+      {
+        const uint8_t *frame = data + i * MPU6050_FIFO_FRAME;
+        MPU6050FifoSample &sample = samples[done + i];
+        for (uint8_t axis = 0; axis < 3; axis++)
+        {
+          sample.accel[axis] = (int16_t)((frame[2 * axis] << 8) | frame[2 * axis + 1]);
+          sample.gyro[axis] = (int16_t)((frame[6 + 2 * axis] << 8) | frame[6 + 2 * axis + 1]);
+        }
+      }
+      done += burst;
+    }
+    this->samples += done;
+    this->remaining = frames - done;
+    return done;
+  }
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+// Stand-in for the MPU6050 on the host: serves FIFO data recorded from a
+// real chip (the raw bytes read from FIFO_R_W) through the same register
+// interface as the Wire bus. Time does not pass by itself, advance()
+// lets the chip collect samples, so runs are repeatable.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+class MPU6050ReplayBus
+{
+private:
+  std::vector<uint8_t> recording;
+  uint8_t registers[128];
+  // Bytes of the recording the chip has sampled, and read or dropped
+  size_t sampled = 0;
+  size_t consumed = 0;
+  bool overflow = false;
+
+  bool enabled()
+  {
+    return (this->registers[MPU6050_REG_USER_CTRL] & MPU6050_USER_FIFO_EN) != 0;
+  }
+
+public:
+  MPU6050ReplayBus()
+  {
+    memset(this->registers, 0, sizeof(this->registers));
+  }
+
+  bool load(const char *path)
+  {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+      return false;
+    }
+    uint8_t buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+      this->recording.insert(this->recording.end(), buffer, buffer + length);
+    }
+    fclose(file);
+    return true;
+  }
+
+  void setRecording(const uint8_t *data, size_t length)
+  {
+    this->recording.assign(data, data + length);
+    this->sampled = 0;
+    this->consumed = 0;
+  }
+
+  // The chip takes count more samples. Like the real FIFO, a full FIFO
+  // loses its oldest bytes and flags the overflow.
+  void advance(size_t count)
+  {
+    if (!this->enabled())
+    {
+      return;
+    }
+    this->sampled += count * MPU6050_FIFO_FRAME;
+    if (this->sampled > this->recording.size())
+    {
+      this->sampled = this->recording.size();
+    }
+    if (this->sampled - this->consumed > MPU6050_FIFO_SIZE)
+    {
+      this->consumed = this->sampled - MPU6050_FIFO_SIZE;
+      this->overflow = true;
+    }
+  }
+
+  // Whole recording sampled and read
+  bool finished()
+  {
+    return this->consumed >= this->recording.size();
+  }
+
+  bool writeRegister(uint8_t reg, uint8_t value)
+  {
+    if (reg >= sizeof(this->registers))
+    {
+      return false;
+    }
+    if (reg == MPU6050_REG_USER_CTRL && (value & MPU6050_USER_FIFO_RESET) != 0)
+    {
+      this->consumed = this->sampled;
+      this->overflow = false;
+      value &= ~MPU6050_USER_FIFO_RESET;
+    }
+    this->registers[reg] = value;
+    return true;
+  }
+
+  bool readRegisters(uint8_t reg, uint8_t *data, size_t length)
+  {
+    if (reg == MPU6050_REG_FIFO_R_W)
+    {
+      // FIFO_R_W does not advance the register address, every byte read
+      // is the next one of the FIFO
+      for (size_t i = 0; i < length; i++)
+      {
+        data[i] = this->consumed < this->sampled ? this->recording[this->consumed++] : 0;
+      }
+      return true;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+      uint8_t address = reg + i;
+      if (address == MPU6050_REG_INT_STATUS)
+      {
+        data[i] = this->overflow ? MPU6050_INT_FIFO_OFLOW : 0;
+        this->overflow = false;
+      }
+      else if (address == MPU6050_REG_FIFO_COUNTH || address == MPU6050_REG_FIFO_COUNTH + 1)
+      {
+        uint16_t count = this->sampled - this->consumed;
+        data[i] = address == MPU6050_REG_FIFO_COUNTH ? count >> 8 : count & 0xFF;
+      }
+      else
+      {
+        data[i] = address < sizeof(this->registers) ? this->registers[address] : 0;
+      }
+    }
+    return true;
+  }
+};
@@ -1,6 +1,7 @@
 #include <SPI.h>
 #include <MFRC522.h>
 #include <Arduino.h>
+#include <Logger.h>
 #include "../../src/credentials.h"
 
 class RFIDReader
@@ -12,18 +13,12 @@ public:
     this->rfid.PCD_Init();
     delay(4);
     this->rfid.PCD_DumpVersionToSerial();
-    Serial.println("RFID Init");
+    LOG_INFO("RFID Init");
   }
 
   bool isValidID(byte uid[10])
   {
-    // Serial.println("Read ID: ");
-    for (uint8_t i = 0; i < 4; i++)
-    {
-      Serial.print(uid[i]);
-      Serial.print(",");
-    }
-    Serial.println("");
+    LOG_DEBUG("Read ID: %u,%u,%u,%u", uid[0], uid[1], uid[2], uid[3]);
     bool valid = true;
     for (int id = 0; id < VALID_ID_COUNT; id++)
     {
@@ -54,18 +49,18 @@ public:
     {
       if (!rfid.PICC_ReadCardSerial())
       {
-        Serial.println("Cannot read card info!");
+        LOG_WARN("Cannot read card info!");
         return false;
       }
 
       if (isValidID(rfid.uid.uidByte))
       {
-        Serial.println("Valid");
+        LOG_INFO("Valid");
         return true;
       }
       else
       {
-        Serial.println("Invalid");
+        LOG_INFO("Invalid");
       }
     }
     return false;
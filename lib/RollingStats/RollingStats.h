@@ -0,0 +1,166 @@
+#pragma once
+
+// Statistics of a sensor signal that cost the same per sample whatever the
+// window size: RollingWindow keeps the mean and variance of the last N
+// samples, Ewma an exponentially weighted mean and variance.
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdint.h>
+typedef bool boolean;
+#endif
+#include <math.h>
+
+// Mean and variance of the last N samples. Adding a sample replaces the
+// oldest one and updates the sums in O(1). Fresh sums of the samples added
+// since the last refresh are kept alongside; after N samples they cover
+// exactly the window and replace the running ones, so float rounding does
+// not build up and no sample pays for a pass over the ring.
+template <uint16_t N>
+class RollingWindow
+{
+private:
+  float values[N];
+  uint16_t next = 0;
+  uint16_t count = 0;
+  float sum = 0;
+  // Sum of squared differences from the mean (Welford)
+  float squares = 0;
+  // Same for the samples added since the last refresh
+  uint16_t freshCount = 0;
+  float freshSum = 0;
+  float freshSquares = 0;
+
+  void refresh(float value)
+  {
+    float oldMean = this->freshCount > 0 ? this->freshSum / this->freshCount : 0;
+    this->freshCount++;
+    this->freshSum += value;
+    this->freshSquares += (value - oldMean) * (value - this->freshSum / this->freshCount);
+    if (this->freshCount >= N)
+    {
+      this->sum = this->freshSum;
+      this->squares = this->freshSquares;
+      this->freshCount = 0;
+      this->freshSum = 0;
+      this->freshSquares = 0;
+    }
+  }
+
+public:
+  void add(float value)
+  {
+    if (this->count < N)
+    {
+      float oldMean = this->mean();
+      this->values[this->next] = value;
+      this->count++;
+      this->sum += value;
+      this->squares += (value - oldMean) * (value - this->mean());
+    }
+    else
+    {
+      float old = this->values[this->next];
+      float oldMean = this->mean();
+      this->values[this->next] = value;
+      this->sum += value - old;
+      this->squares += (value - old) * (value - this->mean() + old - oldMean);
+    }
+    this->next = (this->next + 1) % N;
+    this->refresh(value);
+  }
+
+  void clear()
+  {
+    this->next = 0;
+    this->count = 0;
+    this->sum = 0;
+    this->squares = 0;
+    this->freshCount = 0;
+    this->freshSum = 0;
+    this->freshSquares = 0;
+  }
+
+  boolean full() const
+  {
+    return this->count == N;
+  }
+
+  uint16_t size() const
+  {
+    return this->count;
+  }
+
+  float mean() const
+  {
+    return this->count > 0 ? this->sum / this->count : 0;
+  }
+
+  // Population variance of the samples in the window
+  float variance() const
+  {
+    return this->count > 0 && this->squares > 0 ? this->squares / this->count : 0;
+  }
+
+  float stddev() const
+  {
+    return sqrtf(this->variance());
+  }
+};
+
+// Exponentially weighted mean and variance. alpha is the weight of a new
+// sample, about 2 / (N + 1) to follow the last N samples.
+class Ewma
+{
+private:
+  float alpha;
+  float average = 0;
+  float spread = 0;
+  boolean started = false;
+
+public:
+  Ewma(float alpha) : alpha(alpha) {}
+
+  void add(float value)
+  {
+    if (!this->started)
+    {
+      this->average = value;
+      this->spread = 0;
+      this->started = true;
+      return;
+    }
+    float difference = value - this->average;
+    float increment = this->alpha * difference;
+    this->average += increment;
+    this->spread = (1 - this->alpha) * (this->spread + difference * increment);
+  }
+
+  void clear()
+  {
+    this->started = false;
+    this->average = 0;
+    this->spread = 0;
+  }
+
+  boolean isStarted() const
+  {
+    return this->started;
+  }
+
+  float mean() const
+  {
+    return this->average;
+  }
+
+  float variance() const
+  {
+    return this->spread;
+  }
+
+  float stddev() const
+  {
+    return sqrtf(this->spread);
+  }
+};
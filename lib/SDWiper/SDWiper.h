@@ -0,0 +1,187 @@
+#pragma once
+
+// Removes everything below a directory of an FTPStorage, as fast as the card
+// allows: no recursion (the depth of the tree does not matter for the task
+// stack), no output per entry, and files are removed in batches, so a
+// directory is listed once per SD_WIPE_BATCH files instead of being kept
+// open while its entries are deleted.
+
+#include <FTPPlatform.h>
+#include <vector>
+
+// File names collected from a directory before they are removed
+#ifndef SD_WIPE_BATCH
+#define SD_WIPE_BATCH 32
+#endif
+
+struct SDWipeResult
+{
+  unsigned long filesRemoved;
+  unsigned long directoriesRemoved;
+  // Entries that could not be removed, they are left in place
+  unsigned long failures;
+  unsigned long elapsedMillis;
+  // micros() after the first and the last successful removal, 0 if none
+  unsigned long firstRemoveMicros;
+  unsigned long lastRemoveMicros;
+};
+
+// Called after every batch with the counts so far
+typedef void (*SDWipeProgress)(const SDWipeResult &result, void *context);
+
+class SDWiper
+{
+private:
+  // A directory still to be emptied. The first skip entries of its listing
+  // could not be removed, every entry after them has not been visited yet.
+  struct Frame
+  {
+    String path;
+    unsigned long skip;
+  };
+
+  FTPStorage *storage;
+  SDWipeProgress progress = NULL;
+  void *progressContext = NULL;
+  std::vector<Frame> stack;
+  String batch[SD_WIPE_BATCH];
+
+  static String childPath(const String &dir, const char *name)
+  {
+    const char *sep = strrchr(name, '/');
+    if (sep != NULL)
+    {
+      name = sep + 1;
+    }
+    String path = dir;
+    if (dir.length() == 0 || dir.charAt(dir.length() - 1) != '/')
+    {
+      path += "/";
+    }
+    path += name;
+    return path;
+  }
+
+  // List the next files of the directory on top of the stack into batch.
+  // Stops at the first subdirectory, which is pushed and emptied before the
+  // listing goes on. Returns false when nothing but the skipped entries is left.
+  boolean collect(uint8_t &count)
+  {
+    count = 0;
+    Frame &top = this->stack.back();
+    String dirPath = top.path;
+    unsigned long skip = top.skip;
+    FTPFile dir = this->storage->open(dirPath);
+    if (!dir || !dir.isDirectory())
+    {
+      return false;
+    }
+    boolean found = false;
+    FTPFile entry;
+    while (count < SD_WIPE_BATCH && (entry = dir.openNextFile()))
+    {
+      if (skip > 0)
+      {
+        skip--;
+        continue;
+      }
+      found = true;
+      String path = childPath(dirPath, entry.name());
+      if (entry.isDirectory())
+      {
+        entry.close();
+        Frame frame = {path, 0};
+        // top is invalid from here on
+        this->stack.push_back(frame);
+        break;
+      }
+      entry.close();
+      this->batch[count++] = path;
+    }
+    dir.close();
+    return found;
+  }
+
+  static void removed(SDWipeResult &result)
+  {
+    result.lastRemoveMicros = micros();
+    if (result.firstRemoveMicros == 0)
+    {
+      result.firstRemoveMicros = result.lastRemoveMicros;
+    }
+  }
+
+public:
+  SDWiper(FTPStorage &storage) : storage(&storage) {}
+
+  void onProgress(SDWipeProgress progress, void *context = NULL)
+  {
+    this->progress = progress;
+    this->progressContext = context;
+  }
+
+  // Remove every file and directory below path, path itself is kept
+  SDWipeResult wipe(const String &path = "/")
+  {
+    SDWipeResult result = {0, 0, 0, 0, 0, 0};
+    unsigned long begin = millis();
+    Frame root = {path, 0};
+    this->stack.clear();
+    this->stack.push_back(root);
+
+    while (!this->stack.empty())
+    {
+      // collect may push a subdirectory, failures belong to its parent
+      size_t current = this->stack.size() - 1;
+      uint8_t count;
+      if (this->collect(count))
+      {
+        for (uint8_t i = 0; i < count; i++)
+        {
+          if (this->storage->remove(this->batch[i]))
+          {
+            result.filesRemoved++;
+            this->removed(result);
+          }
+          else
+          {
+            result.failures++;
+            this->stack[current].skip++;
+          }
+        }
+        if (this->progress != NULL && count > 0)
+        {
+          this->progress(result, this->progressContext);
+        }
+        continue;
+      }
+
+      // Directory is empty apart from what could not be removed
+      Frame done = this->stack.back();
+      this->stack.pop_back();
+      if (this->stack.empty())
+      {
+        break;
+      }
+      if (done.skip == 0 && this->storage->rmdir(done.path))
+      {
+        result.directoriesRemoved++;
+        this->removed(result);
+      }
+      else
+      {
+        result.failures++;
+        this->stack.back().skip++;
+      }
+    }
+
+    // Give the memory of a deep tree back
+    std::vector<Frame>().swap(this->stack);
+    for (uint8_t i = 0; i < SD_WIPE_BATCH; i++)
+    {
+      this->batch[i] = String();
+    }
+    result.elapsedMillis = millis() - begin;
+    return result;
+  }
+};
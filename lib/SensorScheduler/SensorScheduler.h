@@ -0,0 +1,164 @@
+#pragma once
+
+// Samples every sensor from one task. Each sensor has its own period and its
+// deadlines are absolute (deadline += period), so the time a sample takes
+// does not shift the next one and periods do not drift. The task sleeps
+// until the earliest deadline of all sensors.
+//
+// Per sensor the scheduler measures the jitter (how late a sample starts
+// after its deadline) and the latency from the deadline to the end of the
+// sample, which is when the tamper decision is made.
+
+#include <Arduino.h>
+#include <Logger.h>
+
+#ifndef SENSOR_MAX_COUNT
+#define SENSOR_MAX_COUNT 4
+#endif
+
+// How often the timing of all sensors is logged, in ms. 0 turns it off.
+#ifndef SENSOR_REPORT_INTERVAL
+#define SENSOR_REPORT_INTERVAL 60000
+#endif
+
+// Takes one sample and acts on it. Returns true when the sample led to a
+// decision (tamper response or mode switch).
+typedef boolean (*SensorSample)(void *context);
+
+struct SensorTiming
+{
+  unsigned long samples;
+  // Deadlines skipped because an earlier sample ran too long
+  unsigned long missed;
+  unsigned long maxJitter;
+  uint64_t jitterSum;
+  // Deadline to end of sample, in us
+  unsigned long maxLatency;
+  unsigned long maxDecisionLatency;
+  unsigned long decisions;
+};
+
+class SensorScheduler
+{
+private:
+  struct Sensor
+  {
+    const char *name;
+    unsigned long period;
+    SensorSample sample;
+    void *context;
+    unsigned long deadline;
+    SensorTiming timing;
+  };
+
+  Sensor sensors[SENSOR_MAX_COUNT];
+  uint8_t count = 0;
+  unsigned long lastReport = 0;
+
+  void runSample(Sensor &sensor)
+  {
+    unsigned long start = micros();
+    boolean decided = sensor.sample(sensor.context);
+    unsigned long end = micros();
+
+    SensorTiming &timing = sensor.timing;
+    unsigned long jitter = start - sensor.deadline;
+    unsigned long latency = end - sensor.deadline;
+    timing.samples++;
+    timing.jitterSum += jitter;
+    timing.maxJitter = max(timing.maxJitter, jitter);
+    timing.maxLatency = max(timing.maxLatency, latency);
+    if (decided)
+    {
+      timing.decisions++;
+      timing.maxDecisionLatency = max(timing.maxDecisionLatency, latency);
+    }
+
+    // Keep to the grid of deadlines, skipping the ones already passed
+    sensor.deadline += sensor.period;
+    while ((long)(micros() - sensor.deadline) >= 0)
+    {
+      sensor.deadline += sensor.period;
+      timing.missed++;
+    }
+  }
+
+public:
+  // Sample every period ms, starting now. Returns false when there is no
+  // room for another sensor.
+  boolean add(const char *name, unsigned long period, SensorSample sample, void *context)
+  {
+    if (this->count >= SENSOR_MAX_COUNT)
+    {
+      return false;
+    }
+    Sensor &sensor = this->sensors[this->count++];
+    sensor.name = name;
+    sensor.period = period * 1000;
+    sensor.sample = sample;
+    sensor.context = context;
+    sensor.deadline = micros();
+    memset(&sensor.timing, 0, sizeof(sensor.timing));
+    return true;
+  }
+
+  // Take the samples that are due, then sleep until the next deadline
+  void step()
+  {
+    for (uint8_t i = 0; i < this->count; i++)
+    {
+      if ((long)(micros() - this->sensors[i].deadline) >= 0)
+      {
+        this->runSample(this->sensors[i]);
+      }
+    }
+
+    if (SENSOR_REPORT_INTERVAL > 0 && millis() - this->lastReport >= SENSOR_REPORT_INTERVAL)
+    {
+      this->report();
+      this->lastReport = millis();
+    }
+
+    if (this->count == 0)
+    {
+      vTaskDelay(SENSOR_REPORT_INTERVAL > 0 ? SENSOR_REPORT_INTERVAL : portMAX_DELAY);
+      return;
+    }
+    unsigned long next = this->sensors[0].deadline;
+    for (uint8_t i = 1; i < this->count; i++)
+    {
+      if ((long)(this->sensors[i].deadline - next) < 0)
+      {
+        next = this->sensors[i].deadline;
+      }
+    }
+    long wait = (long)(next - micros());
+    if (wait > 0)
+    {
+      // Rounded up, waking before the deadline would cost another pass
+      vTaskDelay((wait + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000));
+    }
+  }
+
+  void run()
+  {
+    this->lastReport = millis();
+    while (true)
+    {
+      this->step();
+    }
+  }
+
+  void report()
+  {
+    for (uint8_t i = 0; i < this->count; i++)
+    {
+      Sensor &sensor = this->sensors[i];
+      SensorTiming &timing = sensor.timing;
+      LOG_INFO("Sensor %s/%lums: %lu samples %lu missed, jitter avg %lu max %lu us, latency max %lu us, %lu decisions max %lu us",
+               sensor.name, sensor.period / 1000, timing.samples, timing.missed,
+               timing.samples > 0 ? (unsigned long)(timing.jitterSum / timing.samples) : 0UL, timing.maxJitter,
+               timing.maxLatency, timing.decisions, timing.maxDecisionLatency);
+    }
+  }
+};
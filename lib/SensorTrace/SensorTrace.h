@@ -0,0 +1,235 @@
+#pragma once
+
+// Compact binary trace of sensor samples, recorded on the device and
+// replayed through the detectors on the host (src/replay).
+//
+// File: header, then records.
+//   header: "STRC", version (1 byte), 0 (1 byte),
+//           accelerometer LSB per g (uint16), gyroscope LSB per 10 deg/s (uint16)
+//   record: kind (1 byte), time since the previous record in us (varint),
+//           then by kind
+//     SENSOR_TRACE_LIGHT     reading (varint)
+//     SENSOR_TRACE_MOTION    acceleration x, y, z, rotation x, y, z (int16 each)
+//     SENSOR_TRACE_DETECTION detector that fired on the device (1 byte)
+// Integers are little endian, varints are unsigned LEB128. A light record
+// takes 4 bytes, a motion record at 200 Hz 15.
+
+#include <stdint.h>
+#include <string.h>
+
+#define SENSOR_TRACE_MAGIC "STRC"
+#define SENSOR_TRACE_VERSION 1
+#define SENSOR_TRACE_HEADER_SIZE 10
+
+#define SENSOR_TRACE_LIGHT 1
+#define SENSOR_TRACE_MOTION 2
+#define SENSOR_TRACE_DETECTION 3
+
+// Largest record: kind, 5 byte varint, 12 bytes of motion
+#define SENSOR_TRACE_MAX_RECORD 18
+
+// Detector ids of SENSOR_TRACE_DETECTION records
+#define SENSOR_TRACE_DETECTOR_LIGHT 1
+#define SENSOR_TRACE_DETECTOR_MOTION 2
+
+struct SensorTraceRecord
+{
+  uint8_t kind;
+  // Since the start of the trace
+  uint64_t time;
+  uint16_t light;
+  int16_t accel[3];
+  int16_t gyro[3];
+  uint8_t detector;
+};
+
+class SensorTraceEncoder
+{
+private:
+  uint32_t lastTime = 0;
+  bool started = false;
+
+  static size_t putVarint(uint8_t *out, uint32_t value)
+  {
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+      out[length++] = (value & 0x7F) | 0x80;
+      value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+  }
+
+  static size_t putInt16(uint8_t *out, int16_t value)
+  {
+    out[0] = (uint16_t)value & 0xFF;
+    out[1] = (uint16_t)value >> 8;
+    return 2;
+  }
+
+  // Kind and time of a record. Times that go backwards (samples timed from
+  // a FIFO batch) are recorded as simultaneous.
+  size_t begin(uint8_t *out, uint8_t kind, uint32_t time)
+  {
+    uint32_t delta = 0;
+    if (!this->started)
+    {
+      this->started = true;
+      this->lastTime = time;
+    }
+    else if ((int32_t)(time - this->lastTime) > 0)
+    {
+      delta = time - this->lastTime;
+      this->lastTime = time;
+    }
+    out[0] = kind;
+    return 1 + putVarint(out + 1, delta);
+  }
+
+public:
+  static size_t header(uint8_t *out, uint16_t accelLsbPerG, uint16_t gyroLsbPer10Dps)
+  {
+    memcpy(out, SENSOR_TRACE_MAGIC, 4);
+    out[4] = SENSOR_TRACE_VERSION;
+    out[5] = 0;
+    putInt16(out + 6, accelLsbPerG);
+    putInt16(out + 8, gyroLsbPer10Dps);
+    return SENSOR_TRACE_HEADER_SIZE;
+  }
+
+  // Each writes at most SENSOR_TRACE_MAX_RECORD bytes, time is micros()
+  size_t light(uint8_t *out, uint32_t time, uint16_t value)
+  {
+    size_t length = this->begin(out, SENSOR_TRACE_LIGHT, time);
+    return length + putVarint(out + length, value);
+  }
+
+  size_t motion(uint8_t *out, uint32_t time, const int16_t *accel, const int16_t *gyro)
+  {
+    size_t length = this->begin(out, SENSOR_TRACE_MOTION, time);
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      length += putInt16(out + length, accel[i]);
+    }
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      length += putInt16(out + length, gyro[i]);
+    }
+    return length;
+  }
+
+  size_t detection(uint8_t *out, uint32_t time, uint8_t detector)
+  {
+    size_t length = this->begin(out, SENSOR_TRACE_DETECTION, time);
+    out[length++] = detector;
+    return length;
+  }
+};
+
+// Reads records back from a trace held in memory
+class SensorTraceDecoder
+{
+private:
+  const uint8_t *data;
+  size_t length;
+  size_t position = 0;
+  uint64_t time = 0;
+
+  bool getVarint(uint32_t &value)
+  {
+    value = 0;
+    for (uint8_t shift = 0; shift < 35 && this->position < this->length; shift += 7)
+    {
+      uint8_t part = this->data[this->position++];
+      value |= (uint32_t)(part & 0x7F) << shift;
+      if ((part & 0x80) == 0)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool getInt16(int16_t &value)
+  {
+    if (this->position + 2 > this->length)
+    {
+      return false;
+    }
+    value = (int16_t)(this->data[this->position] | (this->data[this->position + 1] << 8));
+    this->position += 2;
+    return true;
+  }
+
+public:
+  uint16_t accelLsbPerG = 0;
+  uint16_t gyroLsbPer10Dps = 0;
+
+  SensorTraceDecoder(const uint8_t *data, size_t length) : data(data), length(length) {}
+
+  // False if this is not a trace this version can read
+  bool begin()
+  {
+    if (this->length < SENSOR_TRACE_HEADER_SIZE || memcmp(this->data, SENSOR_TRACE_MAGIC, 4) != 0 ||
+        this->data[4] != SENSOR_TRACE_VERSION)
+    {
+      return false;
+    }
+    this->position = 6;
+    int16_t value;
+    this->getInt16(value);
+    this->accelLsbPerG = value;
+    this->getInt16(value);
+    this->gyroLsbPer10Dps = value;
+    return true;
+  }
+
+  // False at the end of the trace, or at a record cut short (the device
+  // lost power while writing)
+  bool next(SensorTraceRecord &record)
+  {
+    if (this->position >= this->length)
+    {
+      return false;
+    }
+    record.kind = this->data[this->position++];
+    uint32_t delta;
+    if (!this->getVarint(delta))
+    {
+      return false;
+    }
+    this->time += delta;
+    record.time = this->time;
+    switch (record.kind)
+    {
+    case SENSOR_TRACE_LIGHT:
+    {
+      uint32_t value;
+      if (!this->getVarint(value))
+        return false;
+      record.light = value;
+      return true;
+    }
+    case SENSOR_TRACE_MOTION:
+      for (uint8_t i = 0; i < 3; i++)
+      {
+        if (!this->getInt16(record.accel[i]))
+          return false;
+      }
+      for (uint8_t i = 0; i < 3; i++)
+      {
+        if (!this->getInt16(record.gyro[i]))
+          return false;
+      }
+      return true;
+    case SENSOR_TRACE_DETECTION:
+      if (this->position >= this->length)
+        return false;
+      record.detector = this->data[this->position++];
+      return true;
+    default:
+      return false;
+    }
+  }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+// Records the sensor samples to SENSOR_TRACE_PATH on the SD card, in the
+// format of SensorTrace.h. Samples are encoded into one of two buffers by
+// the sensor task, full buffers are written by a low priority task so the
+// sampling deadlines never wait for the card. When both buffers are still
+// being written the samples are dropped and counted.
+//
+// A detection wipes the card, including the trace: record with the box in
+// unsecure mode (RFID), detections are then only marked in the trace.
+
+#include <FTPPlatform.h>
+#include "SensorTrace.h"
+
+// Record a trace on the device, off by default
+#ifndef SENSOR_TRACE
+#define SENSOR_TRACE 0
+#endif
+
+#ifndef SENSOR_TRACE_PATH
+#define SENSOR_TRACE_PATH "/sensors.trc"
+#endif
+
+#ifndef SENSOR_TRACE_BUFFER
+#define SENSOR_TRACE_BUFFER 2048
+#endif
+
+#define SENSOR_TRACE_BUFFERS 2
+#define SENSOR_TRACE_STACK 4096
+
+struct SensorTraceChunk
+{
+  uint8_t index;
+  size_t length;
+};
+
+class SensorTraceRecorder
+{
+private:
+  uint8_t buffers[SENSOR_TRACE_BUFFERS][SENSOR_TRACE_BUFFER];
+  QueueHandle_t freeBuffers = NULL;
+  QueueHandle_t fullBuffers = NULL;
+  SensorTraceEncoder encoder;
+
+  // Buffer the sensor task encodes into, SENSOR_TRACE_BUFFERS when it has none
+  uint8_t current = SENSOR_TRACE_BUFFERS;
+  size_t length = 0;
+
+  FTPStorage storage;
+  FTPFile file;
+  boolean opened = false;
+  uint16_t accelLsbPerG;
+  uint16_t gyroLsbPer10Dps;
+
+  static void writerTask(void *params)
+  {
+    ((SensorTraceRecorder *)params)->writeLoop();
+  }
+
+  void writeLoop()
+  {
+    SensorTraceChunk chunk;
+    while (true)
+    {
+      xQueueReceive(this->fullBuffers, &chunk, portMAX_DELAY);
+      if (!this->opened)
+      {
+        // The card is mounted by the FTP task, wait for it with the first write
+        this->file = this->storage.open(SENSOR_TRACE_PATH, "w");
+        this->opened = this->file;
+        if (this->opened)
+        {
+          uint8_t header[SENSOR_TRACE_HEADER_SIZE];
+          SensorTraceEncoder::header(header, this->accelLsbPerG, this->gyroLsbPer10Dps);
+          this->file.write(header, sizeof(header));
+        }
+      }
+      if (!this->opened || this->file.write(this->buffers[chunk.index], chunk.length) != chunk.length)
+      {
+        this->failedWrites++;
+      }
+      else
+      {
+        this->file.flush();
+        this->written += chunk.length;
+      }
+      xQueueSend(this->freeBuffers, &chunk.index, portMAX_DELAY);
+    }
+  }
+
+  // Room for one more record, false when there is none
+  boolean reserve()
+  {
+    if (this->current < SENSOR_TRACE_BUFFERS && this->length + SENSOR_TRACE_MAX_RECORD > SENSOR_TRACE_BUFFER)
+    {
+      this->flush();
+    }
+    if (this->current == SENSOR_TRACE_BUFFERS && xQueueReceive(this->freeBuffers, &this->current, 0) != pdTRUE)
+    {
+      this->dropped++;
+      return false;
+    }
+    return true;
+  }
+
+  uint8_t *end()
+  {
+    return this->buffers[this->current] + this->length;
+  }
+
+public:
+  unsigned long dropped = 0;
+  unsigned long failedWrites = 0;
+  volatile unsigned long written = 0;
+
+  // Scale of the raw motion samples, see the trace header
+  boolean begin(uint16_t accelLsbPerG, uint16_t gyroLsbPer10Dps)
+  {
+    this->accelLsbPerG = accelLsbPerG;
+    this->gyroLsbPer10Dps = gyroLsbPer10Dps;
+    this->freeBuffers = xQueueCreate(SENSOR_TRACE_BUFFERS, sizeof(uint8_t));
+    this->fullBuffers = xQueueCreate(SENSOR_TRACE_BUFFERS, sizeof(SensorTraceChunk));
+    if (this->freeBuffers == NULL || this->fullBuffers == NULL)
+    {
+      return false;
+    }
+    for (uint8_t i = 0; i < SENSOR_TRACE_BUFFERS; i++)
+    {
+      xQueueSend(this->freeBuffers, &i, 0);
+    }
+    LOG_INFO("Recording sensor trace to %s", SENSOR_TRACE_PATH);
+    return xTaskCreatePinnedToCore(writerTask, "SensorTrace", SENSOR_TRACE_STACK, this, 0, NULL, 0) == pdPASS;
+  }
+
+  // Called from the sensor task only, time is micros()
+  void recordLight(uint32_t time, uint16_t value)
+  {
+    if (this->reserve())
+    {
+      this->length += this->encoder.light(this->end(), time, value);
+    }
+  }
+
+  void recordMotion(uint32_t time, const int16_t *accel, const int16_t *gyro)
+  {
+    if (this->reserve())
+    {
+      this->length += this->encoder.motion(this->end(), time, accel, gyro);
+    }
+  }
+
+  // Detections are followed by a flush, the trace on the card then reaches
+  // at least up to them
+  void recordDetection(uint32_t time, uint8_t detector)
+  {
+    if (this->reserve())
+    {
+      this->length += this->encoder.detection(this->end(), time, detector);
+      this->flush();
+    }
+  }
+
+  // Hand the current buffer to the writer task
+  void flush()
+  {
+    if (this->current == SENSOR_TRACE_BUFFERS || this->length == 0)
+    {
+      return;
+    }
+    SensorTraceChunk chunk = {this->current, this->length};
+    // Never blocks, there are only SENSOR_TRACE_BUFFERS buffers in circulation
+    xQueueSend(this->fullBuffers, &chunk, portMAX_DELAY);
+    this->current = SENSOR_TRACE_BUFFERS;
+    this->length = 0;
+  }
+};
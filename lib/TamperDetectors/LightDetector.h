@@ -0,0 +1,57 @@
+#pragma once
+
+// Decides from light level readings whether the box was opened. Pure
+// logic, the device feeds it analogRead values and the replay tool feeds it
+// recorded ones.
+
+#include <stdlib.h>
+#include <RollingStats.h>
+#include <Logger.h>
+
+// Samples the light level is compared with
+#ifndef LIGHT_VALUES_COUNT
+#define LIGHT_VALUES_COUNT 10
+#endif
+
+class LightDetector
+{
+private:
+  RollingWindow<LIGHT_VALUES_COUNT> values;
+  int anomalyHistory = 0;
+
+public:
+  // Returns true when the last three readings differ from the mean of the
+  // steady ones. The detector then calibrates again.
+  boolean add(int light)
+  {
+    boolean detected = false;
+    LOG_DEBUG("Light: %d", light);
+    if (this->values.full())
+    {
+      float mean = this->values.mean();
+      LOG_DEBUG("Light - AVG: %.1f", mean);
+      if (fabsf(light - mean) > 20 && fabsf(light - mean) > mean * 0.1)
+      {
+        this->anomalyHistory |= 1;
+      }
+      if ((this->anomalyHistory & 0b111) == 0b111)
+      {
+        LOG_WARN("Light anomaly detected!");
+        detected = true;
+        this->anomalyHistory = 0;
+        this->values.clear();
+      }
+      else
+      {
+        this->values.add(light);
+      }
+    }
+    else
+    { //Calibrating sensor
+      this->values.add(light);
+    }
+
+    this->anomalyHistory <<= 1;
+    return detected;
+  }
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+// Decides from MPU6050 readings whether the box was moved. Pure logic, the
+// device feeds it FIFO samples and the replay tool feeds it recorded ones.
+
+#include <stdint.h>
+#include <math.h>
+#include <RollingStats.h>
+#include <Logger.h>
+
+// The MPU6050 is read through its FIFO at MPU_FIFO_RATE samples per second,
+// the defaults below depend on it
+#ifndef MPU_FIFO
+#define MPU_FIFO 1
+#endif
+
+#ifndef MPU_FIFO_RATE
+#define MPU_FIFO_RATE 200
+#endif
+
+// Steady samples the readings are compared with, and consecutive anomalous
+// samples that make an intrusion
+#ifndef MPU_HISTORY_COUNT
+#if MPU_FIFO
+#define MPU_HISTORY_COUNT 100
+#else
+#define MPU_HISTORY_COUNT 10
+#endif
+#endif
+
+#ifndef MPU_ANOMALY_SAMPLES
+#if MPU_FIFO
+#define MPU_ANOMALY_SAMPLES 20
+#else
+#define MPU_ANOMALY_SAMPLES 5
+#endif
+#endif
+
+// Raw MPU6050 values per unit, for the ranges the device sets (8 g, 500 deg/s)
+#define MPU_ACCEL_LSB_PER_G 4096.0f
+#define MPU_GYRO_LSB_PER_DPS 65.5f
+
+#define MOTION_GRAVITY 9.80665f
+#define MOTION_DEG_TO_RAD 0.017453293f
+
+// Acceleration in m/s^2, rotation in rad/s
+struct MotionSample
+{
+  float accel[3];
+  float gyro[3];
+
+  static MotionSample fromRaw(const int16_t *accel, const int16_t *gyro)
+  {
+    MotionSample sample;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      sample.accel[i] = accel[i] * MOTION_GRAVITY / MPU_ACCEL_LSB_PER_G;
+      sample.gyro[i] = gyro[i] * MOTION_DEG_TO_RAD / MPU_GYRO_LSB_PER_DPS;
+    }
+    return sample;
+  }
+};
+
+class MotionDetector
+{
+private:
+  // Gyroscope x, y, z then acceleration x, y, z
+  RollingWindow<MPU_HISTORY_COUNT> history[6];
+  int anomalyCount = 0;
+
+  void save(const MotionSample &sample)
+  {
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      this->history[i].add(sample.gyro[i]);
+      this->history[3 + i].add(sample.accel[i]);
+    }
+  }
+
+  // Samples taken while the device moves are not used as reference
+  void calibrationStep(const MotionSample &sample)
+  {
+    LOG_DEBUG("MPU - Calibrating");
+    if ((fabsf(sample.accel[0]) < 7 && fabsf(sample.accel[1]) < 7 && fabsf(sample.accel[2]) < 7) ||
+        fabsf(sample.accel[0]) > 11 || fabsf(sample.accel[1]) > 11 || fabsf(sample.accel[2]) > 11 ||
+        fabsf(sample.gyro[0]) > 1 || fabsf(sample.gyro[1]) > 1 || fabsf(sample.gyro[2]) > 1)
+    {
+      return;
+    }
+    this->save(sample);
+    if (this->isCalibrated())
+    {
+      LOG_INFO("MPU - Calibration finished, Z average %.2f", this->average(5));
+    }
+  }
+
+public:
+  // Start a new calibration. It goes on with the next samples, the first
+  // MPU_HISTORY_COUNT steady ones become the reference.
+  void calibrate()
+  {
+    for (uint8_t i = 0; i < 6; i++)
+    {
+      this->history[i].clear();
+    }
+    this->anomalyCount = 0;
+  }
+
+  boolean isCalibrated()
+  {
+    return this->history[0].full();
+  }
+
+  // Reference value of gyroscope x, y, z (0 to 2) or acceleration x, y, z
+  // (3 to 5)
+  float average(uint8_t axis)
+  {
+    return this->history[axis].mean();
+  }
+
+  // Returns true when MPU_ANOMALY_SAMPLES samples in a row moved away from
+  // the reference. The detector then calibrates again.
+  boolean add(const MotionSample &sample)
+  {
+    if (!this->isCalibrated())
+    {
+      this->calibrationStep(sample);
+      return false;
+    }
+
+    const float *accel = sample.accel;
+    if ((fabsf(accel[0]) < 0.5 && fabsf(accel[1]) < 0.5 && fabsf(accel[2]) < 0.5) ||
+        fabsf(accel[0]) > 15 || fabsf(accel[1]) > 15 || fabsf(accel[2]) > 15)
+    {
+      // Error
+      this->anomalyCount = 0;
+      return false;
+    }
+    if (fabsf(accel[0] - this->average(3)) > 0.5 ||
+        fabsf(accel[1] - this->average(4)) > 0.5 ||
+        fabsf(accel[2] - this->average(5)) > 0.5)
+    {
+      // Anomaly detected
+      LOG_DEBUG("MPU - sensor data change detected");
+      if (++this->anomalyCount >= MPU_ANOMALY_SAMPLES)
+      {
+        this->calibrate();
+        LOG_WARN("MPU - Intrusion!!!");
+        return true;
+      }
+    }
+    else
+    {
+      this->anomalyCount = 0;
+      this->save(sample);
+    }
+    return false;
+  }
+};
@@ -0,0 +1,231 @@
+#pragma once
+
+// Events between the tasks of the tamper response: the sensor task
+// publishes detections and mode switches, the wipe engine publishes its
+// progress, and the wipe engine and the LED read them.
+//
+// A TamperEventChannel has one producer and any number of readers, each
+// reader sees every event. Publishing never waits: events go round a ring
+// of TAMPER_EVENT_SLOTS slots, every slot carries the sequence number of
+// its event, and a reader that fell more than a ring behind skips the
+// events it lost and counts them. Nothing takes a lock, so the sensor task
+// never waits for a reader. The last detection is also kept apart, so a
+// reader that lost events still learns there was one.
+//
+// TamperWipeGate makes sure a detection, or a burst of them, starts exactly
+// one wipe, whichever task sees it first: a task claims the gate for a
+// detection with a compare-and-swap, and the winner's wipe covers every
+// detection published until it releases the gate.
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdint.h>
+typedef bool boolean;
+#endif
+#include <atomic>
+
+// Events kept for slow readers, must be a power of two
+#ifndef TAMPER_EVENT_SLOTS
+#define TAMPER_EVENT_SLOTS 16
+#endif
+
+// A detector fired. source is a TAMPER_SOURCE_* of TamperIncidents.h.
+#define TAMPER_EVENT_DETECTED 1
+// The RFID reader switched the mode, value is 1 for unsecure mode
+#define TAMPER_EVENT_MODE 2
+// Wipe engine: started, value is the number of wipes so far
+#define TAMPER_EVENT_WIPE_STARTED 3
+// Wipe engine: value entries removed so far, detail failed
+#define TAMPER_EVENT_WIPE_PROGRESS 4
+// Wipe engine: finished with value entries removed, detail failed
+#define TAMPER_EVENT_WIPE_FINISHED 5
+
+struct TamperEvent
+{
+  // Set by the reader, the position of the event in its channel
+  uint32_t sequence;
+  uint8_t type;
+  uint8_t source;
+  // micros() when it happened
+  uint32_t time;
+  uint32_t value;
+  uint32_t detail;
+};
+
+class TamperEventReader;
+
+class TamperEventChannel
+{
+private:
+  friend class TamperEventReader;
+
+  // The event is kept in atomic words, so a reader copying a slot while the
+  // producer overwrites it reads stale words instead of racing
+  struct Slot
+  {
+    // Sequence of the event in the slot, 0 while it is being written
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> header;
+    std::atomic<uint32_t> time;
+    std::atomic<uint32_t> value;
+    std::atomic<uint32_t> detail;
+  };
+
+  Slot slots[TAMPER_EVENT_SLOTS];
+  // Sequence of the last event published, the first one is 1
+  std::atomic<uint32_t> last;
+  std::atomic<uint32_t> detection;
+
+public:
+  TamperEventChannel()
+  {
+    for (uint16_t i = 0; i < TAMPER_EVENT_SLOTS; i++)
+    {
+      this->slots[i].sequence.store(0, std::memory_order_relaxed);
+    }
+    this->last.store(0, std::memory_order_relaxed);
+    this->detection.store(0, std::memory_order_relaxed);
+  }
+
+  // Producer task only
+  void publish(const TamperEvent &event)
+  {
+    uint32_t sequence = this->last.load(std::memory_order_relaxed) + 1;
+    Slot &slot = this->slots[sequence & (TAMPER_EVENT_SLOTS - 1)];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.header.store(event.type | (event.source << 8), std::memory_order_relaxed);
+    slot.time.store(event.time, std::memory_order_relaxed);
+    slot.value.store(event.value, std::memory_order_relaxed);
+    slot.detail.store(event.detail, std::memory_order_relaxed);
+    slot.sequence.store(sequence, std::memory_order_release);
+    if (event.type == TAMPER_EVENT_DETECTED)
+    {
+      this->detection.store(sequence, std::memory_order_relaxed);
+    }
+    this->last.store(sequence, std::memory_order_release);
+  }
+
+  void publish(uint8_t type, uint8_t source, uint32_t time, uint32_t value = 0, uint32_t detail = 0)
+  {
+    TamperEvent event = {0, type, source, time, value, detail};
+    this->publish(event);
+  }
+
+  uint32_t published()
+  {
+    return this->last.load(std::memory_order_acquire);
+  }
+
+  // Sequence of the last TAMPER_EVENT_DETECTED, 0 if there was none
+  uint32_t lastDetection()
+  {
+    return this->detection.load(std::memory_order_acquire);
+  }
+};
+
+// Position of one consumer in a channel, used by that consumer only
+class TamperEventReader
+{
+private:
+  TamperEventChannel *channel;
+  uint32_t next;
+
+public:
+  // Events overwritten before this reader got to them
+  uint32_t lost = 0;
+
+  // Reads the events published from now on
+  TamperEventReader(TamperEventChannel &channel) : channel(&channel), next(channel.published() + 1) {}
+
+  // Next event, false when there is none yet
+  boolean read(TamperEvent &event)
+  {
+    while (true)
+    {
+      uint32_t last = this->channel->last.load(std::memory_order_acquire);
+      if ((int32_t)(last - this->next) < 0)
+      {
+        return false;
+      }
+      if (last - this->next >= TAMPER_EVENT_SLOTS)
+      {
+        // Lapped by the producer, go on with the oldest event still kept
+        this->lost += last - this->next - (TAMPER_EVENT_SLOTS - 1);
+        this->next = last - (TAMPER_EVENT_SLOTS - 1);
+      }
+      TamperEventChannel::Slot &slot = this->channel->slots[this->next & (TAMPER_EVENT_SLOTS - 1)];
+      uint32_t before = slot.sequence.load(std::memory_order_acquire);
+      uint32_t header = slot.header.load(std::memory_order_relaxed);
+      event.time = slot.time.load(std::memory_order_relaxed);
+      event.value = slot.value.load(std::memory_order_relaxed);
+      event.detail = slot.detail.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint32_t after = slot.sequence.load(std::memory_order_relaxed);
+      if (before != this->next || after != this->next)
+      {
+        // Overwritten while it was copied. Skipped rather than waited for,
+        // the producer may be a lower priority task on this core.
+        this->lost++;
+        this->next++;
+        continue;
+      }
+      event.sequence = this->next;
+      event.type = header & 0xFF;
+      event.source = header >> 8;
+      this->next++;
+      return true;
+    }
+  }
+};
+
+class TamperWipeGate
+{
+private:
+  // Bit 31 is set while a wipe runs, the other bits are the sequence of
+  // the last detection covered by a wipe
+  std::atomic<uint32_t> state;
+
+  static const uint32_t RUNNING = 0x80000000;
+  static const uint32_t COVERED = 0x7FFFFFFF;
+
+public:
+  // Wipes started since boot
+  std::atomic<uint32_t> wipes;
+
+  TamperWipeGate() : state(0), wipes(0) {}
+
+  // True for exactly one caller per detection that is not covered yet, that
+  // caller wipes and then calls release()
+  boolean claim(uint32_t sequence)
+  {
+    uint32_t current = this->state.load(std::memory_order_acquire);
+    do
+    {
+      if ((current & RUNNING) != 0 || (int32_t)((sequence & COVERED) - (current & COVERED)) <= 0)
+      {
+        return false;
+      }
+    } while (!this->state.compare_exchange_weak(current, RUNNING | (sequence & COVERED), std::memory_order_acquire));
+    this->wipes.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // The wipe is done. Detections up to covered (the last one published
+  // when it ended) were made while it ran and need no wipe of their own.
+  void release(uint32_t covered)
+  {
+    uint32_t current = this->state.load(std::memory_order_relaxed);
+    if ((int32_t)((covered & COVERED) - (current & COVERED)) < 0)
+    {
+      covered = current;
+    }
+    this->state.store(covered & COVERED, std::memory_order_release);
+  }
+
+  boolean isWiping()
+  {
+    return (this->state.load(std::memory_order_acquire) & RUNNING) != 0;
+  }
+};
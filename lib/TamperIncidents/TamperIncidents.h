@@ -0,0 +1,262 @@
+#pragma once
+
+// Timeline of each tamper response, from the sensor sample that showed the
+// intrusion to the last file removed from the card. The last
+// TAMPER_INCIDENTS incidents are kept in NVS, so they survive the reboot
+// that usually follows, and are reported on the serial console and with
+// SITE INCIDENTS.
+//
+// The wipe task (respond() in main.cpp) starts each incident, records its
+// stages and finishes it. Times are passed in by the caller, micros() of
+// the moment each stage was reached. Other tasks (the FTP task for SITE
+// INCIDENTS, the serial console) read the kept incidents with snapshot(),
+// which retries while finish() rewrites them, like a seqlock.
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <Preferences.h>
+#else
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+typedef bool boolean;
+#endif
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <Logger.h>
+
+// Incidents kept, older ones are overwritten
+#ifndef TAMPER_INCIDENTS
+#define TAMPER_INCIDENTS 8
+#endif
+
+// Stages of a response, as offsets from the sample
+#define TAMPER_STAGE_DECISION 0
+#define TAMPER_STAGE_TASK_START 1
+#define TAMPER_STAGE_KEY_DESTROYED 2
+// The FTP server let go of the card
+#define TAMPER_STAGE_FTP_QUIESCED 3
+#define TAMPER_STAGE_FIRST_DELETE 4
+#define TAMPER_STAGE_LAST_DELETE 5
+#define TAMPER_STAGES 6
+
+#define TAMPER_NOT_REACHED 0xFFFFFFFF
+
+#define TAMPER_SOURCE_LIGHT 1
+#define TAMPER_SOURCE_MOTION 2
+
+#define TAMPER_OUTCOME_WIPED 0
+// Detected in unsecure mode, nothing removed
+#define TAMPER_OUTCOME_SKIPPED 1
+// The card could not be opened
+#define TAMPER_OUTCOME_NO_CARD 2
+
+struct TamperIncident
+{
+  // Incidents since the log was first written, never reset
+  uint32_t number;
+  // millis() at the detection, worked back from the decision time by the
+  // wipe task
+  uint32_t uptime;
+  // us after the sample, TAMPER_NOT_REACHED for stages not reached
+  uint32_t stages[TAMPER_STAGES];
+  uint32_t filesRemoved;
+  uint32_t failures;
+  uint8_t source;
+  uint8_t outcome;
+};
+
+class TamperIncidentLog
+{
+private:
+  // Stored as one NVS blob
+  struct Ring
+  {
+    uint32_t total;
+    TamperIncident incidents[TAMPER_INCIDENTS];
+  } ring;
+
+  TamperIncident current;
+  uint32_t sampleTime;
+  volatile boolean open = false;
+  // Odd while the ring is rewritten
+  std::atomic<uint32_t> sequence;
+
+  void beginChange()
+  {
+    this->sequence.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void endChange()
+  {
+    this->sequence.fetch_add(1, std::memory_order_release);
+  }
+
+  // Let a writer preempted on this core finish its change
+  static void pause()
+  {
+#ifdef ARDUINO
+    delay(1);
+#else
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+  }
+
+  void store()
+  {
+#ifdef ARDUINO
+    Preferences preferences;
+    preferences.begin("tamper", false);
+    if (preferences.putBytes("incidents", &this->ring, sizeof(this->ring)) != sizeof(this->ring))
+    {
+      LOG_WARN("Tamper incidents could not be stored");
+    }
+    preferences.end();
+#endif
+  }
+
+public:
+  TamperIncidentLog() : sequence(0)
+  {
+    memset(&this->ring, 0, sizeof(this->ring));
+  }
+
+  // Load the incidents of earlier boots
+  void begin()
+  {
+#ifdef ARDUINO
+    this->beginChange();
+    Preferences preferences;
+    preferences.begin("tamper", true);
+    if (preferences.getBytes("incidents", &this->ring, sizeof(this->ring)) != sizeof(this->ring))
+    {
+      memset(&this->ring, 0, sizeof(this->ring));
+    }
+    preferences.end();
+    this->endChange();
+#endif
+  }
+
+  // A detector fired on the sample taken at sampleTime. False while the
+  // response to an earlier detection is still running, this one is then
+  // part of it.
+  boolean start(uint8_t source, uint32_t sampleTime, uint32_t decisionTime, uint32_t uptime)
+  {
+    if (this->open)
+    {
+      return false;
+    }
+    memset(&this->current, 0, sizeof(this->current));
+    for (uint8_t i = 0; i < TAMPER_STAGES; i++)
+    {
+      this->current.stages[i] = TAMPER_NOT_REACHED;
+    }
+    this->current.source = source;
+    this->current.uptime = uptime;
+    this->sampleTime = sampleTime;
+    this->open = true;
+    this->stage(TAMPER_STAGE_DECISION, decisionTime);
+    return true;
+  }
+
+  void stage(uint8_t stage, uint32_t time)
+  {
+    if (this->open && time != 0)
+    {
+      this->current.stages[stage] = time - this->sampleTime;
+    }
+  }
+
+  // Close the open incident, store it and print it
+  void finish(uint8_t outcome, uint32_t filesRemoved = 0, uint32_t failures = 0)
+  {
+    if (!this->open)
+    {
+      return;
+    }
+    this->current.outcome = outcome;
+    this->current.filesRemoved = filesRemoved;
+    this->current.failures = failures;
+    this->current.number = this->ring.total + 1;
+    this->beginChange();
+    this->ring.incidents[this->ring.total % TAMPER_INCIDENTS] = this->current;
+    this->ring.total++;
+    this->endChange();
+    this->open = false;
+    this->store();
+
+    char text[LOG_LINE_SIZE];
+    format(this->current, text, sizeof(text));
+    LOG_INFO("Incident %s", text);
+  }
+
+  // Copy of the kept incidents into incidents (room for TAMPER_INCIDENTS),
+  // oldest first. Returns how many were copied. Safe from any task.
+  uint32_t snapshot(TamperIncident *incidents)
+  {
+    Ring copy;
+    while (true)
+    {
+      uint32_t sequence = this->sequence.load(std::memory_order_acquire);
+      if ((sequence & 1) == 0)
+      {
+        const volatile uint8_t *from = (const volatile uint8_t *)&this->ring;
+        uint8_t *to = (uint8_t *)&copy;
+        for (size_t i = 0; i < sizeof(copy); i++)
+        {
+          to[i] = from[i];
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (this->sequence.load(std::memory_order_relaxed) == sequence)
+        {
+          break;
+        }
+      }
+      pause();
+    }
+    uint32_t count = copy.total < TAMPER_INCIDENTS ? copy.total : TAMPER_INCIDENTS;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      incidents[i] = copy.incidents[(copy.total - count + i) % TAMPER_INCIDENTS];
+    }
+    return count;
+  }
+
+  // One line, times in ms after the sample:
+  // "#3 motion 1234 s wiped: decision 0.2 task 1.1 key 3.4 ftp 5.0 first 1012.0 last 1530.3 ms, 12 removed, 0 failed"
+  static size_t format(const TamperIncident &incident, char *text, size_t size)
+  {
+    static const char *stageNames[TAMPER_STAGES] = {"decision", "task", "key", "ftp", "first", "last"};
+    static const char *outcomes[] = {"wiped", "skipped", "no card"};
+    int length = snprintf(text, size, "#%lu %s %lu s %s:", (unsigned long)incident.number,
+                          incident.source == TAMPER_SOURCE_LIGHT    ? "light"
+                          : incident.source == TAMPER_SOURCE_MOTION ? "motion"
+                                                                    : "unknown",
+                          (unsigned long)(incident.uptime / 1000), outcomes[incident.outcome % 3]);
+    for (uint8_t i = 0; i < TAMPER_STAGES && length >= 0 && (size_t)length < size; i++)
+    {
+      if (incident.stages[i] != TAMPER_NOT_REACHED)
+      {
+        length += snprintf(text + length, size - length, " %s %.1f", stageNames[i], incident.stages[i] / 1000.0);
+      }
+    }
+    if (length >= 0 && (size_t)length < size)
+    {
+      length += snprintf(text + length, size - length, " ms, %lu removed, %lu failed",
+                         (unsigned long)incident.filesRemoved, (unsigned long)incident.failures);
+    }
+    if (length < 0)
+    {
+      return 0;
+    }
+    return (size_t)length < size ? length : size - 1;
+  }
+};
+
+inline TamperIncidentLog &tamperIncidents()
+{
+  static TamperIncidentLog log;
+  return log;
+}
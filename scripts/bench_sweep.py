@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""Run a native benchmark test once per value of a compile-time setting.
+
+Settings such as FTP_BUF_SIZE or LOG_LEVEL are macros, so every value needs
+its own build. For each value this runs
+
+  PLATFORMIO_BUILD_FLAGS=-D<NAME>=<value> pio test -e native -f <test> -v
+
+and prints the benchmark's report lines (its TEST_MESSAGE output), one JSON
+object per line, so sweeps can be compared with jq:
+
+  {"define": "LOG_LEVEL", "value": "4", "message": "..."}
+
+  python3 scripts/bench_sweep.py test_bench_buffers FTP_BUF_SIZE 2048 4096 8192 16384
+  python3 scripts/bench_sweep.py test_bench_logging LOG_LEVEL 0 3 4
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+
+def run(args, value):
+    env = dict(os.environ)
+    flags = env.get("PLATFORMIO_BUILD_FLAGS", "")
+    env["PLATFORMIO_BUILD_FLAGS"] = ("%s -D%s=%s" % (flags, args.define, value)).strip()
+    command = [args.pio, "test", "-e", args.environment, "-f", args.test, "-v"]
+    result = subprocess.run(command, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    messages = []
+    for line in result.stdout.splitlines():
+        # Unity prints messages as file:line:test:INFO: text
+        marker = line.find(":INFO: ")
+        if marker >= 0:
+            messages.append(line[marker + 7:])
+    return result.returncode, messages, result.stdout
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("test", help="test directory name, e.g. test_bench_logging")
+    parser.add_argument("define", help="macro to set, e.g. LOG_LEVEL")
+    parser.add_argument("values", nargs="+")
+    parser.add_argument("--environment", default="native")
+    parser.add_argument("--pio", default="pio")
+    parser.add_argument("--output", help="also write the results to this file")
+    args = parser.parse_args()
+
+    out = open(args.output, "w") if args.output else None
+    failed = False
+    try:
+        for value in args.values:
+            code, messages, output = run(args, value)
+            if code != 0:
+                print("bench_sweep: %s=%s failed:\n%s" % (args.define, value, output), file=sys.stderr)
+                failed = True
+            for message in messages:
+                line = json.dumps({"define": args.define, "value": value, "message": message})
+                print(line)
+                if out:
+                    out.write(line + "\n")
+    finally:
+        if out:
+            out.close()
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
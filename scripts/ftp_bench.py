@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""Loopback benchmark client for the FTP server.
+
+Measures against a running server (the native build, or the board):
+  - RETR and STOR throughput in MB/s for a range of file sizes
+  - LIST, MLSD and NLST latency against the number of directory entries
+  - control round trip time (NOOP)
+  - login time, from connect to the 230 reply
+
+Every result is printed as one JSON object per line, so runs of two builds
+can be compared with diff or jq:
+
+  {"bench": "retr", "size": 1048576, "runs": 5, "mbps": 212.4, ...}
+
+  python3 scripts/ftp_bench.py --port 2121
+  pio run -e native -t ftpbench       (builds, starts and stops the server)
+"""
+
+import argparse
+import ftplib
+import io
+import json
+import os
+import statistics
+import sys
+import time
+
+DEFAULT_SIZES = [1024, 65536, 1048576, 8388608]
+DEFAULT_ENTRIES = [10, 100, 1000]
+
+
+def connect(args):
+    ftp = ftplib.FTP()
+    ftp.connect(args.host, args.port, timeout=30)
+    ftp.login(args.user, args.password)
+    return ftp
+
+
+def summary(name, samples, **fields):
+    """Median and spread of samples (seconds) as microseconds."""
+    micros = sorted(s * 1e6 for s in samples)
+    result = {"bench": name}
+    result.update(fields)
+    result.update({
+        "runs": len(micros),
+        "median_us": round(statistics.median(micros), 1),
+        "min_us": round(micros[0], 1),
+        "max_us": round(micros[-1], 1),
+    })
+    return result
+
+
+def emit(result, out):
+    line = json.dumps(result, sort_keys=False)
+    print(line)
+    if out:
+        out.write(line + "\n")
+        out.flush()
+
+
+def bench_login(args, out):
+    samples = []
+    for _ in range(args.runs):
+        begin = time.perf_counter()
+        ftp = connect(args)
+        samples.append(time.perf_counter() - begin)
+        ftp.quit()
+    emit(summary("login", samples), out)
+
+
+def bench_rtt(args, out):
+    ftp = connect(args)
+    samples = []
+    for _ in range(args.runs * 20):
+        begin = time.perf_counter()
+        ftp.voidcmd("NOOP")
+        samples.append(time.perf_counter() - begin)
+    ftp.quit()
+    emit(summary("noop_rtt", samples), out)
+
+
+def bench_transfers(args, out):
+    ftp = connect(args)
+    ftp.voidcmd("TYPE I")
+    for size in args.sizes:
+        content = os.urandom(size)
+        name = "bench_%d.bin" % size
+        for verb in ("stor", "retr"):
+            samples = []
+            for _ in range(args.runs):
+                begin = time.perf_counter()
+                if verb == "stor":
+                    ftp.storbinary("STOR " + name, io.BytesIO(content), blocksize=65536)
+                else:
+                    received = io.BytesIO()
+                    ftp.retrbinary("RETR " + name, received.write, blocksize=65536)
+                    if received.getvalue() != content:
+                        raise RuntimeError("RETR %s returned different content" % name)
+                samples.append(time.perf_counter() - begin)
+            result = summary(verb, samples, size=size)
+            result["mbps"] = round(size / statistics.median(samples) / 1e6, 2)
+            emit(result, out)
+        ftp.delete(name)
+    ftp.quit()
+
+
+def bench_listings(args, out):
+    ftp = connect(args)
+    for entries in args.entries:
+        directory = "bench_list_%d" % entries
+        try:
+            ftp.mkd(directory)
+        except ftplib.error_perm:
+            pass
+        ftp.cwd(directory)
+        for i in range(entries):
+            ftp.storbinary("STOR entry_%05d.txt" % i, io.BytesIO(b"x"))
+        for verb in ("LIST", "MLSD", "NLST"):
+            samples = []
+            for _ in range(args.runs):
+                lines = []
+                begin = time.perf_counter()
+                ftp.retrlines(verb, lines.append)
+                samples.append(time.perf_counter() - begin)
+                if len(lines) != entries:
+                    raise RuntimeError("%s listed %d of %d entries" % (verb, len(lines), entries))
+            emit(summary(verb.lower(), samples, entries=entries), out)
+        for i in range(entries):
+            ftp.delete("entry_%05d.txt" % i)
+        ftp.cwd("/")
+        ftp.rmd(directory)
+    ftp.quit()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=2121)
+    parser.add_argument("--user", default="esp32")
+    parser.add_argument("--password", default="esp32")
+    parser.add_argument("--runs", type=int, default=5, help="repetitions of every measurement")
+    parser.add_argument("--sizes", type=int, nargs="+", default=DEFAULT_SIZES, help="file sizes in bytes")
+    parser.add_argument("--entries", type=int, nargs="+", default=DEFAULT_ENTRIES, help="directory sizes for the listings")
+    parser.add_argument("--output", help="also write the results to this file")
+    args = parser.parse_args()
+
+    out = open(args.output, "w") if args.output else None
+    try:
+        bench_login(args, out)
+        bench_rtt(args, out)
+        bench_transfers(args, out)
+        bench_listings(args, out)
+    except (OSError, ftplib.Error, RuntimeError) as error:
+        print("ftp_bench: %s" % error, file=sys.stderr)
+        return 1
+    finally:
+        if out:
+            out.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
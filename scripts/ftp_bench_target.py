@@ -0,0 +1,69 @@
+# PlatformIO extra script of the native env: adds the "ftpbench" target,
+#
+#   pio run -e native -t ftpbench
+#
+# which builds the native server, serves an empty temporary directory with
+# it, runs scripts/ftp_bench.py against it on the loopback and stops it.
+# Results go to .pio/build/native/ftp_bench.jsonl, the server log (with its
+# own FTPM measurement records) to ftp_bench_server.log next to it. Options
+# for the client can be given in FTP_BENCH_ARGS, e.g. FTP_BENCH_ARGS="--runs 10".
+
+Import("env")
+
+import os
+import shlex
+import shutil
+import socket
+import subprocess
+import tempfile
+import time
+
+
+def command_port():
+    for define in env.get("CPPDEFINES", []):
+        if isinstance(define, (list, tuple)) and define[0] == "FTP_COMMAND_PORT":
+            return int(define[1])
+    return 2121
+
+
+def wait_for_port(port, server, timeout=10):
+    deadline = time.time() + timeout
+    while time.time() < deadline and server.poll() is None:
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def run_bench(target, source, env):
+    build_dir = env.subst("$BUILD_DIR")
+    program = env.subst("$BUILD_DIR/${PROGNAME}${PROGSUFFIX}")
+    client = os.path.join(env.subst("$PROJECT_DIR"), "scripts", "ftp_bench.py")
+    port = command_port()
+    root = tempfile.mkdtemp(prefix="ftp_bench_")
+    log = open(os.path.join(build_dir, "ftp_bench_server.log"), "w")
+    server = subprocess.Popen([program, root], stdout=log, stderr=subprocess.STDOUT)
+    try:
+        if not wait_for_port(port, server):
+            print("ftpbench: the server did not start, see %s" % log.name)
+            return 1
+        arguments = [env.subst("$PYTHONEXE"), client, "--port", str(port),
+                     "--output", os.path.join(build_dir, "ftp_bench.jsonl")]
+        arguments += shlex.split(os.environ.get("FTP_BENCH_ARGS", ""))
+        return subprocess.call(arguments)
+    finally:
+        server.terminate()
+        server.wait()
+        log.close()
+        shutil.rmtree(root, ignore_errors=True)
+
+
+env.AddCustomTarget(
+    name="ftpbench",
+    dependencies="$BUILD_DIR/${PROGNAME}${PROGSUFFIX}",
+    actions=run_bench,
+    title="FTP benchmark",
+    description="Run scripts/ftp_bench.py against the native server on the loopback",
+)
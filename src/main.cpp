@@ -8,6 +8,13 @@
 #include <WiFiClient.h>
 #include <FTPServer.h>
 #include <MPU6050.h>
+#include <SDWiper.h>
+#include <SensorScheduler.h>
+#include <SensorTraceRecorder.h>
+#include <LightDetector.h>
+#include <TamperIncidents.h>
+#include <TamperEvents.h>
+#include <Logger.h>
 
 #include "credentials.h"
 
@@ -16,37 +23,52 @@
 #define LIGHT_PIN 35
 #define LED_PIN 2
 
-bool isLEDOn = false;
-bool isFTPsuspended = false;
+// Sampling periods in ms. The MPU6050 samples into its FIFO in between and
+// is drained every MPU_PERIOD, the FIFO holds 85 samples (425 ms at 200 Hz).
+#define RFID_PERIOD 400
+#define LIGHT_PERIOD 500
+#define MPU_PERIOD 200
+
+// LED toggles while the card is wiped, in ms
+#define LED_BLINK_PERIOD 100
+
+// Owned by the sensor task, the other tasks follow TAMPER_EVENT_MODE
 bool unsecureMode = false;
-bool accessDetected = false;
 
-#define LIGHT_VALUES_COUNT 10
-int lightValues[LIGHT_VALUES_COUNT] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
-int lightIdx = 0;
+// Detections and mode switches, published by the sensor task
+TamperEventChannel sensorEvents;
+// Wipe progress, published by the wipe task
+TamperEventChannel wipeEvents;
+TamperWipeGate wipeGate;
+
+// Readers are created before any task runs, so none misses an event
+TamperEventReader wipeSensorEvents(sensorEvents);
+TamperEventReader ledSensorEvents(sensorEvents);
+TamperEventReader ledWipeEvents(wipeEvents);
+
+LightDetector lightDetector;
+
+#if SENSOR_TRACE
+SensorTraceRecorder sensorTrace;
+
+void recordMotion(uint32_t time, const int16_t *accel, const int16_t *gyro)
+{
+  sensorTrace.recordMotion(time, accel, gyro);
+}
+#endif
 
 TaskHandle_t FTPTask;
+// Runs in the FTP task, quiesced by the wipe task
+FTPServer ftpServer;
 
-TaskHandle_t RFIDTask;
-TaskHandle_t AccTask;
-TaskHandle_t LightTask;
-TaskHandle_t SDCleanerTask;
+TaskHandle_t SensorTask;
+TaskHandle_t WipeTask;
 
 void switchMode()
 {
-  if (!unsecureMode)
-  {
-    Serial.println("Unsecure mode ON");
-    unsecureMode = true;
-    digitalWrite(2, true);
-  }
-  else
-  {
-    Serial.println("Unsecure mode OFF");
-    unsecureMode = false;
-    digitalWrite(2, false);
-  }
-  isLEDOn = !isLEDOn;
+  unsecureMode = !unsecureMode;
+  LOG_INFO("Unsecure mode %s", unsecureMode ? "ON" : "OFF");
+  sensorEvents.publish(TAMPER_EVENT_MODE, 0, micros(), unsecureMode);
 }
 
 void launchWiFi()
@@ -60,255 +82,327 @@ void launchWiFi()
     Serial.print(".");
   }
   Serial.println("");
-  Serial.print("Connected to ");
-  Serial.println(ssid);
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
+  LOG_INFO("Connected to %s, IP address: %s", ssid, WiFi.localIP().toString().c_str());
 }
 
-String absolutePath(String path, String filename)
+void publishWipeProgress(const SDWipeResult &result, void *context)
 {
-  if (path = "/")
-  {
-    return path + filename;
-  }
-  else
-  {
-    return path + "/" + filename;
-  }
+  wipeEvents.publish(TAMPER_EVENT_WIPE_PROGRESS, *(uint8_t *)context, micros(),
+                     result.filesRemoved + result.directoriesRemoved, result.failures);
 }
 
-void SDCleaner(String path)
+// millis() when the detection was decided, detection.time is its micros()
+uint32_t detectionUptime(const TamperEvent &detection)
 {
-  File dir = SD.open(path);
-  File file = dir.openNextFile();
-  while (file)
-  {
-    String fileName = file.name();
-    if (file.isDirectory())
-    {
-      SDCleaner(fileName);
-      // Serial.println(path);
-      Serial.println(fileName);
-      // Serial.println(absolutePath(path, fileName));
-      SD.rmdir(fileName);
-    }
-    else
-    {
-      // Serial.println(path);
-      Serial.println(fileName);
-      // Serial.println(absolutePath(path, fileName));
-      SD.remove(fileName);
-    }
-    file = dir.openNextFile();
-  }
+  return millis() - (micros() - detection.time) / 1000;
 }
 
-void SDCleanerThread(void *params)
+// Wipes the card for a detection, unless it is covered by an earlier wipe
+void respond(const TamperEvent &detection, boolean unsecure)
 {
-  Serial.println("Access detected!");
-  if (accessDetected == true || unsecureMode == true)
+  TamperIncidentLog &incident = tamperIncidents();
+  if (unsecure)
   {
-    vTaskDelete(NULL);
+    incident.start(detection.source, detection.value, detection.time, detectionUptime(detection));
+    incident.stage(TAMPER_STAGE_TASK_START, micros());
+    incident.finish(TAMPER_OUTCOME_SKIPPED);
+    return;
   }
-  accessDetected = true;
+  if (!wipeGate.claim(detection.sequence))
+  {
+    return;
+  }
+  incident.start(detection.source, detection.value, detection.time, detectionUptime(detection));
+  incident.stage(TAMPER_STAGE_TASK_START, micros());
+  LOG_WARN("Access detected!");
+  uint8_t source = detection.source;
+  wipeEvents.publish(TAMPER_EVENT_WIPE_STARTED, source, micros(), wipeGate.wipes);
+#if FTP_ENCRYPTION
+  // The card is unreadable from here on, deleting the files can take its time
+  ftpKeyStore().destroy();
+  incident.stage(TAMPER_STAGE_KEY_DESTROYED, micros());
+#endif
+  // Transfers are aborted and the FTP task lets go of the card. Past the
+  // timeout the wipe goes ahead anyway, removes may then fail on open files.
+  if (ftpServer.quiesce())
+  {
+    incident.stage(TAMPER_STAGE_FTP_QUIESCED, micros());
+  }
+  else
+  {
+    LOG_WARN("Wiping with the FTP server still busy");
+  }
+  SDWipeResult result = {0, 0, 0, 0, 0, 0};
   if (SD.begin())
   {
-    for (int i = 0; i < 5; i++)
-    {
-      digitalWrite(2, true);
-      vTaskDelay(100);
-      digitalWrite(2, false);
-      vTaskDelay(100);
-    }
-    Serial.println("SD cleaner start!");
-    SDCleaner("/");
-    Serial.println("SD cleaner finished!");
+    LOG_INFO("SD cleaner start!");
+    FTPStorage storage;
+    SDWiper wiper(storage);
+    wiper.onProgress(publishWipeProgress, &source);
+    result = wiper.wipe("/");
+    LOG_INFO("SD cleaner finished: %lu files and %lu directories removed, %lu failed, in %lu ms",
+             result.filesRemoved, result.directoriesRemoved, result.failures, result.elapsedMillis);
+    incident.stage(TAMPER_STAGE_FIRST_DELETE, result.firstRemoveMicros);
+    incident.stage(TAMPER_STAGE_LAST_DELETE, result.lastRemoveMicros);
+    incident.finish(TAMPER_OUTCOME_WIPED, result.filesRemoved + result.directoriesRemoved, result.failures);
   }
-  accessDetected = false;
-  vTaskDelete(NULL);
+  else
+  {
+    incident.finish(TAMPER_OUTCOME_NO_CARD);
+  }
+#if FTP_ENCRYPTION
+  // New uploads are encrypted with a fresh key
+  ftpKeyStore().renew();
+#endif
+  ftpServer.resume();
+  wipeEvents.publish(TAMPER_EVENT_WIPE_FINISHED, source, micros(),
+                     result.filesRemoved + result.directoriesRemoved, result.failures);
+  // Detections made while the card was wiped need no wipe of their own
+  wipeGate.release(sensorEvents.published());
 }
 
-void LightThread(void *params)
+// Wipe engine, woken by the sensor task after each detection
+void WipeThread(void *params)
 {
-
-  TickType_t xLastWakeTime;
-  int mean = -1;
-  int anomalyHistory = 0;
-  while (1)
+  boolean unsecure = false;
+  uint32_t lost = 0;
+  TamperEvent event;
+  while (true)
   {
-    xLastWakeTime = xTaskGetTickCount();
-    int light = analogRead(LIGHT_PIN);
-    Serial.println("Light: " + String(light));
-    if (lightValues[LIGHT_VALUES_COUNT - 1] != -1)
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while (wipeSensorEvents.read(event))
     {
-      int sum = 0;
-      for (int i = 0; i < LIGHT_VALUES_COUNT; i++)
-      {
-        sum += lightValues[i];
-      }
-      mean = sum / (LIGHT_VALUES_COUNT);
-      Serial.println("Light - AVG: " + String(mean));
-      if (abs(light - mean) > 20 && abs(light - mean) > mean * 0.1)
+      if (event.type == TAMPER_EVENT_MODE)
       {
-        anomalyHistory |= 1;
+        unsecure = event.value;
       }
-      if ((anomalyHistory & 0b111) == 0b111)
+      else if (event.type == TAMPER_EVENT_DETECTED)
       {
-        Serial.println("Light anomaly detected!");
-        vTaskSuspend(FTPTask);
-        xTaskCreatePinnedToCore(
-            SDCleanerThread,
-            "SDCleaner",
-            10000,
-            NULL,
-            1,
-            &SDCleanerTask,
-            1);
-        vTaskResume(FTPTask);
-        anomalyHistory = 0;
-        for (int i = 0; i < LIGHT_VALUES_COUNT; i++)
-        {
-          lightValues[i] = -1;
-        }
-        lightIdx = 0;
+        respond(event, unsecure);
       }
-      else
+    }
+    if (wipeSensorEvents.lost != lost)
+    {
+      // Overrun: a detection may be among the lost events, the gate knows
+      // whether the last one is covered
+      LOG_WARN("Wipe engine lost %lu events", (unsigned long)(wipeSensorEvents.lost - lost));
+      lost = wipeSensorEvents.lost;
+      event.sequence = sensorEvents.lastDetection();
+      event.source = 0;
+      event.time = event.value = micros();
+      if (event.sequence != 0)
       {
-        lightValues[lightIdx] = light;
-        lightIdx = (lightIdx + 1) % LIGHT_VALUES_COUNT;
+        respond(event, unsecure);
       }
     }
-    else
-    { //Calibrating sensor
-      lightValues[lightIdx] = light;
-      lightIdx = (lightIdx + 1) % LIGHT_VALUES_COUNT;
-    }
-
-    anomalyHistory <<= 1;
-    vTaskDelayUntil(&xLastWakeTime, 500);
   }
-  vTaskDelete(NULL);
 }
 
-void RFIDThread(void *params)
+// A detector fired on the sample taken at sampleTime
+void detected(uint8_t source, uint32_t sampleTime)
 {
-  RFIDReader rf = RFIDReader(RFID_SS_PIN, RFID_RST_PIN);
+  uint32_t now = micros();
+#if SENSOR_TRACE
+  sensorTrace.recordDetection(now, source == TAMPER_SOURCE_LIGHT ? SENSOR_TRACE_DETECTOR_LIGHT : SENSOR_TRACE_DETECTOR_MOTION);
+#endif
+  sensorEvents.publish(TAMPER_EVENT_DETECTED, source, now, sampleTime);
+  xTaskNotifyGive(WipeTask);
+}
 
-  digitalWrite(2, false);
-  TickType_t xLastWakeTime;
-  while (1)
+boolean sampleLight(void *params)
+{
+  int light = analogRead(LIGHT_PIN);
+  uint32_t sampleTime = micros();
+#if SENSOR_TRACE
+  sensorTrace.recordLight(sampleTime, light);
+#endif
+  if (lightDetector.add(light))
   {
-    xLastWakeTime = xTaskGetTickCount();
-    if (rf.verifyLoop())
-    {
+    detected(TAMPER_SOURCE_LIGHT, sampleTime);
+    return true;
+  }
+  return false;
+}
 
-      switchMode();
-    }
-    vTaskDelayUntil(&xLastWakeTime, 400);
+boolean sampleRFID(void *params)
+{
+  RFIDReader *rf = (RFIDReader *)params;
+  if (rf->verifyLoop())
+  {
+    switchMode();
+    return true;
   }
-  vTaskDelete(NULL);
+  return false;
+}
+
+boolean sampleAcc(void *params)
+{
+  MPU6050 *mpu = (MPU6050 *)params;
+  if (mpu->checkForAnomalies())
+  {
+    detected(TAMPER_SOURCE_MOTION, mpu->getSampleTime());
+    LOG_WARN("MPU - Intrusion detected");
+    mpu->calibrate();
+    return true;
+  }
+  return false;
 }
 
-void AccThread(void *params)
+// All sensors are sampled by this one task, see SensorScheduler
+void SensorThread(void *params)
 {
-  TickType_t xLastWakeTime;
+  RFIDReader rf = RFIDReader(RFID_SS_PIN, RFID_RST_PIN);
   vTaskDelay(100);
-  MPU6050 mpu;
-  mpu.init();
+  // Its sample windows are too large for the task stack
+  static MPU6050 mpu;
 
-  while (1)
+  SensorScheduler scheduler;
+  scheduler.add("RFID", RFID_PERIOD, sampleRFID, &rf);
+  scheduler.add("Light", LIGHT_PERIOD, sampleLight, NULL);
+#if SENSOR_TRACE
+  sensorTrace.begin(MPU_ACCEL_LSB_PER_G, MPU_GYRO_LSB_PER_DPS * 10);
+  mpu.setSampleHook(recordMotion);
+#endif
+  if (mpu.init())
   {
-    xLastWakeTime = xTaskGetTickCount();
-    if (mpu.checkForAnomalies())
-    {
-      Serial.print("MPU - Intrusion detected");
-      vTaskSuspend(FTPTask);
-      xTaskCreatePinnedToCore(
-          SDCleanerThread,
-          "SDCleaner",
-          10000,
-          NULL,
-          1,
-          &SDCleanerTask,
-          1);
-      vTaskResume(FTPTask);
-      mpu.calibrate();
-    }
-    vTaskDelayUntil(&xLastWakeTime, 500);
+    scheduler.add("MPU", MPU_PERIOD, sampleAcc, &mpu);
   }
-  vTaskDelete(NULL);
+  scheduler.run();
 }
 
 void FTPThread(void *params)
 {
-  FTPServer ftpServer = FTPServer();
   if (SD.begin())
   {
-    Serial.println("SD opened!");
+    LOG_INFO("SD opened!");
     ftpServer.begin("esp32", "esp32", 50009);
 
     while (1)
     {
-      vTaskDelay(1);
       ftpServer.mainFTPLoop();
+      ftpServer.wait();
     }
   }
   else
   {
-    Serial.println("SD Card error!");
+    LOG_ERROR("SD Card error!");
   }
   vTaskDelete(NULL);
 }
 
+// LED: on in unsecure mode, blinking while the card is wiped
+void ledLoop()
+{
+  static boolean unsecure = false;
+  static boolean wiping = false;
+  static boolean lit = false;
+  TamperEvent event;
+  while (ledSensorEvents.read(event))
+  {
+    if (event.type == TAMPER_EVENT_MODE)
+      unsecure = event.value;
+  }
+  while (ledWipeEvents.read(event))
+  {
+    if (event.type == TAMPER_EVENT_WIPE_STARTED)
+      wiping = true;
+    else if (event.type == TAMPER_EVENT_WIPE_FINISHED)
+      wiping = false;
+  }
+  boolean on = wiping ? (millis() / LED_BLINK_PERIOD) % 2 == 0 : unsecure;
+  if (on != lit)
+  {
+    digitalWrite(LED_PIN, on);
+    lit = on;
+  }
+}
+
+// Tamper incidents of this and earlier boots, oldest first
+void printIncidents()
+{
+  TamperIncident incidents[TAMPER_INCIDENTS];
+  uint32_t count = tamperIncidents().snapshot(incidents);
+  char line[LOG_LINE_SIZE];
+  LOG_INFO("Tamper incidents: %lu kept", (unsigned long)count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    TamperIncidentLog::format(incidents[i], line, sizeof(line));
+    LOG_INFO("%s", line);
+  }
+}
+
+// Commands typed on the serial console, one per line
+void serialConsole()
+{
+  static String line;
+  while (Serial.available() > 0)
+  {
+    char c = Serial.read();
+    if (c != '\r' && c != '\n')
+    {
+      if (line.length() < 32)
+        line += c;
+      continue;
+    }
+    line.trim();
+    if (line.equalsIgnoreCase("incidents"))
+    {
+      printIncidents();
+    }
+    else if (line.length() > 0)
+    {
+      LOG_WARN("Unknown command %s, commands: incidents", line.c_str());
+    }
+    line = "";
+  }
+}
+
 void setup()
 {
 
   Serial.begin(115200);
+  logger().begin();
+  tamperIncidents().begin();
+  printIncidents();
   launchWiFi();
   while (!Serial)
   {
   }
   SPI.begin(); // Init SPI bus
 
-  pinMode(2, OUTPUT);
+  pinMode(LED_PIN, OUTPUT);
+
+  xTaskCreatePinnedToCore(
+      WipeThread,
+      "Wipe",
+      10000,
+      NULL,
+      1,
+      &WipeTask,
+      1);
 
   xTaskCreatePinnedToCore(
       FTPThread, /* Task function. */
       "FTP",     /* name of task. */
-      100000,    /* Stack size of task */
+      16384,     /* Stack size of task, transfer buffers are on the heap */
       NULL,      /* parameter of the task */
-      1,         /* priority of the task */
+      FTP_TASK_PRIORITY, /* priority of the task */
       &FTPTask,  /* Task handle to keep track of created task */
       1);        /* pin task to core */
 
   xTaskCreatePinnedToCore(
-      RFIDThread,
-      "RFID",
-      10000,
-      NULL,
-      1,
-      &RFIDTask,
-      0);
-  xTaskCreatePinnedToCore(
-      LightThread,
-      "Light",
-      10000,
-      NULL,
-      1,
-      &LightTask,
-      0);
-  xTaskCreatePinnedToCore(
-      AccThread,
-      "Acc",
-      10000,
+      SensorThread,
+      "Sensors",
+      6144,
       NULL,
       1,
-      &AccTask,
+      &SensorTask,
       0);
 }
 
 void loop()
 {
+  serialConsole();
+  ledLoop();
   vTaskDelay(1);
 }
@@ -0,0 +1,23 @@
+// FTP server as a Linux process, for testing and profiling the server
+// without a board. Serves the directory given as first argument (default:
+// the current directory) on FTP_COMMAND_PORT, data ports from 50009.
+//
+//   pio run -e native && .pio/build/native/program /tmp/sdroot
+
+#include <FTPServer.h>
+
+int main(int argc, char **argv)
+{
+  const char *root = argc > 1 ? argv[1] : ".";
+  logger().begin();
+  FTPStorage storage(root);
+  static FTPServer ftpServer(storage);
+  ftpServer.begin("esp32", "esp32", 50009);
+  LOG_INFO("Serving %s on port %d", root, FTP_COMMAND_PORT);
+
+  while (1)
+  {
+    ftpServer.mainFTPLoop();
+    ftpServer.wait();
+  }
+}
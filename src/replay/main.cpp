@@ -0,0 +1,179 @@
+// Replays a sensor trace recorded on the device (SENSOR_TRACE=1) through the
+// light and motion detectors, to measure threshold changes without the box.
+// Times of known tampering, in ms from the start of the trace, mark the
+// expected detections: a detection up to the window after one counts as
+// found, any other is a false positive.
+//
+//   pio run -e replay && .pio/build/replay/program sensors.trc 61500 184000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <LightDetector.h>
+#include <MotionDetector.h>
+#include <SensorTrace.h>
+
+// Default time a detection may take after the tampering, in ms
+#define REPLAY_WINDOW 5000
+
+struct ReplayDetector
+{
+  const char *name;
+  unsigned long samples;
+  // Detections in the trace, as decided on the device
+  unsigned long recorded;
+  // Detections of the replay, and those not explained by tampering
+  unsigned long detections;
+  unsigned long falsePositives;
+  // Tamperings found, and the sum and largest of their latency in ms
+  unsigned long found;
+  double latencySum;
+  double maxLatency;
+};
+
+static bool readFile(const char *path, std::vector<uint8_t> &data)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    data.insert(data.end(), buffer, buffer + length);
+  }
+  fclose(file);
+  return true;
+}
+
+// Match a detection at time ms against the tamperings this detector has
+// not found yet
+static void detected(ReplayDetector &detector, std::vector<bool> &found, const std::vector<double> &tampers,
+                     double window, double time)
+{
+  detector.detections++;
+  for (size_t i = 0; i < tampers.size(); i++)
+  {
+    if (!found[i] && time >= tampers[i] && time <= tampers[i] + window)
+    {
+      found[i] = true;
+      double latency = time - tampers[i];
+      detector.found++;
+      detector.latencySum += latency;
+      if (latency > detector.maxLatency)
+      {
+        detector.maxLatency = latency;
+      }
+      return;
+    }
+  }
+  detector.falsePositives++;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = NULL;
+  std::vector<double> tampers;
+  double window = REPLAY_WINDOW;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+    {
+      window = atof(argv[++i]);
+    }
+    else if (path == NULL)
+    {
+      path = argv[i];
+    }
+    else
+    {
+      tampers.push_back(atof(argv[i]));
+    }
+  }
+  if (path == NULL)
+  {
+    fprintf(stderr, "Usage: %s <trace> [tamper_ms ...] [--window ms]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<uint8_t> data;
+  if (!readFile(path, data))
+  {
+    fprintf(stderr, "Cannot read %s\n", path);
+    return 1;
+  }
+  SensorTraceDecoder decoder(data.data(), data.size());
+  if (!decoder.begin())
+  {
+    fprintf(stderr, "%s is not a sensor trace\n", path);
+    return 1;
+  }
+  if (decoder.accelLsbPerG != (uint16_t)MPU_ACCEL_LSB_PER_G ||
+      decoder.gyroLsbPer10Dps != (uint16_t)(MPU_GYRO_LSB_PER_DPS * 10))
+  {
+    fprintf(stderr, "Warning: trace recorded at %u LSB/g, %u LSB/10 deg/s, the detector expects %u, %u\n",
+            decoder.accelLsbPerG, decoder.gyroLsbPer10Dps,
+            (unsigned)MPU_ACCEL_LSB_PER_G, (unsigned)(MPU_GYRO_LSB_PER_DPS * 10));
+  }
+
+  LightDetector light;
+  MotionDetector motion;
+  ReplayDetector results[2] = {{"light"}, {"motion"}};
+  std::vector<bool> lightFound(tampers.size()), motionFound(tampers.size());
+  uint64_t duration = 0;
+
+  // Decoding included, timing each sample would cost more than the detectors
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  SensorTraceRecord record;
+  while (decoder.next(record))
+  {
+    double time = record.time / 1000.0;
+    duration = record.time;
+    bool fired;
+    switch (record.kind)
+    {
+    case SENSOR_TRACE_LIGHT:
+      fired = light.add(record.light);
+      results[0].samples++;
+      if (fired)
+        detected(results[0], lightFound, tampers, window, time);
+      break;
+    case SENSOR_TRACE_MOTION:
+      fired = motion.add(MotionSample::fromRaw(record.accel, record.gyro));
+      results[1].samples++;
+      if (fired)
+        detected(results[1], motionFound, tampers, window, time);
+      break;
+    case SENSOR_TRACE_DETECTION:
+      if (record.detector == SENSOR_TRACE_DETECTOR_LIGHT)
+        results[0].recorded++;
+      else if (record.detector == SENSOR_TRACE_DETECTOR_MOTION)
+        results[1].recorded++;
+      break;
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  double hours = duration / 3.6e9;
+  unsigned long samples = results[0].samples + results[1].samples;
+  printf("%s: %.1f s, %lu samples, %zu tamperings, window %.0f ms\n", path, duration / 1e6, samples,
+         tampers.size(), window);
+  printf("%-8s %9s %9s %9s %7s %9s %9s %10s\n", "detector", "samples", "device", "replay", "found",
+         "avg ms", "max ms", "false/h");
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    ReplayDetector &result = results[i];
+    printf("%-8s %9lu %9lu %9lu %3lu/%-3zu %9.0f %9.0f %10.2f\n", result.name, result.samples, result.recorded,
+           result.detections, result.found, tampers.size(),
+           result.found > 0 ? result.latencySum / result.found : 0.0, result.maxLatency,
+           hours > 0 ? result.falsePositives / hours : 0.0);
+  }
+  printf("Replayed at %.0f samples/s (%.1f ns per sample)\n", seconds > 0 ? samples / seconds : 0.0,
+         samples > 0 ? seconds * 1e9 / samples : 0.0);
+  return 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+// Counts heap allocations of the test binary by replacing the global
+// operator new. Include in one translation unit only, the test's main.
+
+#include <new>
+#include <atomic>
+#include <stdlib.h>
+
+inline std::atomic<unsigned long> &ftpAllocationCount()
+{
+  static std::atomic<unsigned long> count(0);
+  return count;
+}
+
+// Allocations since the start of the program
+inline unsigned long ftpAllocations()
+{
+  return ftpAllocationCount().load();
+}
+
+void *operator new(size_t size)
+{
+  ftpAllocationCount()++;
+  void *memory = malloc(size > 0 ? size : 1);
+  if (memory == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  ftpAllocationCount()++;
+  return malloc(size > 0 ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return operator new(size, std::nothrow);
+}
+
+// Every delete form frees what the forms above took from malloc. Not
+// inlined, GCC would otherwise see free() on the result of operator new.
+__attribute__((noinline)) inline void ftpFree(void *memory)
+{
+  free(memory);
+}
+
+void operator delete(void *memory) noexcept
+{
+  ftpFree(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+  ftpFree(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+  ftpFree(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept
+{
+  ftpFree(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t &) noexcept
+{
+  ftpFree(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t &) noexcept
+{
+  ftpFree(memory);
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+// In-process network for the FTP server: listeners are found by port in a
+// registry, connections are socket pairs. No TCP port is bound, so tests
+// can run many servers and sessions side by side. Include before the
+// server headers.
+
+#define FTP_HOST_NETWORK 1
+
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <sys/socket.h>
+#include "posix/FTPPosixRuntime.h"
+#include "posix/FTPPosixNetwork.h"
+
+// A socket pair end. Copies share it like FTPPosixConnection.
+class FTPFakeConnection : public FTPPosixConnection
+{
+public:
+  FTPFakeConnection() {}
+
+  explicit FTPFakeConnection(int fd) : FTPPosixConnection(fd) {}
+
+  // Server side sends take as long as on a link of this many bytes per
+  // second, 0 for no limit. lwIP sends on the board block the FTP task
+  // like this, a host socket buffer would hide the cost.
+  static double &sendRate()
+  {
+    static double rate = 0;
+    return rate;
+  }
+
+  // Server side writes, a TCP segment each on the board
+  static std::atomic<unsigned long> &writes()
+  {
+    static std::atomic<unsigned long> count(0);
+    return count;
+  }
+
+  size_t write(const uint8_t *data, size_t length)
+  {
+    writes()++;
+    uint64_t begin = micros();
+    size_t sent = FTPPosixConnection::write(data, length);
+    double rate = sendRate();
+    if (rate > 0)
+    {
+      uint64_t due = begin + (uint64_t)(sent / rate * 1e6);
+      uint64_t now = micros();
+      if (due > now)
+        std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+    }
+    return sent;
+  }
+
+  size_t println(const char *text)
+  {
+    size_t length = this->write((const uint8_t *)text, strlen(text));
+    return length + this->write((const uint8_t *)"\r\n", 2);
+  }
+
+  // Socket pairs have no address, PASV names the loopback
+  boolean localAddress(uint8_t address[4])
+  {
+    static const uint8_t loopback[4] = {127, 0, 0, 1};
+    memcpy(address, loopback, 4);
+    return this->fd() >= 0;
+  }
+};
+
+class FTPFakeListener
+{
+private:
+  // Shared with the registry and the connecting clients, outlives copies
+  struct Queue
+  {
+    std::mutex lock;
+    std::deque<int> pending;
+    // Readable while connections are pending, for the server's wait
+    int signal[2];
+
+    Queue()
+    {
+      if (pipe(this->signal) == 0)
+      {
+        fcntl(this->signal[0], F_SETFL, O_NONBLOCK);
+      }
+    }
+
+    ~Queue()
+    {
+      ::close(this->signal[0]);
+      ::close(this->signal[1]);
+      for (size_t i = 0; i < this->pending.size(); i++)
+      {
+        ::close(this->pending[i]);
+      }
+    }
+  };
+
+  uint16_t port;
+  std::shared_ptr<Queue> queue;
+
+  // Listeners by port
+  static std::map<uint16_t, std::weak_ptr<Queue>> &queues()
+  {
+    static std::map<uint16_t, std::weak_ptr<Queue>> byPort;
+    return byPort;
+  }
+
+  static std::mutex &queuesLock()
+  {
+    static std::mutex lock;
+    return lock;
+  }
+
+public:
+  FTPFakeListener(uint16_t port = 0) : port(port) {}
+
+  void begin()
+  {
+    std::lock_guard<std::mutex> guard(queuesLock());
+    std::shared_ptr<Queue> existing = queues()[this->port].lock();
+    this->queue = existing ? existing : std::make_shared<Queue>();
+    queues()[this->port] = this->queue;
+  }
+
+  int fd()
+  {
+    return this->queue ? this->queue->signal[0] : -1;
+  }
+
+  boolean hasClient()
+  {
+    if (!this->queue)
+    {
+      return false;
+    }
+    std::lock_guard<std::mutex> guard(this->queue->lock);
+    return !this->queue->pending.empty();
+  }
+
+  FTPFakeConnection available()
+  {
+    if (!this->queue)
+    {
+      return FTPFakeConnection();
+    }
+    std::lock_guard<std::mutex> guard(this->queue->lock);
+    if (this->queue->pending.empty())
+    {
+      return FTPFakeConnection();
+    }
+    int fd = this->queue->pending.front();
+    this->queue->pending.pop_front();
+    char c;
+    if (::read(this->queue->signal[0], &c, 1) != 1)
+    {
+      LOG_WARN("Fake listener on port %u lost its signal", this->port);
+    }
+    return FTPFakeConnection(fd);
+  }
+
+  // Socket buffer size of new connections, 0 for the system default. A
+  // few KB behave like the small TCP window of lwIP.
+  static int &bufferSize()
+  {
+    static int size = 0;
+    return size;
+  }
+
+  // Client side: connect to the listener on port, -1 if there is none
+  static int connect(uint16_t port)
+  {
+    std::shared_ptr<Queue> queue;
+    {
+      std::lock_guard<std::mutex> guard(queuesLock());
+      std::map<uint16_t, std::weak_ptr<Queue>>::iterator found = queues().find(port);
+      if (found != queues().end())
+      {
+        queue = found->second.lock();
+      }
+    }
+    int ends[2];
+    if (!queue || socketpair(AF_UNIX, SOCK_STREAM, 0, ends) != 0)
+    {
+      return -1;
+    }
+    int size = bufferSize();
+    for (int i = 0; i < 2 && size > 0; i++)
+    {
+      setsockopt(ends[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+      setsockopt(ends[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    std::lock_guard<std::mutex> guard(queue->lock);
+    queue->pending.push_back(ends[0]);
+    if (::write(queue->signal[1], "c", 1) != 1)
+    {
+      LOG_WARN("Fake listener on port %u not signalled", port);
+    }
+    return ends[1];
+  }
+};
+
+typedef FTPFakeListener FTPListener;
+typedef FTPFakeConnection FTPConnection;
+
+// FTPTestConnector for FTPTestClient
+inline int ftpFakeConnect(uint16_t port)
+{
+  return FTPFakeListener::connect(port);
+}
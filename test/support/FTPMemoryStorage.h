@@ -0,0 +1,384 @@
+#pragma once
+
+// Files kept in memory, with the FTPPosixStorage API. An optional delay per
+// read and write makes it as slow as an SD card, so the network side of the
+// server can be measured on its own or against a known storage speed.
+// Include before the server headers.
+
+#define FTP_HOST_STORAGE 1
+
+#include <map>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <chrono>
+#include "posix/FTPPosixRuntime.h"
+#include "FTPPath.h"
+
+struct FTPMemoryNode
+{
+  bool directory;
+  std::string content;
+  time_t modified;
+};
+
+// One file system, shared by the storage copies and the open files
+struct FTPMemoryVolume
+{
+  std::mutex lock;
+  std::map<std::string, std::shared_ptr<FTPMemoryNode>> nodes;
+  // Added to every read and write: fixed part and per KB
+  unsigned long accessMicros = 0;
+  unsigned long microsPerKB = 0;
+  // Per directory entry handed out by openNextFile, the SD library opens
+  // a File for each
+  unsigned long openMicros = 0;
+  // Per remove and rmdir
+  unsigned long removeMicros = 0;
+  // Every spikeEvery-th write takes spikeMicros longer, as a card that
+  // erases a block now and then
+  unsigned long spikeEvery = 0;
+  unsigned long spikeMicros = 0;
+  unsigned long writes = 0;
+  // Writes fail, as on a full or broken card
+  bool failWrites = false;
+  // Files and directories open, copies of a file count once
+  std::atomic<int> openFiles;
+
+  FTPMemoryVolume() : openFiles(0)
+  {
+    std::shared_ptr<FTPMemoryNode> root = std::make_shared<FTPMemoryNode>();
+    root->directory = true;
+    root->modified = time(NULL);
+    this->nodes["/"] = root;
+  }
+
+  void delay(size_t length)
+  {
+    unsigned long micros = this->accessMicros + this->microsPerKB * length / 1024;
+    if (micros > 0)
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(micros));
+    }
+  }
+
+  void delayRemove()
+  {
+    if (this->removeMicros > 0)
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(this->removeMicros));
+    }
+  }
+
+  static std::string parent(const std::string &path)
+  {
+    size_t sep = path.rfind('/');
+    return sep == 0 ? "/" : path.substr(0, sep);
+  }
+
+  // Directory entries of path, under lock
+  std::vector<std::string> children(const std::string &path)
+  {
+    std::vector<std::string> names;
+    std::string prefix = path == "/" ? "/" : path + "/";
+    for (std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator it = this->nodes.lower_bound(prefix); it != this->nodes.end(); ++it)
+    {
+      if (it->first.compare(0, prefix.size(), prefix) != 0)
+        break;
+      if (it->first.size() > prefix.size() && it->first.find('/', prefix.size()) == std::string::npos)
+        names.push_back(it->first);
+    }
+    return names;
+  }
+};
+
+class FTPMemoryFile
+{
+private:
+  struct Handle
+  {
+    std::shared_ptr<FTPMemoryVolume> volume;
+    std::shared_ptr<FTPMemoryNode> node;
+    std::string path;
+    size_t position = 0;
+    bool writable = false;
+    bool append = false;
+    std::vector<std::string> entries;
+    size_t nextEntry = 0;
+
+    ~Handle()
+    {
+      this->volume->openFiles--;
+    }
+  };
+
+  std::shared_ptr<Handle> handle;
+
+public:
+  static FTPMemoryFile open(const std::shared_ptr<FTPMemoryVolume> &volume, const std::string &path, const char *mode)
+  {
+    FTPMemoryFile opened;
+    std::lock_guard<std::mutex> guard(volume->lock);
+    std::shared_ptr<FTPMemoryNode> node;
+    std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator found = volume->nodes.find(path);
+    if (found != volume->nodes.end())
+    {
+      node = found->second;
+      if (node->directory && mode[0] != 'r')
+        return opened;
+      if (mode[0] == 'w')
+      {
+        node->content.clear();
+        node->modified = time(NULL);
+      }
+    }
+    else if (mode[0] == 'w' || mode[0] == 'a')
+    {
+      std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator parent = volume->nodes.find(FTPMemoryVolume::parent(path));
+      if (parent == volume->nodes.end() || !parent->second->directory)
+        return opened;
+      node = std::make_shared<FTPMemoryNode>();
+      node->directory = false;
+      node->modified = time(NULL);
+      volume->nodes[path] = node;
+    }
+    else
+    {
+      return opened;
+    }
+    std::shared_ptr<Handle> handle = std::make_shared<Handle>();
+    handle->volume = volume;
+    volume->openFiles++;
+    handle->node = node;
+    handle->path = path;
+    handle->writable = mode[0] != 'r' || mode[1] == '+';
+    handle->append = mode[0] == 'a';
+    if (node->directory)
+      handle->entries = volume->children(path);
+    opened.handle = handle;
+    return opened;
+  }
+
+  operator bool() const
+  {
+    return (bool)this->handle;
+  }
+
+  const char *name() const
+  {
+    if (!this->handle)
+      return "";
+    return this->handle->path.c_str() + this->handle->path.rfind('/') + 1;
+  }
+
+  const char *path() const
+  {
+    return this->handle ? this->handle->path.c_str() : "";
+  }
+
+  boolean isDirectory() const
+  {
+    return this->handle && this->handle->node->directory;
+  }
+
+  size_t size()
+  {
+    if (!this->handle || this->handle->node->directory)
+      return 0;
+    std::lock_guard<std::mutex> guard(this->handle->volume->lock);
+    return this->handle->node->content.size();
+  }
+
+  time_t getLastWrite()
+  {
+    return this->handle ? this->handle->node->modified : 0;
+  }
+
+  int read(uint8_t *data, size_t length)
+  {
+    if (!this->handle || this->handle->node->directory)
+      return -1;
+    size_t count;
+    {
+      std::lock_guard<std::mutex> guard(this->handle->volume->lock);
+      const std::string &content = this->handle->node->content;
+      count = this->handle->position < content.size() ? std::min(length, content.size() - this->handle->position) : 0;
+      memcpy(data, content.data() + this->handle->position, count);
+      this->handle->position += count;
+    }
+    this->handle->volume->delay(count);
+    return count;
+  }
+
+  size_t readBytes(char *data, size_t length)
+  {
+    int count = this->read((uint8_t *)data, length);
+    return count > 0 ? count : 0;
+  }
+
+  size_t write(const uint8_t *data, size_t length)
+  {
+    if (!this->handle || !this->handle->writable || this->handle->volume->failWrites)
+      return 0;
+    bool spike;
+    {
+      std::lock_guard<std::mutex> guard(this->handle->volume->lock);
+      std::string &content = this->handle->node->content;
+      if (this->handle->append)
+        this->handle->position = content.size();
+      if (content.size() < this->handle->position + length)
+        content.resize(this->handle->position + length);
+      memcpy(&content[this->handle->position], data, length);
+      this->handle->position += length;
+      this->handle->node->modified = time(NULL);
+      FTPMemoryVolume &volume = *this->handle->volume;
+      spike = volume.spikeEvery > 0 && ++volume.writes % volume.spikeEvery == 0;
+    }
+    this->handle->volume->delay(length);
+    if (spike)
+      std::this_thread::sleep_for(std::chrono::microseconds(this->handle->volume->spikeMicros));
+    return length;
+  }
+
+  boolean seek(uint32_t position)
+  {
+    if (!this->handle || this->handle->node->directory)
+      return false;
+    this->handle->position = position;
+    return true;
+  }
+
+  size_t position()
+  {
+    return this->handle ? this->handle->position : 0;
+  }
+
+  void flush() {}
+
+  void close()
+  {
+    this->handle.reset();
+  }
+
+  FTPMemoryFile openNextFile()
+  {
+    while (this->handle && this->handle->nextEntry < this->handle->entries.size())
+    {
+      FTPMemoryFile next = open(this->handle->volume, this->handle->entries[this->handle->nextEntry++], "r");
+      if (this->handle->volume->openMicros > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(this->handle->volume->openMicros));
+      if (next)
+        return next;
+    }
+    return FTPMemoryFile();
+  }
+};
+
+class FTPMemoryStorage
+{
+private:
+  std::shared_ptr<FTPMemoryVolume> volume;
+
+  template <typename Operation>
+  boolean locked(const String &path, Operation apply)
+  {
+    std::lock_guard<std::mutex> guard(this->volume->lock);
+    return apply(std::string(ftpNormalizePath(path).c_str()));
+  }
+
+public:
+  // Copies share the files
+  FTPMemoryStorage() : volume(std::make_shared<FTPMemoryVolume>()) {}
+
+  FTPMemoryVolume &getVolume()
+  {
+    return *this->volume;
+  }
+
+  FTPMemoryFile open(const String &path, const char *mode = "r")
+  {
+    return FTPMemoryFile::open(this->volume, ftpNormalizePath(path).c_str(), mode);
+  }
+
+  boolean exists(const String &path)
+  {
+    return this->locked(path, [this](const std::string &p)
+                        { return this->volume->nodes.count(p) > 0; });
+  }
+
+  boolean mkdir(const String &path)
+  {
+    return this->locked(path, [this](const std::string &p)
+                        {
+                          std::map<std::string, std::shared_ptr<FTPMemoryNode>> &nodes = this->volume->nodes;
+                          std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator parent = nodes.find(FTPMemoryVolume::parent(p));
+                          if (nodes.count(p) > 0 || parent == nodes.end() || !parent->second->directory)
+                            return false;
+                          std::shared_ptr<FTPMemoryNode> node = std::make_shared<FTPMemoryNode>();
+                          node->directory = true;
+                          node->modified = time(NULL);
+                          nodes[p] = node;
+                          return true;
+                        });
+  }
+
+  boolean rmdir(const String &path)
+  {
+    this->volume->delayRemove();
+    return this->locked(path, [this](const std::string &p)
+                        {
+                          std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator found = this->volume->nodes.find(p);
+                          if (p == "/" || found == this->volume->nodes.end() || !found->second->directory || !this->volume->children(p).empty())
+                            return false;
+                          this->volume->nodes.erase(found);
+                          return true;
+                        });
+  }
+
+  boolean remove(const String &path)
+  {
+    this->volume->delayRemove();
+    return this->locked(path, [this](const std::string &p)
+                        {
+                          std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator found = this->volume->nodes.find(p);
+                          if (found == this->volume->nodes.end() || found->second->directory)
+                            return false;
+                          this->volume->nodes.erase(found);
+                          return true;
+                        });
+  }
+
+  boolean truncate(const String &path, uint32_t size)
+  {
+    return this->locked(path, [this, size](const std::string &p)
+                        {
+                          std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator found = this->volume->nodes.find(p);
+                          if (found == this->volume->nodes.end() || found->second->directory)
+                            return false;
+                          found->second->content.resize(size);
+                          return true;
+                        });
+  }
+
+  // Files only, as the server renames nothing else in the tests
+  boolean rename(const String &from, const String &to)
+  {
+    std::string target = ftpNormalizePath(to).c_str();
+    return this->locked(from, [this, &target](const std::string &p)
+                        {
+                          std::map<std::string, std::shared_ptr<FTPMemoryNode>> &nodes = this->volume->nodes;
+                          std::map<std::string, std::shared_ptr<FTPMemoryNode>>::iterator found = nodes.find(p);
+                          if (found == nodes.end() || found->second->directory || nodes.count(FTPMemoryVolume::parent(target)) == 0)
+                            return false;
+                          nodes[target] = found->second;
+                          nodes.erase(p);
+                          return true;
+                        });
+  }
+};
+
+typedef FTPMemoryFile FTPPlatformFile;
+typedef FTPMemoryStorage FTPPlatformStorage;
@@ -0,0 +1,299 @@
+#pragma once
+
+// Blocking FTP client for the native tests and benchmarks. It talks to an
+// FTPServer running on another thread of the same process, over loopback
+// TCP or over the in-process sockets of FTPFakeNetwork.h.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// Opens a connection to port, -1 if nothing listens there
+typedef int (*FTPTestConnector)(uint16_t port);
+
+inline int ftpTestConnectTcp(uint16_t port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+inline uint64_t ftpTestMicros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class FTPTestClient
+{
+private:
+  FTPTestConnector connector;
+  int control = -1;
+  int data = -1;
+  // Received on the control connection after the last reply
+  std::string pending;
+
+  // Up to timeout ms for the socket to become readable
+  static bool readable(int fd, int timeout)
+  {
+    struct pollfd ready = {fd, POLLIN, 0};
+    return poll(&ready, 1, timeout) > 0;
+  }
+
+  bool readLine(std::string &line, int timeout)
+  {
+    while (true)
+    {
+      size_t end = this->pending.find("\r\n");
+      if (end != std::string::npos)
+      {
+        line = this->pending.substr(0, end);
+        this->pending.erase(0, end + 2);
+        return true;
+      }
+      char buffer[1024];
+      if (!readable(this->control, timeout))
+      {
+        return false;
+      }
+      ssize_t length = recv(this->control, buffer, sizeof(buffer), 0);
+      if (length <= 0)
+      {
+        return false;
+      }
+      this->pending.append(buffer, length);
+    }
+  }
+
+public:
+  // Code and all lines of the last reply, -1 if none came
+  int code = -1;
+  std::string reply;
+
+  FTPTestClient(FTPTestConnector connector = ftpTestConnectTcp) : connector(connector) {}
+
+  ~FTPTestClient()
+  {
+    this->close();
+  }
+
+  // Connects and reads the banner, retrying while the server starts
+  bool connect(uint16_t port = FTP_COMMAND_PORT)
+  {
+    for (int attempt = 0; attempt < 200 && this->control < 0; attempt++)
+    {
+      this->control = this->connector(port);
+      if (this->control < 0)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    return this->control >= 0 && this->readReply() == 220;
+  }
+
+  bool login(const char *user = "esp32", const char *password = "esp32")
+  {
+    return this->connect() && this->command("USER %s", user) == 331 && this->command("PASS %s", password) == 230;
+  }
+
+  void close()
+  {
+    this->closeData();
+    if (this->control >= 0)
+    {
+      ::close(this->control);
+      this->control = -1;
+    }
+    this->pending.clear();
+  }
+
+  // A whole reply, multi-line ones included
+  int readReply(int timeout = 5000)
+  {
+    this->code = -1;
+    this->reply.clear();
+    std::string line;
+    while (this->readLine(line, timeout))
+    {
+      this->reply += line + "\n";
+      if (line.size() >= 4 && line[3] == ' ' && isdigit(line[0]))
+      {
+        this->code = atoi(line.c_str());
+        break;
+      }
+    }
+    return this->code;
+  }
+
+  void send(const char *format, ...) __attribute__((format(printf, 2, 3)))
+  {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line) - 2, format, args);
+    va_end(args);
+    memcpy(line + length, "\r\n", 2);
+    ::send(this->control, line, length + 2, MSG_NOSIGNAL);
+  }
+
+  int command(const char *format, ...) __attribute__((format(printf, 2, 3)))
+  {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    this->send("%s", line);
+    return this->readReply();
+  }
+
+  // Control connection, -1 if not connected
+  int controlSocket() const
+  {
+    return this->control;
+  }
+
+  // Data connection opened by openData(), -1 if none
+  int dataSocket() const
+  {
+    return this->data;
+  }
+
+  // PASV and connect to the port it names, the address is not needed
+  bool openData()
+  {
+    this->closeData();
+    if (this->command("PASV") != 227)
+    {
+      return false;
+    }
+    unsigned a, b, c, d, high, low;
+    const char *open = strchr(this->reply.c_str(), '(');
+    if (open == NULL || sscanf(open, "(%u,%u,%u,%u,%u,%u)", &a, &b, &c, &d, &high, &low) != 6)
+    {
+      return false;
+    }
+    this->data = this->connector(high * 256 + low);
+    return this->data >= 0;
+  }
+
+  void closeData()
+  {
+    if (this->data >= 0)
+    {
+      ::close(this->data);
+      this->data = -1;
+    }
+  }
+
+  // Read the data connection until the server closes it, or until limit
+  // bytes have arrived, then close it
+  size_t receiveData(std::string &content, size_t limit = SIZE_MAX, int timeout = 10000)
+  {
+    char buffer[16384];
+    size_t received = 0;
+    while (received < limit && readable(this->data, timeout))
+    {
+      ssize_t length = recv(this->data, buffer, std::min(sizeof(buffer), limit - received), 0);
+      if (length <= 0)
+      {
+        break;
+      }
+      content.append(buffer, length);
+      received += length;
+    }
+    this->closeData();
+    return received;
+  }
+
+  // Write content to the data connection, the first limit bytes only
+  size_t sendData(const std::string &content, size_t limit = SIZE_MAX)
+  {
+    size_t length = std::min(content.size(), limit);
+    size_t sent = 0;
+    while (sent < length)
+    {
+      ssize_t written = ::send(this->data, content.data() + sent, std::min<size_t>(length - sent, 65536), MSG_NOSIGNAL);
+      if (written <= 0)
+      {
+        break;
+      }
+      sent += written;
+    }
+    this->closeData();
+    return sent;
+  }
+
+  // RETR path into content. With a limit the data connection is cut after
+  // limit bytes, as a client losing its connection would. Returns the code
+  // of the reply that ends the transfer.
+  int retrieve(const char *path, std::string &content, size_t limit = SIZE_MAX)
+  {
+    if (!this->openData())
+    {
+      return -1;
+    }
+    int started = this->command("RETR %s", path);
+    if (started != 150)
+    {
+      this->closeData();
+      return started;
+    }
+    this->receiveData(content, limit);
+    return this->readReply();
+  }
+
+  // STOR content to path, cut after limit bytes like retrieve()
+  int store(const char *path, const std::string &content, size_t limit = SIZE_MAX)
+  {
+    if (!this->openData())
+    {
+      return -1;
+    }
+    int started = this->command("STOR %s", path);
+    if (started != 150)
+    {
+      this->closeData();
+      return started;
+    }
+    this->sendData(content, limit);
+    return this->readReply();
+  }
+
+  // LIST, MLSD or NLST of the current directory
+  int list(const char *verb, std::string &listing)
+  {
+    if (!this->openData())
+    {
+      return -1;
+    }
+    int started = this->command("%s", verb);
+    if (started != 150)
+    {
+      this->closeData();
+      return started;
+    }
+    this->receiveData(listing);
+    return this->readReply();
+  }
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+// Host files for the native tests: a scratch directory per test binary
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// New empty directory below /tmp, name is a mkdtemp() template prefix
+inline std::string ftpTestTempDir(const char *name)
+{
+  std::string path = std::string("/tmp/") + name + "_XXXXXX";
+  if (mkdtemp(&path[0]) == NULL)
+  {
+    return "";
+  }
+  return path;
+}
+
+inline bool ftpTestWriteFile(const std::string &path, const std::string &content)
+{
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  bool written = fwrite(content.data(), 1, content.size(), file) == content.size();
+  return fclose(file) == 0 && written;
+}
+
+inline bool ftpTestReadFile(const std::string &path, std::string &content)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  content.clear();
+  char buffer[65536];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    content.append(buffer, length);
+  }
+  fclose(file);
+  return true;
+}
+
+inline bool ftpTestExists(const std::string &path)
+{
+  struct stat info;
+  return stat(path.c_str(), &info) == 0;
+}
+
+// Pseudo-random content, the same for the same seed
+inline std::string ftpTestContent(size_t size, uint32_t seed = 1)
+{
+  std::string content(size, '\0');
+  uint32_t state = seed * 2654435761u + 1;
+  for (size_t i = 0; i < size; i++)
+  {
+    state = state * 1664525u + 1013904223u;
+    content[i] = (char)(state >> 24);
+  }
+  return content;
+}
+
+inline void ftpTestRemoveTree(const std::string &path)
+{
+  nftw(
+      path.c_str(), [](const char *entry, const struct stat *, int, struct FTW *) { return remove(entry); }, 16,
+      FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+// Runs an FTPServer on a thread of the test, as FTPThread does on the board
+
+#include <FTPServer.h>
+#include <atomic>
+#include <thread>
+
+// Data ports of the test servers, clear of the native build's 50009
+#ifndef FTP_TEST_DATA_PORT
+#define FTP_TEST_DATA_PORT 50109
+#endif
+
+class FTPTestServer
+{
+private:
+  FTPServer server;
+  std::thread thread;
+  std::atomic<bool> running;
+
+public:
+  FTPTestServer(const FTPStorage &storage) : server(storage), running(false) {}
+
+  FTPServer &get()
+  {
+    return this->server;
+  }
+
+  void start(const char *user = "esp32", const char *password = "esp32")
+  {
+    this->server.begin(user, password, FTP_TEST_DATA_PORT);
+    this->running = true;
+    this->thread = std::thread([this]
+                               {
+                                 while (this->running)
+                                 {
+                                   this->server.mainFTPLoop();
+                                   this->server.wait();
+                                 }
+                               });
+  }
+
+  void stop()
+  {
+    this->running = false;
+    // Also wakes the FTP task from wait()
+    this->server.resume();
+    this->thread.join();
+  }
+};
@@ -0,0 +1,99 @@
+// Transfer throughput at the FTP_BUF_SIZE and FTP_BUFFER_COUNT of this
+// build, on in-memory files with a fixed cost per storage call, as an SD
+// card has, and a WiFi-like send rate. Larger buffers spread the fixed
+// cost over more bytes at the price of pool RAM. Sweep the sizes with
+//
+//   python3 scripts/bench_sweep.py test_bench_buffers FTP_BUF_SIZE 2048 4096 8192 16384
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+static std::string content;
+
+void setUp()
+{
+  FTPMemoryVolume &volume = storage.getVolume();
+  volume.accessMicros = 400;
+  volume.microsPerKB = 250;
+  FTPFakeConnection::sendRate() = 4e6;
+}
+
+void tearDown()
+{
+  storage.getVolume().accessMicros = 0;
+  storage.getVolume().microsPerKB = 0;
+  FTPFakeConnection::sendRate() = 0;
+}
+
+static void report(const char *verb, double seconds)
+{
+  char line[160];
+  snprintf(line, sizeof(line), "FTP_BUF_SIZE %u x %u (%u KB pool): %s %.2f MB/s",
+           (unsigned)FTP_BUF_SIZE, (unsigned)FTP_BUFFER_COUNT, (unsigned)(FTP_BUF_SIZE * FTP_BUFFER_COUNT / 1024),
+           verb, content.size() / seconds / 1e6);
+  TEST_MESSAGE(line);
+}
+
+static void test_retrieve()
+{
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  std::string received;
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(226, client.retrieve("bench.bin", received));
+  report("RETR", (ftpTestMicros() - begin) / 1e6);
+  TEST_ASSERT_TRUE(received == content);
+}
+
+static void test_store()
+{
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(226, client.store("stored.bin", content));
+  report("STOR", (ftpTestMicros() - begin) / 1e6);
+
+  std::string stored;
+  FTPMemoryFile file = storage.open("/stored.bin", "r");
+  stored.resize(file.size());
+  file.read((uint8_t *)&stored[0], stored.size());
+  TEST_ASSERT_TRUE(stored == content);
+}
+
+// All buffers come back to the pool after the transfers
+static void test_pool_refilled()
+{
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(211, client.command("SITE STATS"));
+  char expected[60];
+  snprintf(expected, sizeof(expected), "Transfer buffers %u of %u free", (unsigned)FTP_BUFFER_COUNT, (unsigned)FTP_BUFFER_COUNT);
+  TEST_ASSERT_TRUE(client.reply.find(expected) != std::string::npos);
+}
+
+int main()
+{
+  logger().begin();
+  content = ftpTestContent(2 * 1024 * 1024, 5);
+  FTPMemoryFile file = storage.open("/bench.bin", "w");
+  file.write((const uint8_t *)content.data(), content.size());
+  file.close();
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_retrieve);
+  RUN_TEST(test_store);
+  RUN_TEST(test_pool_refilled);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
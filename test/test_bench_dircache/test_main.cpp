@@ -0,0 +1,141 @@
+// Listing cache: LIST latency of a directory read from storage (cold) and
+// from the cache (warm), with storage as slow as an SD card that opens a
+// File per entry. Changes to the directory must make the next listing
+// cold again, and SITE STATS must count the hits and misses.
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+static FTPTestClient *client;
+
+static const int entries = 500;
+
+void setUp()
+{
+  TEST_ASSERT_EQUAL(200, client->command("SITE STATS RESET"));
+}
+
+void tearDown() {}
+
+// Value after label in the SITE STATS reply
+static unsigned long statistic(const char *label)
+{
+  client->command("SITE STATS");
+  size_t at = client->reply.find(label);
+  return at == std::string::npos ? 0 : strtoul(client->reply.c_str() + at + strlen(label), NULL, 10);
+}
+
+static double listMillis(size_t expectedEntries)
+{
+  std::string listing;
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(226, client->list("LIST", listing));
+  double millis = (ftpTestMicros() - begin) / 1e3;
+  size_t lines = 0;
+  for (size_t at = listing.find("\r\n"); at != std::string::npos; at = listing.find("\r\n", at + 2))
+    lines++;
+  TEST_ASSERT_EQUAL(expectedEntries, lines);
+  return millis;
+}
+
+static void test_cold_and_warm()
+{
+  double cold = listMillis(entries);
+  double warm = 1e9;
+  for (int run = 0; run < 5; run++)
+    warm = std::min(warm, listMillis(entries));
+  char line[120];
+  snprintf(line, sizeof(line), "LIST of %d entries: cold %.2f ms, warm %.2f ms", entries, cold, warm);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_TRUE(warm * 5 < cold);
+  TEST_ASSERT_EQUAL(5, statistic("Listing cache hits "));
+  TEST_ASSERT_EQUAL(1, statistic("misses "));
+}
+
+// STOR, DELE and RNTO into the directory are seen by the next listing
+static void test_changes_invalidate()
+{
+  listMillis(entries);
+  TEST_ASSERT_EQUAL(226, client->store("added.bin", "added"));
+  double afterStore = listMillis(entries + 1);
+  TEST_ASSERT_EQUAL(250, client->command("DELE added.bin"));
+  listMillis(entries);
+  TEST_ASSERT_EQUAL(350, client->command("RNFR entry_00000.txt"));
+  TEST_ASSERT_EQUAL(250, client->command("RNTO /moved.txt"));
+  listMillis(entries - 1);
+  double warm = listMillis(entries - 1);
+
+  unsigned long hits = statistic("Listing cache hits ");
+  unsigned long invalidations = statistic("invalidations ");
+  char line[140];
+  snprintf(line, sizeof(line), "after STOR %.2f ms, warm again %.2f ms, %lu hits, %lu invalidations",
+           afterStore, warm, hits, invalidations);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_TRUE(invalidations >= 3);
+  TEST_ASSERT_EQUAL(350, client->command("RNFR /moved.txt"));
+  TEST_ASSERT_EQUAL(250, client->command("RNTO entry_00000.txt"));
+}
+
+// The native build's storage tells "A" from "a", so must the cache
+static void test_keys_match_case()
+{
+  storage.mkdir("/Case");
+  storage.mkdir("/case");
+  storage.open("/Case/Upper.txt", "w").write((const uint8_t *)"U", 1);
+  storage.open("/case/lower.txt", "w").write((const uint8_t *)"l", 1);
+  storage.open("/case/second.txt", "w").write((const uint8_t *)"s", 1);
+  storage.getVolume().openMicros = 0;
+  for (int run = 0; run < 2; run++)
+  {
+    std::string listing;
+    TEST_ASSERT_EQUAL(250, client->command("CWD /Case"));
+    TEST_ASSERT_EQUAL(226, client->list("NLST", listing));
+    TEST_ASSERT_EQUAL_STRING("Upper.txt\r\n", listing.c_str());
+    listing.clear();
+    TEST_ASSERT_EQUAL(250, client->command("CWD /case"));
+    TEST_ASSERT_EQUAL(226, client->list("NLST", listing));
+    TEST_ASSERT_EQUAL_STRING("lower.txt\r\nsecond.txt\r\n", listing.c_str());
+  }
+  // Answered from the cached listing of /case, which has no LOWER.TXT.
+  // A failed DELE ends the session, so on a session of its own.
+  FTPTestClient other(ftpFakeConnect);
+  TEST_ASSERT_TRUE(other.login());
+  TEST_ASSERT_EQUAL(550, other.command("DELE /case/LOWER.TXT"));
+  TEST_ASSERT_TRUE(storage.exists("/case/lower.txt"));
+  storage.getVolume().openMicros = 200;
+  TEST_ASSERT_EQUAL(250, client->command("CWD /dir"));
+}
+
+int main()
+{
+  logger().begin();
+  storage.mkdir("/dir");
+  char name[40];
+  for (int i = 0; i < entries; i++)
+  {
+    snprintf(name, sizeof(name), "/dir/entry_%05d.txt", i);
+    storage.open(name, "w").write((const uint8_t *)"entry", 5);
+  }
+  storage.getVolume().openMicros = 200;
+  server = new FTPTestServer(storage);
+  server->start();
+  client = new FTPTestClient(ftpFakeConnect);
+  client->login();
+  client->command("CWD /dir");
+
+  UNITY_BEGIN();
+  RUN_TEST(test_cold_and_warm);
+  RUN_TEST(test_changes_invalidate);
+  RUN_TEST(test_keys_match_case);
+  int failures = UNITY_END();
+
+  delete client;
+  server->stop();
+  return failures;
+}
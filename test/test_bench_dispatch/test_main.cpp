@@ -0,0 +1,128 @@
+// Command dispatch: nanoseconds per lookup for every verb, through the
+// packed verb table and through the String comparison chain it replaced,
+// in the chain's order. Also the per-state masks and the verbs that need
+// an argument, on a server with in-memory files.
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+
+// Order of the comparisons in the old processCommand
+static const char *const chain[] = {
+    "PWD", "NOOP", "QUIT", "ABOR", "MODE", "STRU", "CDUP", "CWD", "FEAT",
+    "MKD", "TYPE", "PASV", "MLSD", "LIST", "DELE", "RMD", "RNFR", "RNTO",
+    "RETR", "STOR", "SYST", "SIZE", "REST", "MDTM", "NLST", "STAT", "SITE"};
+static const int chainLength = sizeof(chain) / sizeof(chain[0]);
+
+static const int lookups = 200000;
+static volatile uintptr_t sink;
+
+void setUp() {}
+void tearDown() {}
+
+static int chainLookup(const String &command)
+{
+  for (int i = 0; i < chainLength; i++)
+  {
+    if (command == chain[i])
+      return i;
+  }
+  return -1;
+}
+
+static double nanosPerLookup(uint64_t begin)
+{
+  return (ftpTestMicros() - begin) * 1000.0 / lookups;
+}
+
+static void test_every_verb_found()
+{
+  for (int i = 0; i < chainLength; i++)
+  {
+    const FTPCommandEntry *entry = FTPSession::findCommand(ftpPackVerb(chain[i]));
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL(ftpVerb(chain[i]), entry->verb);
+  }
+  TEST_ASSERT_NULL(FTPSession::findCommand(ftpPackVerb("XPWD")));
+  TEST_ASSERT_NULL(FTPSession::findCommand(ftpPackVerb("PW")));
+  // Five letters cannot pack, rather than matching on the first four
+  TEST_ASSERT_EQUAL(0, ftpPackVerb("RETRX"));
+}
+
+static void test_dispatch_cost_per_verb()
+{
+  double tableTotal = 0, chainTotal = 0;
+  for (int i = 0; i < chainLength; i++)
+  {
+    uint64_t begin = ftpTestMicros();
+    for (int n = 0; n < lookups; n++)
+    {
+      sink = (uintptr_t)FTPSession::findCommand(ftpPackVerb(chain[(i + (sink & 1)) % chainLength]));
+    }
+    double table = nanosPerLookup(begin);
+
+    String command(chain[i]);
+    begin = ftpTestMicros();
+    for (int n = 0; n < lookups; n++)
+    {
+      sink = chainLookup(command) + (sink & 1);
+    }
+    double comparisons = nanosPerLookup(begin);
+
+    char line[120];
+    snprintf(line, sizeof(line), "%-4s table %6.1f ns, String chain %6.1f ns", chain[i], table, comparisons);
+    TEST_MESSAGE(line);
+    tableTotal += table;
+    chainTotal += comparisons;
+  }
+  char line[120];
+  snprintf(line, sizeof(line), "mean table %.1f ns, String chain %.1f ns", tableTotal / chainLength, chainTotal / chainLength);
+  TEST_MESSAGE(line);
+}
+
+static void test_state_masks()
+{
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.connect());
+  TEST_ASSERT_EQUAL(530, client.command("PWD"));
+  TEST_ASSERT_EQUAL(215, client.command("SYST"));
+  TEST_ASSERT_EQUAL(500, client.command("XYZZ"));
+  TEST_ASSERT_EQUAL(331, client.command("USER esp32"));
+  TEST_ASSERT_EQUAL(230, client.command("PASS esp32"));
+  TEST_ASSERT_EQUAL(503, client.command("USER esp32"));
+  TEST_ASSERT_EQUAL(257, client.command("PWD"));
+}
+
+static void test_file_verbs_need_a_name()
+{
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(501, client.command("MDTM"));
+  TEST_ASSERT_EQUAL(501, client.command("SIZE"));
+  TEST_ASSERT_EQUAL(226, client.store("named.txt", "content"));
+  TEST_ASSERT_EQUAL(213, client.command("MDTM named.txt"));
+  TEST_ASSERT_EQUAL(213, client.command("SIZE named.txt"));
+}
+
+int main()
+{
+  logger().begin();
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_every_verb_found);
+  RUN_TEST(test_dispatch_cost_per_verb);
+  RUN_TEST(test_state_masks);
+  RUN_TEST(test_file_verbs_need_a_name);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
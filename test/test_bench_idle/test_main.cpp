@@ -0,0 +1,117 @@
+// FTP task cost with one idle logged-in client, and NOOP round trip, when
+// it sleeps on the sockets (FTPServer::wait) and when it polls with a
+// fixed 1 ms delay between passes as it used to (FTP_POLL_INTERVAL 1).
+
+// Chosen per run, see FTPServer::wait
+static unsigned long benchPollInterval = 0;
+#define FTP_POLL_INTERVAL benchPollInterval
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+
+// Idle time measured per run, in ms
+#define IDLE_MILLIS 1000
+#define NOOPS 500
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+
+struct IdleResult
+{
+  double wakeupsPerSecond;
+  double idlePercent;
+  double cpuPercent;
+  double noopMedian;
+  double noopP99;
+};
+
+void setUp() {}
+void tearDown() {}
+
+static double processCpuMicros()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static IdleResult run(unsigned long pollInterval)
+{
+  benchPollInterval = pollInterval;
+  IdleResult result;
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  // The FTP task picks the new interval up after its current sleep
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  TEST_ASSERT_EQUAL(200, client.command("SITE STATS RESET"));
+
+  // Nothing to do: only the FTP task runs, its CPU time is the process'
+  double cpuBegin = processCpuMicros();
+  uint64_t begin = ftpTestMicros();
+  std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MILLIS));
+  double seconds = (ftpTestMicros() - begin) / 1e6;
+  result.cpuPercent = (processCpuMicros() - cpuBegin) / 1e4 / seconds;
+
+  TEST_ASSERT_EQUAL(211, client.command("SITE STATS"));
+  size_t at = client.reply.find("Loop wakeups ");
+  TEST_ASSERT_TRUE(at != std::string::npos);
+  char *end;
+  result.wakeupsPerSecond = strtoul(client.reply.c_str() + at + strlen("Loop wakeups "), &end, 10) / seconds;
+  at = client.reply.find("FTP task idle ");
+  TEST_ASSERT_TRUE(at != std::string::npos);
+  result.idlePercent = strtod(client.reply.c_str() + at + strlen("FTP task idle "), NULL);
+
+  std::vector<double> times;
+  for (int i = 0; i < NOOPS; i++)
+  {
+    uint64_t sent = ftpTestMicros();
+    TEST_ASSERT_EQUAL(200, client.command("NOOP"));
+    times.push_back(ftpTestMicros() - sent);
+  }
+  std::sort(times.begin(), times.end());
+  result.noopMedian = times[NOOPS / 2];
+  result.noopP99 = times[NOOPS * 99 / 100];
+
+  char line[200];
+  snprintf(line, sizeof(line), "%-8s: %.0f wakeups/s, FTP task idle %.1f%%, CPU %.2f%%, NOOP median %.0f us, p99 %.0f us",
+           pollInterval > 0 ? "polling" : "waiting", result.wakeupsPerSecond, result.idlePercent, result.cpuPercent,
+           result.noopMedian, result.noopP99);
+  TEST_MESSAGE(line);
+  client.command("QUIT");
+  benchPollInterval = 0;
+  return result;
+}
+
+static void test_idle_client()
+{
+  IdleResult waiting = run(0);
+  IdleResult polling = run(1);
+
+  // Asleep until the session timeout or FTP_MAX_WAIT, instead of every ms
+  TEST_ASSERT_TRUE(waiting.wakeupsPerSecond < 10);
+  TEST_ASSERT_TRUE(polling.wakeupsPerSecond > 100);
+  TEST_ASSERT_TRUE(waiting.idlePercent > 99);
+  // A command no longer waits for the end of the current sleep
+  TEST_ASSERT_TRUE(waiting.noopMedian < polling.noopMedian);
+}
+
+int main()
+{
+  logger().begin();
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_idle_client);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
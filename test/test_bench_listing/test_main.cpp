@@ -0,0 +1,117 @@
+// Directory listings: entries per second for LIST, MLSD and NLST of a
+// 10000 file directory, too big for the listing cache, so every run is
+// streamed from storage. While a slow listing runs, another session's
+// commands must still be answered between the listing's batches.
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+
+static const int entries = 10000;
+
+void setUp()
+{
+  storage.getVolume().openMicros = 0;
+}
+
+void tearDown() {}
+
+static size_t countLines(const std::string &listing)
+{
+  size_t lines = 0;
+  for (size_t at = listing.find("\r\n"); at != std::string::npos; at = listing.find("\r\n", at + 2))
+    lines++;
+  return lines;
+}
+
+static double listRate(FTPTestClient &client, const char *verb)
+{
+  std::string listing;
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(226, client.list(verb, listing));
+  double seconds = (ftpTestMicros() - begin) / 1e6;
+  TEST_ASSERT_EQUAL(entries, countLines(listing));
+  return entries / seconds;
+}
+
+static void test_entries_per_second()
+{
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(250, client.command("CWD /big"));
+  const char *verbs[] = {"LIST", "MLSD", "NLST"};
+  for (int i = 0; i < 3; i++)
+  {
+    double best = 0;
+    for (int run = 0; run < 3; run++)
+      best = std::max(best, listRate(client, verbs[i]));
+    char line[100];
+    snprintf(line, sizeof(line), "%s of %d entries: %.0f entries/s", verbs[i], entries, best);
+    TEST_MESSAGE(line);
+  }
+}
+
+// 30 us per entry makes a listing take 300 ms, a NOOP of a second session
+// must not wait for all of it
+static void test_other_session_served_during_listing()
+{
+  storage.getVolume().openMicros = 30;
+  FTPTestClient lister(ftpFakeConnect);
+  FTPTestClient other(ftpFakeConnect);
+  TEST_ASSERT_TRUE(lister.login());
+  TEST_ASSERT_TRUE(other.login());
+  TEST_ASSERT_EQUAL(250, lister.command("CWD /big"));
+
+  std::string listing;
+  int listed = 0;
+  uint64_t listBegin = ftpTestMicros();
+  std::thread listingThread([&]()
+                             { listed = lister.list("LIST", listing); });
+  uint64_t longest = 0;
+  int noops = 0;
+  while (listed == 0)
+  {
+    uint64_t begin = ftpTestMicros();
+    TEST_ASSERT_EQUAL(200, other.command("NOOP"));
+    longest = std::max(longest, ftpTestMicros() - begin);
+    noops++;
+  }
+  listingThread.join();
+  double listMillis = (ftpTestMicros() - listBegin) / 1e3;
+  TEST_ASSERT_EQUAL(226, listed);
+  TEST_ASSERT_EQUAL(entries, countLines(listing));
+
+  char line[140];
+  snprintf(line, sizeof(line), "slow LIST took %.0f ms, %d NOOPs of another session, longest %.1f ms", listMillis, noops, longest / 1e3);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_TRUE(noops > 1);
+  TEST_ASSERT_TRUE(longest < listMillis * 1e3 / 4);
+}
+
+int main()
+{
+  logger().begin();
+  storage.mkdir("/big");
+  char name[40];
+  for (int i = 0; i < entries; i++)
+  {
+    snprintf(name, sizeof(name), "/big/capture_%05d.bin", i);
+    storage.open(name, "w").write((const uint8_t *)"data", 4);
+  }
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_entries_per_second);
+  RUN_TEST(test_other_session_served_during_listing);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
@@ -0,0 +1,124 @@
+// Logging cost: time per deferred log line next to what the same line
+// takes on a 115200 baud UART, and the round trip of simple commands at
+// the LOG_LEVEL of this build. Compare levels with
+//
+//   python3 scripts/bench_sweep.py test_bench_logging LOG_LEVEL 0 3 4
+//
+// LOG_LEVEL 4 (debug) logs two lines for every command.
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <vector>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+
+static const int repeats = 2000;
+
+void setUp() {}
+void tearDown() {}
+
+// The drain task prints to stdout, not into the test report
+static int quietStdout()
+{
+  fflush(stdout);
+  int saved = dup(1);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, 1);
+  close(null);
+  return saved;
+}
+
+static void restoreStdout(int saved)
+{
+  // Let the drain task finish the lines of the run
+  std::this_thread::sleep_for(std::chrono::milliseconds(2 * LOG_DRAIN_INTERVAL));
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+}
+
+// Lines are written in bursts that fit a ring, so none are dropped
+static void test_line_cost()
+{
+  const char *command = "RETR";
+  const char *params = "captures/sensor_2024-01-01.csv";
+  int saved = quietStdout();
+  uint64_t micros = 0;
+  int lines = 0;
+  for (int burst = 0; burst < 20; burst++)
+  {
+    uint64_t begin = ftpTestMicros();
+    for (int i = 0; i < LOG_RING_SLOTS / 2; i++)
+    {
+      logger().write(LOG_LEVEL_DEBUG, "command: %s, params: %s", command, params);
+    }
+    micros += ftpTestMicros() - begin;
+    lines += LOG_RING_SLOTS / 2;
+    std::this_thread::sleep_for(std::chrono::milliseconds(2 * LOG_DRAIN_INTERVAL));
+  }
+  restoreStdout(saved);
+
+  // Time, level, text and newline; 10 bits per character on the wire
+  char line[LOG_LINE_SIZE];
+  int length = snprintf(line, sizeof(line), "12345 D command: %s, params: %s\n", command, params);
+  char message[140];
+  snprintf(message, sizeof(message), "deferred line %.2f us, the same %d characters at 115200 baud %.0f us",
+           micros / (double)lines, length, length * 10 / 115200.0 * 1e6);
+  TEST_MESSAGE(message);
+}
+
+static double medianMicros(FTPTestClient &client, const char *command, int expected)
+{
+  std::vector<uint64_t> samples;
+  for (int i = 0; i < repeats; i++)
+  {
+    uint64_t begin = ftpTestMicros();
+    TEST_ASSERT_EQUAL(expected, client.command("%s", command));
+    samples.push_back(ftpTestMicros() - begin);
+  }
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+static void test_command_overhead()
+{
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  static const char *const commands[] = {"NOOP", "PWD", "TYPE I", "CWD /"};
+  static const int codes[] = {200, 257, 200, 250};
+  double results[4];
+  int saved = quietStdout();
+  for (int i = 0; i < 4; i++)
+  {
+    results[i] = medianMicros(client, commands[i], codes[i]);
+  }
+  restoreStdout(saved);
+  for (int i = 0; i < 4; i++)
+  {
+    char line[100];
+    snprintf(line, sizeof(line), "LOG_LEVEL %d: %-6s %.1f us per command", LOG_LEVEL, commands[i], results[i]);
+    TEST_MESSAGE(line);
+  }
+}
+
+int main()
+{
+  logger().begin();
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_line_cost);
+  RUN_TEST(test_command_overhead);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
@@ -0,0 +1,164 @@
+// Control channel parsing: commands per second and heap allocations per
+// command of FTPLineAssembler, next to the byte by byte String building it
+// replaced. Commands arrive pipelined, a batch per socket read.
+
+#include "../support/FTPAllocationCounter.h"
+
+#include <unity.h>
+#include <sys/socket.h>
+#include "FTPLineAssembler.h"
+#include "../support/FTPTestClient.h"
+
+// A client session's worth of commands
+static const char *const session[] = {
+    "USER esp32", "PASS esp32", "SYST", "FEAT", "PWD", "TYPE I", "PASV",
+    "LIST", "CWD /logs", "PASV", "RETR sensor_2024-01-01.csv",
+    "SIZE sensor_2024-01-02.csv", "MDTM sensor_2024-01-02.csv", "PASV",
+    "STOR upload.bin", "NOOP"};
+static const int sessionLength = sizeof(session) / sizeof(session[0]);
+
+static int ends[2];
+static FTPConnection server;
+static std::string batch;
+static int batchCommands;
+
+void setUp() {}
+void tearDown() {}
+
+static void sendBatch()
+{
+  TEST_ASSERT_EQUAL((int)batch.size(), (int)::send(ends[1], batch.data(), batch.size(), 0));
+}
+
+// The parser before FTPLineAssembler: one read and one String per byte.
+// The host String keeps short text inline, so its allocation count is far
+// below the board's, where every String((char)c) goes to the heap.
+static int parseByteByByte(FTPConnection &client)
+{
+  int commands = 0;
+  String commandBuffer;
+  int c;
+  while ((c = client.read()) >= 0)
+  {
+    if (c == '\n')
+    {
+      commands++;
+      commandBuffer = "";
+    }
+    else
+    {
+      commandBuffer.concat(String((char)c));
+    }
+  }
+  return commands;
+}
+
+static void report(const char *name, int commands, uint64_t micros, unsigned long allocations)
+{
+  char line[160];
+  snprintf(line, sizeof(line), "%-14s %.2f M commands/s, %.2f allocations per command",
+           name, commands / (double)micros, (double)allocations / commands);
+  TEST_MESSAGE(line);
+}
+
+static void test_pipelined_commands_split()
+{
+  FTPLineAssembler lines;
+  const char pipelined[] = "type i\r\nPASV\r\n  RETR  a file.bin  \r\nNOOP";
+  ::send(ends[1], pipelined, sizeof(pipelined) - 1, 0);
+  TEST_ASSERT_TRUE(lines.next(server));
+  TEST_ASSERT_EQUAL_STRING("TYPE", lines.command());
+  TEST_ASSERT_EQUAL_STRING("i", lines.params());
+  TEST_ASSERT_TRUE(lines.hasLine());
+  TEST_ASSERT_TRUE(lines.next(server));
+  TEST_ASSERT_EQUAL_STRING("PASV", lines.command());
+  TEST_ASSERT_EQUAL_STRING("", lines.params());
+  TEST_ASSERT_TRUE(lines.next(server));
+  TEST_ASSERT_EQUAL_STRING("RETR", lines.command());
+  TEST_ASSERT_EQUAL_STRING("a file.bin", lines.params());
+  // NOOP is incomplete until its CRLF arrives
+  TEST_ASSERT_FALSE(lines.hasLine());
+  TEST_ASSERT_FALSE(lines.next(server));
+  ::send(ends[1], "\r\n", 2, 0);
+  TEST_ASSERT_TRUE(lines.next(server));
+  TEST_ASSERT_EQUAL_STRING("NOOP", lines.command());
+}
+
+static void test_overlong_line_is_empty_command()
+{
+  FTPLineAssembler lines;
+  std::string overlong = "STOR " + std::string(FTP_COMMAND_SIZE * 2, 'x') + "\r\nPWD\r\n";
+  ::send(ends[1], overlong.data(), overlong.size(), 0);
+  while (!lines.next(server))
+  {
+  }
+  TEST_ASSERT_EQUAL_STRING("", lines.command());
+  TEST_ASSERT_TRUE(lines.next(server));
+  TEST_ASSERT_EQUAL_STRING("PWD", lines.command());
+}
+
+static void test_assembler_rate()
+{
+  FTPLineAssembler lines;
+  int commands = 0;
+  uint64_t micros = 0;
+  unsigned long allocations = 0;
+  for (int round = 0; round < 2000; round++)
+  {
+    sendBatch();
+    unsigned long allocationsBefore = ftpAllocations();
+    uint64_t begin = ftpTestMicros();
+    for (int i = 0; i < batchCommands; i++)
+    {
+      TEST_ASSERT_TRUE(lines.next(server));
+    }
+    micros += ftpTestMicros() - begin;
+    allocations += ftpAllocations() - allocationsBefore;
+    commands += batchCommands;
+  }
+  // Views into the fixed buffer, nothing on the heap
+  TEST_ASSERT_EQUAL(0, allocations);
+  report("line assembler", commands, micros, allocations);
+}
+
+static void test_byte_by_byte_rate()
+{
+  int commands = 0;
+  uint64_t micros = 0;
+  unsigned long allocations = 0;
+  for (int round = 0; round < 200; round++)
+  {
+    sendBatch();
+    unsigned long allocationsBefore = ftpAllocations();
+    uint64_t begin = ftpTestMicros();
+    commands += parseByteByByte(server);
+    micros += ftpTestMicros() - begin;
+    allocations += ftpAllocations() - allocationsBefore;
+  }
+  TEST_ASSERT_EQUAL(200 * batchCommands, commands);
+  report("byte by byte", commands, micros, allocations);
+}
+
+int main()
+{
+  logger().begin();
+  TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, ends));
+  server = FTPConnection(ends[0]);
+  // As many commands as fit the assembler's buffer in one read
+  while (batch.size() + 64 < FTP_COMMAND_SIZE)
+  {
+    batch += session[batchCommands % sessionLength];
+    batch += "\r\n";
+    batchCommands++;
+  }
+
+  UNITY_BEGIN();
+  RUN_TEST(test_pipelined_commands_split);
+  RUN_TEST(test_overlong_line_is_empty_command);
+  RUN_TEST(test_assembler_rate);
+  RUN_TEST(test_byte_by_byte_rate);
+  int failures = UNITY_END();
+
+  ::close(ends[1]);
+  return failures;
+}
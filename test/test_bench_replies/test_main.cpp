@@ -0,0 +1,142 @@
+// Replies: heap allocations and connection writes (TCP segments on the
+// board) per command. The client side sends and receives with fixed
+// buffers, so the allocations counted while a command runs are the
+// server's.
+
+#include "../support/FTPAllocationCounter.h"
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+static FTPTestClient *client;
+
+static const int repeats = 200;
+
+void setUp() {}
+void tearDown() {}
+
+// Reads until the final line of a reply, without allocating
+static int rawReply(int fd, size_t &bytes)
+{
+  char text[2048];
+  size_t length = 0;
+  while (length < sizeof(text))
+  {
+    ssize_t received = recv(fd, text + length, sizeof(text) - length, 0);
+    if (received <= 0)
+      return -1;
+    length += received;
+    // The final line starts with the code and a space
+    for (size_t begin = 0; begin < length;)
+    {
+      const char *end = (const char *)memchr(text + begin, '\n', length - begin);
+      if (end == NULL)
+        break;
+      if (end - (text + begin) >= 4 && text[begin + 3] == ' ')
+      {
+        bytes = length;
+        return atoi(text + begin);
+      }
+      begin = end - text + 1;
+    }
+  }
+  return -1;
+}
+
+struct Cost
+{
+  double allocations;
+  double writes;
+  // Writes of a reply collected in one buffer, FTP_REPLY_SIZE at a time
+  double expectedWrites;
+};
+
+static Cost measure(const char *command, int expected)
+{
+  unsigned long allocations = 0, writes = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < repeats; i++)
+  {
+    unsigned long allocationsBefore = ftpAllocations();
+    unsigned long writesBefore = FTPFakeConnection::writes();
+    client->send("%s", command);
+    TEST_ASSERT_EQUAL(expected, rawReply(client->controlSocket(), bytes));
+    allocations += ftpAllocations() - allocationsBefore;
+    writes += FTPFakeConnection::writes() - writesBefore;
+  }
+  Cost cost = {(double)allocations / repeats, (double)writes / repeats, (double)((bytes + FTP_REPLY_SIZE - 1) / FTP_REPLY_SIZE)};
+  char line[120];
+  snprintf(line, sizeof(line), "%-14s %5.2f allocations, %4.2f writes, %u byte reply", command, cost.allocations, cost.writes, (unsigned)bytes);
+  TEST_MESSAGE(line);
+  return cost;
+}
+
+// Single and multi-line replies go out in one write each, the statistics
+// that do not fit FTP_REPLY_SIZE in as few as possible
+static void test_one_write_per_reply()
+{
+  static const char *const commands[] = {"NOOP", "PWD", "TYPE I", "SYST", "FEAT", "STAT", "SITE STATS",
+                                         "SIZE small.txt", "MDTM small.txt", "CWD /", "XYZZ"};
+  static const int codes[] = {200, 257, 200, 215, 211, 211, 211, 213, 213, 250, 500};
+  for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++)
+  {
+    Cost cost = measure(commands[i], codes[i]);
+    TEST_ASSERT_EQUAL_FLOAT(cost.expectedWrites, cost.writes);
+  }
+}
+
+// Replies that only format numbers and constants do not touch the heap
+static void test_constant_replies_allocate_nothing()
+{
+  TEST_ASSERT_EQUAL_FLOAT(0, measure("NOOP", 200).allocations);
+  TEST_ASSERT_EQUAL_FLOAT(0, measure("TYPE I", 200).allocations);
+  TEST_ASSERT_EQUAL_FLOAT(0, measure("SYST", 215).allocations);
+  TEST_ASSERT_EQUAL_FLOAT(0, measure("FEAT", 211).allocations);
+}
+
+// Banner on connect, 150 and the 226 pair around a small download
+static void test_banner_and_transfer()
+{
+  unsigned long writesBefore = FTPFakeConnection::writes();
+  FTPTestClient other(ftpFakeConnect);
+  TEST_ASSERT_TRUE(other.connect());
+  char line[120];
+  snprintf(line, sizeof(line), "banner         %lu writes", FTPFakeConnection::writes() - writesBefore);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL(1, FTPFakeConnection::writes() - writesBefore);
+
+  std::string received;
+  writesBefore = FTPFakeConnection::writes();
+  TEST_ASSERT_EQUAL(226, client->retrieve("small.txt", received));
+  // PASV, 150, the file's one chunk and the 226 reply
+  snprintf(line, sizeof(line), "PASV+RETR      %lu writes for a %u byte file", FTPFakeConnection::writes() - writesBefore, (unsigned)received.size());
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL(4, FTPFakeConnection::writes() - writesBefore);
+}
+
+int main()
+{
+  logger().begin();
+  FTPMemoryFile file = storage.open("/small.txt", "w");
+  file.write((const uint8_t *)"small file", 10);
+  file.close();
+  server = new FTPTestServer(storage);
+  server->start();
+  client = new FTPTestClient(ftpFakeConnect);
+  client->login();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_one_write_per_reply);
+  RUN_TEST(test_constant_replies_allocate_nothing);
+  RUN_TEST(test_banner_and_transfer);
+  int failures = UNITY_END();
+
+  delete client;
+  server->stop();
+  return failures;
+}
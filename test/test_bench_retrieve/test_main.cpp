@@ -0,0 +1,105 @@
+// RETR throughput with and without the read pipeline, on in-memory files
+// slowed down to SD card speed and sends that take as long as on WiFi.
+// Without the pipeline the card and the network take turns, with it they
+// overlap and the slower of the two sets the rate.
+
+// Chosen per run, see FTPSession::checkoutBuffers
+static bool benchPipelined = true;
+#define FTP_PIPELINED_RETRIEVE benchPipelined
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+static std::string content;
+
+void setUp() {}
+void tearDown() {}
+
+// FTP task wakeups since the last SITE STATS RESET
+static unsigned long loopWakeups(FTPTestClient &client)
+{
+  client.command("SITE STATS");
+  size_t at = client.reply.find("Loop wakeups ");
+  return at == std::string::npos ? 0 : strtoul(client.reply.c_str() + at + 13, NULL, 10);
+}
+
+static void run(const char *name, bool pipelined, unsigned long storageMicrosPerKB, double networkBytesPerSecond)
+{
+  benchPipelined = pipelined;
+  storage.getVolume().microsPerKB = storageMicrosPerKB;
+  FTPFakeConnection::sendRate() = networkBytesPerSecond;
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(200, client.command("SITE STATS RESET"));
+  TEST_ASSERT_TRUE(client.openData());
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(150, client.command("RETR bench.bin"));
+  std::string received;
+  client.receiveData(received);
+  TEST_ASSERT_EQUAL(226, client.readReply());
+  double seconds = (ftpTestMicros() - begin) / 1e6;
+  TEST_ASSERT_TRUE(received == content);
+
+  // Waiting for the reader must not spin the FTP task
+  double wakeupsPerChunk = (double)loopWakeups(client) / (content.size() / FTP_BUF_SIZE);
+  TEST_ASSERT_TRUE(wakeupsPerChunk < 20);
+  char line[160];
+  snprintf(line, sizeof(line), "%-10s %s: %.2f MB/s, %.1f FTP task wakeups per chunk",
+           name, pipelined ? "pipelined" : "plain    ", content.size() / seconds / 1e6, wakeupsPerChunk);
+  TEST_MESSAGE(line);
+  storage.getVolume().microsPerKB = 0;
+  FTPFakeConnection::sendRate() = 0;
+}
+
+// Card and network about as fast as each other, the case the pipeline is for
+static void test_balanced()
+{
+  run("balanced", false, 250, 4e6);
+  run("balanced", true, 250, 4e6);
+}
+
+static void test_slow_card()
+{
+  run("slow card", false, 500, 4e6);
+  run("slow card", true, 500, 4e6);
+}
+
+static void test_slow_network()
+{
+  run("slow net", false, 250, 2e6);
+  run("slow net", true, 250, 2e6);
+}
+
+static void test_unthrottled()
+{
+  run("memory", false, 0, 0);
+  run("memory", true, 0, 0);
+}
+
+int main()
+{
+  logger().begin();
+  content = ftpTestContent(2 * 1024 * 1024, 3);
+  FTPMemoryFile file = storage.open("/bench.bin", "w");
+  file.write((const uint8_t *)content.data(), content.size());
+  file.close();
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_balanced);
+  RUN_TEST(test_slow_card);
+  RUN_TEST(test_slow_network);
+  RUN_TEST(test_unthrottled);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
@@ -0,0 +1,163 @@
+// STOR throughput and the longest time the client cannot send, with and
+// without the write-behind pipeline, on in-memory files slowed down to SD
+// card speed and connections with a small window. Also checks that a card
+// that stops taking data ends the upload with 451, and one too slow to
+// write the end of the upload within FTP_PIPELINE_FINISH_TIMEOUT with 426.
+
+#define FTP_PIPELINE_FINISH_TIMEOUT 200
+
+// Chosen per run, see FTPSession::checkoutBuffers
+static bool benchPipelined = true;
+#define FTP_PIPELINED_STORE benchPipelined
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+static std::string content;
+
+void setUp()
+{
+  FTPMemoryVolume &volume = storage.getVolume();
+  volume.accessMicros = 0;
+  volume.microsPerKB = 0;
+  volume.spikeEvery = 0;
+  volume.spikeMicros = 0;
+  volume.failWrites = false;
+}
+
+void tearDown() {}
+
+// Send content in 1460 byte segments, returns the longest single send
+static uint64_t sendTimed(FTPTestClient &client)
+{
+  uint64_t longest = 0;
+  for (size_t sent = 0; sent < content.size();)
+  {
+    uint64_t begin = ftpTestMicros();
+    ssize_t written = ::send(client.dataSocket(), content.data() + sent, std::min<size_t>(1460, content.size() - sent), MSG_NOSIGNAL);
+    longest = std::max(longest, ftpTestMicros() - begin);
+    if (written <= 0)
+      break;
+    sent += written;
+  }
+  client.closeData();
+  return longest;
+}
+
+static void run(const char *name, bool pipelined)
+{
+  benchPipelined = pipelined;
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_TRUE(client.openData());
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(150, client.command("STOR bench.bin"));
+  uint64_t stall = sendTimed(client);
+  TEST_ASSERT_EQUAL(226, client.readReply());
+  double seconds = (ftpTestMicros() - begin) / 1e6;
+
+  std::string stored;
+  FTPMemoryFile file = storage.open("/bench.bin", "r");
+  stored.resize(file.size());
+  file.read((uint8_t *)&stored[0], stored.size());
+  TEST_ASSERT_TRUE(stored == content);
+
+  char line[160];
+  snprintf(line, sizeof(line), "%-12s %s: %.2f MB/s, longest client send %.1f ms",
+           name, pipelined ? "pipelined" : "plain    ", content.size() / seconds / 1e6, stall / 1e3);
+  TEST_MESSAGE(line);
+}
+
+static void test_steady_card()
+{
+  storage.getVolume().microsPerKB = 250;
+  run("steady card", false);
+  run("steady card", true);
+}
+
+// A 30 ms block erase every 64 writes
+static void test_card_with_pauses()
+{
+  storage.getVolume().microsPerKB = 250;
+  storage.getVolume().spikeEvery = 64;
+  storage.getVolume().spikeMicros = 30000;
+  run("pausing card", false);
+  run("pausing card", true);
+}
+
+static void test_unthrottled()
+{
+  run("memory", false);
+  run("memory", true);
+}
+
+// The upload ends with 451 in bounded time, the session stays usable
+static void test_write_failure()
+{
+  for (int pipelined = 0; pipelined < 2; pipelined++)
+  {
+    benchPipelined = pipelined;
+    storage.getVolume().failWrites = true;
+    FTPTestClient client(ftpFakeConnect);
+    TEST_ASSERT_TRUE(client.login());
+    uint64_t begin = ftpTestMicros();
+    TEST_ASSERT_EQUAL(451, client.store("failing.bin", content));
+    char line[120];
+    snprintf(line, sizeof(line), "failing card %s: 451 after %.1f ms", pipelined ? "pipelined" : "plain    ", (ftpTestMicros() - begin) / 1e3);
+    TEST_MESSAGE(line);
+    storage.getVolume().failWrites = false;
+    TEST_ASSERT_EQUAL(257, client.command("PWD"));
+  }
+}
+
+// The FTP task waits for the end of the upload at most
+// FTP_PIPELINE_FINISH_TIMEOUT and the chunk being written, not for all of it
+static void test_write_timeout()
+{
+  benchPipelined = true;
+  const unsigned long writeMillis = 200;
+  std::string upload = content.substr(0, FTP_PIPELINE_BUFFERS * FTP_BUF_SIZE);
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_TRUE(client.openData());
+  TEST_ASSERT_EQUAL(150, client.command("STOR slow.bin"));
+  storage.getVolume().accessMicros = writeMillis * 1000;
+  TEST_ASSERT_EQUAL(upload.size(), client.sendData(upload));
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(426, client.readReply());
+  double millis = (ftpTestMicros() - begin) / 1e3;
+  TEST_ASSERT_TRUE(millis < FTP_PIPELINE_FINISH_TIMEOUT + 3 * writeMillis);
+  char line[120];
+  snprintf(line, sizeof(line), "slow card pipelined: 426 after %.1f ms, %lu ms per chunk", millis, writeMillis);
+  TEST_MESSAGE(line);
+  storage.getVolume().accessMicros = 0;
+  TEST_ASSERT_EQUAL(257, client.command("PWD"));
+  TEST_ASSERT_EQUAL(226, client.store("slow.bin", upload));
+}
+
+int main()
+{
+  logger().begin();
+  content = ftpTestContent(2 * 1024 * 1024, 4);
+  FTPFakeListener::bufferSize() = 8192;
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_steady_card);
+  RUN_TEST(test_card_with_pauses);
+  RUN_TEST(test_unthrottled);
+  RUN_TEST(test_write_failure);
+  RUN_TEST(test_write_timeout);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
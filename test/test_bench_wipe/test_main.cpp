@@ -0,0 +1,180 @@
+// Time to wipe synthetic trees with SDWiper, on in-memory files that take
+// as long as an SD card to list and to remove entries. The recursive
+// wipe SDWiper replaced runs on the same trees for comparison, without
+// the Serial line it printed per entry (its cost at 115200 baud is
+// reported separately).
+
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include <SDWiper.h>
+#include "../support/FTPTestClient.h"
+
+static FTPMemoryStorage storage;
+
+void setUp()
+{
+  storage.getVolume().openMicros = 0;
+  storage.getVolume().removeMicros = 0;
+}
+
+void tearDown() {}
+
+struct Tree
+{
+  unsigned long files;
+  unsigned long directories;
+  // Bytes the old wipe printed, one line per entry
+  unsigned long printed;
+};
+
+static void addFile(Tree &tree, const String &path)
+{
+  storage.open(path, "w").write((const uint8_t *)"x", 1);
+  tree.files++;
+  tree.printed += path.length() + 2;
+}
+
+static void addDirectory(Tree &tree, const String &path)
+{
+  TEST_ASSERT_TRUE(storage.mkdir(path));
+  tree.directories++;
+  tree.printed += path.length() + 2;
+}
+
+// One directory of many files, as a capture folder
+static Tree wideTree()
+{
+  Tree tree = {0, 0, 0};
+  addDirectory(tree, "/captures");
+  char name[48];
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(name, sizeof(name), "/captures/sensor_%05d.csv", i);
+    addFile(tree, name);
+  }
+  return tree;
+}
+
+// A chain of nested directories with a file at every level
+static Tree deepTree()
+{
+  Tree tree = {0, 0, 0};
+  String path = "";
+  for (int depth = 0; depth < 200; depth++)
+  {
+    path += "/d";
+    addDirectory(tree, path);
+    addFile(tree, path + "/f");
+  }
+  return tree;
+}
+
+// Days, hours and files per hour
+static Tree mixedTree()
+{
+  Tree tree = {0, 0, 0};
+  char path[64];
+  for (int day = 0; day < 4; day++)
+  {
+    snprintf(path, sizeof(path), "/day%d", day);
+    addDirectory(tree, path);
+    for (int hour = 0; hour < 6; hour++)
+    {
+      snprintf(path, sizeof(path), "/day%d/hour%02d", day, hour);
+      addDirectory(tree, path);
+      for (int i = 0; i < 20; i++)
+      {
+        snprintf(path, sizeof(path), "/day%d/hour%02d/%03d.bin", day, hour, i);
+        addFile(tree, path);
+      }
+    }
+  }
+  return tree;
+}
+
+// The old SDCleaner without its Serial output: one level of recursion per
+// directory, entries removed while their directory is listed
+static void recursiveWipe(const String &path, unsigned long &removed)
+{
+  FTPMemoryFile dir = storage.open(path);
+  FTPMemoryFile file = dir.openNextFile();
+  while (file)
+  {
+    String filePath = file.path();
+    if (file.isDirectory())
+    {
+      recursiveWipe(filePath, removed);
+      removed += storage.rmdir(filePath);
+    }
+    else
+    {
+      removed += storage.remove(filePath);
+    }
+    file = dir.openNextFile();
+  }
+}
+
+static bool emptyRoot()
+{
+  FTPMemoryFile root = storage.open("/");
+  return !root.openNextFile();
+}
+
+static void run(const char *name, Tree (*build)())
+{
+  // 50 us to open an entry, 500 us to remove one
+  Tree tree = build();
+  storage.getVolume().openMicros = 50;
+  storage.getVolume().removeMicros = 500;
+  SDWiper wiper(storage);
+  SDWipeResult result = wiper.wipe("/");
+  TEST_ASSERT_EQUAL(tree.files, result.filesRemoved);
+  TEST_ASSERT_EQUAL(tree.directories, result.directoriesRemoved);
+  TEST_ASSERT_EQUAL(0, result.failures);
+  TEST_ASSERT_TRUE(emptyRoot());
+
+  storage.getVolume().openMicros = 0;
+  storage.getVolume().removeMicros = 0;
+  build();
+  storage.getVolume().openMicros = 50;
+  storage.getVolume().removeMicros = 500;
+  unsigned long removed = 0;
+  uint64_t begin = ftpTestMicros();
+  recursiveWipe("/", removed);
+  double recursiveMillis = (ftpTestMicros() - begin) / 1e3;
+  TEST_ASSERT_EQUAL(tree.files + tree.directories, removed);
+  TEST_ASSERT_TRUE(emptyRoot());
+
+  char line[200];
+  snprintf(line, sizeof(line), "%-6s %lu files, %lu dirs: SDWiper %lu ms (%.0f files/s), recursive %.0f ms + %.0f ms of Serial output",
+           name, tree.files, tree.directories, result.elapsedMillis, result.filesRemoved * 1000.0 / std::max(result.elapsedMillis, 1UL),
+           recursiveMillis, tree.printed * 10 / 115.2);
+  TEST_MESSAGE(line);
+}
+
+static void test_wide_tree()
+{
+  run("wide", wideTree);
+}
+
+static void test_deep_tree()
+{
+  run("deep", deepTree);
+}
+
+static void test_mixed_tree()
+{
+  run("mixed", mixedTree);
+}
+
+int main()
+{
+  logger().begin();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_wide_tree);
+  RUN_TEST(test_deep_tree);
+  RUN_TEST(test_mixed_tree);
+  return UNITY_END();
+}
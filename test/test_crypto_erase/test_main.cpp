@@ -0,0 +1,214 @@
+// Encryption at rest (FTP_ENCRYPTION): files are unreadable as soon as the
+// key is destroyed, also while transfers are running.
+
+#define FTP_ENCRYPTION 1
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static std::string root;
+static FTPTestServer *server;
+
+void setUp()
+{
+  ftpKeyStore().renew();
+}
+
+void tearDown() {}
+
+// RFC 8439, section 2.4.2
+static void test_cipher_vector()
+{
+  uint8_t key[FTP_CRYPTO_KEY_SIZE];
+  for (uint8_t i = 0; i < FTP_CRYPTO_KEY_SIZE; i++)
+  {
+    key[i] = i;
+  }
+  const uint8_t nonce[FTP_CRYPTO_NONCE_SIZE] = {0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0};
+  const char *plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+  const uint8_t expected[16] = {0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81};
+  uint8_t data[114];
+  memcpy(data, plaintext, sizeof(data));
+  // Block counter 1
+  FTPChaCha20::apply(key, nonce, 64, data, sizeof(data));
+  TEST_ASSERT_EQUAL_MEMORY(expected, data, sizeof(expected));
+  TEST_ASSERT_EQUAL(0x4d, data[113]);
+
+  // In parts, from any position
+  uint8_t parts[114];
+  memcpy(parts, plaintext, sizeof(parts));
+  FTPChaCha20::apply(key, nonce, 64, parts, 7);
+  FTPChaCha20::apply(key, nonce, 71, parts + 7, 60);
+  FTPChaCha20::apply(key, nonce, 131, parts + 67, 47);
+  TEST_ASSERT_EQUAL_MEMORY(data, parts, sizeof(data));
+}
+
+static void test_no_plaintext_on_card()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  std::string content = std::string(20000, 'A') + "secret marker";
+  TEST_ASSERT_EQUAL(226, client.store("plain.txt", content));
+  std::string raw;
+  TEST_ASSERT_TRUE(ftpTestReadFile(root + "/plain.txt", raw));
+  TEST_ASSERT_EQUAL(content.size() + FTP_CRYPTO_HEADER_SIZE, raw.size());
+  TEST_ASSERT_TRUE(raw.find("secret marker") == std::string::npos);
+  TEST_ASSERT_TRUE(raw.find("AAAAAAAA") == std::string::npos);
+
+  std::string back;
+  TEST_ASSERT_EQUAL(226, client.retrieve("plain.txt", back));
+  TEST_ASSERT_TRUE(back == content);
+}
+
+// The header stays, the resumed upload is cut at the offset
+static void test_resumed_upload_truncated()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  std::string content = ftpTestContent(100000, 8);
+  TEST_ASSERT_EQUAL(226, client.store("resumed.bin", content));
+  TEST_ASSERT_EQUAL(350, client.command("REST 500"));
+  TEST_ASSERT_EQUAL(226, client.store("resumed.bin", "end"));
+  std::string raw;
+  TEST_ASSERT_TRUE(ftpTestReadFile(root + "/resumed.bin", raw));
+  TEST_ASSERT_EQUAL(503 + FTP_CRYPTO_HEADER_SIZE, raw.size());
+  std::string back;
+  TEST_ASSERT_EQUAL(226, client.retrieve("resumed.bin", back));
+  TEST_ASSERT_TRUE(back == content.substr(0, 500) + "end");
+}
+
+static void test_unreadable_after_destroy()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  std::string content = ftpTestContent(100000);
+  TEST_ASSERT_EQUAL(226, client.store("wiped.bin", content));
+
+  FTPStorage storage(FTPPlatformStorage(root.c_str()));
+  FTPFile open = storage.open("/wiped.bin", "r");
+  TEST_ASSERT_TRUE((bool)open);
+
+  ftpKeyStore().destroy();
+
+  // Neither new opens nor handles already open give data
+  TEST_ASSERT_FALSE((bool)storage.open("/wiped.bin", "r"));
+  uint8_t buffer[256];
+  TEST_ASSERT_EQUAL(-1, open.read(buffer, sizeof(buffer)));
+  uint8_t chunk[16] = {1, 2, 3};
+  TEST_ASSERT_EQUAL(0, open.write(chunk, sizeof(chunk)));
+  TEST_ASSERT_EQUAL(1, chunk[0]);
+  open.close();
+
+  std::string back;
+  TEST_ASSERT_EQUAL(550, client.retrieve("wiped.bin", back));
+  TEST_ASSERT_EQUAL(0, back.size());
+
+  // A new key does not decrypt the old files
+  ftpKeyStore().renew();
+  TEST_ASSERT_EQUAL(226, client.retrieve("wiped.bin", back));
+  TEST_ASSERT_EQUAL(content.size(), back.size());
+  TEST_ASSERT_FALSE(back == content);
+}
+
+// The key is destroyed on another task while chunks are being written:
+// every chunk that went to the card is fully encrypted with the old key,
+// none with a partly zeroed one
+static void test_destroy_during_writes()
+{
+  FTPStorage storage(FTPPlatformStorage(root.c_str()));
+  for (int round = 0; round < 40; round++)
+  {
+    uint8_t oldKey[FTP_CRYPTO_KEY_SIZE];
+    TEST_ASSERT_TRUE(ftpKeyStore().copyKey(oldKey, ftpKeyStore().getGeneration()));
+    FTPFile file = storage.open("/race.bin", "w");
+    TEST_ASSERT_TRUE((bool)file);
+
+    std::string plain = ftpTestContent(4096, round);
+    std::atomic<size_t> written(0);
+    std::thread writer([&]
+                       {
+                         std::string chunk;
+                         while (true)
+                         {
+                           chunk = plain;
+                           size_t n = file.write((uint8_t *)&chunk[0], chunk.size());
+                           written += n;
+                           if (n < chunk.size())
+                             break;
+                         }
+                       });
+    std::this_thread::sleep_for(std::chrono::microseconds(200 + round * 37));
+    ftpKeyStore().destroy();
+    writer.join();
+    file.close();
+
+    std::string raw;
+    TEST_ASSERT_TRUE(ftpTestReadFile(root + "/race.bin", raw));
+    TEST_ASSERT_EQUAL(written + FTP_CRYPTO_HEADER_SIZE, raw.size());
+    uint8_t *data = (uint8_t *)&raw[FTP_CRYPTO_HEADER_SIZE];
+    FTPChaCha20::apply(oldKey, (uint8_t *)&raw[4], 0, data, written);
+    for (size_t offset = 0; offset < written; offset += plain.size())
+    {
+      TEST_ASSERT_EQUAL_MEMORY(plain.data(), data + offset, min(plain.size(), written - offset));
+    }
+    ftpKeyStore().renew();
+  }
+}
+
+// The key is destroyed while a download is running: the client gets an
+// error, not the rest of the file and 226
+static void test_destroy_during_retrieve()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  std::string content = ftpTestContent(4000000, 7);
+  TEST_ASSERT_EQUAL(226, client.store("long.bin", content));
+  TEST_ASSERT_TRUE(client.openData());
+  TEST_ASSERT_EQUAL(150, client.command("RETR long.bin"));
+  std::string back;
+  client.receiveData(back, 100000);
+  ftpKeyStore().destroy();
+  int code = client.readReply();
+  TEST_ASSERT_TRUE(code == 451 || code == 426);
+}
+
+static void test_cipher_throughput()
+{
+  uint8_t key[FTP_CRYPTO_KEY_SIZE] = {1};
+  uint8_t nonce[FTP_CRYPTO_NONCE_SIZE] = {2};
+  std::string data(FTP_BUF_SIZE, 'x');
+  const size_t total = 64 * 1024 * 1024;
+  uint64_t begin = ftpTestMicros();
+  for (size_t position = 0; position < total; position += data.size())
+  {
+    FTPChaCha20::apply(key, nonce, position, (uint8_t *)&data[0], data.size());
+  }
+  double seconds = (ftpTestMicros() - begin) / 1e6;
+  char line[100];
+  snprintf(line, sizeof(line), "ChaCha20 in %u byte chunks: %.1f MB/s", (unsigned)FTP_BUF_SIZE, total / seconds / 1e6);
+  TEST_MESSAGE(line);
+}
+
+int main()
+{
+  root = ftpTestTempDir("ftp_crypto");
+  logger().begin();
+  server = new FTPTestServer(FTPStorage(FTPPlatformStorage(root.c_str())));
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_cipher_vector);
+  RUN_TEST(test_no_plaintext_on_card);
+  RUN_TEST(test_resumed_upload_truncated);
+  RUN_TEST(test_unreadable_after_destroy);
+  RUN_TEST(test_destroy_during_writes);
+  RUN_TEST(test_destroy_during_retrieve);
+  RUN_TEST(test_cipher_throughput);
+  int failures = UNITY_END();
+
+  server->stop();
+  ftpTestRemoveTree(root);
+  return failures;
+}
@@ -0,0 +1,113 @@
+// A transfer waiting for its data connection (PASV, then RETR without
+// connecting): the control connection is still served, NOOP and ABOR are
+// answered within a bounded loop gap, and a client that never connects
+// gets 425 after FTP_DATA_CONNECT_TIMEOUT.
+
+#define FTP_DATA_CONNECT_TIMEOUT 1000
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+// Longest control loop gap and NOOP round trip accepted, in us
+#define MAX_GAP_MICROS 50000
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+static FTPTestClient *client;
+
+void setUp()
+{
+  TEST_ASSERT_EQUAL(200, client->command("SITE STATS RESET"));
+}
+
+void tearDown() {}
+
+// Value after label in the SITE STATS reply
+static unsigned long statistic(const char *label)
+{
+  client->command("SITE STATS");
+  size_t at = client->reply.find(label);
+  TEST_ASSERT_TRUE(at != std::string::npos);
+  return strtoul(client->reply.c_str() + at + strlen(label), NULL, 10);
+}
+
+// NOOPs while the transfer waits, returns the slowest round trip in us
+static uint64_t noops(int count)
+{
+  uint64_t slowest = 0;
+  for (int i = 0; i < count; i++)
+  {
+    uint64_t begin = ftpTestMicros();
+    TEST_ASSERT_EQUAL(200, client->command("NOOP"));
+    slowest = std::max(slowest, ftpTestMicros() - begin);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return slowest;
+}
+
+static void test_abort_pending_transfer()
+{
+  TEST_ASSERT_EQUAL(227, client->command("PASV"));
+  client->send("RETR file.bin");
+  uint64_t slowest = noops(20);
+  TEST_ASSERT_LESS_THAN(MAX_GAP_MICROS, slowest);
+
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_EQUAL(426, client->command("ABOR"));
+  TEST_ASSERT_EQUAL(226, client->readReply());
+  uint64_t abort = ftpTestMicros() - begin;
+  TEST_ASSERT_LESS_THAN(MAX_GAP_MICROS, abort);
+
+  unsigned long gap = statistic("longest control loop gap waiting for data ");
+  TEST_ASSERT_LESS_THAN(MAX_GAP_MICROS, gap);
+  TEST_ASSERT_EQUAL(0, statistic("data timeouts "));
+  char line[120];
+  snprintf(line, sizeof(line), "Pending RETR: slowest NOOP %lu us, ABOR %lu us, control loop gap %lu us",
+           (unsigned long)slowest, (unsigned long)abort, gap);
+  TEST_MESSAGE(line);
+
+  // The session takes transfers again
+  std::string content;
+  TEST_ASSERT_EQUAL(226, client->retrieve("file.bin", content));
+  TEST_ASSERT_EQUAL(1000, content.size());
+}
+
+static void test_timeout_reported()
+{
+  TEST_ASSERT_EQUAL(227, client->command("PASV"));
+  uint64_t begin = ftpTestMicros();
+  client->send("RETR file.bin");
+  uint64_t slowest = noops(10);
+  TEST_ASSERT_LESS_THAN(MAX_GAP_MICROS, slowest);
+  TEST_ASSERT_EQUAL(425, client->readReply(FTP_DATA_CONNECT_TIMEOUT * 3));
+  TEST_ASSERT_TRUE(ftpTestMicros() - begin >= FTP_DATA_CONNECT_TIMEOUT * 1000);
+
+  TEST_ASSERT_EQUAL(1, statistic("data timeouts "));
+  TEST_ASSERT_LESS_THAN(MAX_GAP_MICROS, statistic("longest control loop gap waiting for data "));
+  TEST_ASSERT_EQUAL(257, client->command("PWD"));
+}
+
+int main()
+{
+  logger().begin();
+  std::string content = ftpTestContent(1000);
+  storage.open("/file.bin", "w").write((const uint8_t *)content.data(), content.size());
+  server = new FTPTestServer(storage);
+  server->start();
+  client = new FTPTestClient(ftpFakeConnect);
+  client->login();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_abort_pending_transfer);
+  RUN_TEST(test_timeout_reported);
+  int failures = UNITY_END();
+
+  delete client;
+  server->stop();
+  return failures;
+}
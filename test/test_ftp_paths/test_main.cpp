@@ -0,0 +1,121 @@
+// Clients cannot reach host files outside the directory the native server
+// serves: paths are normalized, ".." stops at the root.
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static std::string base;
+static std::string root;
+static FTPTestServer *server;
+
+void setUp() {}
+void tearDown() {}
+
+static void test_normalize()
+{
+  TEST_ASSERT_EQUAL_STRING("/", ftpNormalizePath("/").c_str());
+  TEST_ASSERT_EQUAL_STRING("/", ftpNormalizePath("").c_str());
+  TEST_ASSERT_EQUAL_STRING("/", ftpNormalizePath("/..").c_str());
+  TEST_ASSERT_EQUAL_STRING("/", ftpNormalizePath("/a/../..").c_str());
+  TEST_ASSERT_EQUAL_STRING("/a/b", ftpNormalizePath("/a//./b/").c_str());
+  TEST_ASSERT_EQUAL_STRING("/b", ftpNormalizePath("/a/../b").c_str());
+  TEST_ASSERT_EQUAL_STRING("/etc/hostname", ftpNormalizePath("/../../etc/hostname").c_str());
+  TEST_ASSERT_EQUAL_STRING("/x", ftpNormalizePath("x").c_str());
+  TEST_ASSERT_EQUAL_STRING("/..a/b..", ftpNormalizePath("/..a/b..").c_str());
+}
+
+static void test_storage_stays_in_root()
+{
+  FTPPosixStorage storage(root.c_str());
+  TEST_ASSERT_TRUE(storage.exists("/inside.txt"));
+  TEST_ASSERT_FALSE(storage.exists("/../secret.txt"));
+  TEST_ASSERT_FALSE((bool)storage.open("/../secret.txt", "r"));
+  TEST_ASSERT_FALSE((bool)storage.open("../secret.txt", "r"));
+  TEST_ASSERT_FALSE(storage.remove("/../secret.txt"));
+  TEST_ASSERT_TRUE(ftpTestExists(base + "/secret.txt"));
+
+  FTPPosixFile file = storage.open("/../../inside.txt", "r");
+  TEST_ASSERT_TRUE((bool)file);
+  TEST_ASSERT_EQUAL_STRING("/inside.txt", file.path());
+}
+
+static void test_retr_outside_root()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  std::string content;
+  TEST_ASSERT_EQUAL(550, client.retrieve("../secret.txt", content));
+  TEST_ASSERT_EQUAL(550, client.retrieve("/../../secret.txt", content));
+  std::string escaped = std::string("../../../../../../..") + base + "/secret.txt";
+  TEST_ASSERT_EQUAL(550, client.retrieve(escaped.c_str(), content));
+  TEST_ASSERT_EQUAL(0, content.size());
+
+  // Inside the root ".." still works
+  TEST_ASSERT_EQUAL(226, client.retrieve("sub/../inside.txt", content));
+  TEST_ASSERT_EQUAL_STRING("inside", content.c_str());
+}
+
+static void test_cwd_clamped()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(250, client.command("CWD ../../.."));
+  TEST_ASSERT_EQUAL(257, client.command("PWD"));
+  TEST_ASSERT_TRUE(client.reply.find("\"/\"") != std::string::npos);
+  TEST_ASSERT_EQUAL(250, client.command("CDUP"));
+  std::string content;
+  TEST_ASSERT_EQUAL(550, client.retrieve("secret.txt", content));
+  TEST_ASSERT_EQUAL(226, client.retrieve("inside.txt", content));
+}
+
+static void test_changes_outside_root()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(226, client.store("../../stored.txt", "stored"));
+  TEST_ASSERT_TRUE(ftpTestExists(root + "/stored.txt"));
+  TEST_ASSERT_FALSE(ftpTestExists(base + "/stored.txt"));
+
+  TEST_ASSERT_EQUAL(550, client.command("DELE ../secret.txt"));
+  TEST_ASSERT_TRUE(ftpTestExists(base + "/secret.txt"));
+  // A failed DELE ends the session
+  client.close();
+  TEST_ASSERT_TRUE(client.login());
+
+  TEST_ASSERT_EQUAL(350, client.command("RNFR stored.txt"));
+  TEST_ASSERT_EQUAL(250, client.command("RNTO ../moved.txt"));
+  TEST_ASSERT_TRUE(ftpTestExists(root + "/moved.txt"));
+  TEST_ASSERT_FALSE(ftpTestExists(base + "/moved.txt"));
+
+  TEST_ASSERT_EQUAL(275, client.command("MKD ../made"));
+  TEST_ASSERT_TRUE(ftpTestExists(root + "/made"));
+  TEST_ASSERT_FALSE(ftpTestExists(base + "/made"));
+}
+
+int main()
+{
+  base = ftpTestTempDir("ftp_paths");
+  root = base + "/root";
+  mkdir(root.c_str(), 0755);
+  mkdir((root + "/sub").c_str(), 0755);
+  ftpTestWriteFile(base + "/secret.txt", "outside");
+  ftpTestWriteFile(root + "/inside.txt", "inside");
+
+  logger().begin();
+  server = new FTPTestServer(FTPStorage(root.c_str()));
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_normalize);
+  RUN_TEST(test_storage_stays_in_root);
+  RUN_TEST(test_retr_outside_root);
+  RUN_TEST(test_cwd_clamped);
+  RUN_TEST(test_changes_outside_root);
+  int failures = UNITY_END();
+
+  server->stop();
+  ftpTestRemoveTree(base);
+  return failures;
+}
@@ -0,0 +1,231 @@
+// FTPServer::quiesce() as the wipe task uses it: transfers in flight are
+// aborted with 426 and their files closed, storage commands get 450 while
+// other commands are still answered, resume() serves the storage again
+// with fresh listings, and a quiesce() that timed out does not make the
+// next one return before the FTP task let go of the storage.
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+
+void setUp()
+{
+  storage.getVolume().accessMicros = 0;
+  storage.getVolume().microsPerKB = 0;
+  storage.getVolume().removeMicros = 0;
+}
+
+void tearDown()
+{
+  server->get().resume();
+}
+
+static void putFile(const char *path, const std::string &content)
+{
+  storage.open(path, "w").write((const uint8_t *)content.data(), content.size());
+}
+
+// Wait for a command sent with send() to start, the FTP task is then busy
+// with it
+static void pause(int millis)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+}
+
+// The sessions of the clients of the previous test are free once the
+// server saw them leave
+static bool login(FTPTestClient &client)
+{
+  for (int attempt = 0; attempt < 100; attempt++)
+  {
+    if (client.login())
+      return true;
+    pause(10);
+  }
+  return false;
+}
+
+// Quiesces and those too late, from SITE STATS
+static void quiesceCounts(FTPTestClient &client, unsigned long &quiesces, unsigned long &late)
+{
+  TEST_ASSERT_EQUAL(211, client.command("SITE STATS"));
+  size_t at = client.reply.find("Quiesced ");
+  TEST_ASSERT_TRUE(at != std::string::npos);
+  char *end;
+  quiesces = strtoul(client.reply.c_str() + at + strlen("Quiesced "), &end, 10);
+  late = strtoul(end + strlen(" times, "), NULL, 10);
+}
+
+static void test_transfers_aborted()
+{
+  std::string content = ftpTestContent(4000000, 25);
+  putFile("/big.bin", content);
+  // About 1 MB/s, as an SD card: the download lasts seconds
+  storage.getVolume().microsPerKB = 1000;
+
+  FTPTestClient reader(ftpFakeConnect);
+  TEST_ASSERT_TRUE(login(reader));
+  TEST_ASSERT_TRUE(reader.openData());
+  TEST_ASSERT_EQUAL(150, reader.command("RETR big.bin"));
+  char buffer[16384];
+  TEST_ASSERT_TRUE(recv(reader.dataSocket(), buffer, sizeof(buffer), 0) > 0);
+
+  FTPTestClient writer(ftpFakeConnect);
+  TEST_ASSERT_TRUE(login(writer));
+  unsigned long quiesces, late;
+  quiesceCounts(writer, quiesces, late);
+  TEST_ASSERT_TRUE(writer.openData());
+  TEST_ASSERT_EQUAL(150, writer.command("STOR upload.bin"));
+  std::string part = ftpTestContent(100000, 26);
+  TEST_ASSERT_EQUAL((ssize_t)part.size(), ::send(writer.dataSocket(), part.data(), part.size(), MSG_NOSIGNAL));
+  pause(50);
+  TEST_ASSERT_EQUAL(2, storage.getVolume().openFiles.load());
+
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_TRUE(server->get().quiesce());
+  uint64_t elapsed = ftpTestMicros() - begin;
+  TEST_ASSERT_EQUAL(0, storage.getVolume().openFiles.load());
+
+  TEST_ASSERT_LESS_THAN(FTP_QUIESCE_TIMEOUT * 1000, elapsed);
+  TEST_ASSERT_TRUE(server->get().getQuiesceMicros() > 0);
+  TEST_ASSERT_TRUE(server->get().getQuiesceMicros() <= elapsed);
+  char line[80];
+  snprintf(line, sizeof(line), "quiesce() returned in %lu us, FTP task took %lu us", (unsigned long)elapsed,
+           server->get().getQuiesceMicros());
+  TEST_MESSAGE(line);
+
+  TEST_ASSERT_EQUAL(426, reader.readReply());
+  TEST_ASSERT_EQUAL(426, writer.readReply());
+  reader.closeData();
+  writer.closeData();
+  unsigned long quiescesAfter, lateAfter;
+  quiesceCounts(writer, quiescesAfter, lateAfter);
+  TEST_ASSERT_EQUAL(quiesces + 1, quiescesAfter);
+  TEST_ASSERT_EQUAL(late, lateAfter);
+}
+
+static void test_storage_commands_refused()
+{
+  putFile("/kept.txt", "kept");
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(login(client));
+  TEST_ASSERT_TRUE(server->get().quiesce());
+
+  TEST_ASSERT_EQUAL(450, client.command("SIZE kept.txt"));
+  TEST_ASSERT_EQUAL(450, client.command("CWD /"));
+  TEST_ASSERT_EQUAL(450, client.command("MKD /new"));
+  TEST_ASSERT_EQUAL(450, client.command("DELE kept.txt"));
+  std::string content;
+  TEST_ASSERT_EQUAL(450, client.retrieve("kept.txt", content));
+  TEST_ASSERT_EQUAL(450, client.store("other.txt", "other"));
+  std::string listing;
+  TEST_ASSERT_EQUAL(450, client.list("NLST", listing));
+
+  TEST_ASSERT_EQUAL(200, client.command("NOOP"));
+  TEST_ASSERT_EQUAL(257, client.command("PWD"));
+  TEST_ASSERT_TRUE(storage.exists("/kept.txt"));
+  TEST_ASSERT_FALSE(storage.exists("/new"));
+  TEST_ASSERT_FALSE(storage.exists("/other.txt"));
+}
+
+static void test_resume_serves_fresh_listing()
+{
+  storage.mkdir("/resume");
+  putFile("/resume/before.txt", "before");
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(login(client));
+  TEST_ASSERT_EQUAL(250, client.command("CWD /resume"));
+  std::string listing;
+  TEST_ASSERT_EQUAL(226, client.list("NLST", listing));
+  listing.clear();
+  TEST_ASSERT_EQUAL(226, client.list("NLST", listing));
+  TEST_ASSERT_EQUAL_STRING("before.txt\r\n", listing.c_str());
+
+  // The wipe changes the card while the server keeps off it
+  TEST_ASSERT_TRUE(server->get().quiesce());
+  storage.remove("/resume/before.txt");
+  putFile("/resume/after.txt", "after");
+  TEST_ASSERT_EQUAL(450, client.command("SIZE after.txt"));
+  server->get().resume();
+
+  listing.clear();
+  TEST_ASSERT_EQUAL(226, client.list("NLST", listing));
+  TEST_ASSERT_EQUAL_STRING("after.txt\r\n", listing.c_str());
+  std::string content;
+  TEST_ASSERT_EQUAL(226, client.retrieve("after.txt", content));
+  TEST_ASSERT_EQUAL_STRING("after", content.c_str());
+  TEST_ASSERT_EQUAL(226, client.store("stored.txt", "stored"));
+  TEST_ASSERT_TRUE(storage.exists("/resume/stored.txt"));
+}
+
+static void test_late_quiesce()
+{
+  storage.mkdir("/late");
+  putFile("/late/a.bin", "a");
+  putFile("/late/b.bin", "b");
+  FTPTestClient client(ftpFakeConnect);
+  TEST_ASSERT_TRUE(login(client));
+  unsigned long quiesces, late;
+  quiesceCounts(client, quiesces, late);
+
+  // The FTP task is stuck in a slow remove for longer than the timeout
+  const unsigned long removeMillis = 300;
+  storage.getVolume().removeMicros = removeMillis * 1000;
+  client.send("DELE /late/a.bin");
+  pause(30);
+  uint64_t begin = ftpTestMicros();
+  TEST_ASSERT_FALSE(server->get().quiesce(50));
+  TEST_ASSERT_TRUE(ftpTestMicros() - begin >= 50000);
+  TEST_ASSERT_EQUAL(250, client.readReply());
+
+  // It quiesces once the remove is done, and gives the semaphore nobody
+  // waits for any more
+  for (int i = 0; i < 200 && server->get().getQuiesceMicros() < 100000; i++)
+  {
+    pause(10);
+  }
+  TEST_ASSERT_TRUE(server->get().getQuiesceMicros() >= 100000);
+  server->get().resume();
+  TEST_ASSERT_EQUAL(213, client.command("SIZE /late/b.bin"));
+
+  // The next quiesce() must wait for its own request, not take that give
+  client.send("DELE /late/b.bin");
+  pause(30);
+  begin = ftpTestMicros();
+  TEST_ASSERT_TRUE(server->get().quiesce(1000));
+  uint64_t elapsed = ftpTestMicros() - begin;
+  TEST_ASSERT_TRUE(elapsed >= (removeMillis - 100) * 1000);
+  TEST_ASSERT_TRUE(server->get().getQuiesceMicros() >= (removeMillis - 100) * 1000);
+  TEST_ASSERT_EQUAL(250, client.readReply());
+  TEST_ASSERT_EQUAL(450, client.command("SIZE /late/a.bin"));
+
+  storage.getVolume().removeMicros = 0;
+  unsigned long quiescesAfter, lateAfter;
+  quiesceCounts(client, quiescesAfter, lateAfter);
+  TEST_ASSERT_EQUAL(quiesces + 2, quiescesAfter);
+  TEST_ASSERT_EQUAL(late + 1, lateAfter);
+}
+
+int main()
+{
+  logger().begin();
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_transfers_aborted);
+  RUN_TEST(test_storage_commands_refused);
+  RUN_TEST(test_resume_serves_fresh_listing);
+  RUN_TEST(test_late_quiesce);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
@@ -0,0 +1,160 @@
+// Transfers that lose their data connection end with 426 and can be
+// resumed with REST; the bytes that did arrive never have a hole.
+
+// Give up on a client that stops reading quickly
+#define FTP_POSIX_WRITE_TIMEOUT 300
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static std::string root;
+static std::string content;
+static FTPTestServer *server;
+
+void setUp() {}
+void tearDown() {}
+
+// Resume a RETR from what the client got, the concatenation is the file
+static void resume(FTPTestClient &client, const char *path, std::string &got)
+{
+  TEST_ASSERT_EQUAL(350, client.command("REST %lu", (unsigned long)got.size()));
+  std::string rest;
+  TEST_ASSERT_EQUAL(226, client.retrieve(path, rest));
+  TEST_ASSERT_EQUAL(content.size() - got.size(), rest.size());
+  got += rest;
+}
+
+static void test_retr_cut_and_resumed()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  std::string got;
+  TEST_ASSERT_EQUAL(426, client.retrieve("big.bin", got, 1000000));
+  TEST_ASSERT_EQUAL(1000000, got.size());
+  resume(client, "big.bin", got);
+  TEST_ASSERT_TRUE(got == content);
+}
+
+// The client reads a while, stops reading until the server gives up on the
+// socket, then takes what was sent: it is the start of the file, not the
+// start with a hole
+static void test_retr_stalled_and_resumed()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_TRUE(client.openData());
+  TEST_ASSERT_EQUAL(150, client.command("RETR big.bin"));
+  std::string got;
+  char buffer[4096];
+  for (int i = 0; i < 50; i++)
+  {
+    ssize_t length = recv(client.dataSocket(), buffer, sizeof(buffer), 0);
+    TEST_ASSERT_TRUE(length > 0);
+    got.append(buffer, length);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+  client.receiveData(got, SIZE_MAX, 2000);
+  int code = client.readReply();
+  TEST_ASSERT_TRUE(code == 426 || code == 226);
+  TEST_ASSERT_TRUE(got.size() <= content.size());
+  TEST_ASSERT_TRUE(got == content.substr(0, got.size()));
+  if (code == 426)
+  {
+    resume(client, "big.bin", got);
+  }
+  TEST_ASSERT_TRUE(got == content);
+}
+
+static void test_stor_cut_and_resumed()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(226, client.store("up.bin", content, 3000000));
+  TEST_ASSERT_EQUAL(213, client.command("SIZE up.bin"));
+  TEST_ASSERT_EQUAL_STRING("213 3000000\n", client.reply.c_str());
+
+  TEST_ASSERT_EQUAL(350, client.command("REST 3000000"));
+  TEST_ASSERT_EQUAL(226, client.store("up.bin", content.substr(3000000)));
+  std::string stored;
+  TEST_ASSERT_TRUE(ftpTestReadFile(root + "/up.bin", stored));
+  TEST_ASSERT_EQUAL(content.size(), stored.size());
+  TEST_ASSERT_TRUE(stored == content);
+}
+
+// A resumed upload shorter than the file it resumes leaves nothing of the
+// old end behind, and one past the end of the file is refused
+static void test_stor_resumed_shorter()
+{
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(226, client.store("short.bin", content.substr(0, 1000000)));
+  std::string replacement = ftpTestContent(5000, 7);
+  TEST_ASSERT_EQUAL(350, client.command("REST 1000"));
+  TEST_ASSERT_EQUAL(226, client.store("short.bin", replacement));
+  std::string stored;
+  TEST_ASSERT_TRUE(ftpTestReadFile(root + "/short.bin", stored));
+  TEST_ASSERT_EQUAL(6000, stored.size());
+  TEST_ASSERT_TRUE(stored == content.substr(0, 1000) + replacement);
+
+  TEST_ASSERT_EQUAL(350, client.command("REST 6001"));
+  TEST_ASSERT_TRUE(client.openData());
+  TEST_ASSERT_EQUAL(554, client.command("STOR short.bin"));
+  client.closeData();
+  TEST_ASSERT_EQUAL(350, client.command("REST 10"));
+  TEST_ASSERT_TRUE(client.openData());
+  TEST_ASSERT_EQUAL(554, client.command("STOR missing.bin"));
+  client.closeData();
+  TEST_ASSERT_FALSE(ftpTestExists(root + "/missing.bin"));
+  TEST_ASSERT_TRUE(ftpTestReadFile(root + "/short.bin", stored));
+  TEST_ASSERT_EQUAL(6000, stored.size());
+}
+
+// A cut listing ends with 426 and the session goes on
+static void test_list_cut()
+{
+  mkdir((root + "/many").c_str(), 0755);
+  for (int i = 0; i < 3000; i++)
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "%s/many/file_with_a_long_name_%04d.txt", root.c_str(), i);
+    ftpTestWriteFile(name, "x");
+  }
+  FTPTestClient client;
+  TEST_ASSERT_TRUE(client.login());
+  TEST_ASSERT_EQUAL(250, client.command("CWD many"));
+  TEST_ASSERT_TRUE(client.openData());
+  TEST_ASSERT_EQUAL(150, client.command("LIST"));
+  struct linger reset = {1, 0};
+  setsockopt(client.dataSocket(), SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+  std::string listing;
+  client.receiveData(listing, 1000);
+  TEST_ASSERT_EQUAL(426, client.readReply());
+
+  TEST_ASSERT_EQUAL(226, client.list("NLST", listing));
+  TEST_ASSERT_TRUE(listing.find("file_with_a_long_name_2999.txt") != std::string::npos);
+}
+
+int main()
+{
+  root = ftpTestTempDir("ftp_resume");
+  content = ftpTestContent(16 * 1024 * 1024, 3);
+  ftpTestWriteFile(root + "/big.bin", content);
+  logger().begin();
+  server = new FTPTestServer(FTPStorage(root.c_str()));
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_retr_cut_and_resumed);
+  RUN_TEST(test_retr_stalled_and_resumed);
+  RUN_TEST(test_stor_cut_and_resumed);
+  RUN_TEST(test_stor_resumed_shorter);
+  RUN_TEST(test_list_cut);
+  int failures = UNITY_END();
+
+  server->stop();
+  ftpTestRemoveTree(root);
+  return failures;
+}
@@ -0,0 +1,169 @@
+// Several clients at once, on the in-process network and in-memory files:
+// every session gets its own files back intact, an extra client is turned
+// away, and the aggregate throughput is reported.
+
+#include "../support/FTPFakeNetwork.h"
+#include "../support/FTPMemoryStorage.h"
+
+#include <unity.h>
+#include "../support/FTPTestServer.h"
+#include "../support/FTPTestClient.h"
+#include "../support/FTPTestFiles.h"
+
+static FTPMemoryStorage storage;
+static FTPTestServer *server;
+
+void setUp()
+{
+  storage.getVolume().accessMicros = 0;
+  storage.getVolume().microsPerKB = 0;
+}
+
+void tearDown() {}
+
+struct SessionResult
+{
+  bool ok = true;
+  std::string failure;
+  uint64_t bytes = 0;
+};
+
+// One client: upload, download and list its files rounds times
+static void runSession(int id, int rounds, size_t size, SessionResult &result)
+{
+  FTPTestClient client(ftpFakeConnect);
+  if (!client.login())
+  {
+    result.ok = false;
+    result.failure = "login";
+    return;
+  }
+  char directory[32];
+  snprintf(directory, sizeof(directory), "client%d", id);
+  client.command("MKD %s", directory);
+  if (client.command("CWD %s", directory) != 250)
+  {
+    result.ok = false;
+    result.failure = "CWD";
+    return;
+  }
+  for (int round = 0; round < rounds && result.ok; round++)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "file%d.bin", round);
+    std::string content = ftpTestContent(size, id * 1000 + round);
+    std::string back;
+    std::string listing;
+    if (client.store(name, content) != 226)
+    {
+      result.failure = std::string("STOR ") + name + ": " + client.reply;
+    }
+    else if (client.retrieve(name, back) != 226 || back != content)
+    {
+      result.failure = std::string("RETR ") + name + ": " + client.reply;
+    }
+    else if (client.list("NLST", listing) != 226 || listing.find(name) == std::string::npos)
+    {
+      result.failure = std::string("NLST: ") + client.reply;
+    }
+    result.ok = result.failure.empty();
+    result.bytes += 2 * size;
+  }
+  client.command("QUIT");
+}
+
+static double runSessions(int sessions, int rounds, size_t size)
+{
+  std::vector<SessionResult> results(sessions);
+  std::vector<std::thread> threads;
+  uint64_t begin = ftpTestMicros();
+  for (int i = 0; i < sessions; i++)
+  {
+    threads.push_back(std::thread(runSession, i, rounds, size, std::ref(results[i])));
+  }
+  uint64_t bytes = 0;
+  for (int i = 0; i < sessions; i++)
+  {
+    threads[i].join();
+    TEST_ASSERT_TRUE_MESSAGE(results[i].ok, results[i].failure.c_str());
+    bytes += results[i].bytes;
+  }
+  double seconds = (ftpTestMicros() - begin) / 1e6;
+  return bytes / seconds / 1e6;
+}
+
+static void report(const char *what, int sessions, size_t size, double rate)
+{
+  char line[160];
+  snprintf(line, sizeof(line), "%s: %d sessions, %lu byte files: %.1f MB/s", what, sessions, (unsigned long)size, rate);
+  TEST_MESSAGE(line);
+}
+
+static void test_all_sessions_at_once()
+{
+  for (int sessions = 1; sessions <= FTP_MAX_SESSIONS; sessions++)
+  {
+    report("memory", sessions, 1000000, runSessions(sessions, 5, 1000000));
+  }
+}
+
+static void test_small_files()
+{
+  report("memory", FTP_MAX_SESSIONS, 1000, runSessions(FTP_MAX_SESSIONS, 50, 1000));
+}
+
+// About 1 MB/s per card access stream, as an SD card on SPI
+static void test_slow_storage()
+{
+  storage.getVolume().accessMicros = 200;
+  storage.getVolume().microsPerKB = 1000;
+  for (int sessions = 1; sessions <= FTP_MAX_SESSIONS; sessions++)
+  {
+    report("slow storage", sessions, 300000, runSessions(sessions, 2, 300000));
+  }
+}
+
+static void test_extra_client_rejected()
+{
+  std::vector<FTPTestClient *> clients;
+  for (int i = 0; i < FTP_MAX_SESSIONS; i++)
+  {
+    clients.push_back(new FTPTestClient(ftpFakeConnect));
+    TEST_ASSERT_TRUE(clients.back()->login());
+  }
+  FTPTestClient extra(ftpFakeConnect);
+  extra.connect();
+  TEST_ASSERT_EQUAL(421, extra.code);
+  for (size_t i = 0; i < clients.size(); i++)
+  {
+    TEST_ASSERT_EQUAL(257, clients[i]->command("PWD"));
+    delete clients[i];
+  }
+  // Sessions are free again once the server saw their clients leave
+  bool loggedIn = false;
+  for (int attempt = 0; attempt < 100 && !loggedIn; attempt++)
+  {
+    FTPTestClient later(ftpFakeConnect);
+    loggedIn = later.login();
+    if (!loggedIn)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  TEST_ASSERT_TRUE(loggedIn);
+}
+
+int main()
+{
+  logger().begin();
+  server = new FTPTestServer(storage);
+  server->start();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_all_sessions_at_once);
+  RUN_TEST(test_small_files);
+  RUN_TEST(test_slow_storage);
+  RUN_TEST(test_extra_client_rejected);
+  int failures = UNITY_END();
+
+  server->stop();
+  return failures;
+}
@@ -0,0 +1,293 @@
+// MPU6050Fifo against MPU6050ReplayBus: recorded FIFO bytes come out as the
+// samples they encode, reads recover from an overflow and from a partial
+// frame, and replaying a recording through the FIFO makes the motion
+// detector fire where it fired on every sample of the recording.
+
+#include <unity.h>
+#include <MPU6050Fifo.h>
+#include <MotionDetector.h>
+#include <vector>
+
+// As in MPU6050.h, which needs the Adafruit driver
+#define MPU_FIFO_BATCH 42
+
+// 1 g on the 8 g range
+#define RAW_G 4096
+
+void setUp() {}
+void tearDown() {}
+
+static void appendFrame(std::vector<uint8_t> &recording, const int16_t *accel, const int16_t *gyro)
+{
+  for (uint8_t axis = 0; axis < 3; axis++)
+  {
+    recording.push_back((uint16_t)accel[axis] >> 8);
+    recording.push_back((uint16_t)accel[axis] & 0xFF);
+  }
+  for (uint8_t axis = 0; axis < 3; axis++)
+  {
+    recording.push_back((uint16_t)gyro[axis] >> 8);
+    recording.push_back((uint16_t)gyro[axis] & 0xFF);
+  }
+}
+
+// Frame i of a recording whose values all differ, with negative ones
+static void numberedFrame(size_t i, int16_t *accel, int16_t *gyro)
+{
+  for (uint8_t axis = 0; axis < 3; axis++)
+  {
+    accel[axis] = (int16_t)(i * 7 + axis * 1000) * (axis == 1 ? -1 : 1);
+    gyro[axis] = (int16_t)(-30000 + i * 11 + axis);
+  }
+}
+
+static std::vector<uint8_t> numberedRecording(size_t frames)
+{
+  std::vector<uint8_t> recording;
+  for (size_t i = 0; i < frames; i++)
+  {
+    int16_t accel[3], gyro[3];
+    numberedFrame(i, accel, gyro);
+    appendFrame(recording, accel, gyro);
+  }
+  return recording;
+}
+
+static void assertFrame(size_t i, const MPU6050FifoSample &sample)
+{
+  int16_t accel[3], gyro[3];
+  numberedFrame(i, accel, gyro);
+  TEST_ASSERT_EQUAL_MEMORY(accel, sample.accel, sizeof(accel));
+  TEST_ASSERT_EQUAL_MEMORY(gyro, sample.gyro, sizeof(gyro));
+}
+
+void test_decodes_frames()
+{
+  std::vector<uint8_t> recording = numberedRecording(60);
+  MPU6050ReplayBus bus;
+  bus.setRecording(recording.data(), recording.size());
+  MPU6050Fifo fifo;
+  TEST_ASSERT_TRUE(fifo.begin(bus, 200));
+
+  MPU6050FifoSample samples[MPU_FIFO_BATCH];
+  TEST_ASSERT_EQUAL(0, fifo.read(samples, MPU_FIFO_BATCH));
+
+  // More than one batch waiting: the oldest come first, the rest is left
+  bus.advance(50);
+  TEST_ASSERT_EQUAL(MPU_FIFO_BATCH, fifo.read(samples, MPU_FIFO_BATCH));
+  TEST_ASSERT_EQUAL(50 - MPU_FIFO_BATCH, fifo.remaining);
+  for (size_t i = 0; i < MPU_FIFO_BATCH; i++)
+  {
+    assertFrame(i, samples[i]);
+  }
+  // Two status and count reads per call, then one per MPU6050_FIFO_BURST
+  // frames
+  TEST_ASSERT_EQUAL(2 * 2 + (MPU_FIFO_BATCH + MPU6050_FIFO_BURST - 1) / MPU6050_FIFO_BURST, fifo.transactions);
+
+  bus.advance(10);
+  TEST_ASSERT_EQUAL(18, fifo.read(samples, MPU_FIFO_BATCH));
+  TEST_ASSERT_EQUAL(0, fifo.remaining);
+  for (size_t i = 0; i < 18; i++)
+  {
+    assertFrame(MPU_FIFO_BATCH + i, samples[i]);
+  }
+  TEST_ASSERT_TRUE(bus.finished());
+  TEST_ASSERT_EQUAL(60, fifo.samples);
+  TEST_ASSERT_EQUAL(0, fifo.overflows);
+}
+
+void test_sample_times_line_up()
+{
+  // Samples timed the way MPU6050::checkForAnomalies does it must be one
+  // period apart, across batches too
+  const uint32_t period = 1000000UL / MPU_FIFO_RATE;
+  std::vector<uint8_t> recording = numberedRecording(80);
+  MPU6050ReplayBus bus;
+  bus.setRecording(recording.data(), recording.size());
+  MPU6050Fifo fifo;
+  TEST_ASSERT_TRUE(fifo.begin(bus, MPU_FIFO_RATE));
+
+  bus.advance(80);
+  // The chip took the 80th frame at countTime
+  uint32_t countTime = 80 * period;
+  MPU6050FifoSample samples[MPU_FIFO_BATCH];
+  size_t index = 0;
+  size_t count;
+  do
+  {
+    count = fifo.read(samples, MPU_FIFO_BATCH);
+    for (size_t i = 0; i < count; i++, index++)
+    {
+      uint32_t time = countTime - (fifo.remaining + count - 1 - i) * period;
+      TEST_ASSERT_EQUAL_UINT32((index + 1) * period, time);
+      assertFrame(index, samples[i]);
+    }
+  } while (count == MPU_FIFO_BATCH);
+  TEST_ASSERT_EQUAL(80, index);
+}
+
+void test_overflow_recovers()
+{
+  std::vector<uint8_t> recording = numberedRecording(200);
+  MPU6050ReplayBus bus;
+  bus.setRecording(recording.data(), recording.size());
+  MPU6050Fifo fifo;
+  TEST_ASSERT_TRUE(fifo.begin(bus, 200));
+
+  // 100 frames do not fit in 1024 bytes: the oldest bytes are lost and
+  // what is left no longer starts on a frame
+  bus.advance(100);
+  MPU6050FifoSample samples[MPU_FIFO_BATCH];
+  TEST_ASSERT_EQUAL(0, fifo.read(samples, MPU_FIFO_BATCH));
+  TEST_ASSERT_EQUAL(1, fifo.overflows);
+  TEST_ASSERT_EQUAL(0, fifo.remaining);
+
+  // The reset dropped the rest, the next frames come out whole
+  TEST_ASSERT_EQUAL(0, fifo.read(samples, MPU_FIFO_BATCH));
+  bus.advance(5);
+  TEST_ASSERT_EQUAL(5, fifo.read(samples, MPU_FIFO_BATCH));
+  for (size_t i = 0; i < 5; i++)
+  {
+    assertFrame(100 + i, samples[i]);
+  }
+  TEST_ASSERT_EQUAL(1, fifo.overflows);
+}
+
+void test_partial_frame_waits()
+{
+  // The recording ends in the middle of a frame: whole frames are read,
+  // the partial one stays in the FIFO until the reset drops it
+  std::vector<uint8_t> recording = numberedRecording(10);
+  std::vector<uint8_t> tail = numberedRecording(11);
+  recording.insert(recording.end(), tail.end() - MPU6050_FIFO_FRAME, tail.end() - 5);
+  MPU6050ReplayBus bus;
+  bus.setRecording(recording.data(), recording.size());
+  MPU6050Fifo fifo;
+  TEST_ASSERT_TRUE(fifo.begin(bus, 200));
+
+  bus.advance(11);
+  MPU6050FifoSample samples[MPU_FIFO_BATCH];
+  TEST_ASSERT_EQUAL(10, fifo.read(samples, MPU_FIFO_BATCH));
+  for (size_t i = 0; i < 10; i++)
+  {
+    assertFrame(i, samples[i]);
+  }
+  TEST_ASSERT_EQUAL(0, fifo.remaining);
+  TEST_ASSERT_EQUAL(0, fifo.read(samples, MPU_FIFO_BATCH));
+  TEST_ASSERT_FALSE(bus.finished());
+  TEST_ASSERT_EQUAL(0, fifo.overflows);
+
+  TEST_ASSERT_TRUE(fifo.reset());
+  TEST_ASSERT_TRUE(bus.finished());
+
+  // A new recording on the same chip reads aligned from its start
+  std::vector<uint8_t> next = numberedRecording(3);
+  bus.setRecording(next.data(), next.size());
+  bus.advance(3);
+  TEST_ASSERT_EQUAL(3, fifo.read(samples, MPU_FIFO_BATCH));
+  for (size_t i = 0; i < 3; i++)
+  {
+    assertFrame(i, samples[i]);
+  }
+}
+
+// A box at rest, lifted twice. Gyroscope z holds the frame number, the
+// detector only looks at it while calibrating, where it stays far below
+// the 1 rad/s limit.
+static std::vector<uint8_t> liftRecording(size_t frames, const size_t *lifts, size_t liftCount, size_t liftFrames)
+{
+  std::vector<uint8_t> recording;
+  for (size_t i = 0; i < frames; i++)
+  {
+    int16_t noise = (int16_t)((i * 37) % 41) - 20;
+    int16_t accel[3] = {(int16_t)(30 + noise), (int16_t)(-45 - noise), (int16_t)(RAW_G + noise)};
+    int16_t gyro[3] = {noise, (int16_t)-noise, (int16_t)i};
+    for (size_t j = 0; j < liftCount; j++)
+    {
+      if (i >= lifts[j] && i < lifts[j] + liftFrames)
+      {
+        // 1.3 g, away from the reference and refused as calibration
+        accel[2] = RAW_G * 13 / 10 + noise;
+      }
+    }
+    appendFrame(recording, accel, gyro);
+  }
+  return recording;
+}
+
+void test_detections_match_recording()
+{
+  const size_t frames = 900;
+  const size_t lifts[] = {300, 650};
+  const size_t liftFrames = 60;
+  std::vector<uint8_t> recording = liftRecording(frames, lifts, 2, liftFrames);
+
+  // Every sample of the recording through the detector, as the chip took them
+  std::vector<size_t> recorded;
+  MotionDetector reference;
+  for (size_t i = 0; i < frames; i++)
+  {
+    MPU6050FifoSample sample;
+    const uint8_t *frame = recording.data() + i * MPU6050_FIFO_FRAME;
+    for (uint8_t axis = 0; axis < 3; axis++)
+    {
+      sample.accel[axis] = (int16_t)((frame[2 * axis] << 8) | frame[2 * axis + 1]);
+      sample.gyro[axis] = (int16_t)((frame[6 + 2 * axis] << 8) | frame[6 + 2 * axis + 1]);
+    }
+    if (reference.add(MotionSample::fromRaw(sample.accel, sample.gyro)))
+    {
+      recorded.push_back(i);
+    }
+  }
+  TEST_ASSERT_EQUAL(2, recorded.size());
+  TEST_ASSERT_EQUAL(lifts[0] + MPU_ANOMALY_SAMPLES - 1, recorded[0]);
+  TEST_ASSERT_EQUAL(lifts[1] + MPU_ANOMALY_SAMPLES - 1, recorded[1]);
+
+  // The same recording through the FIFO, read at uneven intervals the way
+  // MPU6050::checkForAnomalies reads it
+  MPU6050ReplayBus bus;
+  bus.setRecording(recording.data(), recording.size());
+  MPU6050Fifo fifo;
+  TEST_ASSERT_TRUE(fifo.begin(bus, MPU_FIFO_RATE));
+  MotionDetector detector;
+  std::vector<size_t> detections;
+  const size_t steps[] = {7, 13, 31, 50, 3, 24};
+  MPU6050FifoSample samples[MPU_FIFO_BATCH];
+  for (size_t pass = 0; !bus.finished() && pass < 1000; pass++)
+  {
+    bus.advance(steps[pass % 6]);
+    size_t count;
+    bool fired = false;
+    do
+    {
+      count = fifo.read(samples, MPU_FIFO_BATCH);
+      for (size_t i = 0; i < count && !fired; i++)
+      {
+        if (detector.add(MotionSample::fromRaw(samples[i].accel, samples[i].gyro)))
+        {
+          detections.push_back(samples[i].gyro[2]);
+          fifo.reset();
+          fired = true;
+        }
+      }
+    } while (count == MPU_FIFO_BATCH && !fired);
+  }
+  TEST_ASSERT_TRUE(bus.finished());
+  TEST_ASSERT_EQUAL(0, fifo.overflows);
+  TEST_ASSERT_EQUAL(recorded.size(), detections.size());
+  for (size_t i = 0; i < recorded.size(); i++)
+  {
+    TEST_ASSERT_EQUAL(recorded[i], detections[i]);
+  }
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_decodes_frames);
+  RUN_TEST(test_sample_times_line_up);
+  RUN_TEST(test_overflow_recovers);
+  RUN_TEST(test_partial_frame_waits);
+  RUN_TEST(test_detections_match_recording);
+  return UNITY_END();
+}
@@ -0,0 +1,220 @@
+// RollingWindow and Ewma against straightforward recomputation, and what
+// one sample costs for several window sizes.
+
+#include <unity.h>
+#include <RollingStats.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+void setUp() {}
+void tearDown() {}
+
+// Mean and population variance of the last n values, in double
+static void reference(const std::vector<float> &values, size_t n, double &mean, double &variance)
+{
+  size_t begin = values.size() > n ? values.size() - n : 0;
+  double total = 0;
+  for (size_t i = begin; i < values.size(); i++)
+    total += values[i];
+  mean = total / (values.size() - begin);
+  double squares = 0;
+  for (size_t i = begin; i < values.size(); i++)
+    squares += (values[i] - mean) * (values[i] - mean);
+  variance = squares / (values.size() - begin);
+}
+
+template <uint16_t N>
+static void checkAgainstReference(float offset, float scale, size_t samples)
+{
+  RollingWindow<N> window;
+  std::vector<float> values;
+  std::mt19937 random(N);
+  std::normal_distribution<float> noise(offset, scale);
+  for (size_t i = 0; i < samples; i++)
+  {
+    float value = noise(random);
+    values.push_back(value);
+    window.add(value);
+    TEST_ASSERT_EQUAL(std::min<size_t>(i + 1, N), window.size());
+    if (i % 97 == 0 || i == samples - 1)
+    {
+      double mean, variance;
+      reference(values, N, mean, variance);
+      TEST_ASSERT_FLOAT_WITHIN(fabs(offset) * 1e-5 + scale * 1e-4, mean, window.mean());
+      TEST_ASSERT_FLOAT_WITHIN(variance * 1e-2 + scale * scale * 1e-4, variance, window.variance());
+    }
+  }
+}
+
+static void test_window_filling()
+{
+  RollingWindow<4> window;
+  TEST_ASSERT_EQUAL(0, window.size());
+  TEST_ASSERT_FALSE(window.full());
+  TEST_ASSERT_EQUAL_FLOAT(0, window.mean());
+  TEST_ASSERT_EQUAL_FLOAT(0, window.variance());
+  window.add(2);
+  window.add(4);
+  TEST_ASSERT_EQUAL_FLOAT(3, window.mean());
+  TEST_ASSERT_EQUAL_FLOAT(1, window.variance());
+  window.add(6);
+  window.add(8);
+  TEST_ASSERT_TRUE(window.full());
+  TEST_ASSERT_EQUAL_FLOAT(5, window.mean());
+  TEST_ASSERT_EQUAL_FLOAT(5, window.variance());
+  // 2 drops out
+  window.add(10);
+  TEST_ASSERT_EQUAL_FLOAT(7, window.mean());
+  TEST_ASSERT_EQUAL_FLOAT(5, window.variance());
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, sqrtf(5), window.stddev());
+}
+
+static void test_window_constant()
+{
+  RollingWindow<16> window;
+  for (int i = 0; i < 1000; i++)
+  {
+    window.add(1013.25f);
+  }
+  TEST_ASSERT_EQUAL_FLOAT(1013.25f, window.mean());
+  TEST_ASSERT_EQUAL_FLOAT(0, window.variance());
+}
+
+static void test_window_clear()
+{
+  RollingWindow<8> window;
+  for (int i = 0; i < 13; i++)
+  {
+    window.add(i * 100);
+  }
+  window.clear();
+  TEST_ASSERT_EQUAL(0, window.size());
+  window.add(1);
+  window.add(3);
+  TEST_ASSERT_EQUAL_FLOAT(2, window.mean());
+  TEST_ASSERT_EQUAL_FLOAT(1, window.variance());
+  for (int i = 0; i < 6; i++)
+  {
+    window.add(2);
+  }
+  TEST_ASSERT_EQUAL_FLOAT(2, window.mean());
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.25f, window.variance());
+}
+
+static void test_window_matches_reference()
+{
+  checkAgainstReference<1>(5, 1, 300);
+  checkAgainstReference<10>(0, 1, 5000);
+  checkAgainstReference<64>(9.81f, 0.05f, 20000);
+  checkAgainstReference<500>(-3, 20, 20000);
+}
+
+// Accelerometer-like signal with a large offset and little noise, where a
+// running variance without refreshes drifts away
+static void test_window_long_run()
+{
+  checkAgainstReference<50>(16384, 2, 2000000);
+}
+
+static void test_window_step()
+{
+  RollingWindow<20> window;
+  for (int i = 0; i < 100; i++)
+  {
+    window.add(0);
+  }
+  for (int i = 0; i < 20; i++)
+  {
+    window.add(100);
+  }
+  TEST_ASSERT_EQUAL_FLOAT(100, window.mean());
+  TEST_ASSERT_FLOAT_WITHIN(1e-3, 0, window.variance());
+}
+
+static void test_ewma()
+{
+  Ewma ewma(0.5f);
+  TEST_ASSERT_FALSE(ewma.isStarted());
+  ewma.add(10);
+  TEST_ASSERT_TRUE(ewma.isStarted());
+  TEST_ASSERT_EQUAL_FLOAT(10, ewma.mean());
+  TEST_ASSERT_EQUAL_FLOAT(0, ewma.variance());
+  ewma.add(20);
+  TEST_ASSERT_EQUAL_FLOAT(15, ewma.mean());
+  TEST_ASSERT_EQUAL_FLOAT(25, ewma.variance());
+  ewma.clear();
+  TEST_ASSERT_FALSE(ewma.isStarted());
+
+  // Settles on the mean and variance of a stationary signal
+  Ewma slow(2.0f / 201);
+  std::mt19937 random(1);
+  std::normal_distribution<float> noise(50, 3);
+  for (int i = 0; i < 100000; i++)
+  {
+    slow.add(noise(random));
+  }
+  TEST_ASSERT_FLOAT_WITHIN(1, 50, slow.mean());
+  TEST_ASSERT_FLOAT_WITHIN(2, 9, slow.variance());
+  TEST_ASSERT_FLOAT_WITHIN(0.4, 3, slow.stddev());
+}
+
+// Mean and worst cost of one add(), which must not grow with the window
+template <uint16_t N>
+static void measureAdd()
+{
+  const size_t samples = 2000000;
+  std::vector<float> values(4096);
+  std::mt19937 random(7);
+  std::normal_distribution<float> noise(0, 1);
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    values[i] = noise(random);
+  }
+  RollingWindow<N> window;
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < samples; i++)
+  {
+    window.add(values[i & 4095]);
+  }
+  double total = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+
+  // Worst single add, timer overhead included; the 99.99th percentile
+  // leaves out the scheduler
+  std::vector<double> each(200000);
+  for (size_t i = 0; i < each.size(); i++)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    window.add(values[i & 4095]);
+    each[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  }
+  std::sort(each.begin(), each.end());
+  char line[120];
+  snprintf(line, sizeof(line), "RollingWindow<%u>: %.1f ns per sample, 99.99%% of samples under %.0f ns (mean %.3f)",
+           N, total / samples, each[each.size() - each.size() / 10000 - 1], window.mean());
+  TEST_MESSAGE(line);
+}
+
+static void test_cost_per_sample()
+{
+  measureAdd<8>();
+  measureAdd<64>();
+  measureAdd<512>();
+  measureAdd<4096>();
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_window_filling);
+  RUN_TEST(test_window_constant);
+  RUN_TEST(test_window_clear);
+  RUN_TEST(test_window_matches_reference);
+  RUN_TEST(test_window_long_run);
+  RUN_TEST(test_window_step);
+  RUN_TEST(test_ewma);
+  RUN_TEST(test_cost_per_sample);
+  return UNITY_END();
+}
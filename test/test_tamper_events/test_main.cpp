@@ -0,0 +1,266 @@
+// Host stress test of the tamper event channel and the wipe gate: several
+// wipe engines race for every detection, each burst must start exactly one
+// wipe and never two at once.
+
+#include <unity.h>
+#include <TamperEvents.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+void setUp() {}
+void tearDown() {}
+
+// Wipe engines that read the channel the way WipeThread in main.cpp does
+class WipeEngines
+{
+private:
+  TamperEventChannel &channel;
+  std::vector<std::thread> threads;
+  std::atomic<bool> running;
+  std::atomic<int> active;
+  // Per engine, the channel position it has handled every event up to
+  std::atomic<uint32_t> handled[16];
+
+  void respond(uint32_t sequence)
+  {
+    if (!this->gate.claim(sequence))
+    {
+      return;
+    }
+    if (this->active.fetch_add(1) != 0)
+    {
+      this->overlaps++;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(this->wipeMillis));
+    this->active.fetch_sub(1);
+    this->gate.release(this->channel.published());
+  }
+
+  void loop(int index)
+  {
+    TamperEventReader reader(this->channel);
+    uint32_t lost = 0;
+    TamperEvent event;
+    while (this->running)
+    {
+      uint32_t upTo = this->channel.published();
+      while (reader.read(event))
+      {
+        // Every event is checked for tearing, see publishBurst()
+        if (event.value != event.sequence * 7 || event.detail != ~event.value || event.time != event.sequence)
+        {
+          this->torn++;
+        }
+        if (event.type == TAMPER_EVENT_DETECTED)
+        {
+          this->respond(event.sequence);
+        }
+      }
+      if (reader.lost != lost)
+      {
+        lost = reader.lost;
+        if (this->channel.lastDetection() != 0)
+        {
+          this->respond(this->channel.lastDetection());
+        }
+      }
+      this->handled[index] = upTo;
+      std::this_thread::yield();
+    }
+    this->lostEvents += reader.lost;
+  }
+
+public:
+  TamperWipeGate gate;
+  int wipeMillis = 20;
+  std::atomic<uint32_t> overlaps;
+  std::atomic<uint32_t> torn;
+  std::atomic<uint32_t> lostEvents;
+
+  WipeEngines(TamperEventChannel &channel, int count) : channel(channel), running(true), active(0), overlaps(0), torn(0), lostEvents(0)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      this->handled[i] = 0;
+      this->threads.push_back(std::thread(&WipeEngines::loop, this, i));
+    }
+    // The readers start at the channel position they see first
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  // Wait until every engine has handled every event and no wipe runs,
+  // then check the last detection is covered
+  void settle()
+  {
+    for (int i = 0; i < 2000; i++)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      uint32_t published = this->channel.published();
+      boolean idle = !this->gate.isWiping();
+      for (size_t engine = 0; engine < this->threads.size(); engine++)
+      {
+        idle = idle && this->handled[engine] == published;
+      }
+      if (idle)
+      {
+        uint32_t last = this->channel.lastDetection();
+        TEST_ASSERT_FALSE_MESSAGE(last != 0 && this->gate.claim(last), "Detection left without a wipe");
+        return;
+      }
+    }
+    TEST_FAIL_MESSAGE("Wipe engines did not settle");
+  }
+
+  void stop()
+  {
+    this->running = false;
+    for (size_t i = 0; i < this->threads.size(); i++)
+    {
+      this->threads[i].join();
+    }
+  }
+};
+
+// Events carry values derived from their sequence, a reader can tell a
+// torn copy. Returns the sequence of the last event.
+static uint32_t publishBurst(TamperEventChannel &channel, uint8_t type, int count)
+{
+  uint32_t sequence = channel.published();
+  for (int i = 0; i < count; i++)
+  {
+    sequence++;
+    channel.publish(type, 1, sequence, sequence * 7, ~(sequence * 7));
+  }
+  return sequence;
+}
+
+static void runBursts(int engines, int bursts, int burstSize)
+{
+  TamperEventChannel channel;
+  WipeEngines wipe(channel, engines);
+  for (int burst = 0; burst < bursts; burst++)
+  {
+    // Mode events in between, as the RFID reader publishes them
+    publishBurst(channel, TAMPER_EVENT_MODE, burst % 3);
+    publishBurst(channel, TAMPER_EVENT_DETECTED, burstSize);
+    wipe.settle();
+    TEST_ASSERT_EQUAL_UINT32(burst + 1, wipe.gate.wipes.load());
+  }
+  wipe.stop();
+  TEST_ASSERT_EQUAL_UINT32(0, wipe.overlaps.load());
+  TEST_ASSERT_EQUAL_UINT32(0, wipe.torn.load());
+}
+
+static void test_single_engine()
+{
+  runBursts(1, 20, 1);
+}
+
+static void test_four_engines_single_detections()
+{
+  runBursts(4, 50, 1);
+}
+
+static void test_eight_engines_bursts()
+{
+  runBursts(8, 50, 40);
+}
+
+// Detections published while a wipe runs are covered by it
+static void test_detections_during_wipe()
+{
+  TamperEventChannel channel;
+  WipeEngines wipe(channel, 4);
+  wipe.wipeMillis = 100;
+  publishBurst(channel, TAMPER_EVENT_DETECTED, 1);
+  for (int i = 0; i < 20; i++)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    publishBurst(channel, TAMPER_EVENT_DETECTED, 1);
+  }
+  wipe.settle();
+  wipe.stop();
+  TEST_ASSERT_EQUAL_UINT32(1, wipe.gate.wipes.load());
+  TEST_ASSERT_EQUAL_UINT32(0, wipe.overlaps.load());
+}
+
+// The producer overruns the ring while the readers are busy wiping: they
+// lose events, never read a torn one, and the last detection still gets
+// exactly one wipe
+static void test_flood_overruns_ring()
+{
+  TamperEventChannel channel;
+  WipeEngines wipe(channel, 8);
+  wipe.wipeMillis = 5;
+  for (int round = 0; round < 20; round++)
+  {
+    uint32_t wipes = wipe.gate.wipes;
+    publishBurst(channel, TAMPER_EVENT_MODE, 10000);
+    publishBurst(channel, TAMPER_EVENT_DETECTED, 1);
+    publishBurst(channel, TAMPER_EVENT_MODE, 10 * TAMPER_EVENT_SLOTS);
+    wipe.settle();
+    TEST_ASSERT_EQUAL_UINT32(wipes + 1, wipe.gate.wipes.load());
+  }
+  wipe.stop();
+  TEST_ASSERT_EQUAL_UINT32(0, wipe.overlaps.load());
+  TEST_ASSERT_EQUAL_UINT32(0, wipe.torn.load());
+  TEST_ASSERT_TRUE(wipe.lostEvents > 0);
+}
+
+// Every reader sees every event in order while it keeps up
+static void test_readers_see_every_event()
+{
+  TamperEventChannel channel;
+  const uint32_t total = 200000;
+  std::atomic<uint32_t> done(0);
+  std::vector<std::thread> readers;
+  std::atomic<uint32_t> failures(0);
+  for (int i = 0; i < 4; i++)
+  {
+    readers.push_back(std::thread([&]
+                                  {
+                                    TamperEventReader reader(channel);
+                                    uint32_t expected = 1;
+                                    TamperEvent event;
+                                    while (expected <= total)
+                                    {
+                                      if (!reader.read(event))
+                                        continue;
+                                      if (event.value != event.sequence * 7 || event.detail != ~event.value)
+                                        failures++;
+                                      // Lost events are skipped, never reordered
+                                      if (event.sequence < expected)
+                                        failures++;
+                                      expected = event.sequence + 1;
+                                    }
+                                    done++;
+                                  }));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  for (uint32_t i = 0; i < total; i++)
+  {
+    publishBurst(channel, TAMPER_EVENT_MODE, 1);
+    if ((i & 63) == 0)
+      std::this_thread::yield();
+  }
+  for (size_t i = 0; i < readers.size(); i++)
+  {
+    readers[i].join();
+  }
+  TEST_ASSERT_EQUAL_UINT32(4, done.load());
+  TEST_ASSERT_EQUAL_UINT32(0, failures.load());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_single_engine);
+  RUN_TEST(test_four_engines_single_detections);
+  RUN_TEST(test_eight_engines_bursts);
+  RUN_TEST(test_detections_during_wipe);
+  RUN_TEST(test_flood_overruns_ring);
+  RUN_TEST(test_readers_see_every_event);
+  return UNITY_END();
+}
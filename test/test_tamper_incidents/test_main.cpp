@@ -0,0 +1,107 @@
+// Host test of the tamper incident log: the wipe task finishes incidents
+// while the FTP task and the console take snapshots, which must never see
+// an incident half written.
+
+// Every finished incident is logged at info level
+#define LOG_LEVEL LOG_LEVEL_WARN
+
+#include <unity.h>
+#include <TamperIncidents.h>
+#include <atomic>
+#include <thread>
+
+void setUp() {}
+void tearDown() {}
+
+// Every field of incident n is derived from n, so a torn copy shows
+static void record(TamperIncidentLog &log, uint32_t n)
+{
+  TEST_ASSERT_TRUE(log.start(TAMPER_SOURCE_MOTION, 0, n, n * 10));
+  for (uint8_t stage = 1; stage < TAMPER_STAGES; stage++)
+  {
+    log.stage(stage, n + stage);
+  }
+  log.finish(TAMPER_OUTCOME_WIPED, n, n % 7);
+}
+
+static void checkSnapshot(const TamperIncident *incidents, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const TamperIncident &incident = incidents[i];
+    uint32_t n = incident.number;
+    TEST_ASSERT_EQUAL(n, incident.filesRemoved);
+    TEST_ASSERT_EQUAL(n % 7, incident.failures);
+    TEST_ASSERT_EQUAL(n * 10, incident.uptime);
+    for (uint8_t stage = 0; stage < TAMPER_STAGES; stage++)
+    {
+      TEST_ASSERT_EQUAL(n + stage, incident.stages[stage]);
+    }
+    // Oldest first, no gaps
+    if (i > 0)
+    {
+      TEST_ASSERT_EQUAL(incidents[i - 1].number + 1, n);
+    }
+  }
+}
+
+static void test_keeps_the_latest()
+{
+  TamperIncidentLog log;
+  TamperIncident incidents[TAMPER_INCIDENTS];
+  TEST_ASSERT_EQUAL(0, log.snapshot(incidents));
+  for (uint32_t n = 1; n <= TAMPER_INCIDENTS + 3; n++)
+  {
+    record(log, n);
+  }
+  TEST_ASSERT_EQUAL(TAMPER_INCIDENTS, log.snapshot(incidents));
+  TEST_ASSERT_EQUAL(4, incidents[0].number);
+  checkSnapshot(incidents, TAMPER_INCIDENTS);
+}
+
+// A detection during an open incident belongs to it
+static void test_one_open_incident()
+{
+  TamperIncidentLog log;
+  TEST_ASSERT_TRUE(log.start(TAMPER_SOURCE_LIGHT, 0, 1, 1));
+  TEST_ASSERT_FALSE(log.start(TAMPER_SOURCE_MOTION, 0, 2, 2));
+  log.finish(TAMPER_OUTCOME_NO_CARD);
+  TamperIncident incidents[TAMPER_INCIDENTS];
+  TEST_ASSERT_EQUAL(1, log.snapshot(incidents));
+  TEST_ASSERT_EQUAL(TAMPER_SOURCE_LIGHT, incidents[0].source);
+  TEST_ASSERT_EQUAL(TAMPER_OUTCOME_NO_CARD, incidents[0].outcome);
+}
+
+static void test_snapshots_while_finishing()
+{
+  TamperIncidentLog log;
+  std::atomic<bool> running(true);
+  std::thread writer([&]()
+                     {
+                       for (uint32_t n = 1; n <= 20000; n++)
+                       {
+                         record(log, n);
+                       }
+                       running = false;
+                     });
+  unsigned long snapshots = 0;
+  TamperIncident incidents[TAMPER_INCIDENTS];
+  while (running)
+  {
+    checkSnapshot(incidents, log.snapshot(incidents));
+    snapshots++;
+  }
+  writer.join();
+  TEST_ASSERT_EQUAL(TAMPER_INCIDENTS, log.snapshot(incidents));
+  TEST_ASSERT_EQUAL(20000, incidents[TAMPER_INCIDENTS - 1].number);
+  TEST_ASSERT_TRUE(snapshots > 0);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_keeps_the_latest);
+  RUN_TEST(test_one_open_incident);
+  RUN_TEST(test_snapshots_while_finishing);
+  return UNITY_END();
+}